@@ -0,0 +1,54 @@
+#include "arena.h"
+#include <stdint.h>
+
+void arena_init(Arena *arena, size_t block_size) {
+   arena->head = NULL;
+   arena->block_size = block_size;
+   arena->total_bytes = 0;
+}
+
+void arena_destroy(Arena *arena) {
+   ArenaBlock *block = arena->head;
+   while (block) {
+      ArenaBlock *next = block->next;
+      free(block);
+      block = next;
+   }
+   arena->head = NULL;
+   arena->total_bytes = 0;
+}
+
+// Returns the offset of the first suitably aligned byte at or after used
+static size_t align_offset(ArenaBlock *block, size_t align) {
+   uintptr_t p = (uintptr_t)(block->data + block->used);
+   return block->used + (((p + align - 1) & ~(uintptr_t)(align - 1)) - p);
+}
+
+void *arena_alloc(Arena *arena, size_t size, size_t align) {
+   ArenaBlock *block = arena->head;
+   if (block == NULL || align_offset(block, align) + size > block->size) {
+      // Oversized requests get a block of their own
+      size_t block_size = size + align > arena->block_size ? size + align : arena->block_size;
+      block = malloc(sizeof(ArenaBlock) + block_size);
+      if (block == NULL) {
+         perror("Arena allocation failed");
+         exit(EXIT_FAILURE);
+      }
+      block->used = 0;
+      block->size = block_size;
+      block->next = arena->head;
+      arena->head = block;
+      arena->total_bytes += block_size;
+   }
+
+   size_t offset = align_offset(block, align);
+   block->used = offset + size;
+   return block->data + offset;
+}
+
+char *arena_strndup(Arena *arena, const char *s, size_t len) {
+   char *copy = arena_alloc(arena, len + 1, 1);
+   memcpy(copy, s, len);
+   copy[len] = '\0';
+   return copy;
+}
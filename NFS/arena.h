@@ -0,0 +1,27 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include "headers.h"
+
+// Bump allocator for long-lived, rarely freed objects such as interned path
+// strings. Allocations are packed into large blocks and released all at once
+// by arena_destroy(); individual frees are not supported.
+typedef struct ArenaBlock {
+   struct ArenaBlock *next;
+   size_t used;
+   size_t size;
+   char data[];
+} ArenaBlock;
+
+typedef struct {
+   ArenaBlock *head;
+   size_t block_size;
+   size_t total_bytes;
+} Arena;
+
+void arena_init(Arena *arena, size_t block_size);
+void arena_destroy(Arena *arena);
+void *arena_alloc(Arena *arena, size_t size, size_t align);
+char *arena_strndup(Arena *arena, const char *s, size_t len);
+
+#endif
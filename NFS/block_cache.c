@@ -0,0 +1,191 @@
+#include "block_cache.h"
+
+static uint64_t block_hash(dev_t dev, ino_t ino, uint64_t index) {
+   uint64_t h = (uint64_t)ino * 0x9e3779b97f4a7c15ULL;
+   h ^= ((uint64_t)dev + index * 0xc2b2ae3d27d4eb4fULL) + (h << 6) + (h >> 2);
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   return h;
+}
+
+static int same_file(const FileVersion *a, dev_t dev, ino_t ino) {
+   return a->dev == dev && a->ino == ino;
+}
+
+int file_version_equal(const FileVersion *a, const FileVersion *b) {
+   return same_file(a, b->dev, b->ino) && a->mtime_ns == b->mtime_ns && a->size == b->size;
+}
+
+static BlockCacheShard *shard_for(BlockCache *cache, uint64_t hash) {
+   return &cache->shards[(hash >> 32) % cache->num_shards];
+}
+
+void file_version_from_stat(FileVersion *version, const struct stat *st) {
+   version->dev = st->st_dev;
+   version->ino = st->st_ino;
+   version->mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+   version->size = st->st_size;
+}
+
+void block_cache_init(BlockCache *cache, size_t max_bytes, size_t block_size, int num_shards) {
+   cache->block_size = block_size;
+   cache->max_bytes = max_bytes;
+   cache->num_shards = num_shards;
+   cache->shards = calloc(num_shards, sizeof(BlockCacheShard));
+   if (cache->shards == NULL) {
+      perror("Block cache allocation failed");
+      exit(EXIT_FAILURE);
+   }
+   size_t shard_bytes = max_bytes / num_shards;
+   for (int i = 0; i < num_shards; i++) {
+      BlockCacheShard *shard = &cache->shards[i];
+      pthread_mutex_init(&shard->lock, NULL);
+      shard->max_bytes = shard_bytes;
+      // Short tail blocks make the byte budget, not the slot count, the
+      // usual limit; twice the full-block count leaves room for them
+      shard->ring_size = shard_bytes / block_size * 2;
+      if (shard->ring_size == 0) continue;
+      shard->num_buckets = 16;
+      while (shard->num_buckets < shard->ring_size) shard->num_buckets *= 2;
+      shard->buckets = calloc(shard->num_buckets, sizeof(CachedBlock *));
+      shard->ring = calloc(shard->ring_size, sizeof(CachedBlock *));
+      shard->free_slots = malloc(shard->ring_size * sizeof(size_t));
+      if (shard->buckets == NULL || shard->ring == NULL || shard->free_slots == NULL) {
+         perror("Block cache allocation failed");
+         exit(EXIT_FAILURE);
+      }
+      for (size_t s = 0; s < shard->ring_size; s++) {
+         shard->free_slots[s] = shard->ring_size - 1 - s;
+      }
+      shard->num_free = shard->ring_size;
+   }
+}
+
+void block_cache_release(CachedBlock *block) {
+   if (__atomic_sub_fetch(&block->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+      free(block);
+   }
+}
+
+// Unlinks block from its shard and drops the cache's reference. Caller
+// holds the shard lock.
+static void shard_remove(BlockCacheShard *shard, CachedBlock *block) {
+   uint64_t hash = block_hash(block->version.dev, block->version.ino, block->index);
+   CachedBlock **link = &shard->buckets[hash & (shard->num_buckets - 1)];
+   while (*link != block) link = &(*link)->hash_next;
+   *link = block->hash_next;
+   shard->ring[block->slot] = NULL;
+   shard->free_slots[shard->num_free++] = block->slot;
+   shard->bytes -= block->len;
+   block_cache_release(block);
+}
+
+// Sweeps the CLOCK hand until len more bytes and one slot fit. Recently hit
+// blocks get a second chance. Caller holds the shard lock.
+static void shard_make_room(BlockCacheShard *shard, size_t len) {
+   while (shard->bytes + len > shard->max_bytes || shard->num_free == 0) {
+      CachedBlock *victim = shard->ring[shard->hand];
+      shard->hand = (shard->hand + 1) % shard->ring_size;
+      if (victim == NULL) continue;
+      if (victim->referenced) {
+         victim->referenced = 0;
+         continue;
+      }
+      shard_remove(shard, victim);
+      shard->evictions++;
+   }
+}
+
+CachedBlock *block_cache_get(BlockCache *cache, const FileVersion *version, uint64_t index) {
+   if (cache->max_bytes == 0) return NULL;
+   uint64_t hash = block_hash(version->dev, version->ino, index);
+   BlockCacheShard *shard = shard_for(cache, hash);
+   CachedBlock *found = NULL;
+
+   pthread_mutex_lock(&shard->lock);
+   if (shard->ring_size > 0) {
+      for (CachedBlock *block = shard->buckets[hash & (shard->num_buckets - 1)]; block; block = block->hash_next) {
+         if (block->index == index && same_file(&block->version, version->dev, version->ino)) {
+            if (file_version_equal(&block->version, version)) found = block;
+            else shard_remove(shard, block);   // The file changed underneath us
+            break;
+         }
+      }
+   }
+   if (found) {
+      found->referenced = 1;
+      __atomic_add_fetch(&found->refcount, 1, __ATOMIC_RELAXED);
+      shard->hits++;
+   } else {
+      shard->misses++;
+   }
+   pthread_mutex_unlock(&shard->lock);
+   return found;
+}
+
+CachedBlock *block_cache_alloc(BlockCache *cache, size_t len) {
+   CachedBlock *block = malloc(sizeof(CachedBlock) + len);
+   if (block == NULL) return NULL;
+   block->refcount = 1;
+   block->len = len;
+   block->has_crc = 0;
+   block->referenced = 0;
+   block->hash_next = NULL;
+   return block;
+}
+
+void block_cache_insert(BlockCache *cache, const FileVersion *version, uint64_t index, CachedBlock *block) {
+   if (cache->max_bytes == 0) return;
+   uint64_t hash = block_hash(version->dev, version->ino, index);
+   BlockCacheShard *shard = shard_for(cache, hash);
+   if (block->len > shard->max_bytes || shard->ring_size == 0) return;
+
+   block->version = *version;
+   block->index = index;
+   pthread_mutex_lock(&shard->lock);
+   // Another worker may have loaded the same block concurrently
+   CachedBlock **head = &shard->buckets[hash & (shard->num_buckets - 1)];
+   for (CachedBlock *other = *head; other; other = other->hash_next) {
+      if (other->index == index && same_file(&other->version, version->dev, version->ino)) {
+         shard_remove(shard, other);
+         break;
+      }
+   }
+   shard_make_room(shard, block->len);
+   block->slot = shard->free_slots[--shard->num_free];
+   shard->ring[block->slot] = block;
+   block->hash_next = *head;
+   *head = block;
+   shard->bytes += block->len;
+   __atomic_add_fetch(&block->refcount, 1, __ATOMIC_RELAXED);
+   pthread_mutex_unlock(&shard->lock);
+}
+
+void block_cache_invalidate_file(BlockCache *cache, dev_t dev, ino_t ino) {
+   if (cache->max_bytes == 0) return;
+   // A file's blocks are spread over every shard
+   for (int i = 0; i < cache->num_shards; i++) {
+      BlockCacheShard *shard = &cache->shards[i];
+      pthread_mutex_lock(&shard->lock);
+      for (size_t s = 0; s < shard->ring_size; s++) {
+         CachedBlock *block = shard->ring[s];
+         if (block && same_file(&block->version, dev, ino)) shard_remove(shard, block);
+      }
+      pthread_mutex_unlock(&shard->lock);
+   }
+}
+
+void block_cache_stats(BlockCache *cache, BlockCacheStats *stats) {
+   memset(stats, 0, sizeof(*stats));
+   for (int i = 0; cache->max_bytes && i < cache->num_shards; i++) {
+      BlockCacheShard *shard = &cache->shards[i];
+      pthread_mutex_lock(&shard->lock);
+      stats->hits += shard->hits;
+      stats->misses += shard->misses;
+      stats->evictions += shard->evictions;
+      stats->bytes += shard->bytes;
+      stats->blocks += shard->ring_size - shard->num_free;
+      pthread_mutex_unlock(&shard->lock);
+   }
+}
@@ -0,0 +1,86 @@
+#ifndef _BLOCK_CACHE_H_
+#define _BLOCK_CACHE_H_
+
+#include "headers.h"
+#include <stdint.h>
+
+// Memory-bounded cache of fixed-size file blocks for the storage server.
+//
+// Blocks are keyed by (device, inode, block index) and stamped with the
+// version (mtime and size) of the file they were read from, so a lookup for
+// a file that has since changed simply misses. The cache is split into
+// shards, each with its own lock, hash table and CLOCK ring, so concurrent
+// workers rarely contend. Blocks are reference counted: a sender keeps the
+// buffer alive while it is on its way to the socket even if the block is
+// evicted or invalidated in the meantime.
+
+typedef struct {
+   dev_t dev;
+   ino_t ino;
+   int64_t mtime_ns;
+   off_t size;
+} FileVersion;
+
+typedef struct CachedBlock {
+   int refcount;                // One reference is held by the cache while indexed
+   FileVersion version;
+   uint64_t index;
+   size_t len;
+   uint32_t crc;                // CRC32C of data, if has_crc; set before insert
+   int has_crc;
+   size_t slot;                 // Position in the shard's CLOCK ring
+   int referenced;              // CLOCK bit, set on every hit
+   struct CachedBlock *hash_next;
+   uint8_t data[];
+} CachedBlock;
+
+typedef struct {
+   pthread_mutex_t lock;
+   CachedBlock **buckets;
+   size_t num_buckets;          // Power of two
+   CachedBlock **ring;          // CLOCK ring; NULL slots are free
+   size_t ring_size;
+   size_t hand;
+   size_t *free_slots;
+   size_t num_free;
+   size_t bytes;
+   size_t max_bytes;
+   unsigned long hits;
+   unsigned long misses;
+   unsigned long evictions;
+} BlockCacheShard;
+
+typedef struct {
+   BlockCacheShard *shards;
+   int num_shards;
+   size_t block_size;
+   size_t max_bytes;            // Zero when the cache is disabled
+} BlockCache;
+
+typedef struct {
+   unsigned long hits;
+   unsigned long misses;
+   unsigned long evictions;
+   size_t bytes;
+   size_t blocks;
+} BlockCacheStats;
+
+// A max_bytes of zero leaves the cache disabled: lookups always miss and
+// inserts are dropped
+void block_cache_init(BlockCache *cache, size_t max_bytes, size_t block_size, int num_shards);
+void file_version_from_stat(FileVersion *version, const struct stat *st);
+int file_version_equal(const FileVersion *a, const FileVersion *b);
+
+// Returns a referenced block, or NULL on a miss
+CachedBlock *block_cache_get(BlockCache *cache, const FileVersion *version, uint64_t index);
+// Allocates an unindexed block of len bytes holding one reference for the
+// caller, to be filled and then passed to block_cache_insert
+CachedBlock *block_cache_alloc(BlockCache *cache, size_t len);
+// Indexes a filled block; the caller keeps its own reference
+void block_cache_insert(BlockCache *cache, const FileVersion *version, uint64_t index, CachedBlock *block);
+void block_cache_release(CachedBlock *block);
+// Drops every block of a file, e.g. after it was replaced or deleted
+void block_cache_invalidate_file(BlockCache *cache, dev_t dev, ino_t ino);
+void block_cache_stats(BlockCache *cache, BlockCacheStats *stats);
+
+#endif
@@ -0,0 +1,214 @@
+#include "checksum_store.h"
+
+#define SIDECAR_MAGIC 0x4E465343   // "NFSC"
+
+typedef struct {
+   uint32_t magic;
+   uint32_t block_size;
+   int64_t mtime_ns;
+   uint64_t size;
+} SidecarHeader;
+
+int checksum_store_init(ChecksumStore *store, const char *dir, size_t block_size) {
+   struct stat st;
+   if (stat(dir, &st) != 0) {
+      if (errno != ENOENT || mkdir(dir, 0755) != 0) return -1;
+   }
+   else if (!S_ISDIR(st.st_mode)) {
+      errno = ENOTDIR;
+      return -1;
+   }
+   snprintf(store->dir, sizeof(store->dir), "%s", dir);
+   store->block_size = block_size;
+   store->blocks_verified = store->mismatches = store->files_saved = 0;
+   crc32c_shift_init(&store->block_shift, block_size);
+   return 0;
+}
+
+static void sidecar_path(ChecksumStore *store, const struct stat *st, char *out, size_t out_size) {
+   snprintf(out, out_size, "%s/%llx-%llx", store->dir,
+            (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+}
+
+static uint64_t num_blocks(ChecksumStore *store, uint64_t size) {
+   return (size + store->block_size - 1) / store->block_size;
+}
+
+void block_checksums_init(BlockChecksums *sums, size_t block_size) {
+   memset(sums, 0, sizeof(*sums));
+   sums->block_size = block_size;
+}
+
+void block_checksums_add(BlockChecksums *sums, uint32_t crc) {
+   if (sums->count == sums->capacity) {
+      sums->capacity = sums->capacity ? sums->capacity * 2 : 64;
+      sums->crcs = realloc(sums->crcs, sums->capacity * sizeof(uint32_t));
+      if (sums->crcs == NULL) {
+         perror("Failed to allocate block checksums");
+         exit(1);
+      }
+   }
+   sums->crcs[sums->count++] = crc;
+}
+
+void block_checksums_update(BlockChecksums *sums, const uint8_t *data, size_t len) {
+   while (len > 0) {
+      size_t n = sums->block_size - sums->partial_len;
+      if (n > len) n = len;
+      sums->partial = crc32c(sums->partial, data, n);
+      sums->partial_len += n;
+      data += n;
+      len -= n;
+      if (sums->partial_len == sums->block_size) {
+         block_checksums_add(sums, sums->partial);
+         sums->partial = 0;
+         sums->partial_len = 0;
+      }
+   }
+}
+
+void block_checksums_free(BlockChecksums *sums) {
+   free(sums->crcs);
+   sums->crcs = NULL;
+   sums->count = sums->capacity = 0;
+}
+
+int checksum_store_save(ChecksumStore *store, const struct stat *st, BlockChecksums *sums) {
+   if (sums->partial_len > 0) {
+      block_checksums_add(sums, sums->partial);
+      sums->partial = 0;
+      sums->partial_len = 0;
+   }
+   if (sums->count != num_blocks(store, st->st_size)) {
+      errno = EINVAL;   // Not the data this version holds
+      return -1;
+   }
+
+   FileVersion version;
+   file_version_from_stat(&version, st);
+   SidecarHeader header = { SIDECAR_MAGIC, store->block_size, version.mtime_ns, st->st_size };
+   char path[512], temp_path[520];
+   sidecar_path(store, st, path, sizeof(path));
+   snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path);
+   int fd = mkstemp(temp_path);
+   if (fd < 0) return -1;
+   // A replaced sidecar is only ever swapped whole, so readers see one or
+   // the other
+   int ok = write(fd, &header, sizeof(header)) == sizeof(header);
+   size_t bytes = sums->count * sizeof(uint32_t);
+   ok = ok && (bytes == 0 || write(fd, sums->crcs, bytes) == (ssize_t)bytes);
+   ok = close(fd) == 0 && ok;
+   if (!ok || rename(temp_path, path) < 0) {
+      unlink(temp_path);
+      return -1;
+   }
+   __atomic_add_fetch(&store->files_saved, 1, __ATOMIC_RELAXED);
+   return 0;
+}
+
+int checksum_store_load(ChecksumStore *store, const struct stat *st, uint64_t first, size_t count,
+                        uint32_t *out) {
+   char path[512];
+   sidecar_path(store, st, path, sizeof(path));
+   int fd = open(path, O_RDONLY);
+   if (fd < 0) return -1;
+   FileVersion version;
+   file_version_from_stat(&version, st);
+   SidecarHeader header;
+   size_t bytes = count * sizeof(uint32_t);
+   int ok = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+            header.magic == SIDECAR_MAGIC && header.block_size == store->block_size &&
+            header.mtime_ns == version.mtime_ns && header.size == (uint64_t)st->st_size &&
+            first + count <= num_blocks(store, st->st_size) &&
+            (bytes == 0 || pread(fd, out, bytes, sizeof(header) + first * sizeof(uint32_t)) == (ssize_t)bytes);
+   close(fd);
+   if (!ok) {
+      errno = ENOENT;   // Nothing usable stored for this version
+      return -1;
+   }
+   return 0;
+}
+
+// Reads len bytes at offset. Returns 0, or -1 if the file ended early.
+static int read_fully(int fd, uint8_t *buffer, size_t len, uint64_t offset) {
+   while (len > 0) {
+      ssize_t bytes_read = pread(fd, buffer, len, offset);
+      if (bytes_read < 0 && errno == EINTR) continue;
+      if (bytes_read <= 0) {
+         if (bytes_read == 0) errno = EIO;
+         return -1;
+      }
+      buffer += bytes_read;
+      len -= bytes_read;
+      offset += bytes_read;
+   }
+   return 0;
+}
+
+int checksum_store_check(ChecksumStore *store, uint32_t stored, uint32_t actual) {
+   if (actual != stored) {
+      __atomic_add_fetch(&store->mismatches, 1, __ATOMIC_RELAXED);
+      return 0;
+   }
+   __atomic_add_fetch(&store->blocks_verified, 1, __ATOMIC_RELAXED);
+   return 1;
+}
+
+int checksum_store_build(ChecksumStore *store, int fd, const struct stat *st) {
+   uint8_t *buffer = malloc(store->block_size);
+   if (buffer == NULL) return -1;
+   BlockChecksums sums;
+   block_checksums_init(&sums, store->block_size);
+   int rc = 0;
+   for (uint64_t offset = 0; rc == 0 && offset < (uint64_t)st->st_size; offset += store->block_size) {
+      size_t len = st->st_size - offset < store->block_size ? st->st_size - offset : store->block_size;
+      rc = read_fully(fd, buffer, len, offset);
+      if (rc == 0) block_checksums_add(&sums, crc32c(0, buffer, len));
+   }
+   if (rc == 0) rc = checksum_store_save(store, st, &sums);
+   block_checksums_free(&sums);
+   free(buffer);
+   return rc;
+}
+
+void checksum_store_remove(ChecksumStore *store, const struct stat *st) {
+   char path[512];
+   sidecar_path(store, st, path, sizeof(path));
+   unlink(path);
+}
+
+int checksum_store_range(ChecksumStore *store, int fd, const struct stat *st, uint64_t offset,
+                         uint64_t len, uint32_t *crc) {
+   *crc = 0;
+   if (len == 0) return 0;
+   size_t block_size = store->block_size;
+   uint64_t first = offset / block_size;
+   size_t count = (offset + len - 1) / block_size - first + 1;
+   uint32_t *stored = malloc(count * sizeof(uint32_t));
+   uint8_t *buffer = malloc(block_size);
+   int rc = stored && buffer ? checksum_store_load(store, st, first, count, stored) : -1;
+
+   uint64_t end = offset + len;
+   for (size_t i = 0; rc == 0 && i < count; i++) {
+      uint64_t block_start = (first + i) * block_size;
+      uint64_t block_end = block_start + block_size < (uint64_t)st->st_size ? block_start + block_size
+                                                                             : (uint64_t)st->st_size;
+      uint64_t from = offset > block_start ? offset : block_start;
+      uint64_t to = end < block_end ? end : block_end;
+      uint32_t piece = stored[i];
+      if (from != block_start || to != block_end) {
+         // An edge of the range: check the whole block, then sum the part sent
+         rc = read_fully(fd, buffer, block_end - block_start, block_start);
+         if (rc == 0 && !checksum_store_check(store, stored[i], crc32c(0, buffer, block_end - block_start))) {
+            errno = EBADMSG;
+            rc = -1;
+         }
+         if (rc == 0) piece = crc32c(0, buffer + (from - block_start), to - from);
+      }
+      *crc = to - from == block_size ? crc32c_append(&store->block_shift, *crc, piece)
+                                     : crc32c_combine(*crc, piece, to - from);
+   }
+   free(stored);
+   free(buffer);
+   return rc;
+}
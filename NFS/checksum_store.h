@@ -0,0 +1,76 @@
+#ifndef _CHECKSUM_STORE_H_
+#define _CHECKSUM_STORE_H_
+
+#include "headers.h"
+#include "block_cache.h"
+#include "crc32c.h"
+#include <stdint.h>
+
+// Optional per-block CRC32C of the files a storage server holds, kept so
+// reads can be checked against what was written without rescanning files.
+//
+// The checksums of a file live in <dir>/<dev>-<ino>: a header naming the
+// version (size and mtime) they describe, then one u32 per block of
+// block_size bytes, in host byte order. They are saved whenever this server
+// writes a file, since the data passes through memory then anyway, and when
+// a read covers a whole file that has none. A sidecar whose version no longer
+// matches the file is simply ignored, so files changed behind the server's
+// back are never reported corrupt; they just go unchecked until rewritten.
+// Sidecars are not synced: losing one costs verification, never data.
+//
+// Blocks match the block cache, so each cached block is checked once, when
+// it is read from disk. Large reads that bypass the cache combine the stored
+// checksums into one for the whole range, which lets the DATA frame keep its
+// zero-copy body and still be verified end to end by the client.
+
+typedef struct {
+   char dir[256];
+   size_t block_size;
+   Crc32cShift block_shift;     // Appends one full block's checksum
+   unsigned long blocks_verified;   // Updated atomically
+   unsigned long mismatches;
+   unsigned long files_saved;
+} ChecksumStore;
+
+// Checksums of the blocks of data written in order
+typedef struct {
+   uint32_t *crcs;
+   size_t count;
+   size_t capacity;
+   uint32_t partial;            // Of the block still being filled
+   size_t partial_len;
+   size_t block_size;
+} BlockChecksums;
+
+// Returns -1 if dir cannot be used
+int checksum_store_init(ChecksumStore *store, const char *dir, size_t block_size);
+
+void block_checksums_init(BlockChecksums *sums, size_t block_size);
+void block_checksums_update(BlockChecksums *sums, const uint8_t *data, size_t len);
+// Appends a block whose checksum is already known; sums must be at a block
+// boundary
+void block_checksums_add(BlockChecksums *sums, uint32_t crc);
+void block_checksums_free(BlockChecksums *sums);
+
+// Records sums, including any partial last block, as the checksums of the
+// file version st. Returns 0 or -1.
+int checksum_store_save(ChecksumStore *store, const struct stat *st, BlockChecksums *sums);
+// Reads the checksums of blocks [first, first + count) of version st into
+// out. Returns -1 if none are stored for that version.
+int checksum_store_load(ChecksumStore *store, const struct stat *st, uint64_t first, size_t count,
+                        uint32_t *out);
+// Compares the checksum of a block just read from disk with the stored one,
+// counting the outcome. Returns 1 if they match.
+int checksum_store_check(ChecksumStore *store, uint32_t stored, uint32_t actual);
+// Computes and saves the checksums of version st of the file open as fd
+int checksum_store_build(ChecksumStore *store, int fd, const struct stat *st);
+void checksum_store_remove(ChecksumStore *store, const struct stat *st);
+
+// The CRC32C of len bytes of fd from offset, from the stored checksums plus
+// whatever partial blocks the range starts or ends in, which are checked
+// whole. Returns -1 if the version has none stored or fd could not be read,
+// with errno EBADMSG if an edge block does not match.
+int checksum_store_range(ChecksumStore *store, int fd, const struct stat *st, uint64_t offset,
+                         uint64_t len, uint32_t *crc);
+
+#endif
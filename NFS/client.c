@@ -1,25 +1,240 @@
 // client.c
 #include "headers.h"
+#include "protocol.h"
+#include "location_cache.h"
+#include "conn_pool.h"
+#include "transfer.h"
+#include "hash_ring.h"
+#include "codec.h"
+#include "delta.h"
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/random.h>
 
 #define BUFFER_SIZE 4096
 #define MAX_PATH_LENGTH 256
+#define LOCATION_CACHE_CAPACITY 1024
+#define LOCATION_CACHE_TTL_SEC 30
+#define POOL_MAX_PER_SERVER 8
+#define POOL_IDLE_TIMEOUT_SEC 60
+#define UPLOAD_CHUNK_SIZE (4 << 20)     // Bytes per DATA frame of an upload
+#define DEFAULT_SYNC_INTERVAL_MB 64
+#define RECV_BUFFER_SIZE (64 << 10)
+#define DEFAULT_FETCH_STREAMS 4
+#define DEFAULT_FETCH_CHUNK_MB 8
+#define MAX_REPLICAS 8
+#define CONN_CHECKSUMS 0x100   // Negotiated state: DATA frames carry checksums
+#define DELTA_MIN_FILE_SIZE (1 << 20)   // Smaller files are always sent whole
+#define DELTA_FALLBACK (-2)             // write_delta: send the file whole instead
 
 typedef struct {
    char ip[16];
    int port;
    int socket;  // Store the socket connection to the storage server
+   int negotiated;   // Codec, plus CONN_CHECKSUMS, agreed on socket
 } ServerInfo;
 
-// Global variables for persistent connections
-ServerInfo current_server;
-int naming_server_socket = -1;
+// Where received DATA bytes go: a stdio stream, or a file descriptor written
+// at increasing offsets with pwrite (safe for threads filling disjoint ranges)
+typedef struct {
+   FILE *file;
+   int fd;
+   off_t offset;
+} DataSink;
 
-// Function to connect to naming server once
-int connect_to_naming_server(const char* nm_ip, int nm_port) {
-   if (naming_server_socket != -1) {
-      return naming_server_socket;  // Return existing connection
+// One operation for run_on_storage_server
+typedef struct {
+   uint8_t opcode;              // OP_READ, OP_STREAM, OP_WRITE or OP_STATS
+   const char *local_path;      // WRITE source; READ destination (stdout if NULL)
+   uint64_t offset;             // READ range
+   uint64_t length;
+   Durability durability;       // WRITE only
+   uint32_t sync_interval_mb;
+} StorageRequest;
+
+// Naming server shards: the shard map and a connection to each shard,
+// parallel to shard_ring->shards. Maps the shards push are adopted between
+// commands, so sockets never change under a command in progress.
+HashRing *shard_ring;
+int shard_sockets[MAX_SHARDS];
+HashRing *pending_shard_map;
+int shard_map_stale;            // A shard disowned a path; refetch the map
+uint32_t next_request_id = 1;   // Use new_request_id(); fetch threads share it
+LocationCache location_cache;
+ConnPool storage_pool;
+Codec preferred_codec = CODEC_LZ;   // Offered on new storage connections
+int want_checksums = 1;             // Asked for on new storage connections
+int delta_writes = 1;               // Rewrites send only what changed
+CodecStats codec_stats;
+
+uint32_t new_request_id(void) {
+   return __atomic_fetch_add(&next_request_id, 1, __ATOMIC_RELAXED);
+}
+
+// Prints the message carried by an OP_ERROR frame and returns its status
+Status print_error_frame(const char *context, const FrameHeader *hdr, const uint8_t *payload) {
+   PayloadReader reader;
+   char message[BUFFER_SIZE];
+   payload_reader_init(&reader, payload, hdr->payload_len);
+   Status status = payload_get_u32(&reader);
+   if (payload_get_str(&reader, message, sizeof(message)) < 0) {
+      strcpy(message, status_str(status));
+   }
+   printf("%s: %s\n", context, message);
+   return status != ST_OK ? status : ST_INVALID;
+}
+
+// Sends a request whose payload is just the path
+int send_path_request(int fd, uint8_t opcode, const char *path, uint32_t *request_id) {
+   PayloadBuilder request;
+   payload_init(&request);
+   payload_put_str(&request, path);
+   *request_id = new_request_id();
+   int rc = send_frame(fd, opcode, 0, *request_id, request.data, request.len);
+   payload_free(&request);
+   return rc;
+}
+
+static int sink_write(DataSink *sink, const char *data, size_t len) {
+   if (sink->file) {
+      return fwrite(data, 1, len, sink->file) == len ? 0 : -1;
+   }
+   while (len > 0) {
+      ssize_t written = pwrite(sink->fd, data, len, sink->offset);
+      if (written < 0 && errno == EINTR) continue;
+      if (written < 0) return -1;
+      data += written;
+      len -= written;
+      sink->offset += written;
+   }
+   return 0;
+}
+
+// Receives a reply made of DATA frames and copies it to out, checking any
+// checksums they carry. Returns 0 on success, -1 on transport or local write
+// failure, ST_IO_ERROR once the whole reply is in if a frame did not match
+// its checksum, and the (non-zero) status if the server answered with an
+// error. If received is non-NULL it is set to
+// the number of bytes written to out, which is where an interrupted read can
+// resume.
+int receive_data(int fd, DataSink *out, const char *context, uint64_t *received) {
+   char buffer[RECV_BUFFER_SIZE];
+   uint8_t chunk[CODEC_CHUNK_SIZE];
+   FrameHeader hdr;
+   int corrupt = 0;
+   if (received) *received = 0;
+   do {
+      if (recv_frame_header(fd, &hdr) < 0) return -1;
+      if (hdr.opcode != OP_DATA) {
+         uint8_t *payload = NULL;
+         int status = ST_INVALID;
+         if (hdr.payload_len <= MAX_CONTROL_PAYLOAD && (payload = malloc(hdr.payload_len + 1)) != NULL &&
+             recv_all(fd, payload, hdr.payload_len) == 0) {
+            status = print_error_frame(context, &hdr, payload);
+         }
+         free(payload);
+         return status;
+      }
+      if (hdr.flags & FRAME_F_COMPRESSED) {
+         ssize_t raw_len = recv_compressed_chunk(fd, &hdr, chunk, &corrupt, &codec_stats);
+         if (raw_len < 0 || sink_write(out, (const char *)chunk, raw_len) < 0) return -1;
+         if (received) *received += raw_len;
+         continue;
+      }
+      int64_t data_len = data_frame_length(&hdr);
+      if (data_len < 0) return -1;
+      codec_stats_received_raw(&codec_stats, data_len);
+      int checked = (hdr.flags & FRAME_F_CHECKSUM) != 0;
+      uint32_t crc = 0;
+      uint64_t remaining = data_len;
+      while (remaining > 0) {
+         size_t want = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+         ssize_t bytes_received = recv(fd, buffer, want, 0);
+         if (bytes_received < 0 && errno == EINTR) continue;
+         if (bytes_received <= 0) return -1;
+         if (checked) crc = data_checksum(&codec_stats, crc, buffer, bytes_received);
+         if (sink_write(out, buffer, bytes_received) < 0) return -1;
+         remaining -= bytes_received;
+         if (received) *received += bytes_received;
+      }
+      if (checked && recv_checksum_trailer(fd, crc, &corrupt, &codec_stats) < 0) return -1;
+   } while (hdr.flags & FRAME_F_MORE);
+   if (corrupt) {
+      // Bytes already written cannot be taken back, so nothing resumes
+      printf("%s: checksum mismatch, the data received is corrupt\n", context);
+      return ST_IO_ERROR;
+   }
+   return 0;
+}
+
+// Applies a remap or failure notice pushed by the naming server. Returns 0 if
+// the frame was not such an event.
+int handle_naming_server_event(const FrameHeader *hdr, const uint8_t *payload) {
+   PayloadReader reader;
+   payload_reader_init(&reader, payload, hdr->payload_len);
+   if (hdr->opcode == OP_INVALIDATE) {
+      char prefix[MAX_PATH_LENGTH];
+      if (payload_get_str(&reader, prefix, sizeof(prefix)) == 0) {
+         location_cache_invalidate_prefix(&location_cache, prefix);
+      }
+      return 1;
+   }
+   if (hdr->opcode == OP_SERVER_DOWN) {
+      char ip[16];
+      payload_get_str(&reader, ip, sizeof(ip));
+      int port = payload_get_u32(&reader);
+      if (!reader.error) {
+         location_cache_invalidate_server(&location_cache, ip, port);
+         conn_pool_close_server(&storage_pool, ip, port);
+      }
+      return 1;
+   }
+   if (hdr->opcode == OP_SHARD_MAP) {
+      HashRing *ring = hash_ring_decode(payload, hdr->payload_len);
+      if (ring != NULL) {
+         hash_ring_free(pending_shard_map);
+         pending_shard_map = ring;
+      }
+      return 1;
+   }
+   return 0;
+}
+
+// Prints a naming server error. ST_NOT_OWNER means the path moved to another
+// shard, so a fresh shard map is fetched before the next command.
+void print_naming_server_error(const char *context, const FrameHeader *hdr, const uint8_t *payload) {
+   if (print_error_frame(context, hdr, payload) == ST_NOT_OWNER) shard_map_stale = 1;
+}
+
+// Receives the reply to a naming server request, applying any events that
+// were queued ahead of it
+int recv_naming_server_reply(int nm_socket, FrameHeader *hdr, uint8_t **payload) {
+   while (1) {
+      if (recv_frame(nm_socket, hdr, payload, MAX_CONTROL_PAYLOAD) < 0) return -1;
+      if (!handle_naming_server_event(hdr, *payload)) return 0;
+      free(*payload);
    }
-   naming_server_socket = socket(AF_INET, SOCK_STREAM, 0);
+}
+
+// Applies events that arrived on any shard while the client was idle,
+// without blocking. Called before trusting the cache.
+void drain_naming_server_events(void) {
+   for (int i = 0; shard_ring && i < shard_ring->num_shards; i++) {
+      if (shard_sockets[i] < 0) continue;
+      struct pollfd pfd = { .fd = shard_sockets[i], .events = POLLIN };
+      while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+         FrameHeader hdr;
+         uint8_t *payload;
+         if (recv_frame(shard_sockets[i], &hdr, &payload, MAX_CONTROL_PAYLOAD) < 0) break;
+         handle_naming_server_event(&hdr, payload);
+         free(payload);
+      }
+   }
+}
+
+// Connects to one naming server shard
+int connect_to_naming_server(const char* nm_ip, int nm_port) {
+   int nm_socket = socket(AF_INET, SOCK_STREAM, 0);
    struct sockaddr_in nm_addr;
 
    memset(&nm_addr, 0, sizeof(nm_addr));
@@ -27,203 +242,1082 @@ int connect_to_naming_server(const char* nm_ip, int nm_port) {
    nm_addr.sin_addr.s_addr = inet_addr(nm_ip);
    nm_addr.sin_port = htons(nm_port);
 
-   if (connect(naming_server_socket, (struct sockaddr*)&nm_addr, sizeof(nm_addr)) < 0) {
+   if (connect(nm_socket, (struct sockaddr*)&nm_addr, sizeof(nm_addr)) < 0) {
       perror("Connection to naming server failed");
-      naming_server_socket = -1;
+      close(nm_socket);
       return -1;
    }
    // Identify as client (only once)
-   const char* client_type = "CLIENT";
-   send(naming_server_socket, client_type, strlen(client_type), 0);
+   send_frame(nm_socket, OP_HELLO_CLIENT, 0, 0, NULL, 0);
+
+   return nm_socket;
+}
+
+// Switches to a new shard map, keeping the connections to shards that stay
+// and connecting to the ones that joined. Takes ownership of ring.
+void adopt_shard_map(HashRing *ring) {
+   int sockets[MAX_SHARDS];
+   for (int i = 0; i < ring->num_shards; i++) {
+      int old = shard_ring ? hash_ring_find(shard_ring, &ring->shards[i]) : -1;
+      if (old >= 0) {
+         sockets[i] = shard_sockets[old];
+         shard_sockets[old] = -1;
+      } else {
+         sockets[i] = connect_to_naming_server(ring->shards[i].ip, ring->shards[i].port);
+      }
+   }
+   for (int i = 0; shard_ring && i < shard_ring->num_shards; i++) {
+      if (shard_sockets[i] >= 0) close(shard_sockets[i]);
+   }
+   memcpy(shard_sockets, sockets, ring->num_shards * sizeof(int));
+   if (shard_ring && !hash_ring_equal(shard_ring, ring)) {
+      printf("Shard map now has %d naming server(s)\n", ring->num_shards);
+   }
+   hash_ring_free(shard_ring);
+   shard_ring = ring;
+}
+
+// Brings the shard map up to date between commands
+void refresh_shard_map(void) {
+   drain_naming_server_events();
+   if (shard_map_stale && pending_shard_map == NULL) {
+      for (int i = 0; i < shard_ring->num_shards && pending_shard_map == NULL; i++) {
+         pending_shard_map = hash_ring_fetch(shard_ring->shards[i].ip, shard_ring->shards[i].port);
+      }
+   }
+   shard_map_stale = 0;
+   if (pending_shard_map != NULL) {
+      adopt_shard_map(pending_shard_map);
+      pending_shard_map = NULL;
+   }
+}
 
-   return naming_server_socket;
+// Connection to the shard owning path, or -1
+int shard_socket(const char *path) {
+   int owner = hash_ring_owner(shard_ring, path);
+   return owner < 0 ? -1 : shard_sockets[owner];
 }
 
 // Function to get storage server details from naming server
-ServerInfo get_storage_server(const char* nm_ip, int nm_port, const char* path, int nm_socket) {
+ServerInfo get_storage_server(int nm_socket, const char* path) {
    ServerInfo server_info;
    memset(&server_info, 0, sizeof(ServerInfo));
+   server_info.socket = -1;
 
    // Send path request to naming server
-   char request[BUFFER_SIZE];
-   sprintf(request, "GET_SERVER %s", path);
-   send(nm_socket, request, strlen(request), 0);
+   uint32_t request_id;
+   if (send_path_request(nm_socket, OP_GET_SERVER, path, &request_id) < 0) {
+      perror("Failed to send request to naming server");
+      return server_info;
+   }
 
    // Receive server info from naming server
-   char response[BUFFER_SIZE];
-   ssize_t bytes_received = recv(nm_socket, response, BUFFER_SIZE - 1, 0);
-   if (bytes_received <= 0) {
+   FrameHeader hdr;
+   uint8_t *response;
+   if (recv_naming_server_reply(nm_socket, &hdr, &response) < 0) {
       printf("Failed to receive response from naming server\n");
       return server_info;
    }
+   if (hdr.opcode == OP_SERVER_INFO && hdr.request_id == request_id) {
+      PayloadReader reader;
+      char matched[MAX_PATH_LENGTH];
+      payload_reader_init(&reader, response, hdr.payload_len);
+      payload_get_str(&reader, server_info.ip, sizeof(server_info.ip));
+      server_info.port = payload_get_u32(&reader);
+      payload_get_str(&reader, matched, sizeof(matched));
+      if (reader.error) server_info.port = 0;
+      printf("(client)Received response: %s %d\n", server_info.ip, server_info.port);
 
-   response[bytes_received] = '\0';
-   printf("(client)Received response: %s\n", response);
-   sscanf(response, "%s %d", server_info.ip, &server_info.port);
+      // A path resolved through a claimed directory caches the directory, so
+      // its siblings resolve locally too
+      if (server_info.port > 0) {
+         int is_prefix = strcmp(matched, path) != 0;
+         location_cache_insert(&location_cache, is_prefix ? matched : path, is_prefix,
+                               server_info.ip, server_info.port);
+      }
+   }
+   else if (hdr.opcode == OP_ERROR) {
+      print_naming_server_error("Naming server", &hdr, response);
+   }
+   free(response);
    return server_info;
 }
 
+// Resolves path from the location cache, asking the naming server on a miss
+ServerInfo resolve_server(int nm_socket, const char *path, int *from_cache) {
+   ServerInfo server_info;
+   memset(&server_info, 0, sizeof(ServerInfo));
+   server_info.socket = -1;
+
+   drain_naming_server_events();
+   *from_cache = location_cache_lookup(&location_cache, path, server_info.ip, &server_info.port);
+   if (*from_cache) return server_info;
+   return get_storage_server(nm_socket, path);
+}
+
+// Decodes an OP_REPLICAS_REPLY payload into out (at most max entries)
+int parse_replicas(const uint8_t *payload, size_t len, ServerInfo *out, int max) {
+   PayloadReader reader;
+   char matched[MAX_PATH_LENGTH];
+   payload_reader_init(&reader, payload, len);
+   payload_get_str(&reader, matched, sizeof(matched));
+   uint32_t n = payload_get_u32(&reader);
+   int count = 0;
+   for (uint32_t i = 0; i < n && count < max && !reader.error; i++) {
+      memset(&out[count], 0, sizeof(ServerInfo));
+      out[count].socket = -1;
+      payload_get_str(&reader, out[count].ip, sizeof(out[count].ip));
+      out[count].port = payload_get_u32(&reader);
+      if (!reader.error) count++;
+   }
+   return count;
+}
+
+// Asks the naming server for every live replica of path, preferred first.
+// Replica lists are not cached: writes must reach the current set. Returns
+// the number stored in out (at most max), 0 if there is none, or -1.
+int resolve_replicas(int nm_socket, const char *path, ServerInfo *out, int max) {
+   uint32_t request_id;
+   if (send_path_request(nm_socket, OP_GET_REPLICAS, path, &request_id) < 0) {
+      perror("Failed to send request to naming server");
+      return -1;
+   }
+   FrameHeader hdr;
+   uint8_t *response;
+   if (recv_naming_server_reply(nm_socket, &hdr, &response) < 0) {
+      printf("Failed to receive response from naming server\n");
+      return -1;
+   }
+   int count = 0;
+   if (hdr.opcode == OP_REPLICAS_REPLY && hdr.request_id == request_id) {
+      count = parse_replicas(response, hdr.payload_len, out, max);
+   }
+   else if (hdr.opcode == OP_ERROR) {
+      print_naming_server_error("Naming server", &hdr, response);
+   }
+   free(response);
+   return count;
+}
+
+// Sends one OP_GET_SERVERS batch of the paths at indices to a shard and
+// fills in their entries of out. Returns how many it resolved, or -1.
+static int resolve_batch(int nm_socket, char **paths, const int *indices, int count, ServerInfo *out) {
+   PayloadBuilder request;
+   payload_init(&request);
+   payload_put_u32(&request, count);
+   for (int i = 0; i < count; i++) payload_put_str(&request, paths[indices[i]]);
+   uint32_t request_id = new_request_id();
+   int rc = send_frame(nm_socket, OP_GET_SERVERS, 0, request_id, request.data, request.len);
+   payload_free(&request);
+
+   FrameHeader hdr;
+   uint8_t *response;
+   if (rc < 0 || recv_naming_server_reply(nm_socket, &hdr, &response) < 0) return -1;
+   int resolved = 0;
+   if (hdr.opcode == OP_SERVERS_REPLY && hdr.request_id == request_id) {
+      PayloadReader reader;
+      payload_reader_init(&reader, response, hdr.payload_len);
+      uint32_t num_groups = payload_get_u32(&reader);
+      for (uint32_t g = 0; g < num_groups && !reader.error; g++) {
+         char ip[16];
+         char matched[MAX_PATH_LENGTH];
+         payload_get_str(&reader, ip, sizeof(ip));
+         int port = payload_get_u32(&reader);
+         uint32_t members = payload_get_u32(&reader);
+         for (uint32_t m = 0; m < members && !reader.error; m++) {
+            uint32_t index = payload_get_u32(&reader);
+            payload_get_str(&reader, matched, sizeof(matched));
+            if (reader.error || index >= (uint32_t)count) break;
+            ServerInfo *info = &out[indices[index]];
+            strcpy(info->ip, ip);
+            info->port = port;
+            resolved++;
+
+            const char *path = paths[indices[index]];
+            int is_prefix = strcmp(matched, path) != 0;
+            location_cache_insert(&location_cache, is_prefix ? matched : path, is_prefix, ip, port);
+         }
+      }
+   }
+   else if (hdr.opcode == OP_ERROR) {
+      print_naming_server_error("Naming server", &hdr, response);
+   }
+   free(response);
+   return resolved;
+}
+
+// Resolves many paths with one OP_GET_SERVERS round trip per shard. Paths
+// found in the location cache are not sent. Unresolved entries of out get
+// port 0. Returns the number of paths resolved, or -1 if a naming server
+// could not be reached.
+int resolve_servers(char **paths, int count, ServerInfo *out) {
+   int *misses = malloc((count ? count : 1) * sizeof(int));
+   int *owners = malloc((count ? count : 1) * sizeof(int));
+   if (misses == NULL || owners == NULL) {
+      free(misses);
+      free(owners);
+      return -1;
+   }
+
+   drain_naming_server_events();
+   int num_misses = 0, resolved = 0;
+   for (int i = 0; i < count; i++) {
+      memset(&out[i], 0, sizeof(ServerInfo));
+      out[i].socket = -1;
+      if (location_cache_lookup(&location_cache, paths[i], out[i].ip, &out[i].port)) resolved++;
+      else misses[num_misses++] = i;
+   }
+   for (int i = 0; i < num_misses; i++) owners[i] = hash_ring_owner(shard_ring, paths[misses[i]]);
+
+   // Regroup the misses shard by shard, compacting each group to the front
+   int *batch = malloc((num_misses ? num_misses : 1) * sizeof(int));
+   for (int shard = 0; batch && shard < shard_ring->num_shards; shard++) {
+      int n = 0;
+      for (int i = 0; i < num_misses; i++) {
+         if (owners[i] == shard) batch[n++] = misses[i];
+      }
+      if (n == 0) continue;
+      int rc = resolve_batch(shard_sockets[shard], paths, batch, n, out);
+      if (rc < 0) {
+         printf("Failed to resolve paths through naming server %s:%d\n",
+                shard_ring->shards[shard].ip, shard_ring->shards[shard].port);
+         resolved = -1;
+         break;
+      }
+      resolved += rc;
+   }
+   free(batch);
+   free(misses);
+   free(owners);
+   return resolved;
+}
+
+// Resolves every path on the command line in one batch and prints them
+// grouped by storage server
+void resolve_paths(char *args) {
+   char *paths[BUFFER_SIZE / 2];
+   int count = 0;
+   for (char *tok = strtok(args, " \t\n"); tok && count < (int)(sizeof(paths) / sizeof(paths[0]));
+        tok = strtok(NULL, " \t\n")) {
+      paths[count++] = tok;
+   }
+   ServerInfo *servers = malloc((count ? count : 1) * sizeof(ServerInfo));
+   if (servers == NULL) return;
+   int resolved = resolve_servers(paths, count, servers);
+   if (resolved < 0) {
+      free(servers);
+      return;
+   }
+
+   int *printed = calloc(count ? count : 1, sizeof(int));
+   for (int i = 0; printed && i < count; i++) {
+      if (printed[i] || servers[i].port <= 0) continue;
+      printf("%s:%d\n", servers[i].ip, servers[i].port);
+      for (int j = i; j < count; j++) {
+         if (!printed[j] && servers[j].port == servers[i].port && strcmp(servers[j].ip, servers[i].ip) == 0) {
+            printf("   %s\n", paths[j]);
+            printed[j] = 1;
+         }
+      }
+   }
+   for (int i = 0; i < count; i++) {
+      if (servers[i].port <= 0) printf("%s: no server\n", paths[i]);
+   }
+   printf("%d of %d path(s) resolved\n", resolved, count);
+   free(printed);
+   free(servers);
+}
+
+// Lists the claims one shard holds at or below prefix. Returns how many it
+// printed, or -1.
+static int list_shard_paths(int nm_socket, const char *prefix) {
+   uint32_t request_id;
+   if (send_path_request(nm_socket, OP_LIST, prefix, &request_id) < 0) {
+      perror("Failed to send list request to naming server");
+      return -1;
+   }
+   FrameHeader hdr;
+   uint8_t *response;
+   if (recv_naming_server_reply(nm_socket, &hdr, &response) < 0) {
+      printf("Failed to receive response from naming server\n");
+      return -1;
+   }
+   int count = -1;
+   if (hdr.opcode == OP_LIST_REPLY) {
+      PayloadReader reader;
+      payload_reader_init(&reader, response, hdr.payload_len);
+      count = payload_get_u32(&reader);
+      for (int i = 0; i < count && !reader.error; i++) {
+         char path[MAX_PATH_LENGTH];
+         char ip[16];
+         payload_get_str(&reader, path, sizeof(path));
+         payload_get_str(&reader, ip, sizeof(ip));
+         uint32_t port = payload_get_u32(&reader);
+         if (!reader.error) printf("%s -> %s:%u\n", path, ip, port);
+      }
+   }
+   else if (hdr.opcode == OP_ERROR) {
+      print_naming_server_error("List failed", &hdr, response);
+   }
+   free(response);
+   return count;
+}
+
+// List every claimed path at or below a prefix. A prefix lives on one shard;
+// listing everything asks them all.
+void list_paths(const char *prefix) {
+   int total = 0;
+   if (prefix[0] != '\0') {
+      total = list_shard_paths(shard_socket(prefix), prefix);
+   }
+   for (int i = 0; prefix[0] == '\0' && i < shard_ring->num_shards && total >= 0; i++) {
+      int count = list_shard_paths(shard_sockets[i], prefix);
+      total = count < 0 ? -1 : total + count;
+   }
+   if (total >= 0) printf("%d path(s)\n", total);
+}
+
 // Create file or directory on storage server
-void create_item(ServerInfo server, const char* path, int is_directory) {
-   char buffer[BUFFER_SIZE];
+int create_item(ServerInfo server, const char* path, int is_directory) {
+   char full_path[MAX_PATH_LENGTH];
+   uint32_t request_id;
 
-   sprintf(buffer, "CREATE %s%s", path, is_directory ? "/" : "");
-   send(server.socket, buffer, strlen(buffer), 0);
+   snprintf(full_path, sizeof(full_path), "%s%s", path, is_directory ? "/" : "");
+   send_path_request(server.socket, OP_CREATE, full_path, &request_id);
 
-   memset(buffer, 0, BUFFER_SIZE);
-   recv(server.socket, buffer, BUFFER_SIZE - 1, 0);
-   printf("Create response: %s\n", buffer);
+   FrameHeader hdr;
+   uint8_t *response;
+   if (recv_frame(server.socket, &hdr, &response, MAX_CONTROL_PAYLOAD) < 0) {
+      perror("Failed to receive create response");
+      return -1;
+   }
+   int rc = 0;
+   if (hdr.opcode == OP_ACK) {
+      printf("Create response: %s\n", (char *)response);
+   } else {
+      rc = print_error_frame("Create failed", &hdr, response);
+   }
+   free(response);
+   return rc;
 }
 
 
 // Cleanup connections before exit
 void cleanup_connections() {
-   if (naming_server_socket != -1) {
-      close(naming_server_socket);
+   for (int i = 0; shard_ring && i < shard_ring->num_shards; i++) {
+      if (shard_sockets[i] >= 0) close(shard_sockets[i]);
+   }
+   conn_pool_close_idle(&storage_pool);
+}
+
+// Pool setup hook: agrees with the storage server on the codec and on
+// checksums for this connection. Returns the codec, plus CONN_CHECKSUMS if
+// DATA frames carry them. Servers that predate negotiation answer with an
+// error, which leaves the connection plain.
+int negotiate_connection(int fd) {
+   uint8_t options = want_checksums ? NEGOTIATE_CHECKSUMS : 0;
+   if (preferred_codec == CODEC_NONE && options == 0) return CODEC_NONE;
+   uint8_t offer[3] = { 1, preferred_codec, options };
+   FrameHeader hdr;
+   uint8_t *reply;
+   if (send_frame(fd, OP_NEGOTIATE, 0, new_request_id(), offer, sizeof(offer)) < 0 ||
+       recv_frame(fd, &hdr, &reply, MAX_CONTROL_PAYLOAD) < 0) {
+      perror("Connection negotiation failed");
+      return -1;
    }
-   if (current_server.socket != -1) {
-      close(current_server.socket);
+   int negotiated = CODEC_NONE;
+   if (hdr.opcode == OP_NEGOTIATE && hdr.payload_len >= 1 && reply[0] < CODEC_COUNT) {
+      negotiated = reply[0];
+      if (hdr.payload_len >= 2 && (reply[1] & NEGOTIATE_CHECKSUMS)) negotiated |= CONN_CHECKSUMS;
    }
+   free(reply);
+   return negotiated;
 }
 
-// Function to connect to the storage server
+// Checks a connection to the storage server out of the pool
 int connect_to_storage_server(ServerInfo *server){
-   printf("Connecting to storage server %s:%d\n", server->ip, server->port);
    if (server->socket != -1){
-      return server->socket; // Return existing connection if already connected
+      return server->socket; // Already checked out
+   }
+   server->socket = conn_pool_acquire(&storage_pool, server->ip, server->port, &server->negotiated);
+   return server->socket;
+}
+
+// Hands the connection back to the pool. rc is the result of the exchange:
+// negative means the stream may be out of sync and the connection is dropped.
+void release_storage_server(ServerInfo *server, int rc) {
+   if (server->socket == -1) return;
+   conn_pool_release(&storage_pool, server->ip, server->port, server->socket, server->negotiated, rc >= 0);
+   server->socket = -1;
+}
+
+// Creates path (a trailing '/' makes a directory) through the naming server.
+// A new top-level path is placed by the naming server on its least loaded
+// storage server; one under an existing claim is created here on every
+// replica of that claim.
+void create_path(int nm_socket, const char *path) {
+   uint32_t request_id;
+   drain_naming_server_events();
+   if (send_path_request(nm_socket, OP_CREATE, path, &request_id) < 0) {
+      perror("Failed to send request to naming server");
+      return;
    }
+   FrameHeader hdr;
+   uint8_t *response;
+   if (recv_naming_server_reply(nm_socket, &hdr, &response) < 0) {
+      printf("Failed to receive response from naming server\n");
+      return;
+   }
+   if (hdr.opcode == OP_ACK) {
+      printf("Create response: %s\n", (char *)response);
+   }
+   else if (hdr.opcode == OP_REPLICAS_REPLY) {
+      ServerInfo replicas[MAX_REPLICAS];
+      int n = parse_replicas(response, hdr.payload_len, replicas, MAX_REPLICAS);
+      for (int i = 0; i < n; i++) {
+         if (connect_to_storage_server(&replicas[i]) < 0) {
+            printf("Failed to connect to storage server %s:%d\n", replicas[i].ip, replicas[i].port);
+            continue;
+         }
+         int rc = create_item(replicas[i], path, 0);
+         release_storage_server(&replicas[i], rc);
+      }
+   }
+   else if (hdr.opcode == OP_ERROR) {
+      print_naming_server_error("Create failed", &hdr, response);
+   }
+   free(response);
+}
+
+// Prints the latest load report of every storage server
+void show_server_loads(int nm_socket) {
+   uint32_t request_id = new_request_id();
+   drain_naming_server_events();
+   if (send_frame(nm_socket, OP_SERVER_LOADS, 0, request_id, NULL, 0) < 0) {
+      perror("Failed to send request to naming server");
+      return;
+   }
+   FrameHeader hdr;
+   uint8_t *response;
+   if (recv_naming_server_reply(nm_socket, &hdr, &response) < 0) {
+      printf("Failed to receive response from naming server\n");
+      return;
+   }
+   if (hdr.opcode == OP_ACK) {
+      printf("%s", hdr.payload_len > 0 ? (char *)response : "No storage servers\n");
+   }
+   else if (hdr.opcode == OP_ERROR) {
+      print_naming_server_error("Naming server", &hdr, response);
+   }
+   free(response);
+}
 
-   // Create socket for storage server connection
-   server->socket = socket(AF_INET, SOCK_STREAM, 0);
-   if (server->socket < 0){
-      perror("Error creating socket for storage server");
+// Reads length bytes of file_path starting at offset (READ_TO_END for the
+// rest of the file) and copies them to out. Returns the receive_data result.
+int read_file_range(int server_socket, const char *file_path, uint64_t offset, uint64_t length,
+                    DataSink *out, uint64_t *received) {
+   PayloadBuilder request;
+   payload_init(&request);
+   payload_put_str(&request, file_path);
+   payload_put_u64(&request, offset);
+   payload_put_u64(&request, length);
+   int rc = send_frame(server_socket, OP_READ, 0, new_request_id(), request.data, request.len);
+   payload_free(&request);
+   if (rc < 0) {
+      perror("Failed to send file path to server");
       return -1;
    }
+   // The byte count is announced up front, so a short reply is detected
+   return receive_data(server_socket, out, "Read failed", received);
+}
+
+// Function to read a file, or part of one, from the storage server. A READ
+// into a local file appends from request->offset, resuming a partial copy.
+int read_file(int server_socket, const char *file_path, const StorageRequest *request) {
+   DataSink out = { stdout, -1, 0 };
+   if (request->local_path) {
+      out.file = fopen(request->local_path, "ab");
+      if (out.file == NULL) {
+         perror("Failed to open local file");
+         return ST_INVALID;   // Nothing was sent; the connection is still clean
+      }
+   }
+   printf("Requesting ss to read file: %s\n", file_path);
+
+   uint64_t received;
+   int rc = read_file_range(server_socket, file_path, request->offset, request->length, &out, &received);
+   if (out.file != stdout) fclose(out.file);
+   if (rc == 0) {
+      printf("\nFile transfer complete (%llu bytes)\n", (unsigned long long)received);
+   }
+   else if (rc < 0) {
+      perror("Error receiving file content");
+      printf("Received %llu bytes; resume from offset %llu\n", (unsigned long long)received,
+             (unsigned long long)(request->offset + received));
+   }
+   return rc;
+}
 
+// The server's copy of a file, as OP_SIGNATURES describes it
+typedef struct {
+   uint64_t size;
+   int64_t mtime_ns;
+   uint64_t ino;
+   uint32_t block_size;
+   uint64_t count;
+   BlockSignature *sigs;
+} RemoteBase;
 
-   struct sockaddr_in server_addr;
-   memset(&server_addr, 0, sizeof(server_addr));
-   server_addr.sin_family = AF_INET;
-   server_addr.sin_addr.s_addr = inet_addr(server->ip);
-   server_addr.sin_port = htons(server->port);
+// Skips a reply made of DATA frames
+static int discard_data(int fd) {
+   FrameHeader hdr;
+   do {
+      if (recv_frame_header(fd, &hdr) < 0 || hdr.opcode != OP_DATA ||
+          discard_payload(fd, hdr.payload_len) < 0) {
+         return -1;
+      }
+   } while (hdr.flags & FRAME_F_MORE);
+   return 0;
+}
 
-   if (connect(server->socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0){
-      perror("Error connecting to storage server");
+// Fetches the block signatures of the server's copy of file_path, hashed
+// with seed. Returns 0, DELTA_FALLBACK if there is nothing to compute a
+// delta against, -1 on transport failure or the status of an error reply.
+static int fetch_signatures(int server_socket, const char *file_path, uint32_t seed, RemoteBase *base) {
+   PayloadBuilder request;
+   payload_init(&request);
+   payload_put_str(&request, file_path);
+   payload_put_u32(&request, seed);
+   int rc = send_frame(server_socket, OP_SIGNATURES, 0, new_request_id(), request.data, request.len);
+   payload_free(&request);
+   if (rc < 0) {
+      perror("Failed to request block signatures");
+      return -1;
+   }
+   FrameHeader hdr;
+   uint8_t *response;
+   if (recv_frame(server_socket, &hdr, &response, MAX_CONTROL_PAYLOAD) < 0) {
+      perror("Failed to receive block signatures");
       return -1;
    }
-   else{
-      printf("Connected to storage server\n");
+   PayloadReader reader;
+   payload_reader_init(&reader, response, hdr.payload_len);
+   if (hdr.opcode == OP_ERROR) {
+      // A file not there yet, or a server without delta writes, takes the
+      // file whole; only a moved path is worth reporting
+      rc = DELTA_FALLBACK;
+      if (payload_get_u32(&reader) == ST_NOT_OWNER) rc = print_error_frame("Write failed", &hdr, response);
+      free(response);
+      return rc;
    }
-   printf("Connected to storage server\n");
-   return server->socket;
+   base->size = payload_get_u64(&reader);
+   base->mtime_ns = payload_get_u64(&reader);
+   base->ino = payload_get_u64(&reader);
+   base->block_size = payload_get_u32(&reader);
+   base->count = payload_get_u64(&reader);
+   int valid = hdr.opcode == OP_SIGNATURES && !reader.error &&
+               base->block_size == delta_block_size(base->size) &&
+               base->count == (base->size + base->block_size - 1) / base->block_size;
+   free(response);
+   if (!valid) {
+      printf("Malformed block signatures\n");
+      return -1;
+   }
+
+   // Without memory for them the signatures are skipped and the file goes
+   // whole
+   char *table = NULL;
+   size_t table_len = 0;
+   DataSink out = { open_memstream(&table, &table_len), -1, 0 };
+   if (out.file == NULL) {
+      perror("Failed to allocate block signatures");
+      return discard_data(server_socket) < 0 ? -1 : DELTA_FALLBACK;
+   }
+   rc = receive_data(server_socket, &out, "Write failed", NULL);
+   if (fclose(out.file) != 0 && rc == 0) {
+      perror("Failed to allocate block signatures");
+      rc = DELTA_FALLBACK;
+   }
+   if (rc == 0 && table_len != base->count * DELTA_SIGNATURE_SIZE) {
+      printf("Malformed block signatures\n");
+      rc = -1;
+   }
+   if (rc == 0) {
+      base->sigs = malloc((base->count ? base->count : 1) * sizeof(BlockSignature));
+      if (base->sigs == NULL) {
+         perror("Failed to allocate block signatures");
+         rc = DELTA_FALLBACK;
+      }
+   }
+   if (rc == 0) {
+      for (uint64_t i = 0; i < base->count; i++) {
+         block_signature_decode(&base->sigs[i], (const uint8_t *)table + i * DELTA_SIGNATURE_SIZE);
+      }
+   }
+   free(table);
+   return rc;
 }
 
-// Function to read the file from the storage server
-void read_file(int server_socket, const char *file_path) {
-   // Send the file path to the server to request the file
-   if (send(server_socket, file_path, strlen(file_path) + 1, 0) < 0) {
-      perror("Failed to send file path to server");
-      close(server_socket);
-      return;
+// Packs a delta into DATA frames of CODEC_CHUNK_SIZE bytes, the most the
+// server takes in one
+typedef struct {
+   int sock;
+   uint32_t request_id;
+   DataEncoder *enc;
+   uint8_t frame[CODEC_CHUNK_SIZE];
+   size_t filled;
+   uint64_t left;               // Of the whole delta, so the last frame is known
+} DeltaSender;
+
+static int delta_send(DeltaSender *sender, const uint8_t *data, uint64_t len) {
+   while (len > 0) {
+      size_t n = sizeof(sender->frame) - sender->filled;
+      if (n > len) n = len;
+      memcpy(sender->frame + sender->filled, data, n);
+      sender->filled += n;
+      sender->left -= n;
+      data += n;
+      len -= n;
+      if (sender->filled == sizeof(sender->frame) || sender->left == 0) {
+         int rc = send_data_chunk(sender->sock, sender->left ? FRAME_F_MORE : 0, sender->request_id,
+                                  sender->enc, sender->frame, sender->filled);
+         sender->filled = 0;
+         if (rc < 0) return -1;
+      }
+   }
+   return 0;
+}
+
+// Rewrites file_path by sending only what changed since the server's copy:
+// the local file is described as runs of that copy's blocks and literal
+// bytes (see delta.h), and the server rebuilds it. Returns like write_file,
+// or DELTA_FALLBACK if the file should be sent whole instead.
+static int write_delta(int server_socket, int negotiated, const char *file_path, int fd, uint64_t total,
+                       const StorageRequest *options) {
+   uint32_t seed;
+   if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) seed = time(NULL) ^ getpid();
+   RemoteBase base = { 0 };
+   int rc = fetch_signatures(server_socket, file_path, seed, &base);
+   if (rc != 0) return rc;
+   uint8_t *data = base.count ? mmap(NULL, total, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+   if (data == MAP_FAILED) {
+      free(base.sigs);
+      return DELTA_FALLBACK;
+   }
+   SignatureIndex index;
+   DeltaPlan plan;
+   int planned = signature_index_init(&index, base.sigs, base.count, base.block_size, base.size, seed) == 0;
+   if (planned) {
+      planned = delta_plan_build(&plan, &index, data, total) == 0;
+      signature_index_free(&index);
    }
-   else{
-      printf("Requesting ss to read file: %s\n", file_path);
+   free(base.sigs);
+   if (!planned) perror("Failed to allocate a delta");
+   if (!planned || plan.copied_blocks == 0 || plan.encoded_size >= total) {
+      // Nothing in common worth a delta
+      if (planned) delta_plan_free(&plan);
+      munmap(data, total);
+      return DELTA_FALLBACK;
    }
 
-   // Buffer to receive the file content
-   char buffer[BUFFER_SIZE];
-   ssize_t bytes_received;
+   PayloadBuilder request;
+   payload_init(&request);
+   payload_put_str(&request, file_path);
+   payload_put_u64(&request, total);
+   payload_put_u32(&request, crc32c(0, data, total));
+   payload_put_u64(&request, base.size);
+   payload_put_u64(&request, base.mtime_ns);
+   payload_put_u64(&request, base.ino);
+   payload_put_u32(&request, base.block_size);
+   payload_put_u8(&request, options->durability);
+   payload_put_u32(&request, options->sync_interval_mb);
+   payload_put_u64(&request, plan.encoded_size);
+   uint32_t request_id = new_request_id();
+   rc = send_frame(server_socket, OP_DELTA_WRITE, 0, request_id, request.data, request.len);
+   payload_free(&request);
 
-   // Receive the file content from the server
-   while ((bytes_received = recv(server_socket, buffer, sizeof(buffer) - 1, 0)) > 0) {
-      buffer[bytes_received] = '\0'; // Null-terminate the received data for string operations
+   DataEncoder enc;
+   data_encoder_init(&enc, negotiated & ~CONN_CHECKSUMS, (negotiated & CONN_CHECKSUMS) != 0, &codec_stats);
+   DeltaSender sender = { .sock = server_socket, .request_id = request_id, .enc = &enc,
+                          .left = plan.encoded_size };
+   for (size_t i = 0; rc == 0 && i < plan.count; i++) {
+      const DeltaOp *op = &plan.ops[i];
+      uint8_t header[DELTA_COPY_SIZE];
+      rc = delta_send(&sender, header, delta_op_encode(op, header));
+      if (rc == 0 && !op->copy) rc = delta_send(&sender, data + op->start, op->len);
+   }
+   uint64_t delta_size = plan.encoded_size;
+   delta_plan_free(&plan);
+   munmap(data, total);
+   if (rc < 0) {
+      perror("Failed to send data to server");
+      return -1;
+   }
 
-      // Check for the "END_OF_FILE" marker
-      if (strstr(buffer, "END_OF_FILE") != NULL) {
-         // Print up to the "END_OF_FILE" marker and break
-         char *end_marker = strstr(buffer, "END_OF_FILE");
-         fwrite(buffer, 1, end_marker - buffer, stdout);
-         printf("\nFile transfer complete\n");
-         break;
-      }
-      // Print the received data
-      fwrite(buffer, 1, bytes_received, stdout);
+   FrameHeader hdr;
+   uint8_t *response;
+   if (recv_frame(server_socket, &hdr, &response, MAX_CONTROL_PAYLOAD) < 0) {
+      perror("Failed to receive server response");
+      return -1;
    }
-   if (bytes_received < 0) {
-      perror("Error receiving file content");
+   PayloadReader reader;
+   payload_reader_init(&reader, response, hdr.payload_len);
+   rc = 0;
+   if (hdr.opcode == OP_ACK) {
+      printf("Server Response: %s (%llu bytes, sent as a %llu byte delta after %llu bytes of signatures)\n",
+             (char *)response, (unsigned long long)total, (unsigned long long)delta_size,
+             (unsigned long long)(base.count * DELTA_SIGNATURE_SIZE));
+   }
+   else if (hdr.opcode == OP_ERROR && payload_get_u32(&reader) == ST_CONFLICT) {
+      print_error_frame("Delta write refused, sending the whole file", &hdr, response);
+      rc = DELTA_FALLBACK;
    }
-   close(server_socket);
+   else {
+      rc = print_error_frame("Write failed", &hdr, response);
+   }
+   free(response);
+   return rc;
 }
 
-void write_file(int server_socket, const char *file_path, const char *data) {
-   // Send the file path to the server
-   if (send(server_socket, file_path, strlen(file_path) + 1, 0) < 0) {
-      perror("Failed to send file path to server");
-      close(server_socket);
-      return;
+// Uploads a local file: a header announcing the size and durability, then
+// the contents as DATA frames, sent straight from the page cache unless the
+// connection compresses or checksums them. negotiated is what the
+// connection agreed on. With delta writes on, a file of DELTA_MIN_FILE_SIZE
+// or more that the server already holds is sent as a delta against it.
+int write_file(int server_socket, int negotiated, const char *file_path, const StorageRequest *options) {
+   int fd = open(options->local_path, O_RDONLY);
+   struct stat file_stat;
+   if (fd < 0 || fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+      printf("Cannot upload %s: not a readable regular file\n", options->local_path);
+      if (fd >= 0) close(fd);
+      return ST_INVALID;   // Nothing was sent; the connection is still clean
+   }
+   uint64_t total = file_stat.st_size;
+   if (delta_writes && total >= DELTA_MIN_FILE_SIZE) {
+      int rc = write_delta(server_socket, negotiated, file_path, fd, total, options);
+      if (rc != DELTA_FALLBACK) {
+         close(fd);
+         return rc;
+      }
+   }
+
+   PayloadBuilder request;
+   payload_init(&request);
+   payload_put_str(&request, file_path);
+   payload_put_u64(&request, total);
+   payload_put_u8(&request, options->durability);
+   payload_put_u32(&request, options->sync_interval_mb);
+   uint32_t request_id = new_request_id();
+   int rc = send_frame(server_socket, OP_WRITE, 0, request_id, request.data, request.len);
+   payload_free(&request);
+
+   DataEncoder enc;
+   data_encoder_init(&enc, negotiated & ~CONN_CHECKSUMS, (negotiated & CONN_CHECKSUMS) != 0, &codec_stats);
+   if (data_encoder_transforms(&enc)) {
+      if (rc == 0 && total > 0) rc = send_file_compressed(server_socket, request_id, fd, 0, total, &enc);
+   }
+   else {
+      for (uint64_t offset = 0; rc == 0 && offset < total; offset += UPLOAD_CHUNK_SIZE) {
+         uint64_t len = total - offset < UPLOAD_CHUNK_SIZE ? total - offset : UPLOAD_CHUNK_SIZE;
+         uint8_t flags = offset + len < total ? FRAME_F_MORE : 0;
+         rc = send_file_frame(server_socket, flags, request_id, fd, offset, len);
+      }
    }
-   // Send the data to be written
-   if (send(server_socket, data, strlen(data) + 1, 0) < 0) {
+   close(fd);
+   if (rc < 0) {
       perror("Failed to send data to server");
-      close(server_socket);
-      return;
+      return -1;
    }
+
    // Check server's response
-   char response[256];
-   ssize_t bytes_received = recv(server_socket, response, sizeof(response), 0);
-   if (bytes_received > 0) {
-      response[bytes_received] = '\0';
-      printf("Server Response: %s\n", response);
-   } 
-   else {
+   FrameHeader hdr;
+   uint8_t *response;
+   if (recv_frame(server_socket, &hdr, &response, MAX_CONTROL_PAYLOAD) < 0) {
       perror("Failed to receive server response");
+      return -1;
    }
-   close(server_socket);
+   rc = 0;
+   if (hdr.opcode == OP_ACK) {
+      printf("Server Response: %s (%llu bytes)\n", (char *)response, (unsigned long long)total);
+   } else {
+      rc = print_error_frame("Write failed", &hdr, response);
+   }
+   free(response);
+   return rc;
 }
 
-void get_file_info(int server_socket, const char *file_path) {
+// Fetches the size and permissions of a remote file. Returns 0, -1 on
+// transport failure or the status of an error reply.
+int stat_remote_file(int server_socket, const char *file_path, uint64_t *size, uint32_t *mode) {
    // Send the file path to the server
-   if (send(server_socket, file_path, strlen(file_path) + 1, 0) < 0) {
+   uint32_t request_id;
+   if (send_path_request(server_socket, OP_INFO, file_path, &request_id) < 0) {
       perror("Failed to send file path to server");
-      close(server_socket);
-      return;
+      return -1;
    }
    // Receive file information from the server
-   char response[256];
-   ssize_t bytes_received = recv(server_socket, response, sizeof(response), 0);
-   if (bytes_received > 0) {
-      response[bytes_received] = '\0';
-      printf("File Info: %s\n", response);
-   } else {
+   FrameHeader hdr;
+   uint8_t *response;
+   if (recv_frame(server_socket, &hdr, &response, MAX_CONTROL_PAYLOAD) < 0) {
       perror("Failed to receive file info");
+      return -1;
+   }
+   int rc = 0;
+   if (hdr.opcode == OP_INFO_REPLY) {
+      PayloadReader reader;
+      payload_reader_init(&reader, response, hdr.payload_len);
+      *size = payload_get_u64(&reader);
+      *mode = payload_get_u32(&reader);
+   } else {
+      rc = print_error_frame("Info failed", &hdr, response);
    }
-   close(server_socket);
+   free(response);
+   return rc;
 }
 
-void stream_audio_file(int server_socket, const char *file_path) {
+int get_file_info(int server_socket, const char *file_path) {
+   uint64_t size;
+   uint32_t mode;
+   int rc = stat_remote_file(server_socket, file_path, &size, &mode);
+   if (rc == 0) {
+      printf("File Info: Size: %llu bytes, Permissions: %o\n", (unsigned long long)size, mode);
+   }
+   return rc;
+}
+
+int stream_audio_file(int server_socket, const char *file_path) {
    // Send the file path to the server
-   if (send(server_socket, file_path, strlen(file_path) + 1, 0) < 0) {
+   uint32_t request_id;
+   if (send_path_request(server_socket, OP_STREAM, file_path, &request_id) < 0) {
       perror("Failed to send file path to server");
-      close(server_socket);
-      return;
+      return -1;
    }
    // Stream audio data from the server
-   char buffer[BUFFER_SIZE];
-   ssize_t bytes_received;
-
    printf("Streaming audio...\n");
-   while ((bytes_received = recv(server_socket, buffer, sizeof(buffer), 0)) > 0) {
-      fwrite(buffer, 1, bytes_received, stdout);  // Assuming stdout is redirected to a player
-   }
-   if (bytes_received < 0) {
+   DataSink out = { stdout, -1, 0 };
+   int rc = receive_data(server_socket, &out, "Stream failed", NULL);  // Assuming stdout is redirected to a player
+   if (rc < 0) {
       perror("Error streaming audio file");
    }
-    else {
+   else if (rc == 0) {
       printf("\nAudio streaming complete\n");
    }
-   close(server_socket);
+   return rc;
+}
+
+// Prints the counters of the storage server
+int get_server_stats(int server_socket) {
+   uint32_t request_id = new_request_id();
+   if (send_frame(server_socket, OP_STATS, 0, request_id, NULL, 0) < 0) {
+      perror("Failed to send stats request");
+      return -1;
+   }
+   FrameHeader hdr;
+   uint8_t *response;
+   if (recv_frame(server_socket, &hdr, &response, MAX_CONTROL_PAYLOAD) < 0) {
+      perror("Failed to receive stats");
+      return -1;
+   }
+   int rc = 0;
+   if (hdr.opcode == OP_ACK) {
+      printf("%s\n", (char *)response);
+   } else {
+      rc = print_error_frame("Stats failed", &hdr, response);
+   }
+   free(response);
+   return rc;
+}
+
+// One replica's share of a replicated WRITE
+typedef struct {
+   ServerInfo server;
+   const char *path;
+   const StorageRequest *request;
+   int rc;
+} ReplicaWrite;
+
+void *replica_write_worker(void *arg) {
+   ReplicaWrite *write = arg;
+   write->rc = connect_to_storage_server(&write->server) < 0
+                  ? -1 : write_file(write->server.socket, write->server.negotiated, write->path,
+                                          write->request);
+   release_storage_server(&write->server, write->rc);
+   return NULL;
+}
+
+// Uploads to every replica of path at once, so the replicas stay identical
+// and the upload takes as long as the slowest one rather than their sum
+void write_replicas(int nm_socket, const char *path, const StorageRequest *request) {
+   ServerInfo servers[MAX_REPLICAS];
+   int n = resolve_replicas(nm_socket, path, servers, MAX_REPLICAS);
+   if (n <= 0) {
+      printf("Failed to get storage server details\n");
+      return;
+   }
+   ReplicaWrite writes[MAX_REPLICAS];
+   pthread_t threads[MAX_REPLICAS];
+   int threaded[MAX_REPLICAS] = { 0 };
+   for (int i = 0; i < n; i++) {
+      writes[i] = (ReplicaWrite){ servers[i], path, request, 0 };
+      if (n > 1) threaded[i] = pthread_create(&threads[i], NULL, replica_write_worker, &writes[i]) == 0;
+      if (!threaded[i]) replica_write_worker(&writes[i]);
+   }
+   int failed = 0;
+   for (int i = 0; i < n; i++) {
+      if (threaded[i]) pthread_join(threads[i], NULL);
+      if (writes[i].rc != 0) {
+         printf("Write to replica %s:%d failed\n", servers[i].ip, servers[i].port);
+         failed++;
+      }
+   }
+   if (n > 1) printf("Write reached %d of %d replica(s)\n", n - failed, n);
 }
 
+// Runs a READ, STREAM, WRITE or STATS against the server owning path; WRITEs
+// go to every replica. A cached location that turns out to be stale
+// (unreachable, or disowned by the server) is dropped and the path resolved
+// once more through the naming server.
+void run_on_storage_server(int nm_socket, const char *path, const StorageRequest *request) {
+   if (request->opcode == OP_WRITE) {
+      write_replicas(nm_socket, path, request);
+      return;
+   }
+   for (int attempt = 0; attempt < 2; attempt++) {
+      int from_cache;
+      ServerInfo storage_server = resolve_server(nm_socket, path, &from_cache);
+      if (storage_server.port <= 0) {
+         printf("Failed to get storage server details\n");
+         return;
+      }
+      int server_socket = connect_to_storage_server(&storage_server);
+      int rc = ST_NOT_OWNER;
+      if (server_socket == -1) {
+         printf("Failed to connect to storage server\n");
+      }
+      else if (request->opcode == OP_READ) {
+         rc = read_file(server_socket, path, request);
+      }
+      else if (request->opcode == OP_STATS) {
+         rc = get_server_stats(server_socket);
+      }
+      else {
+         rc = stream_audio_file(server_socket, path);
+      }
+      release_storage_server(&storage_server, rc);
+      if (!from_cache || rc != ST_NOT_OWNER) return;
+      location_cache_invalidate(&location_cache, path);
+   }
+}
+
+
+
+// Shared state of a striped download. Workers claim chunks in order and
+// pwrite them straight to their place in the output file.
+typedef struct {
+   const char *path;
+   ServerInfo *servers;         // Chunk i is read from servers[i % num_servers]
+   int num_servers;
+   int out_fd;
+   uint64_t size;
+   uint64_t chunk_size;
+   uint64_t num_chunks;
+   uint64_t next_chunk;         // Claimed with an atomic increment
+   int failed;
+} FetchJob;
+
+void *fetch_worker(void *arg) {
+   FetchJob *job = arg;
+   while (!__atomic_load_n(&job->failed, __ATOMIC_RELAXED)) {
+      uint64_t chunk = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED);
+      if (chunk >= job->num_chunks) break;
+
+      ServerInfo server = job->servers[chunk % job->num_servers];
+      server.socket = -1;
+      if (connect_to_storage_server(&server) < 0) {
+         __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+         break;
+      }
+      uint64_t offset = chunk * job->chunk_size;
+      uint64_t length = job->size - offset < job->chunk_size ? job->size - offset : job->chunk_size;
+      DataSink out = { NULL, job->out_fd, offset };
+      uint64_t received = 0;
+      int rc = read_file_range(server.socket, job->path, offset, length, &out, &received);
+      release_storage_server(&server, rc);
+      if (rc != 0 || received != length) {
+         printf("Chunk at offset %llu failed\n", (unsigned long long)offset);
+         __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+      }
+   }
+   return NULL;
+}
+
+// Downloads path into local_path as byte ranges fetched concurrently over
+// up to streams pooled connections, then reports the achieved throughput
+void fetch_file(int nm_socket, const char *path, const char *local_path, int streams,
+                uint64_t chunk_size) {
+   ServerInfo server;
+   uint64_t size = 0;
+   uint32_t mode = 0;
+   int rc = -1;
+   for (int attempt = 0; attempt < 2 && rc != 0; attempt++) {
+      int from_cache;
+      server = resolve_server(nm_socket, path, &from_cache);
+      if (server.port <= 0) {
+         printf("Failed to get storage server details\n");
+         return;
+      }
+      rc = connect_to_storage_server(&server) < 0 ? ST_NOT_OWNER
+                                                  : stat_remote_file(server.socket, path, &size, &mode);
+      release_storage_server(&server, rc);
+      if (!from_cache || rc != ST_NOT_OWNER) break;
+      location_cache_invalidate(&location_cache, path);
+   }
+   if (rc != 0) {
+      printf("Failed to stat %s\n", path);
+      return;
+   }
+
+   int out_fd = open(local_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (out_fd < 0 || ftruncate(out_fd, size) < 0) {
+      perror("Failed to create local file");
+      if (out_fd >= 0) close(out_fd);
+      return;
+   }
+
+   // Stripe the chunks across every replica so one hot file is read from
+   // all of their disks at once
+   ServerInfo replicas[MAX_REPLICAS];
+   int num_replicas = resolve_replicas(nm_socket, path, replicas, MAX_REPLICAS);
+   if (num_replicas <= 0) {
+      replicas[0] = server;
+      num_replicas = 1;
+   }
+
+   FetchJob job = { path, replicas, num_replicas, out_fd, size, chunk_size,
+                    (size + chunk_size - 1) / chunk_size, 0, 0 };
+   if (streams > (int)job.num_chunks) streams = job.num_chunks ? job.num_chunks : 1;
+   pthread_t *threads = malloc(streams * sizeof(pthread_t));
+   struct timespec start, end;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   int started = 0;
+   for (; threads && started < streams; started++) {
+      if (pthread_create(&threads[started], NULL, fetch_worker, &job) != 0) break;
+   }
+   if (started == 0) fetch_worker(&job);
+   for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   free(threads);
+   close(out_fd);
+
+   if (job.failed) {
+      printf("Fetch of %s failed\n", path);
+      return;
+   }
+   double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+   printf("Fetched %llu bytes in %.3f s with %d stream(s) from %d replica(s): %.1f MB/s\n",
+          (unsigned long long)size, seconds, started ? started : 1, num_replicas,
+          seconds > 0 ? size / seconds / (1 << 20) : 0.0);
+}
 
 
 int main(int argc, char *argv[]) {
@@ -235,15 +1329,18 @@ int main(int argc, char *argv[]) {
    char* nm_ip = argv[1];
    int nm_port = atoi(argv[2]);
 
-   int nm_socket = connect_to_naming_server(nm_ip, nm_port);
-
-   // Initial connection to the naming server
-   if ( nm_socket < 0) {
+   // The naming server given tells us every shard; paths are then sent
+   // straight to the shard owning them
+   HashRing *ring = hash_ring_fetch(nm_ip, nm_port);
+   if (ring == NULL) {
       printf("Unable to connect to naming server\n");
       return 1;
    }
+   adopt_shard_map(ring);
 
-   printf("Connected to naming server\n");
+   printf("Connected to %d naming server(s)\n", shard_ring->num_shards);
+   location_cache_init(&location_cache, LOCATION_CACHE_CAPACITY, LOCATION_CACHE_TTL_SEC);
+   conn_pool_init(&storage_pool, POOL_MAX_PER_SERVER, POOL_IDLE_TIMEOUT_SEC, negotiate_connection);
 
    while (1) {
       printf("\nEnter command: ");
@@ -264,37 +1361,135 @@ int main(int argc, char *argv[]) {
       if (strcmp(command, "EXIT") == 0) {
          break;
       }
-       // Handle READ command
+      refresh_shard_map();
+      int nm_socket = shard_socket(path);
       if (strcmp(command, "READ") == 0) {
-         // Get storage server details first
-         ServerInfo storage_server = get_storage_server(nm_ip, nm_port, path, nm_socket);
-         if (storage_server.socket == -1) {
-            printf("Failed to get storage server details\n");
+         // READ <path> [offset [length]]
+         unsigned long long offset = 0, length = READ_TO_END;
+         sscanf(line, "%*s %*s %llu %llu", &offset, &length);
+         StorageRequest request = { .opcode = OP_READ, .offset = offset, .length = length };
+         run_on_storage_server(nm_socket, path, &request);
+      }
+      else if (strcmp(command, "GET") == 0) {
+         // GET <path> <local file>: copies the rest of path into the local
+         // file, so an interrupted GET picks up where it stopped
+         char local_path[MAX_PATH_LENGTH] = "";
+         sscanf(line, "%*s %*s %255s", local_path);
+         if (local_path[0] == '\0') {
+            printf("Usage: GET <path> <local file>\n");
             continue;
          }
-         int server_socket = connect_to_storage_server(&storage_server);
-         if (server_socket == -1) {
-            printf("Failed to connect to storage server\n");
+         struct stat local_stat;
+         StorageRequest request = { .opcode = OP_READ, .local_path = local_path, .length = READ_TO_END };
+         if (stat(local_path, &local_stat) == 0) request.offset = local_stat.st_size;
+         run_on_storage_server(nm_socket, path, &request);
+      }
+      else if (strcmp(command, "FETCH") == 0) {
+         // FETCH <path> <local file> [streams [chunk MB]]
+         char local_path[MAX_PATH_LENGTH] = "";
+         int streams = DEFAULT_FETCH_STREAMS;
+         int chunk_mb = DEFAULT_FETCH_CHUNK_MB;
+         sscanf(line, "%*s %*s %255s %d %d", local_path, &streams, &chunk_mb);
+         if (local_path[0] == '\0' || streams < 1 || chunk_mb < 1) {
+            printf("Usage: FETCH <path> <local file> [streams [chunk MB]]\n");
             continue;
          }
-         else{
-            printf("(main) Connected to storage server\n");
-         }
-         read_file(server_socket, path);
-      } 
+         fetch_file(nm_socket, path, local_path, streams, (uint64_t)chunk_mb << 20);
+      }
       else if (strcmp(command, "STREAM") == 0) {
-         ServerInfo storage_server = get_storage_server(nm_ip, nm_port, path, nm_socket);
-         if (storage_server.socket == -1) {
-            printf("Failed to get storage server details\n");
+         StorageRequest request = { .opcode = OP_STREAM };
+         run_on_storage_server(nm_socket, path, &request);
+      }
+      else if (strcmp(command, "WRITE") == 0) {
+         // WRITE <path> <local file> [none|end|every[:MB]]
+         char local_path[MAX_PATH_LENGTH] = "";
+         char mode[32] = "none";
+         sscanf(line, "%*s %*s %255s %31s", local_path, mode);
+         StorageRequest request = { .opcode = OP_WRITE, .local_path = local_path,
+                                    .durability = DURABILITY_NONE,
+                                    .sync_interval_mb = DEFAULT_SYNC_INTERVAL_MB };
+         if (strcmp(mode, "end") == 0) {
+            request.durability = DURABILITY_END;
+         }
+         else if (strncmp(mode, "every", 5) == 0) {
+            request.durability = DURABILITY_PERIODIC;
+            if (mode[5] == ':' && atoi(mode + 6) > 0) request.sync_interval_mb = atoi(mode + 6);
+         }
+         if (local_path[0] == '\0') {
+            printf("Usage: WRITE <path> <local file> [none|end|every[:MB]]\n");
             continue;
          }
-         int server_socket = connect_to_storage_server(&storage_server);
-         if (server_socket == -1) {
-            printf("Failed to connect to storage server\n");
+         run_on_storage_server(nm_socket, path, &request);
+      }
+      else if (strcmp(command, "LIST") == 0) {
+         list_paths(path);
+      }
+      else if (strcmp(command, "RESOLVE") == 0) {
+         resolve_paths(strstr(line, command) + strlen(command));
+      }
+      else if (strcmp(command, "STATS") == 0) {
+         // STATS <path>: counters of the server owning path
+         StorageRequest request = { .opcode = OP_STATS };
+         run_on_storage_server(nm_socket, path, &request);
+      }
+      else if (strcmp(command, "CREATE") == 0) {
+         // CREATE <path>, with a trailing '/' for a directory
+         if (path[0] == '\0') {
+            printf("Usage: CREATE <path>\n");
             continue;
          }
-         stream_audio_file(server_socket, path);
-      } 
+         create_path(nm_socket, path);
+      }
+      else if (strcmp(command, "SERVERS") == 0) {
+         show_server_loads(nm_socket);
+      }
+      else if (strcmp(command, "CACHE") == 0) {
+         printf("Location cache: %zu entries, %lu hits, %lu misses\n",
+                location_cache.count, location_cache.hits, location_cache.misses);
+         printf("Connection pool: %lu connects, %lu reuses\n",
+                storage_pool.connected, storage_pool.reused);
+      }
+      else if (strcmp(command, "COMPRESS") == 0) {
+         // COMPRESS [none|lz|zlib]: codec offered on new connections
+         if (path[0] != '\0') {
+            int codec = codec_parse(path);
+            if (codec < 0) {
+               printf("Usage: COMPRESS [none|lz|zlib]\n");
+               continue;
+            }
+            preferred_codec = codec;
+            // Idle connections keep what they negotiated; start afresh
+            conn_pool_close_idle(&storage_pool);
+         }
+         char report[BUFFER_SIZE];
+         codec_stats_format(&codec_stats, report, sizeof(report));
+         printf("Offering %s\n%s\n", codec_name(preferred_codec), report);
+      }
+      else if (strcmp(command, "CHECKSUMS") == 0) {
+         // CHECKSUMS [on|off]: whether new connections checksum DATA frames
+         if (path[0] != '\0') {
+            if (strcmp(path, "on") != 0 && strcmp(path, "off") != 0) {
+               printf("Usage: CHECKSUMS [on|off]\n");
+               continue;
+            }
+            want_checksums = strcmp(path, "on") == 0;
+            conn_pool_close_idle(&storage_pool);
+         }
+         char report[BUFFER_SIZE];
+         codec_stats_format(&codec_stats, report, sizeof(report));
+         printf("Checksums %s\n%s\n", want_checksums ? "on" : "off", report);
+      }
+      else if (strcmp(command, "DELTA") == 0) {
+         // DELTA [on|off]: whether rewrites send only what changed
+         if (path[0] != '\0') {
+            if (strcmp(path, "on") != 0 && strcmp(path, "off") != 0) {
+               printf("Usage: DELTA [on|off]\n");
+               continue;
+            }
+            delta_writes = strcmp(path, "on") == 0;
+         }
+         printf("Delta writes %s\n", delta_writes ? "on" : "off");
+      }
       else {
          printf("Unknown command\n");
       }
@@ -302,5 +1497,4 @@ int main(int argc, char *argv[]) {
 
    cleanup_connections();
    return 0;
-   return 0;
 }
@@ -0,0 +1,355 @@
+#include "codec.h"
+#include "transfer.h"
+#include <time.h>
+#include <zlib.h>
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define ZLIB_LEVEL 6
+#define CODEC_MIN_CHUNK 64
+
+static const char *codec_names[CODEC_COUNT] = { "none", "lz", "zlib" };
+
+const char *codec_name(Codec codec) {
+   return codec < CODEC_COUNT ? codec_names[codec] : "unknown";
+}
+
+int codec_parse(const char *name) {
+   for (int i = 0; i < CODEC_COUNT; i++) {
+      if (strcmp(name, codec_names[i]) == 0) return i;
+   }
+   return -1;
+}
+
+Codec codec_choose(const uint8_t *offered, size_t count) {
+   for (size_t i = 0; i < count; i++) {
+      if (offered[i] < CODEC_COUNT) return offered[i];
+   }
+   return CODEC_NONE;
+}
+
+static uint64_t thread_cpu_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Checksums take microseconds per call, too short to be worth a system call
+// for the thread clock; the monotonic one is read without entering the kernel
+static uint64_t monotonic_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint32_t lz_hash(uint32_t sequence) {
+   return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes the part of a length that did not fit in its token nibble: runs of
+// 255 closed by a smaller byte
+static uint8_t *lz_put_length(uint8_t *op, const uint8_t *end, size_t len) {
+   while (len >= 255) {
+      if (op >= end) return NULL;
+      *op++ = 255;
+      len -= 255;
+   }
+   if (op >= end) return NULL;
+   *op++ = (uint8_t)len;
+   return op;
+}
+
+// One sequence: token, literals, then (unless this is the last sequence) the
+// match offset. Returns the new output position or NULL if out is full.
+static uint8_t *lz_put_sequence(uint8_t *op, const uint8_t *end, const uint8_t *literals,
+                                size_t num_literals, size_t offset, size_t match_len) {
+   if (op >= end) return NULL;
+   uint8_t *token = op++;
+   size_t extra = match_len ? match_len - LZ_MIN_MATCH : 0;
+   *token = (uint8_t)(((num_literals < 15 ? num_literals : 15) << 4) | (extra < 15 ? extra : 15));
+   if (num_literals >= 15 && (op = lz_put_length(op, end, num_literals - 15)) == NULL) return NULL;
+   if ((size_t)(end - op) < num_literals) return NULL;
+   memcpy(op, literals, num_literals);
+   op += num_literals;
+   if (match_len == 0) return op;
+   if (end - op < 2) return NULL;
+   *op++ = (uint8_t)offset;
+   *op++ = (uint8_t)(offset >> 8);
+   if (extra >= 15) op = lz_put_length(op, end, extra - 15);
+   return op;
+}
+
+static size_t lz_compress(const uint8_t *in, size_t len, uint8_t *out, size_t out_cap) {
+   uint32_t table[1 << LZ_HASH_BITS];
+   memset(table, 0, sizeof(table));
+   const uint8_t *end = out + out_cap;
+   uint8_t *op = out;
+   size_t ip = 0, anchor = 0;
+
+   while (ip + LZ_MIN_MATCH <= len) {
+      uint32_t sequence, candidate_sequence;
+      memcpy(&sequence, in + ip, sizeof(sequence));
+      uint32_t h = lz_hash(sequence);
+      size_t candidate = table[h];
+      table[h] = (uint32_t)ip;
+      memcpy(&candidate_sequence, in + candidate, sizeof(candidate_sequence));
+      if (candidate >= ip || ip - candidate > LZ_MAX_OFFSET || candidate_sequence != sequence) {
+         // Skip ahead faster the longer nothing has matched
+         ip += 1 + ((ip - anchor) >> 6);
+         continue;
+      }
+      size_t match_len = LZ_MIN_MATCH;
+      while (ip + match_len < len && in[candidate + match_len] == in[ip + match_len]) match_len++;
+      op = lz_put_sequence(op, end, in + anchor, ip - anchor, ip - candidate, match_len);
+      if (op == NULL) return 0;
+      ip += match_len;
+      anchor = ip;
+   }
+   op = lz_put_sequence(op, end, in + anchor, len - anchor, 0, 0);
+   return op ? (size_t)(op - out) : 0;
+}
+
+// Reads a length continued past its token nibble. Returns -1 on overrun.
+static int lz_get_length(const uint8_t *in, size_t len, size_t *ip, size_t *value) {
+   uint8_t b;
+   do {
+      if (*ip >= len) return -1;
+      b = in[(*ip)++];
+      *value += b;
+   } while (b == 255);
+   return 0;
+}
+
+static int lz_decompress(const uint8_t *in, size_t len, uint8_t *out, size_t raw_len) {
+   size_t ip = 0, op = 0;
+   while (1) {
+      if (ip >= len) return -1;
+      uint8_t token = in[ip++];
+      size_t num_literals = token >> 4;
+      if (num_literals == 15 && lz_get_length(in, len, &ip, &num_literals) < 0) return -1;
+      if (num_literals > len - ip || num_literals > raw_len - op) return -1;
+      memcpy(out + op, in + ip, num_literals);
+      ip += num_literals;
+      op += num_literals;
+      if (ip == len) return op == raw_len ? 0 : -1;   // The last sequence has no match
+
+      if (len - ip < 2) return -1;
+      size_t offset = in[ip] | (in[ip + 1] << 8);
+      ip += 2;
+      size_t match_len = (token & 15) + LZ_MIN_MATCH;
+      if ((token & 15) == 15 && lz_get_length(in, len, &ip, &match_len) < 0) return -1;
+      if (offset == 0 || offset > op || match_len > raw_len - op) return -1;
+      // Matches may overlap their own output, e.g. a run of one byte
+      const uint8_t *from = out + op - offset;
+      if (offset >= match_len) {
+         memcpy(out + op, from, match_len);
+      }
+      else {
+         for (size_t i = 0; i < match_len; i++) out[op + i] = from[i];
+      }
+      op += match_len;
+   }
+}
+
+size_t codec_compress(Codec codec, const uint8_t *in, size_t len, uint8_t *out, size_t out_cap) {
+   if (codec == CODEC_LZ) return lz_compress(in, len, out, out_cap);
+   if (codec == CODEC_ZLIB) {
+      uLongf out_len = out_cap;
+      return compress2(out, &out_len, in, len, ZLIB_LEVEL) == Z_OK ? out_len : 0;
+   }
+   return 0;
+}
+
+int codec_decompress(Codec codec, const uint8_t *in, size_t len, uint8_t *out, size_t raw_len) {
+   if (codec == CODEC_LZ) return lz_decompress(in, len, out, raw_len);
+   if (codec == CODEC_ZLIB) {
+      uLongf out_len = raw_len;
+      return uncompress(out, &out_len, in, len) == Z_OK && out_len == raw_len ? 0 : -1;
+   }
+   return -1;
+}
+
+void data_encoder_init(DataEncoder *enc, Codec codec, int checksums, CodecStats *stats) {
+   enc->codec = codec;
+   enc->skip = 0;
+   enc->checksums = checksums;
+   enc->stats = stats;
+}
+
+static void put_u32(uint8_t *out, uint32_t v) {
+   out[0] = v >> 24;
+   out[1] = v >> 16;
+   out[2] = v >> 8;
+   out[3] = v;
+}
+
+uint32_t data_checksum(CodecStats *stats, uint32_t crc, const void *data, size_t len) {
+   uint64_t start = monotonic_ns();
+   crc = crc32c(crc, data, len);
+   __atomic_add_fetch(&stats->checksum_ns, monotonic_ns() - start, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&stats->checksum_bytes, len, __ATOMIC_RELAXED);
+   return crc;
+}
+
+int send_checksummed_frame(int sock, uint8_t flags, uint32_t request_id, const uint8_t *data,
+                           size_t len, uint32_t crc) {
+   FrameHeader hdr = { OP_DATA, flags | FRAME_F_CHECKSUM, request_id, len + CHECKSUM_TRAILER_SIZE };
+   uint8_t raw[FRAME_HEADER_SIZE], trailer[CHECKSUM_TRAILER_SIZE];
+   frame_header_encode(&hdr, raw);
+   put_u32(trailer, crc);
+   struct iovec iov[3] = {
+      { raw, FRAME_HEADER_SIZE }, { (void *)data, len }, { trailer, CHECKSUM_TRAILER_SIZE }
+   };
+   return send_iov_all(sock, iov, 3);
+}
+
+// A raw chunk, with its checksum if enc wants one
+static int send_raw_chunk(int sock, uint8_t flags, uint32_t request_id, DataEncoder *enc,
+                          const uint8_t *data, size_t len) {
+   if (!enc->checksums || len == 0) return send_frame(sock, OP_DATA, flags, request_id, data, len);
+   return send_checksummed_frame(sock, flags, request_id, data, len,
+                                 data_checksum(enc->stats, 0, data, len));
+}
+
+int send_data_chunk(int sock, uint8_t flags, uint32_t request_id, DataEncoder *enc,
+                    const uint8_t *data, size_t len) {
+   CodecStats *stats = enc->stats;
+   if (enc->codec == CODEC_NONE || len == 0) {
+      return send_raw_chunk(sock, flags, request_id, enc, data, len);
+   }
+
+   __atomic_add_fetch(&stats->raw_sent, len, __ATOMIC_RELAXED);
+   int attempt = len >= CODEC_MIN_CHUNK && enc->skip == 0;
+   if (len >= CODEC_MIN_CHUNK && enc->skip > 0) enc->skip--;
+   if (attempt) {
+      // Compressing must save at least 1/16 of the chunk to beat sending it,
+      // which also leaves room for the checksum
+      uint8_t out[CODEC_HEADER_SIZE + CODEC_CHUNK_SIZE];
+      uint64_t start = thread_cpu_ns();
+      size_t packed = codec_compress(enc->codec, data, len, out + CODEC_HEADER_SIZE,
+                                     len - len / 16 - CODEC_HEADER_SIZE);
+      __atomic_add_fetch(&stats->compress_ns, thread_cpu_ns() - start, __ATOMIC_RELAXED);
+      if (packed > 0) {
+         out[0] = enc->codec;
+         put_u32(out + 1, len);
+         size_t payload_len = CODEC_HEADER_SIZE + packed;
+         if (enc->checksums) {
+            put_u32(out + payload_len, data_checksum(stats, 0, data, len));
+            payload_len += CHECKSUM_TRAILER_SIZE;
+            flags |= FRAME_F_CHECKSUM;
+         }
+         __atomic_add_fetch(&stats->chunks_compressed, 1, __ATOMIC_RELAXED);
+         __atomic_add_fetch(&stats->wire_sent, payload_len, __ATOMIC_RELAXED);
+         return send_frame(sock, OP_DATA, flags | FRAME_F_COMPRESSED, request_id, out, payload_len);
+      }
+      enc->skip = CODEC_BYPASS_CHUNKS;
+   }
+   __atomic_add_fetch(&stats->chunks_bypassed, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&stats->wire_sent, len, __ATOMIC_RELAXED);
+   return send_raw_chunk(sock, flags, request_id, enc, data, len);
+}
+
+ssize_t recv_compressed_chunk(int sock, const FrameHeader *hdr, uint8_t *out, int *corrupt,
+                              CodecStats *stats) {
+   uint8_t in[CODEC_HEADER_SIZE + CODEC_CHUNK_SIZE + CHECKSUM_TRAILER_SIZE];
+   size_t trailer = hdr->flags & FRAME_F_CHECKSUM ? CHECKSUM_TRAILER_SIZE : 0;
+   if (hdr->payload_len < CODEC_HEADER_SIZE + trailer || hdr->payload_len > sizeof(in) ||
+       recv_all(sock, in, hdr->payload_len) < 0) {
+      errno = EPROTO;
+      return -1;
+   }
+   PayloadReader reader;
+   payload_reader_init(&reader, in, hdr->payload_len);
+   Codec codec = payload_get_u8(&reader);
+   uint32_t raw_len = payload_get_u32(&reader);
+   if (raw_len > CODEC_CHUNK_SIZE) {
+      errno = EPROTO;
+      return -1;
+   }
+   size_t packed = hdr->payload_len - CODEC_HEADER_SIZE - trailer;
+   uint64_t start = thread_cpu_ns();
+   int rc = codec_decompress(codec, in + CODEC_HEADER_SIZE, packed, out, raw_len);
+   __atomic_add_fetch(&stats->decompress_ns, thread_cpu_ns() - start, __ATOMIC_RELAXED);
+   if (rc < 0) {
+      errno = EBADMSG;
+      return -1;
+   }
+   if (trailer) {
+      PayloadReader sum;
+      payload_reader_init(&sum, in + CODEC_HEADER_SIZE + packed, trailer);
+      if (payload_get_u32(&sum) != data_checksum(stats, 0, out, raw_len)) {
+         __atomic_add_fetch(&stats->checksum_failures, 1, __ATOMIC_RELAXED);
+         *corrupt = 1;
+      }
+   }
+   __atomic_add_fetch(&stats->raw_received, raw_len, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&stats->wire_received, hdr->payload_len, __ATOMIC_RELAXED);
+   return raw_len;
+}
+
+int64_t data_frame_length(const FrameHeader *hdr) {
+   if (!(hdr->flags & FRAME_F_CHECKSUM)) return hdr->payload_len;
+   return hdr->payload_len < CHECKSUM_TRAILER_SIZE ? -1
+                                                   : (int64_t)(hdr->payload_len - CHECKSUM_TRAILER_SIZE);
+}
+
+int recv_checksum_trailer(int sock, uint32_t crc, int *corrupt, CodecStats *stats) {
+   uint8_t trailer[CHECKSUM_TRAILER_SIZE];
+   if (recv_all(sock, trailer, sizeof(trailer)) < 0) return -1;
+   PayloadReader reader;
+   payload_reader_init(&reader, trailer, sizeof(trailer));
+   if (payload_get_u32(&reader) != crc) {
+      __atomic_add_fetch(&stats->checksum_failures, 1, __ATOMIC_RELAXED);
+      *corrupt = 1;
+   }
+   return 0;
+}
+
+ssize_t recv_data_chunk(int sock, const FrameHeader *hdr, uint8_t *out, int *corrupt, CodecStats *stats) {
+   if (hdr->flags & FRAME_F_COMPRESSED) return recv_compressed_chunk(sock, hdr, out, corrupt, stats);
+   int64_t len = data_frame_length(hdr);
+   if (len < 0 || len > CODEC_CHUNK_SIZE) {
+      errno = EPROTO;
+      return -1;
+   }
+   if (recv_all(sock, out, len) < 0) return -1;
+   codec_stats_received_raw(stats, len);
+   if ((hdr->flags & FRAME_F_CHECKSUM) &&
+       recv_checksum_trailer(sock, data_checksum(stats, 0, out, len), corrupt, stats) < 0) {
+      return -1;
+   }
+   return len;
+}
+
+void codec_stats_received_raw(CodecStats *stats, uint64_t len) {
+   __atomic_add_fetch(&stats->raw_received, len, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&stats->wire_received, len, __ATOMIC_RELAXED);
+}
+
+void codec_stats_format(const CodecStats *stats, char *out, size_t out_size) {
+   CodecStats s;
+   s.raw_sent = __atomic_load_n(&stats->raw_sent, __ATOMIC_RELAXED);
+   s.wire_sent = __atomic_load_n(&stats->wire_sent, __ATOMIC_RELAXED);
+   s.raw_received = __atomic_load_n(&stats->raw_received, __ATOMIC_RELAXED);
+   s.wire_received = __atomic_load_n(&stats->wire_received, __ATOMIC_RELAXED);
+   s.compress_ns = __atomic_load_n(&stats->compress_ns, __ATOMIC_RELAXED);
+   s.decompress_ns = __atomic_load_n(&stats->decompress_ns, __ATOMIC_RELAXED);
+   s.chunks_compressed = __atomic_load_n(&stats->chunks_compressed, __ATOMIC_RELAXED);
+   s.chunks_bypassed = __atomic_load_n(&stats->chunks_bypassed, __ATOMIC_RELAXED);
+   s.checksum_bytes = __atomic_load_n(&stats->checksum_bytes, __ATOMIC_RELAXED);
+   s.checksum_ns = __atomic_load_n(&stats->checksum_ns, __ATOMIC_RELAXED);
+   s.checksum_failures = __atomic_load_n(&stats->checksum_failures, __ATOMIC_RELAXED);
+   snprintf(out, out_size,
+            "compression: sent %llu -> %llu bytes (%.2fx), received %llu <- %llu bytes (%.2fx), "
+            "%llu chunks compressed, %llu sent raw, cpu %.1f ms compressing, %.1f ms expanding\n"
+            "checksums (crc32c %s): %llu bytes in %.1f ms, %llu mismatches",
+            (unsigned long long)s.raw_sent, (unsigned long long)s.wire_sent,
+            s.wire_sent ? (double)s.raw_sent / s.wire_sent : 1.0,
+            (unsigned long long)s.raw_received, (unsigned long long)s.wire_received,
+            s.wire_received ? (double)s.raw_received / s.wire_received : 1.0,
+            (unsigned long long)s.chunks_compressed, (unsigned long long)s.chunks_bypassed,
+            s.compress_ns / 1e6, s.decompress_ns / 1e6, crc32c_backend(),
+            (unsigned long long)s.checksum_bytes, s.checksum_ns / 1e6,
+            (unsigned long long)s.checksum_failures);
+}
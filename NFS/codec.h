@@ -0,0 +1,119 @@
+#ifndef _CODEC_H_
+#define _CODEC_H_
+
+#include "headers.h"
+#include "protocol.h"
+#include "crc32c.h"
+#include <stdint.h>
+
+// Block compression and checksums of DATA frames, negotiated per storage
+// connection.
+//
+// A client offers the codecs it wants in OP_NEGOTIATE and the storage
+// server picks the first it supports; both sides then compress what they
+// send on that connection. Bulk data is cut into chunks of at most
+// CODEC_CHUNK_SIZE bytes, each sent as its own DATA frame. A chunk that
+// compresses well travels with FRAME_F_COMPRESSED and a payload of
+//
+//   u8 codec | u32 raw length | compressed bytes
+//
+// and any other chunk is sent as it is, so already-compressed data (audio,
+// archives) costs one failed attempt per chunk rather than growing. After a
+// chunk that does not compress the encoder sends a few raw before trying
+// again. Receivers expand any flagged frame whatever was negotiated.
+//
+// With NEGOTIATE_CHECKSUMS every DATA frame that carries data is flagged
+// FRAME_F_CHECKSUM and ends with a u32 CRC32C of its raw (uncompressed)
+// bytes, which the receiver checks as they are consumed. A mismatch fails
+// the transfer but leaves the connection in sync.
+//
+// CODEC_LZ is an in-tree byte-oriented LZ77 in the style of LZ4: a greedy
+// matcher over a 4-byte hash, fast in both directions. CODEC_ZLIB trades
+// CPU for a higher ratio.
+
+typedef enum {
+   CODEC_NONE = 0,
+   CODEC_LZ,
+   CODEC_ZLIB,
+   CODEC_COUNT
+} Codec;
+
+#define CODEC_CHUNK_SIZE (64 * 1024)
+#define CODEC_HEADER_SIZE 5          // codec and raw length ahead of the data
+#define CODEC_BYPASS_CHUNKS 8        // Raw chunks sent after an incompressible one
+#define CHECKSUM_TRAILER_SIZE 4
+
+// Bytes and CPU time spent on compression and checksums by one side. Updated atomically,
+// so one instance is shared by every connection of a process.
+typedef struct {
+   uint64_t raw_sent;           // Before compression, on compressing transfers
+   uint64_t wire_sent;          // As framed on the wire
+   uint64_t raw_received;       // Every DATA frame, compressed or not
+   uint64_t wire_received;
+   uint64_t compress_ns;        // Thread CPU time in the codecs
+   uint64_t decompress_ns;
+   uint64_t chunks_compressed;
+   uint64_t chunks_bypassed;    // Sent raw: too little gain, or skipped
+   uint64_t checksum_bytes;     // Summed, sending and receiving
+   uint64_t checksum_ns;        // Time spent summing them
+   uint64_t checksum_failures;  // Frames received that did not match
+} CodecStats;
+
+// Compression state of one transfer
+typedef struct {
+   Codec codec;                 // CODEC_NONE sends everything raw
+   int skip;                    // Chunks still to send raw
+   int checksums;               // Append a CRC32C to every frame
+   CodecStats *stats;
+} DataEncoder;
+
+const char *codec_name(Codec codec);
+// Returns the codec called name, or -1
+int codec_parse(const char *name);
+// Picks the first offered codec this build supports, else CODEC_NONE
+Codec codec_choose(const uint8_t *offered, size_t count);
+
+// Compresses len bytes into out. Returns the compressed size, or 0 if the
+// result would not fit in out_cap bytes.
+size_t codec_compress(Codec codec, const uint8_t *in, size_t len, uint8_t *out, size_t out_cap);
+// Expands len bytes into exactly raw_len bytes of out. Returns 0 or -1.
+int codec_decompress(Codec codec, const uint8_t *in, size_t len, uint8_t *out, size_t raw_len);
+
+void data_encoder_init(DataEncoder *enc, Codec codec, int checksums, CodecStats *stats);
+// 1 if data sent through enc has to pass through memory
+static inline int data_encoder_transforms(const DataEncoder *enc) {
+   return enc->codec != CODEC_NONE || enc->checksums;
+}
+// Sends len (at most CODEC_CHUNK_SIZE) bytes as one DATA frame, compressed
+// if that saves enough to be worth it
+int send_data_chunk(int sock, uint8_t flags, uint32_t request_id, DataEncoder *enc,
+                    const uint8_t *data, size_t len);
+// Sends a DATA frame of len bytes whose CRC32C is already known
+int send_checksummed_frame(int sock, uint8_t flags, uint32_t request_id, const uint8_t *data,
+                           size_t len, uint32_t crc);
+// Reads the payload of a DATA frame flagged FRAME_F_COMPRESSED and expands
+// it into out, which holds CODEC_CHUNK_SIZE bytes. Returns the raw length,
+// or -1 with the connection out of sync. A chunk that fails its checksum is
+// still consumed, with *corrupt set.
+ssize_t recv_compressed_chunk(int sock, const FrameHeader *hdr, uint8_t *out, int *corrupt,
+                              CodecStats *stats);
+
+// Bytes of data in an uncompressed DATA frame, not counting its checksum
+// trailer. -1 if the payload is too short to hold one.
+int64_t data_frame_length(const FrameHeader *hdr);
+// Continues crc over len bytes, counting the time spent in stats
+uint32_t data_checksum(CodecStats *stats, uint32_t crc, const void *data, size_t len);
+// Reads the trailer of a DATA frame flagged FRAME_F_CHECKSUM and compares it
+// with crc, the checksum of the data it carried. Returns -1 if the trailer
+// could not be read; a mismatch sets *corrupt.
+int recv_checksum_trailer(int sock, uint32_t crc, int *corrupt, CodecStats *stats);
+// Reads any DATA frame carrying at most CODEC_CHUNK_SIZE bytes into out,
+// expanding it if compressed, like recv_compressed_chunk
+ssize_t recv_data_chunk(int sock, const FrameHeader *hdr, uint8_t *out, int *corrupt, CodecStats *stats);
+
+// Counts a DATA frame received without compression
+void codec_stats_received_raw(CodecStats *stats, uint64_t len);
+// Two lines summarizing stats
+void codec_stats_format(const CodecStats *stats, char *out, size_t out_size);
+
+#endif
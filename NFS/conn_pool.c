@@ -0,0 +1,197 @@
+#include "conn_pool.h"
+#include <poll.h>
+#include <netinet/tcp.h>
+
+#define KEEPALIVE_IDLE_SEC 30
+#define KEEPALIVE_INTERVAL_SEC 10
+#define KEEPALIVE_PROBES 3
+#define CONNECT_TIMEOUT_MS 1000
+
+// Caller holds the lock
+static PoolServer *find_server(ConnPool *pool, const char *ip, int port, int create) {
+   for (PoolServer *server = pool->servers; server; server = server->next) {
+      if (server->port == port && strcmp(server->ip, ip) == 0) return server;
+   }
+   if (!create) return NULL;
+   PoolServer *server = calloc(1, sizeof(PoolServer));
+   if (server == NULL) return NULL;
+   snprintf(server->ip, sizeof(server->ip), "%s", ip);
+   server->port = port;
+   server->next = pool->servers;
+   pool->servers = server;
+   return server;
+}
+
+// An idle connection should have nothing to read. Readable means the server
+// closed it (EOF) or the stream is out of sync; either way it is unusable.
+static int is_healthy(int fd) {
+   struct pollfd pfd = { .fd = fd, .events = POLLIN };
+   return poll(&pfd, 1, 0) == 0;
+}
+
+// Drops idle connections past the timeout. Caller holds the lock.
+static void evict_expired(ConnPool *pool, PoolServer *server, time_t now) {
+   PooledConn **link = &server->idle;
+   while (*link) {
+      PooledConn *conn = *link;
+      if (now - conn->last_used >= pool->idle_timeout_sec) {
+         *link = conn->next;
+         close(conn->fd);
+         free(conn);
+         server->num_open--;
+      } else {
+         link = &conn->next;
+      }
+   }
+}
+
+static int open_connection(const char *ip, int port) {
+   int fd = socket(AF_INET, SOCK_STREAM, 0);
+   if (fd < 0) {
+      perror("Error creating socket for storage server");
+      return -1;
+   }
+   struct sockaddr_in addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = inet_addr(ip);
+   addr.sin_port = htons(port);
+   // Connect without blocking so an unreachable host is bounded by the
+   // timeout, then switch back to blocking I/O for the exchange
+   int flags = fcntl(fd, F_GETFL);
+   fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+   int rc = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+   if (rc < 0 && errno == EINPROGRESS) {
+      struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+      int error = ETIMEDOUT;
+      socklen_t error_len = sizeof(error);
+      if (poll(&pfd, 1, CONNECT_TIMEOUT_MS) == 1) {
+         getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len);
+      }
+      errno = error;
+      rc = error == 0 ? 0 : -1;
+   }
+   if (rc < 0) {
+      perror("Error connecting to storage server");
+      close(fd);
+      return -1;
+   }
+   fcntl(fd, F_SETFL, flags);
+
+   // Requests are small and latency bound; keepalive notices dead peers on
+   // connections that sit idle in the pool
+   int on = 1;
+   int idle = KEEPALIVE_IDLE_SEC, interval = KEEPALIVE_INTERVAL_SEC, probes = KEEPALIVE_PROBES;
+   setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+   setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+   setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+   setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+   setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+   return fd;
+}
+
+void conn_pool_init(ConnPool *pool, int max_per_server, int idle_timeout_sec, ConnSetup setup) {
+   pool->servers = NULL;
+   pool->max_per_server = max_per_server;
+   pool->idle_timeout_sec = idle_timeout_sec;
+   pool->setup = setup;
+   pool->reused = 0;
+   pool->connected = 0;
+   pthread_mutex_init(&pool->lock, NULL);
+   pthread_cond_init(&pool->released, NULL);
+}
+
+int conn_pool_acquire(ConnPool *pool, const char *ip, int port, int *state) {
+   pthread_mutex_lock(&pool->lock);
+   PoolServer *server = find_server(pool, ip, port, 1);
+   if (server == NULL) {
+      pthread_mutex_unlock(&pool->lock);
+      return -1;
+   }
+   while (1) {
+      evict_expired(pool, server, time(NULL));
+      while (server->idle) {
+         PooledConn *conn = server->idle;
+         server->idle = conn->next;
+         int fd = conn->fd;
+         *state = conn->state;
+         free(conn);
+         if (is_healthy(fd)) {
+            pool->reused++;
+            pthread_mutex_unlock(&pool->lock);
+            return fd;
+         }
+         close(fd);
+         server->num_open--;
+      }
+      if (server->num_open < pool->max_per_server) break;
+      pthread_cond_wait(&pool->released, &pool->lock);
+   }
+   // Reserve the slot, then connect without holding the lock
+   server->num_open++;
+   pthread_mutex_unlock(&pool->lock);
+
+   int fd = open_connection(ip, port);
+   *state = 0;
+   if (fd >= 0 && pool->setup && (*state = pool->setup(fd)) < 0) {
+      close(fd);
+      fd = -1;
+   }
+
+   pthread_mutex_lock(&pool->lock);
+   if (fd < 0) {
+      server->num_open--;
+      pthread_cond_broadcast(&pool->released);
+   } else {
+      pool->connected++;
+   }
+   pthread_mutex_unlock(&pool->lock);
+   return fd;
+}
+
+void conn_pool_release(ConnPool *pool, const char *ip, int port, int fd, int state, int reusable) {
+   pthread_mutex_lock(&pool->lock);
+   PoolServer *server = find_server(pool, ip, port, 0);
+   PooledConn *conn = reusable && server ? malloc(sizeof(PooledConn)) : NULL;
+   if (conn == NULL) {
+      close(fd);
+      if (server) server->num_open--;
+   } else {
+      conn->fd = fd;
+      conn->state = state;
+      conn->last_used = time(NULL);
+      conn->next = server->idle;
+      server->idle = conn;
+   }
+   pthread_cond_broadcast(&pool->released);
+   pthread_mutex_unlock(&pool->lock);
+}
+
+void conn_pool_close_idle(ConnPool *pool) {
+   pthread_mutex_lock(&pool->lock);
+   for (PoolServer *server = pool->servers; server; server = server->next) {
+      while (server->idle) {
+         PooledConn *conn = server->idle;
+         server->idle = conn->next;
+         close(conn->fd);
+         free(conn);
+         server->num_open--;
+      }
+   }
+   pthread_cond_broadcast(&pool->released);
+   pthread_mutex_unlock(&pool->lock);
+}
+
+void conn_pool_close_server(ConnPool *pool, const char *ip, int port) {
+   pthread_mutex_lock(&pool->lock);
+   PoolServer *server = find_server(pool, ip, port, 0);
+   while (server && server->idle) {
+      PooledConn *conn = server->idle;
+      server->idle = conn->next;
+      close(conn->fd);
+      free(conn);
+      server->num_open--;
+   }
+   pthread_cond_broadcast(&pool->released);
+   pthread_mutex_unlock(&pool->lock);
+}
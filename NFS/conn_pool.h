@@ -0,0 +1,63 @@
+#ifndef _CONN_POOL_H_
+#define _CONN_POOL_H_
+
+#include "headers.h"
+#include <time.h>
+
+// Client-side pool of keep-alive connections to storage servers, keyed by
+// (ip, port).
+//
+// A connection is checked out for one request/reply exchange and handed back
+// afterwards. Idle connections are health-checked before reuse (a peer that
+// closed or sent unsolicited data is dropped) and evicted after an idle
+// timeout. Connecting gives up after CONNECT_TIMEOUT_MS, so a dead server
+// fails fast instead of waiting out the kernel's SYN retries. At most max_per_server connections, idle or in use, are open to
+// one server; acquirers beyond that wait for one to be released.
+//
+// An optional setup hook runs once on every new connection, e.g. to
+// negotiate per-connection options. The value it returns is the
+// connection's state, handed back with the connection on every acquire.
+
+// Returns the new connection's state, or -1 to drop it
+typedef int (*ConnSetup)(int fd);
+
+typedef struct PooledConn {
+   int fd;
+   int state;                   // From the setup hook
+   time_t last_used;
+   struct PooledConn *next;
+} PooledConn;
+
+typedef struct PoolServer {
+   char ip[16];
+   int port;
+   int num_open;                // Idle plus checked out
+   PooledConn *idle;            // Most recently used first
+   struct PoolServer *next;
+} PoolServer;
+
+typedef struct {
+   PoolServer *servers;
+   int max_per_server;
+   int idle_timeout_sec;
+   ConnSetup setup;             // NULL for none
+   unsigned long reused;
+   unsigned long connected;
+   pthread_mutex_t lock;
+   pthread_cond_t released;
+} ConnPool;
+
+void conn_pool_init(ConnPool *pool, int max_per_server, int idle_timeout_sec, ConnSetup setup);
+// Returns a connected socket to ip:port and sets *state to its state, or
+// returns -1 if none could be opened
+int conn_pool_acquire(ConnPool *pool, const char *ip, int port, int *state);
+// Returns fd and its state to the pool. Pass reusable = 0 when the exchange
+// failed part way and the stream may be out of sync; the connection is then
+// closed.
+void conn_pool_release(ConnPool *pool, const char *ip, int port, int fd, int state, int reusable);
+// Closes every idle connection
+void conn_pool_close_idle(ConnPool *pool);
+// Closes the idle connections to ip:port, e.g. once it is known to be down
+void conn_pool_close_server(ConnPool *pool, const char *ip, int port);
+
+#endif
@@ -0,0 +1,356 @@
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78       // Reflected Castagnoli polynomial
+#define LANE_LONG 8192               // Bytes per lane in the three-way loops
+#define LANE_SHORT 256
+#define FOLD_MIN 256                 // Shortest buffer worth folding with clmul
+#define FOLD_WIDE_MIN 1024
+
+static uint32_t crc32c_table[8][256];
+static uint32_t x2n_table[64];       // x^(2^n) mod P, for combining
+static Crc32cShift shift_long;       // Appends LANE_LONG zero bytes
+static Crc32cShift shift_short;
+// Fold constants for carry-less multiplication, x^(8n+7) mod P bit reversed,
+// one pair per distance a 128 bit block is moved forward: {lo half, hi half}
+static uint64_t fold_128[2], fold_512[2], fold_2048[2];
+static uint32_t (*crc32c_impl)(uint32_t crc, const uint8_t *next, size_t len);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static void crc32c_setup(void);
+
+// The zeros operators below are 32x32 matrices over GF(2), one column per word
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+   uint32_t sum = 0;
+   while (vec) {
+      if (vec & 1) sum ^= *mat;
+      vec >>= 1;
+      mat++;
+   }
+   return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+   for (int n = 0; n < 32; n++) square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+// Builds in op the operator that appends len zero bytes to a CRC register
+static void crc32c_zeros_op(uint32_t *op, size_t len) {
+   uint32_t odd[32], even[32];
+   // One zero bit
+   odd[0] = CRC32C_POLY;
+   uint32_t row = 1;
+   for (int n = 1; n < 32; n++) {
+      odd[n] = row;
+      row <<= 1;
+   }
+   gf2_matrix_square(even, odd);   // Two zero bits
+   gf2_matrix_square(odd, even);   // Four, so odd now appends half a byte
+
+   // Square once per bit of len, starting at one byte, accumulating into op
+   int first = 1;
+   uint32_t *cur = odd, *next = even;
+   while (len) {
+      gf2_matrix_square(next, cur);
+      uint32_t *t = cur;
+      cur = next;
+      next = t;
+      if (len & 1) {
+         if (first) {
+            memcpy(op, cur, sizeof(odd));
+            first = 0;
+         }
+         else {
+            uint32_t product[32];
+            for (int n = 0; n < 32; n++) product[n] = gf2_matrix_times(cur, op[n]);
+            memcpy(op, product, sizeof(product));
+         }
+      }
+      len >>= 1;
+   }
+   if (first) {
+      // No zeros at all: the identity
+      for (int n = 0; n < 32; n++) op[n] = 1u << n;
+   }
+}
+
+void crc32c_shift_init(Crc32cShift *shift, size_t len) {
+   uint32_t op[32];
+   crc32c_zeros_op(op, len);
+   for (uint32_t n = 0; n < 256; n++) {
+      shift->table[0][n] = gf2_matrix_times(op, n);
+      shift->table[1][n] = gf2_matrix_times(op, n << 8);
+      shift->table[2][n] = gf2_matrix_times(op, n << 16);
+      shift->table[3][n] = gf2_matrix_times(op, n << 24);
+   }
+}
+
+static inline uint32_t crc32c_shift(const Crc32cShift *shift, uint32_t crc) {
+   return shift->table[0][crc & 0xff] ^ shift->table[1][(crc >> 8) & 0xff] ^
+          shift->table[2][(crc >> 16) & 0xff] ^ shift->table[3][crc >> 24];
+}
+
+uint32_t crc32c_append(const Crc32cShift *shift, uint32_t crc_a, uint32_t crc_b) {
+   return crc32c_shift(shift, crc_a) ^ crc_b;
+}
+
+// a * b mod P, with bit 31 holding the coefficient of x^0 as in the CRC
+// register. a must not be zero.
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+   uint32_t m = 1u << 31, p = 0;
+   while (1) {
+      if (a & m) {
+         p ^= b;
+         if ((a & (m - 1)) == 0) break;
+      }
+      m >>= 1;
+      b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+   }
+   return p;
+}
+
+uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, size_t len_b) {
+   pthread_once(&crc32c_once, crc32c_setup);
+   // x^(8 * len_b) mod P, one factor per bit set in len_b
+   uint32_t op = 1u << 31;
+   for (int k = 3; len_b; len_b >>= 1, k++) {
+      if (len_b & 1) op = multmodp(x2n_table[k], op);
+   }
+   return multmodp(op, crc_a) ^ crc_b;
+}
+
+// Sets k to the pair of constants that move a 128 bit block bits bits forward
+static void fold_constants(uint64_t *k, size_t bits) {
+   uint32_t op[32];
+   // The low half of the block is worth x^(bits + 31) after the multiply
+   // shifts it, the high half x^(bits - 33); both are 7 mod 8, so start
+   // from x^7 and append whole zero bytes
+   crc32c_zeros_op(op, (bits + 24) / 8);
+   k[0] = gf2_matrix_times(op, 1u << 24);
+   crc32c_zeros_op(op, (bits - 40) / 8);
+   k[1] = gf2_matrix_times(op, 1u << 24);
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *next, size_t len) {
+   uint64_t crc0 = ~crc;
+   while (len && ((uintptr_t)next & 7)) {
+      crc0 = crc32c_table[0][(crc0 ^ *next++) & 0xff] ^ (crc0 >> 8);
+      len--;
+   }
+   while (len >= 8) {
+      uint64_t word;
+      memcpy(&word, next, sizeof(word));
+      word ^= crc0;
+      crc0 = crc32c_table[7][word & 0xff] ^ crc32c_table[6][(word >> 8) & 0xff] ^
+             crc32c_table[5][(word >> 16) & 0xff] ^ crc32c_table[4][(word >> 24) & 0xff] ^
+             crc32c_table[3][(word >> 32) & 0xff] ^ crc32c_table[2][(word >> 40) & 0xff] ^
+             crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+      next += 8;
+      len -= 8;
+   }
+   while (len) {
+      crc0 = crc32c_table[0][(crc0 ^ *next++) & 0xff] ^ (crc0 >> 8);
+      len--;
+   }
+   return (uint32_t)~crc0;
+}
+
+#if defined(__x86_64__)
+// Runs three lanes of lane bytes each through the crc32 instruction at once,
+// then folds the second and third lanes onto the first
+__attribute__((target("sse4.2")))
+static inline uint64_t crc32c_lanes(uint64_t crc0, const uint8_t **next, size_t *len,
+                                    size_t lane, const Crc32cShift *shift) {
+   while (*len >= lane * 3) {
+      uint64_t crc1 = 0, crc2 = 0, word;
+      const uint8_t *p = *next, *end = *next + lane;
+      do {
+         memcpy(&word, p, sizeof(word));
+         crc0 = _mm_crc32_u64(crc0, word);
+         memcpy(&word, p + lane, sizeof(word));
+         crc1 = _mm_crc32_u64(crc1, word);
+         memcpy(&word, p + 2 * lane, sizeof(word));
+         crc2 = _mm_crc32_u64(crc2, word);
+         p += 8;
+      } while (p < end);
+      crc0 = crc32c_shift(shift, (uint32_t)crc0) ^ crc1;
+      crc0 = crc32c_shift(shift, (uint32_t)crc0) ^ crc2;
+      *next += lane * 3;
+      *len -= lane * 3;
+   }
+   return crc0;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *next, size_t len) {
+   uint64_t crc0 = ~crc;
+   while (len && ((uintptr_t)next & 7)) {
+      crc0 = _mm_crc32_u8((uint32_t)crc0, *next++);
+      len--;
+   }
+   crc0 = crc32c_lanes(crc0, &next, &len, LANE_LONG, &shift_long);
+   crc0 = crc32c_lanes(crc0, &next, &len, LANE_SHORT, &shift_short);
+   while (len >= 8) {
+      uint64_t word;
+      memcpy(&word, next, sizeof(word));
+      crc0 = _mm_crc32_u64(crc0, word);
+      next += 8;
+      len -= 8;
+   }
+   while (len) {
+      crc0 = _mm_crc32_u8((uint32_t)crc0, *next++);
+      len--;
+   }
+   return (uint32_t)~crc0;
+}
+
+__attribute__((target("sse4.2,pclmul"), always_inline))
+static inline __m128i fold_block(__m128i x, __m128i k, __m128i next) {
+   __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+   __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+   return _mm_xor_si128(_mm_xor_si128(lo, hi), next);
+}
+
+// Folds the 128 bit remainder x, which holds the crc register pending for
+// its first bytes, and the bytes left after it, into a CRC. Always inlined so
+// the wide path gets it VEX encoded: legacy SSE instructions run after 512 bit
+// ones cost hundreds of cycles per call.
+__attribute__((target("sse4.2,pclmul"), always_inline))
+static inline uint32_t crc32c_fold_finish(__m128i x, const uint8_t *next, size_t len) {
+   __m128i k = _mm_loadu_si128((const __m128i *)fold_128);
+   while (len >= 16) {
+      x = fold_block(x, k, _mm_loadu_si128((const __m128i *)next));
+      next += 16;
+      len -= 16;
+   }
+   uint64_t crc0 = _mm_crc32_u64(0, _mm_cvtsi128_si64(x));
+   crc0 = _mm_crc32_u64(crc0, _mm_extract_epi64(x, 1));
+   while (len) {
+      crc0 = _mm_crc32_u8((uint32_t)crc0, *next++);
+      len--;
+   }
+   return (uint32_t)~crc0;
+}
+
+// Carry-less multiplication folds four 128 bit blocks at a time into the
+// running remainder, far ahead of the one crc32 instruction per 8 bytes.
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_clmul(uint32_t crc, const uint8_t *next, size_t len) {
+   if (len < FOLD_MIN) return crc32c_hw(crc, next, len);
+   __m128i x0 = _mm_loadu_si128((const __m128i *)next);
+   __m128i x1 = _mm_loadu_si128((const __m128i *)(next + 16));
+   __m128i x2 = _mm_loadu_si128((const __m128i *)(next + 32));
+   __m128i x3 = _mm_loadu_si128((const __m128i *)(next + 48));
+   x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128(~crc));
+   next += 64;
+   len -= 64;
+   __m128i k = _mm_loadu_si128((const __m128i *)fold_512);
+   while (len >= 64) {
+      x0 = fold_block(x0, k, _mm_loadu_si128((const __m128i *)next));
+      x1 = fold_block(x1, k, _mm_loadu_si128((const __m128i *)(next + 16)));
+      x2 = fold_block(x2, k, _mm_loadu_si128((const __m128i *)(next + 32)));
+      x3 = fold_block(x3, k, _mm_loadu_si128((const __m128i *)(next + 48)));
+      next += 64;
+      len -= 64;
+   }
+   k = _mm_loadu_si128((const __m128i *)fold_128);
+   x0 = fold_block(x0, k, x1);
+   x0 = fold_block(x0, k, x2);
+   x0 = fold_block(x0, k, x3);
+   return crc32c_fold_finish(x0, next, len);
+}
+
+// Same with four 512 bit registers, each holding four blocks
+__attribute__((target("sse4.2,pclmul,avx512f,avx512vl,vpclmulqdq"), always_inline))
+static inline __m512i fold_wide(__m512i x, __m512i k, __m512i next) {
+   __m512i lo = _mm512_clmulepi64_epi128(x, k, 0x00);
+   __m512i hi = _mm512_clmulepi64_epi128(x, k, 0x11);
+   return _mm512_ternarylogic_epi64(lo, hi, next, 0x96);   // Three-way xor
+}
+
+__attribute__((target("sse4.2,pclmul,avx512f,avx512vl,vpclmulqdq")))
+static uint32_t crc32c_vclmul(uint32_t crc, const uint8_t *next, size_t len) {
+   if (len < FOLD_WIDE_MIN) return crc32c_clmul(crc, next, len);
+   __m512i x0 = _mm512_loadu_si512(next);
+   __m512i x1 = _mm512_loadu_si512(next + 64);
+   __m512i x2 = _mm512_loadu_si512(next + 128);
+   __m512i x3 = _mm512_loadu_si512(next + 192);
+   x0 = _mm512_xor_si512(x0, _mm512_zextsi128_si512(_mm_cvtsi32_si128(~crc)));
+   next += 256;
+   len -= 256;
+   __m512i k = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)fold_2048));
+   while (len >= 256) {
+      x0 = fold_wide(x0, k, _mm512_loadu_si512(next));
+      x1 = fold_wide(x1, k, _mm512_loadu_si512(next + 64));
+      x2 = fold_wide(x2, k, _mm512_loadu_si512(next + 128));
+      x3 = fold_wide(x3, k, _mm512_loadu_si512(next + 192));
+      next += 256;
+      len -= 256;
+   }
+   k = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)fold_512));
+   x0 = fold_wide(x0, k, x1);
+   x0 = fold_wide(x0, k, x2);
+   x0 = fold_wide(x0, k, x3);
+   // Down to the four blocks of x0
+   __m128i k128 = _mm_loadu_si128((const __m128i *)fold_128);
+   __m128i y = fold_block(_mm512_extracti32x4_epi32(x0, 0), k128, _mm512_extracti32x4_epi32(x0, 1));
+   y = fold_block(y, k128, _mm512_extracti32x4_epi32(x0, 2));
+   y = fold_block(y, k128, _mm512_extracti32x4_epi32(x0, 3));
+   return crc32c_fold_finish(y, next, len);
+}
+#endif
+
+static void crc32c_setup(void) {
+   for (uint32_t n = 0; n < 256; n++) {
+      uint32_t crc = n;
+      for (int k = 0; k < 8; k++) crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+      crc32c_table[0][n] = crc;
+   }
+   for (uint32_t n = 0; n < 256; n++) {
+      uint32_t crc = crc32c_table[0][n];
+      for (int k = 1; k < 8; k++) {
+         crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+         crc32c_table[k][n] = crc;
+      }
+   }
+   uint32_t power = 1u << 30;   // x^1
+   for (int n = 0; n < 64; n++) {
+      x2n_table[n] = power;
+      power = multmodp(power, power);
+   }
+   crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+   if (__builtin_cpu_supports("sse4.2")) {
+      crc32c_shift_init(&shift_long, LANE_LONG);
+      crc32c_shift_init(&shift_short, LANE_SHORT);
+      crc32c_impl = crc32c_hw;
+      if (__builtin_cpu_supports("pclmul")) {
+         fold_constants(fold_128, 128);
+         fold_constants(fold_512, 512);
+         crc32c_impl = crc32c_clmul;
+      }
+      if (crc32c_impl == crc32c_clmul && __builtin_cpu_supports("avx512f") &&
+          __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("vpclmulqdq")) {
+         fold_constants(fold_2048, 2048);
+         crc32c_impl = crc32c_vclmul;
+      }
+   }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+   pthread_once(&crc32c_once, crc32c_setup);
+   return crc32c_impl(crc, buf, len);
+}
+
+const char *crc32c_backend(void) {
+   pthread_once(&crc32c_once, crc32c_setup);
+#if defined(__x86_64__)
+   if (crc32c_impl == crc32c_vclmul) return "vpclmulqdq";
+   if (crc32c_impl == crc32c_clmul) return "pclmul";
+   if (crc32c_impl == crc32c_hw) return "sse4.2";
+#endif
+   return "table";
+}
@@ -0,0 +1,36 @@
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+#include "headers.h"
+#include <stdint.h>
+
+// CRC32C (Castagnoli), the checksum of DATA frames and of stored blocks.
+//
+// On x86-64 CPUs with PCLMULQDQ, buffers of a few hundred bytes and more are
+// folded with carry-less multiplication, 64 bytes per step, or 256 with
+// AVX-512 VPCLMULQDQ; the 16 byte remainder and short buffers go through the
+// SSE4.2 crc32 instruction. Without PCLMULQDQ that instruction runs over three
+// interleaved lanes so its latency is hidden, merged with precomputed zeros
+// operators. Elsewhere a slicing-by-8 table handles eight bytes per step. The
+// choice is made once, on first use.
+//
+// Checksums are chained: crc32c(crc32c(0, a), b) is the checksum of a then b,
+// and crc32c(0, buf, 0) is 0.
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+// "vpclmulqdq", "pclmul", "sse4.2" or "table"
+const char *crc32c_backend(void);
+
+// Appending a fixed number of bytes: with shift set up for len,
+// crc32c_append(shift, crc(a), crc(b)) is crc(a then b) for any b of len
+// bytes, without touching the data
+typedef struct {
+   uint32_t table[4][256];
+} Crc32cShift;
+
+void crc32c_shift_init(Crc32cShift *shift, size_t len);
+uint32_t crc32c_append(const Crc32cShift *shift, uint32_t crc_a, uint32_t crc_b);
+// Same for a b of any length, at the cost of about a microsecond
+uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, size_t len_b);
+
+#endif
@@ -0,0 +1,788 @@
+#define _GNU_SOURCE   // syncfs()
+#include "dedup_store.h"
+#include "crc32c.h"
+#include "murmur3.h"
+#include <limits.h>
+
+#define MANIFEST_MAGIC 0x4E46444D   // "NFDM"
+#define HASH_SEED 0x4e4653          // Chunk names depend on it; never change it
+#define GEAR_SEED 0x9e3779b97f4a7c15ULL   // Cut points too
+#define WINDOW_CHUNKS 4             // Writers buffer this many chunks' worth
+#define INITIAL_BUCKETS 64
+
+// States of a DedupEntry
+#define CHUNK_STORED 0
+#define CHUNK_WRITING 1
+#define CHUNK_UNSEEN 2              // Referenced, not yet found on disk (startup)
+
+typedef struct {
+   uint32_t magic;
+   uint32_t count;
+   int64_t mtime_ns;
+   uint64_t size;
+   uint32_t path_len;
+   uint32_t reserved;
+} ManifestHeader;
+
+static uint64_t gear[256];
+
+// Finds the first cut in data[from, to): a byte after which the gear hash h
+// of the bytes before it, carried in and out through *h, has its masked bits
+// clear. Two bytes per step: the hash after the second byte is computed from
+// the one before the first, so only one shift and add per pair lie on the
+// dependency chain. Returns the length up to the cut, or 0 if there is none.
+static inline size_t find_cut(const uint8_t *data, size_t from, size_t to, uint64_t mask, uint64_t *h) {
+   uint64_t hash = *h;
+   size_t i = from;
+   for (; i + 2 <= to; i += 2) {
+      uint64_t first = (hash << 1) + gear[data[i]];
+      hash = (hash << 2) + (gear[data[i]] << 1) + gear[data[i + 1]];
+      if (!(first & mask)) return i + 1;
+      if (!(hash & mask)) return i + 2;
+   }
+   if (i < to) {
+      hash = (hash << 1) + gear[data[i]];
+      if (!(hash & mask)) return i + 1;
+   }
+   *h = hash;
+   return 0;
+}
+
+// Length of the chunk starting at data, which holds len bytes: everything if
+// that is no more than a chunk's minimum, otherwise cut where the gear hash
+// of the last 64 bytes has its masked bits clear. The stricter mask before
+// the average size and the looser one after it (FastCDC's normalized
+// chunking) keep chunk sizes close to the average.
+static size_t cut_point(const DedupStore *store, const uint8_t *data, size_t len) {
+   size_t max = len < store->max_chunk ? len : store->max_chunk;
+   if (store->chunking == CHUNKING_FIXED || len <= store->min_chunk) return max;
+   size_t normal = store->min_chunk * 2 < max ? store->min_chunk * 2 : max;
+   uint64_t h = 0;
+   size_t cut = find_cut(data, store->min_chunk, normal, store->mask_small, &h);
+   if (cut == 0) cut = find_cut(data, normal, max, store->mask_large, &h);
+   return cut ? cut : max;
+}
+
+static void chunk_path(const DedupStore *store, const uint8_t *hash, uint32_t probe, char *out, size_t out_size) {
+   char hex[33];
+   for (int i = 0; i < 16; i++) snprintf(hex + i * 2, 3, "%02x", hash[i]);
+   if (probe == 0) snprintf(out, out_size, "%s/chunks/%.2s/%s", store->dir, hex, hex);
+   else snprintf(out, out_size, "%s/chunks/%.2s/%s-%u", store->dir, hex, hex, probe);
+}
+
+// Manifests are named by version too, so removing an old one can never take
+// the manifest of a new file that reused its inode
+static void manifest_path(const DedupStore *store, const FileVersion *version, char *out, size_t out_size) {
+   snprintf(out, out_size, "%s/manifests/%llx-%llx-%llx", store->dir, (unsigned long long)version->dev,
+            (unsigned long long)version->ino, (unsigned long long)version->mtime_ns);
+}
+
+static DedupShard *chunk_shard(DedupStore *store, const uint8_t *hash) {
+   return &store->shards[hash[15] % DEDUP_SHARDS];
+}
+
+static size_t chunk_bucket(const DedupShard *shard, const uint8_t *hash) {
+   uint64_t h;
+   memcpy(&h, hash, sizeof(h));
+   return h & (shard->num_buckets - 1);
+}
+
+static uint64_t file_hash(dev_t dev, ino_t ino) {
+   uint64_t h = (uint64_t)ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t)dev;
+   return murmur3_fmix64(h);
+}
+
+static DedupShard *file_shard(DedupStore *store, dev_t dev, ino_t ino) {
+   return &store->shards[(file_hash(dev, ino) >> 32) % DEDUP_SHARDS];
+}
+
+// Caller holds the shard lock
+static DedupEntry *find_entry(DedupShard *shard, const uint8_t *hash, uint32_t probe) {
+   for (DedupEntry *entry = shard->buckets[chunk_bucket(shard, hash)]; entry; entry = entry->next) {
+      if (entry->probe == probe && memcmp(entry->hash, hash, sizeof(entry->hash)) == 0) return entry;
+   }
+   return NULL;
+}
+
+static void grow_entries(DedupShard *shard) {
+   size_t old_size = shard->num_buckets;
+   DedupEntry **old = shard->buckets;
+   shard->num_buckets = old_size * 2;
+   shard->buckets = calloc(shard->num_buckets, sizeof(DedupEntry *));
+   if (shard->buckets == NULL) {
+      perror("Failed to grow the chunk index");
+      exit(1);
+   }
+   for (size_t b = 0; b < old_size; b++) {
+      while (old[b]) {
+         DedupEntry *entry = old[b];
+         old[b] = entry->next;
+         DedupEntry **head = &shard->buckets[chunk_bucket(shard, entry->hash)];
+         entry->next = *head;
+         *head = entry;
+      }
+   }
+   free(old);
+}
+
+// Caller holds the shard lock
+static DedupEntry *add_entry(DedupShard *shard, const uint8_t *hash, uint32_t probe, uint32_t len, int state) {
+   if (shard->count >= shard->num_buckets) grow_entries(shard);
+   DedupEntry *entry = malloc(sizeof(DedupEntry));
+   if (entry == NULL) {
+      perror("Failed to allocate a chunk index entry");
+      exit(1);
+   }
+   memcpy(entry->hash, hash, sizeof(entry->hash));
+   entry->probe = probe;
+   entry->len = len;
+   entry->refs = 0;
+   entry->state = state;
+   DedupEntry **head = &shard->buckets[chunk_bucket(shard, hash)];
+   entry->next = *head;
+   *head = entry;
+   shard->count++;
+   return entry;
+}
+
+// Caller holds the shard lock
+static void remove_entry(DedupShard *shard, DedupEntry *entry) {
+   DedupEntry **link = &shard->buckets[chunk_bucket(shard, entry->hash)];
+   while (*link != entry) link = &(*link)->next;
+   *link = entry->next;
+   shard->count--;
+   free(entry);
+}
+
+// Drops one reference to a chunk, deleting it with the last. The file goes
+// while the lock is held so a writer storing the same data again cannot
+// have its new copy deleted.
+static void release_chunk(DedupStore *store, const DedupChunk *chunk) {
+   DedupShard *shard = chunk_shard(store, chunk->hash);
+   pthread_mutex_lock(&shard->lock);
+   DedupEntry *entry = find_entry(shard, chunk->hash, chunk->probe);
+   if (entry && --entry->refs == 0) {
+      char path[PATH_MAX];
+      chunk_path(store, chunk->hash, chunk->probe, path, sizeof(path));
+      unlink(path);
+      remove_entry(shard, entry);
+   }
+   pthread_mutex_unlock(&shard->lock);
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+   const uint8_t *p = buf;
+   while (len > 0) {
+      ssize_t written = write(fd, p, len);
+      if (written < 0) {
+         if (errno == EINTR) continue;
+         return -1;
+      }
+      p += written;
+      len -= written;
+   }
+   return 0;
+}
+
+// Reads len bytes at offset. Returns 0, or -1 if the file ended early.
+static int read_fully(int fd, uint8_t *buffer, size_t len, uint64_t offset) {
+   while (len > 0) {
+      ssize_t bytes_read = pread(fd, buffer, len, offset);
+      if (bytes_read < 0 && errno == EINTR) continue;
+      if (bytes_read <= 0) {
+         if (bytes_read == 0) errno = EIO;
+         return -1;
+      }
+      buffer += bytes_read;
+      len -= bytes_read;
+      offset += bytes_read;
+   }
+   return 0;
+}
+
+int dedup_chunk_open(DedupStore *store, const DedupChunk *chunk) {
+   char path[PATH_MAX];
+   chunk_path(store, chunk->hash, chunk->probe, path, sizeof(path));
+   return open(path, O_RDONLY);
+}
+
+// 1 if the stored chunk holds exactly data
+static int chunk_matches(DedupStore *store, const DedupChunk *chunk, const uint8_t *data) {
+   uint8_t *stored = malloc(chunk->len);
+   int fd = dedup_chunk_open(store, chunk);
+   int same = stored && fd >= 0 && read_fully(fd, stored, chunk->len, 0) == 0 &&
+              memcmp(stored, data, chunk->len) == 0;
+   if (fd >= 0) close(fd);
+   free(stored);
+   return same;
+}
+
+// Stores a chunk, or takes a reference to an identical one already stored,
+// and fills in chunk. Returns -1 with errno set if it could not be written.
+static int store_chunk(DedupStore *store, const uint8_t *data, size_t len, DedupChunk *chunk) {
+   murmur3_128(data, len, HASH_SEED, chunk->hash);
+   chunk->len = len;
+   chunk->crc = crc32c(0, data, len);
+   DedupShard *shard = chunk_shard(store, chunk->hash);
+   for (chunk->probe = 0; ; chunk->probe++) {
+      pthread_mutex_lock(&shard->lock);
+      DedupEntry *entry = find_entry(shard, chunk->hash, chunk->probe);
+      while (entry && entry->state == CHUNK_WRITING) {
+         // Whoever is writing it may yet fail, taking the entry away
+         pthread_cond_wait(&shard->written, &shard->lock);
+         entry = find_entry(shard, chunk->hash, chunk->probe);
+      }
+      if (entry == NULL) {
+         entry = add_entry(shard, chunk->hash, chunk->probe, len, CHUNK_WRITING);
+         entry->refs = 1;
+         pthread_mutex_unlock(&shard->lock);
+
+         // Not synced here: a durable commit syncs all its chunks at once
+         char path[PATH_MAX];
+         chunk_path(store, chunk->hash, chunk->probe, path, sizeof(path));
+         int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+         int ok = fd >= 0 && write_all(fd, data, len) == 0;
+         if (fd >= 0 && close(fd) < 0) ok = 0;
+         int error = errno;
+
+         pthread_mutex_lock(&shard->lock);
+         if (ok) entry->state = CHUNK_STORED;
+         else {
+            unlink(path);
+            remove_entry(shard, entry);
+         }
+         pthread_cond_broadcast(&shard->written);
+         pthread_mutex_unlock(&shard->lock);
+         if (!ok) {
+            errno = error;
+            return -1;
+         }
+         __atomic_add_fetch(&store->stats.chunks_written, 1, __ATOMIC_RELAXED);
+         __atomic_add_fetch(&store->stats.bytes_written, len, __ATOMIC_RELAXED);
+         return 0;
+      }
+      int candidate = entry->len == len;
+      if (candidate) entry->refs++;   // Keeps it from being deleted while compared
+      pthread_mutex_unlock(&shard->lock);
+      if (candidate && chunk_matches(store, chunk, data)) {
+         __atomic_add_fetch(&store->stats.chunks_deduplicated, 1, __ATOMIC_RELAXED);
+         __atomic_add_fetch(&store->stats.bytes_deduplicated, len, __ATOMIC_RELAXED);
+         return 0;
+      }
+      if (candidate) release_chunk(store, chunk);
+      __atomic_add_fetch(&store->stats.collisions, 1, __ATOMIC_RELAXED);
+   }
+}
+
+static void manifest_free(DedupManifest *manifest) {
+   free(manifest->path);
+   free(manifest->chunks);
+   free(manifest);
+}
+
+void dedup_manifest_release(DedupStore *store, DedupManifest *manifest) {
+   if (__atomic_sub_fetch(&manifest->refcount, 1, __ATOMIC_ACQ_REL) > 0) return;
+   for (uint32_t i = 0; i < manifest->count; i++) release_chunk(store, &manifest->chunks[i]);
+   manifest_free(manifest);
+}
+
+// Caller holds the shard lock
+static DedupManifest **find_manifest(DedupShard *shard, dev_t dev, ino_t ino) {
+   DedupManifest **link = &shard->manifests[file_hash(dev, ino) & (shard->num_manifest_buckets - 1)];
+   while (*link && ((*link)->version.dev != dev || (*link)->version.ino != ino)) link = &(*link)->next;
+   return link;
+}
+
+static void grow_manifests(DedupShard *shard) {
+   size_t old_size = shard->num_manifest_buckets;
+   DedupManifest **old = shard->manifests;
+   shard->num_manifest_buckets = old_size * 2;
+   shard->manifests = calloc(shard->num_manifest_buckets, sizeof(DedupManifest *));
+   if (shard->manifests == NULL) {
+      perror("Failed to grow the manifest table");
+      exit(1);
+   }
+   for (size_t b = 0; b < old_size; b++) {
+      while (old[b]) {
+         DedupManifest *manifest = old[b];
+         old[b] = manifest->next;
+         DedupManifest **head = &shard->manifests[file_hash(manifest->version.dev, manifest->version.ino) &
+                                                  (shard->num_manifest_buckets - 1)];
+         manifest->next = *head;
+         *head = manifest;
+      }
+   }
+   free(old);
+}
+
+// Makes manifest the one of its file, taking over the caller's reference.
+// One left over from an earlier file with the same inode is dropped.
+static void install_manifest(DedupStore *store, DedupManifest *manifest) {
+   DedupShard *shard = file_shard(store, manifest->version.dev, manifest->version.ino);
+   pthread_mutex_lock(&shard->lock);
+   DedupManifest **link = find_manifest(shard, manifest->version.dev, manifest->version.ino);
+   DedupManifest *old = *link;
+   if (old) *link = old->next;
+   else {
+      if (shard->manifest_count >= shard->num_manifest_buckets) {
+         grow_manifests(shard);
+         link = find_manifest(shard, manifest->version.dev, manifest->version.ino);
+      }
+      shard->manifest_count++;
+   }
+   manifest->next = *link;
+   *link = manifest;
+   pthread_mutex_unlock(&shard->lock);
+   if (old) {
+      char path[PATH_MAX];
+      manifest_path(store, &old->version, path, sizeof(path));
+      unlink(path);
+      dedup_manifest_release(store, old);
+   }
+}
+
+DedupManifest *dedup_store_lookup(DedupStore *store, const struct stat *st) {
+   FileVersion version;
+   file_version_from_stat(&version, st);
+   DedupShard *shard = file_shard(store, version.dev, version.ino);
+   pthread_mutex_lock(&shard->lock);
+   DedupManifest *manifest = *find_manifest(shard, version.dev, version.ino);
+   if (manifest && file_version_equal(&manifest->version, &version)) {
+      __atomic_add_fetch(&manifest->refcount, 1, __ATOMIC_RELAXED);
+   }
+   else {
+      errno = manifest ? ESTALE : 0;
+      manifest = NULL;
+   }
+   pthread_mutex_unlock(&shard->lock);
+   return manifest;
+}
+
+void dedup_store_remove(DedupStore *store, const struct stat *st) {
+   FileVersion version;
+   file_version_from_stat(&version, st);
+   DedupShard *shard = file_shard(store, version.dev, version.ino);
+   pthread_mutex_lock(&shard->lock);
+   DedupManifest **link = find_manifest(shard, version.dev, version.ino);
+   DedupManifest *manifest = *link;
+   if (manifest) {
+      *link = manifest->next;
+      shard->manifest_count--;
+   }
+   pthread_mutex_unlock(&shard->lock);
+   if (manifest == NULL) return;
+   char path[PATH_MAX];
+   manifest_path(store, &manifest->version, path, sizeof(path));
+   unlink(path);
+   dedup_manifest_release(store, manifest);
+}
+
+uint32_t dedup_manifest_find(const DedupManifest *manifest, uint64_t offset) {
+   uint32_t low = 0, high = manifest->count ? manifest->count - 1 : 0;
+   while (low < high) {
+      uint32_t mid = low + (high - low + 1) / 2;
+      if (manifest->chunks[mid].offset <= offset) low = mid;
+      else high = mid - 1;
+   }
+   return low;
+}
+
+// Chunks are cached under their content: a device number no file has, and
+// the hash in place of the inode and mtime
+static void chunk_cache_key(const DedupChunk *chunk, FileVersion *key) {
+   uint64_t h1, h2;
+   memcpy(&h1, chunk->hash, sizeof(h1));
+   memcpy(&h2, chunk->hash + 8, sizeof(h2));
+   key->dev = (dev_t)-1;
+   key->ino = (ino_t)h1;
+   key->mtime_ns = (int64_t)h2;
+   key->size = (off_t)chunk->len | (off_t)chunk->probe << 32;
+}
+
+CachedBlock *dedup_chunk_get(DedupStore *store, BlockCache *cache, const DedupChunk *chunk, int keep) {
+   FileVersion key;
+   chunk_cache_key(chunk, &key);
+   CachedBlock *block = block_cache_get(cache, &key, 0);
+   if (block) return block;
+   block = block_cache_alloc(cache, chunk->len);
+   if (block == NULL) return NULL;
+   int fd = dedup_chunk_open(store, chunk);
+   int rc = fd >= 0 ? read_fully(fd, block->data, chunk->len, 0) : -1;
+   if (fd >= 0) close(fd);
+   if (rc == 0 && crc32c(0, block->data, chunk->len) != chunk->crc) {
+      __atomic_add_fetch(&store->stats.mismatches, 1, __ATOMIC_RELAXED);
+      errno = EBADMSG;
+      rc = -1;
+   }
+   if (rc < 0) {
+      int error = errno;
+      block_cache_release(block);
+      errno = error;
+      return NULL;
+   }
+   block->crc = chunk->crc;
+   block->has_crc = 1;
+   if (keep) block_cache_insert(cache, &key, 0, block);
+   return block;
+}
+
+void dedup_writer_init(DedupWriter *writer, DedupStore *store) {
+   memset(writer, 0, sizeof(*writer));
+   writer->store = store;
+   writer->window = malloc(store->max_chunk * WINDOW_CHUNKS);
+   if (writer->window == NULL) {
+      perror("Failed to allocate a chunking window");
+      exit(1);
+   }
+}
+
+static int writer_add(DedupWriter *writer, const uint8_t *data, size_t len) {
+   if (writer->count == writer->capacity) {
+      writer->capacity = writer->capacity ? writer->capacity * 2 : 64;
+      writer->chunks = realloc(writer->chunks, writer->capacity * sizeof(DedupChunk));
+      if (writer->chunks == NULL) {
+         perror("Failed to allocate a manifest");
+         exit(1);
+      }
+   }
+   DedupChunk *chunk = &writer->chunks[writer->count];
+   if (store_chunk(writer->store, data, len, chunk) < 0) return -1;
+   chunk->offset = writer->size;
+   writer->count++;
+   writer->size += len;
+   return 0;
+}
+
+// Cuts chunks while a whole maximum-sized one is buffered, or everything
+// left once the file is complete
+static int writer_cut(DedupWriter *writer, int final) {
+   size_t max_chunk = writer->store->max_chunk;
+   while (writer->end - writer->start >= max_chunk || (final && writer->end > writer->start)) {
+      const uint8_t *data = writer->window + writer->start;
+      size_t len = cut_point(writer->store, data, writer->end - writer->start);
+      if (writer_add(writer, data, len) < 0) return -1;
+      writer->start += len;
+   }
+   return 0;
+}
+
+int dedup_writer_update(DedupWriter *writer, const uint8_t *data, size_t len) {
+   size_t window_size = writer->store->max_chunk * WINDOW_CHUNKS;
+   while (len > 0) {
+      if (writer->end == window_size) {
+         memmove(writer->window, writer->window + writer->start, writer->end - writer->start);
+         writer->end -= writer->start;
+         writer->start = 0;
+      }
+      size_t n = window_size - writer->end < len ? window_size - writer->end : len;
+      memcpy(writer->window + writer->end, data, n);
+      writer->end += n;
+      data += n;
+      len -= n;
+      if (writer_cut(writer, 0) < 0) return -1;
+   }
+   return 0;
+}
+
+static void writer_free(DedupWriter *writer) {
+   free(writer->window);
+   free(writer->chunks);
+   writer->window = NULL;
+   writer->chunks = NULL;
+}
+
+void dedup_writer_abort(DedupWriter *writer) {
+   for (uint32_t i = 0; i < writer->count; i++) release_chunk(writer->store, &writer->chunks[i]);
+   writer_free(writer);
+}
+
+static void sync_dir(const char *dir) {
+   int fd = open(dir, O_RDONLY | O_DIRECTORY);
+   if (fd >= 0) {
+      fsync(fd);
+      close(fd);
+   }
+}
+
+static int save_manifest(DedupStore *store, const DedupManifest *manifest, int sync) {
+   char path[PATH_MAX], temp_path[PATH_MAX + 8];
+   manifest_path(store, &manifest->version, path, sizeof(path));
+   snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path);
+   int fd = mkstemp(temp_path);
+   if (fd < 0) return -1;
+   ManifestHeader header = { MANIFEST_MAGIC, manifest->count, manifest->version.mtime_ns,
+                             manifest->version.size, strlen(manifest->path), 0 };
+   int ok = write_all(fd, &header, sizeof(header)) == 0 &&
+            write_all(fd, manifest->path, header.path_len) == 0 &&
+            write_all(fd, manifest->chunks, manifest->count * sizeof(DedupChunk)) == 0 &&
+            (!sync || fdatasync(fd) == 0);
+   int error = errno;
+   if (close(fd) < 0 && ok) {
+      ok = 0;
+      error = errno;
+   }
+   if (!ok || rename(temp_path, path) < 0) {
+      if (ok) error = errno;
+      unlink(temp_path);
+      errno = error;
+      return -1;
+   }
+   if (sync) {
+      char dir[PATH_MAX];
+      snprintf(dir, sizeof(dir), "%s/manifests", store->dir);
+      sync_dir(dir);
+   }
+   return 0;
+}
+
+int dedup_writer_commit(DedupWriter *writer, const char *path, const struct stat *st, int sync) {
+   DedupStore *store = writer->store;
+   if (writer_cut(writer, 1) < 0) {
+      dedup_writer_abort(writer);
+      return -1;
+   }
+   if (writer->size != (uint64_t)st->st_size) {
+      dedup_writer_abort(writer);
+      errno = EINVAL;   // Not the file this data went into
+      return -1;
+   }
+   // The chunks must be on disk before any manifest that uses them
+   if (sync && syncfs(store->dir_fd) < 0) {
+      int error = errno;
+      dedup_writer_abort(writer);
+      errno = error;
+      return -1;
+   }
+
+   DedupManifest *manifest = malloc(sizeof(DedupManifest));
+   char *path_copy = strdup(path);
+   if (manifest == NULL || path_copy == NULL) {
+      perror("Failed to allocate a manifest");
+      exit(1);
+   }
+   manifest->refcount = 1;
+   file_version_from_stat(&manifest->version, st);
+   manifest->path = path_copy;
+   manifest->count = writer->count;
+   manifest->chunks = writer->chunks;   // With their references
+   writer->chunks = NULL;
+   writer->count = 0;
+   writer_free(writer);
+   if (save_manifest(store, manifest, sync) < 0) {
+      int error = errno;
+      dedup_manifest_release(store, manifest);
+      errno = error;
+      return -1;
+   }
+   install_manifest(store, manifest);
+   return 0;
+}
+
+// Reads a manifest found at startup. Returns NULL if it is damaged.
+static DedupManifest *load_manifest(const char *file, dev_t dev, ino_t ino) {
+   int fd = open(file, O_RDONLY);
+   if (fd < 0) return NULL;
+   ManifestHeader header;
+   DedupManifest *manifest = calloc(1, sizeof(DedupManifest));
+   int ok = manifest && read_fully(fd, (uint8_t *)&header, sizeof(header), 0) == 0 &&
+            header.magic == MANIFEST_MAGIC && header.path_len < PATH_MAX && header.count <= header.size;
+   if (ok) {
+      manifest->path = calloc(1, header.path_len + 1);
+      manifest->chunks = malloc((size_t)header.count * sizeof(DedupChunk) + 1);
+      ok = manifest->path && manifest->chunks &&
+           read_fully(fd, (uint8_t *)manifest->path, header.path_len, sizeof(header)) == 0 &&
+           read_fully(fd, (uint8_t *)manifest->chunks, (size_t)header.count * sizeof(DedupChunk),
+                      sizeof(header) + header.path_len) == 0;
+   }
+   close(fd);
+   uint64_t size = 0;
+   for (uint32_t i = 0; ok && i < header.count; i++) {
+      ok = manifest->chunks[i].offset == size;
+      size += manifest->chunks[i].len;
+   }
+   if (!ok || size != header.size) {
+      if (manifest) manifest_free(manifest);
+      return NULL;
+   }
+   manifest->refcount = 1;
+   manifest->count = header.count;
+   manifest->version = (FileVersion){ dev, ino, header.mtime_ns, header.size };
+   return manifest;
+}
+
+// Installs the manifest of every file still there, counting the references
+// to each chunk. Leftover temporary files and manifests of files deleted
+// meanwhile are deleted. A manifest whose path names its inode with another
+// version is kept, as that placeholder's content is only in the chunks, and
+// so is one whose path names another file now: its file may have been moved.
+static void load_manifests(DedupStore *store) {
+   char dir_path[PATH_MAX];
+   snprintf(dir_path, sizeof(dir_path), "%s/manifests", store->dir);
+   DIR *dir = opendir(dir_path);
+   if (dir == NULL) return;
+   struct dirent *ent;
+   while ((ent = readdir(dir)) != NULL) {
+      if (ent->d_name[0] == '.') continue;
+      char file[PATH_MAX + 256];
+      snprintf(file, sizeof(file), "%s/%s", dir_path, ent->d_name);
+      unsigned long long dev, ino, mtime_ns;
+      int consumed = 0;
+      if (sscanf(ent->d_name, "%llx-%llx-%llx%n", &dev, &ino, &mtime_ns, &consumed) != 3 ||
+          ent->d_name[consumed] != '\0') {
+         unlink(file);   // Cut short by a crash while being saved
+         continue;
+      }
+      DedupManifest *manifest = load_manifest(file, dev, ino);
+      struct stat st;
+      int exists = manifest && stat(manifest->path, &st) == 0;
+      if (manifest && !exists && (errno == ENOENT || errno == ENOTDIR)) {
+         manifest_free(manifest);
+         manifest = NULL;
+      }
+      else if (exists && st.st_dev == (dev_t)dev && st.st_ino == (ino_t)ino) {
+         FileVersion current;
+         file_version_from_stat(&current, &st);
+         if (!file_version_equal(&current, &manifest->version)) {
+            printf("%s was changed outside the server; it cannot be read until rewritten\n",
+                   manifest->path);
+         }
+      }
+      if (manifest == NULL) {
+         printf("Dropping stale or damaged manifest %s\n", file);
+         unlink(file);
+         continue;
+      }
+      for (uint32_t i = 0; i < manifest->count; i++) {
+         DedupChunk *chunk = &manifest->chunks[i];
+         DedupShard *shard = chunk_shard(store, chunk->hash);
+         DedupEntry *entry = find_entry(shard, chunk->hash, chunk->probe);
+         if (entry == NULL) entry = add_entry(shard, chunk->hash, chunk->probe, chunk->len, CHUNK_UNSEEN);
+         entry->refs++;
+      }
+      install_manifest(store, manifest);
+   }
+   closedir(dir);
+}
+
+// Deletes the chunks no manifest uses, and reports any used chunk missing
+static void collect_chunks(DedupStore *store) {
+   for (int d = 0; d < 256; d++) {
+      char dir_path[PATH_MAX];
+      snprintf(dir_path, sizeof(dir_path), "%s/chunks/%02x", store->dir, d);
+      DIR *dir = opendir(dir_path);
+      if (dir == NULL) continue;
+      struct dirent *ent;
+      while ((ent = readdir(dir)) != NULL) {
+         if (ent->d_name[0] == '.') continue;
+         uint8_t hash[16];
+         unsigned int probe = 0;
+         int valid = strlen(ent->d_name) >= 32 && (ent->d_name[32] == '\0' ||
+                     (ent->d_name[32] == '-' && sscanf(ent->d_name + 33, "%u", &probe) == 1));
+         for (int i = 0; valid && i < 16; i++) {
+            unsigned int byte;
+            valid = sscanf(ent->d_name + i * 2, "%2x", &byte) == 1;
+            hash[i] = byte;
+         }
+         DedupEntry *entry = valid ? find_entry(chunk_shard(store, hash), hash, probe) : NULL;
+         if (entry) {
+            entry->state = CHUNK_STORED;
+            continue;
+         }
+         char file[PATH_MAX + 256];
+         snprintf(file, sizeof(file), "%s/%s", dir_path, ent->d_name);
+         unlink(file);
+      }
+      closedir(dir);
+   }
+   for (int s = 0; s < DEDUP_SHARDS; s++) {
+      DedupShard *shard = &store->shards[s];
+      for (size_t b = 0; b < shard->num_buckets; b++) {
+         for (DedupEntry *entry = shard->buckets[b]; entry; entry = entry->next) {
+            if (entry->state != CHUNK_UNSEEN) continue;
+            char path[PATH_MAX];
+            chunk_path(store, entry->hash, entry->probe, path, sizeof(path));
+            fprintf(stderr, "Chunk %s is missing; files using it cannot be read\n", path);
+            entry->state = CHUNK_STORED;
+         }
+      }
+   }
+}
+
+static int make_dir(const char *path) {
+   struct stat st;
+   if (stat(path, &st) == 0) {
+      if (S_ISDIR(st.st_mode)) return 0;
+      errno = ENOTDIR;
+      return -1;
+   }
+   return errno == ENOENT ? mkdir(path, 0755) : -1;
+}
+
+int dedup_store_init(DedupStore *store, const char *dir, Chunking chunking, size_t max_chunk) {
+   memset(store, 0, sizeof(*store));
+   snprintf(store->dir, sizeof(store->dir), "%s", dir);
+   char path[PATH_MAX];
+   if (make_dir(dir) < 0) return -1;
+   snprintf(path, sizeof(path), "%s/manifests", dir);
+   if (make_dir(path) < 0) return -1;
+   snprintf(path, sizeof(path), "%s/chunks", dir);
+   if (make_dir(path) < 0) return -1;
+   for (int d = 0; d < 256; d++) {
+      snprintf(path, sizeof(path), "%s/chunks/%02x", dir, d);
+      if (make_dir(path) < 0) return -1;
+   }
+   store->dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+   if (store->dir_fd < 0) return -1;
+
+   // Chunks average half the maximum and are at least a quarter of it; the
+   // masks test bits toward the top of the gear hash, which depend on the
+   // most bytes
+   store->chunking = chunking;
+   store->max_chunk = max_chunk;
+   store->min_chunk = max_chunk / 4;
+   int bits = 0;
+   while ((size_t)1 << (bits + 1) <= max_chunk / 2) bits++;
+   store->mask_small = ~0ULL << (64 - (bits + 2));
+   store->mask_large = ~0ULL << (64 - (bits - 2));
+   uint64_t seed = GEAR_SEED;
+   for (int i = 0; i < 256; i++) {
+      // splitmix64
+      uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      gear[i] = z ^ (z >> 31);
+   }
+
+   for (int s = 0; s < DEDUP_SHARDS; s++) {
+      DedupShard *shard = &store->shards[s];
+      pthread_mutex_init(&shard->lock, NULL);
+      pthread_cond_init(&shard->written, NULL);
+      shard->num_buckets = shard->num_manifest_buckets = INITIAL_BUCKETS;
+      shard->buckets = calloc(shard->num_buckets, sizeof(DedupEntry *));
+      shard->manifests = calloc(shard->num_manifest_buckets, sizeof(DedupManifest *));
+      if (shard->buckets == NULL || shard->manifests == NULL) {
+         perror("Failed to allocate the chunk index");
+         exit(1);
+      }
+   }
+   load_manifests(store);
+   collect_chunks(store);
+   return 0;
+}
+
+void dedup_store_stats(DedupStore *store, DedupStats *stats) {
+   stats->chunks_written = __atomic_load_n(&store->stats.chunks_written, __ATOMIC_RELAXED);
+   stats->chunks_deduplicated = __atomic_load_n(&store->stats.chunks_deduplicated, __ATOMIC_RELAXED);
+   stats->bytes_written = __atomic_load_n(&store->stats.bytes_written, __ATOMIC_RELAXED);
+   stats->bytes_deduplicated = __atomic_load_n(&store->stats.bytes_deduplicated, __ATOMIC_RELAXED);
+   stats->collisions = __atomic_load_n(&store->stats.collisions, __ATOMIC_RELAXED);
+   stats->mismatches = __atomic_load_n(&store->stats.mismatches, __ATOMIC_RELAXED);
+   stats->unique_chunks = stats->manifests = 0;
+   for (int s = 0; s < DEDUP_SHARDS; s++) {
+      DedupShard *shard = &store->shards[s];
+      pthread_mutex_lock(&shard->lock);
+      stats->unique_chunks += shard->count;
+      stats->manifests += shard->manifest_count;
+      pthread_mutex_unlock(&shard->lock);
+   }
+}
@@ -0,0 +1,149 @@
+#ifndef _DEDUP_STORE_H_
+#define _DEDUP_STORE_H_
+
+#include "headers.h"
+#include "block_cache.h"
+#include <stdint.h>
+
+// Optional content-addressed chunk store for the storage server.
+//
+// Files written through the server are cut into chunks, either of a fixed
+// size or at content-defined boundaries (FastCDC's gear hash, so an insertion
+// only changes the chunks around it). Each distinct chunk is kept once, as
+// <dir>/chunks/<xx>/<hash> named by its 128-bit MurmurHash3, and a chunk
+// that is already stored is not written again. Before a write is skipped the
+// stored chunk is compared byte for byte, so a hash collision, accidental or
+// crafted, costs a second copy and never another file's data.
+//
+// The file itself becomes a sparse placeholder of its full size, so stat and
+// INFO still report it correctly. Its manifest, the list of its chunks with
+// their CRC32C, lives in <dir>/manifests/<dev>-<ino>-<mtime> and is stamped
+// with the version (size and mtime) of the placeholder. Having a manifest,
+// found by inode alone, is what marks a file as a placeholder: one whose
+// version stops matching, because it was touched or changed behind the
+// server's back, fails to read rather than serve the placeholder's zeros,
+// and its chunks are kept until it is rewritten or deleted through the
+// server. Files under the store must therefore only be changed through the
+// server.
+//
+// All manifests are held in memory, and chunk reference counts are rebuilt
+// from them at startup, when chunks no manifest uses are deleted. A chunk
+// goes as soon as the last manifest using it is dropped and no reader holds
+// that manifest any more. Chunks are at most one cache block, and are cached
+// by content rather than by file, so every file sharing a chunk shares its
+// cached copy.
+
+typedef enum {
+   CHUNKING_CDC = 0,
+   CHUNKING_FIXED
+} Chunking;
+
+#define DEDUP_SHARDS 16
+#define DEDUP_MIN_FILE_SIZE 4096   // Smaller files are stored as they are
+
+typedef struct {
+   uint8_t hash[16];
+   uint32_t probe;              // Tells apart chunks whose hashes collide
+   uint32_t len;
+   uint32_t crc;                // CRC32C of the chunk
+   uint64_t offset;             // In the file
+} DedupChunk;
+
+typedef struct DedupManifest {
+   int refcount;                // The store's, while installed, and readers'
+   FileVersion version;
+   char *path;                  // Where the file was written
+   uint32_t count;
+   DedupChunk *chunks;
+   struct DedupManifest *next;  // Hash chain
+} DedupManifest;
+
+typedef struct DedupEntry {
+   uint8_t hash[16];
+   uint32_t probe;
+   uint32_t len;
+   unsigned long refs;          // Chunk references from manifests and writers
+   int state;                   // Stored, being written, or not yet seen on disk at startup
+   struct DedupEntry *next;
+} DedupEntry;
+
+typedef struct {
+   pthread_mutex_t lock;
+   pthread_cond_t written;      // A chunk being written was stored or failed
+   DedupEntry **buckets;
+   size_t num_buckets;          // Power of two
+   size_t count;
+   DedupManifest **manifests;   // By (dev, ino)
+   size_t num_manifest_buckets;
+   size_t manifest_count;
+} DedupShard;
+
+typedef struct {
+   unsigned long chunks_written;
+   unsigned long chunks_deduplicated;
+   unsigned long long bytes_written;
+   unsigned long long bytes_deduplicated;
+   unsigned long collisions;    // Equal hashes, different data
+   unsigned long mismatches;    // Chunks read back that failed their CRC32C
+   size_t unique_chunks;
+   size_t manifests;
+} DedupStats;
+
+typedef struct {
+   char dir[256];
+   int dir_fd;                  // Lets a batch sync the store's file system
+   Chunking chunking;
+   size_t max_chunk;            // One cache block
+   size_t min_chunk;
+   uint64_t mask_small;         // Cut-point masks below and above the
+   uint64_t mask_large;         // average chunk size
+   DedupShard shards[DEDUP_SHARDS];
+   DedupStats stats;            // Counters updated atomically; sizes unused
+} DedupStore;
+
+// Chunks a file being written and stores its chunks as they are cut
+typedef struct {
+   DedupStore *store;
+   uint8_t *window;             // Data not yet cut into chunks
+   size_t start, end;
+   DedupChunk *chunks;
+   uint32_t count;
+   uint32_t capacity;
+   uint64_t size;
+} DedupWriter;
+
+// Opens or creates a store in dir and collects its garbage. Returns -1 if
+// dir cannot be used.
+int dedup_store_init(DedupStore *store, const char *dir, Chunking chunking, size_t max_chunk);
+
+void dedup_writer_init(DedupWriter *writer, DedupStore *store);
+// Returns -1 with errno set if a chunk could not be stored
+int dedup_writer_update(DedupWriter *writer, const uint8_t *data, size_t len);
+// Stores the last chunks and records them as the contents of path, whose
+// placeholder is version st. With sync the chunks and the manifest are
+// durable on return. Frees the writer either way; returns 0 or -1.
+int dedup_writer_commit(DedupWriter *writer, const char *path, const struct stat *st, int sync);
+// Gives up on the file, dropping the references to its chunks
+void dedup_writer_abort(DedupWriter *writer);
+
+// The manifest of version st, referenced. NULL with errno 0 if the file is
+// stored as is, or with errno ESTALE if it is a placeholder whose manifest
+// is of another version, so it has no content to serve.
+DedupManifest *dedup_store_lookup(DedupStore *store, const struct stat *st);
+void dedup_manifest_release(DedupStore *store, DedupManifest *manifest);
+// Index of the chunk holding offset, which must lie within the file
+uint32_t dedup_manifest_find(const DedupManifest *manifest, uint64_t offset);
+// Forgets the manifest of a file being replaced or deleted, if it has one,
+// whatever its version
+void dedup_store_remove(DedupStore *store, const struct stat *st);
+
+// The data of chunk, from cache or read from the store and checked against
+// its CRC32C, as a referenced block. It is added to the cache if keep is
+// set. Returns NULL on failure, with errno EBADMSG if the check failed.
+CachedBlock *dedup_chunk_get(DedupStore *store, BlockCache *cache, const DedupChunk *chunk, int keep);
+// Opens chunk for reading, e.g. to sendfile it
+int dedup_chunk_open(DedupStore *store, const DedupChunk *chunk);
+
+void dedup_store_stats(DedupStore *store, DedupStats *stats);
+
+#endif
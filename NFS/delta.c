@@ -0,0 +1,277 @@
+#include "delta.h"
+#include "murmur3.h"
+
+static void put_u32(uint8_t *out, uint32_t v) {
+   for (int i = 0; i < 4; i++) out[i] = v >> (24 - 8 * i);
+}
+
+static void put_u64(uint8_t *out, uint64_t v) {
+   for (int i = 0; i < 8; i++) out[i] = v >> (56 - 8 * i);
+}
+
+static uint32_t get_u32(const uint8_t *in) {
+   uint32_t v = 0;
+   for (int i = 0; i < 4; i++) v = v << 8 | in[i];
+   return v;
+}
+
+static uint64_t get_u64(const uint8_t *in) {
+   uint64_t v = 0;
+   for (int i = 0; i < 8; i++) v = v << 8 | in[i];
+   return v;
+}
+
+size_t delta_block_size(uint64_t size) {
+   size_t block = DELTA_MIN_BLOCK;
+   while (block < DELTA_MAX_BLOCK && (uint64_t)block * block < size) block <<= 1;
+   return block;
+}
+
+uint32_t delta_weak(const uint8_t *data, size_t len) {
+   uint32_t s1 = 0, s2 = 0;
+   for (size_t i = 0; i < len; i++) {
+      s1 += data[i];
+      s2 += s1;
+   }
+   return (s1 & 0xffff) | (s2 & 0xffff) << 16;
+}
+
+void delta_signature(BlockSignature *sig, const uint8_t *data, size_t len, uint32_t seed) {
+   sig->weak = delta_weak(data, len);
+   murmur3_128(data, len, seed, sig->strong);
+}
+
+void block_signature_encode(const BlockSignature *sig, uint8_t out[DELTA_SIGNATURE_SIZE]) {
+   put_u32(out, sig->weak);
+   memcpy(out + 4, sig->strong, sizeof(sig->strong));
+}
+
+void block_signature_decode(BlockSignature *sig, const uint8_t in[DELTA_SIGNATURE_SIZE]) {
+   sig->weak = get_u32(in);
+   memcpy(sig->strong, in + 4, sizeof(sig->strong));
+}
+
+// The weak checksum's halves are sums, so they are mixed before use
+static inline size_t chain_of(const SignatureIndex *index, uint32_t weak) {
+   return (weak * 0x9e3779b1u) >> index->shift;
+}
+
+static inline int may_contain(const SignatureIndex *index, uint32_t weak) {
+   uint32_t bit = (weak * 0x9e3779b1u) >> index->filter_shift;
+   return (index->filter[bit / 64] >> (bit % 64)) & 1;
+}
+
+int signature_index_init(SignatureIndex *index, const BlockSignature *sigs, uint64_t count,
+                         size_t block_size, uint64_t base_size, uint32_t seed) {
+   index->sigs = sigs;
+   index->count = count;
+   index->block_size = block_size;
+   index->last_len = count ? base_size - (count - 1) * block_size : 0;
+   index->seed = seed;
+   int bits = 4;
+   while (bits < 31 && ((uint64_t)1 << bits) < 2 * count) bits++;
+   index->shift = 32 - bits;
+   int filter_bits = bits + 3 > 32 ? 32 : bits + 3;
+   index->filter_shift = 32 - filter_bits;
+   index->heads = malloc(((size_t)1 << bits) * sizeof(int64_t));
+   index->next = malloc((count ? count : 1) * sizeof(int64_t));
+   index->filter = calloc(((size_t)1 << filter_bits) / 64 + 1, sizeof(uint64_t));
+   if (index->heads == NULL || index->next == NULL || index->filter == NULL) {
+      signature_index_free(index);
+      return -1;
+   }
+   memset(index->heads, 0xff, ((size_t)1 << bits) * sizeof(int64_t));
+   // Built backwards so each chain lists earlier blocks first
+   for (uint64_t i = count; i-- > 0; ) {
+      size_t chain = chain_of(index, sigs[i].weak);
+      index->next[i] = index->heads[chain];
+      index->heads[chain] = i;
+      uint32_t bit = (sigs[i].weak * 0x9e3779b1u) >> index->filter_shift;
+      index->filter[bit / 64] |= (uint64_t)1 << (bit % 64);
+   }
+   return 0;
+}
+
+void signature_index_free(SignatureIndex *index) {
+   free(index->heads);
+   free(index->next);
+   free(index->filter);
+   index->heads = index->next = NULL;
+   index->filter = NULL;
+}
+
+static inline size_t block_len(const SignatureIndex *index, uint64_t block) {
+   return block + 1 == index->count ? index->last_len : index->block_size;
+}
+
+// A base block of len bytes equal to data, whose weak checksum is weak, or
+// -1. The block after the last one matched is tried first, so runs of equal
+// blocks are copied as runs.
+static int64_t find_block(const SignatureIndex *index, uint32_t weak, const uint8_t *data, size_t len,
+                          uint64_t hint) {
+   uint8_t strong[16];
+   int hashed = 0;
+   if (hint < index->count && index->sigs[hint].weak == weak && block_len(index, hint) == len) {
+      murmur3_128(data, len, index->seed, strong);
+      hashed = 1;
+      if (memcmp(strong, index->sigs[hint].strong, sizeof(strong)) == 0) return hint;
+   }
+   for (int64_t i = index->heads[chain_of(index, weak)]; i >= 0; i = index->next[i]) {
+      if (index->sigs[i].weak != weak || block_len(index, i) != len) continue;
+      if (!hashed) {
+         murmur3_128(data, len, index->seed, strong);
+         hashed = 1;
+      }
+      if (memcmp(strong, index->sigs[i].strong, sizeof(strong)) == 0) return i;
+   }
+   return -1;
+}
+
+// Appends op, or marks the plan failed if there is no room for it
+static void add_op(DeltaPlan *plan, DeltaOp op) {
+   if (plan->failed) return;
+   if (plan->count == plan->capacity) {
+      size_t capacity = plan->capacity ? plan->capacity * 2 : 64;
+      DeltaOp *ops = realloc(plan->ops, capacity * sizeof(DeltaOp));
+      if (ops == NULL) {
+         plan->failed = 1;
+         return;
+      }
+      plan->ops = ops;
+      plan->capacity = capacity;
+   }
+   plan->ops[plan->count++] = op;
+}
+
+static void add_literal(DeltaPlan *plan, uint64_t offset, uint64_t len) {
+   while (len > 0) {
+      uint64_t n = len < DELTA_MAX_LITERAL ? len : DELTA_MAX_LITERAL;
+      add_op(plan, (DeltaOp){ 0, offset, n });
+      plan->encoded_size += DELTA_LITERAL_HEADER + n;
+      plan->literal_bytes += n;
+      offset += n;
+      len -= n;
+   }
+}
+
+static void add_copy(DeltaPlan *plan, uint64_t block) {
+   DeltaOp *last = plan->count ? &plan->ops[plan->count - 1] : NULL;
+   if (last && last->copy && last->start + last->len == block && last->len < UINT32_MAX) {
+      last->len++;
+   }
+   else {
+      add_op(plan, (DeltaOp){ 1, block, 1 });
+      plan->encoded_size += DELTA_COPY_SIZE;
+   }
+   plan->copied_blocks++;
+}
+
+int delta_plan_build(DeltaPlan *plan, const SignatureIndex *index, const uint8_t *data, uint64_t size) {
+   memset(plan, 0, sizeof(*plan));
+   size_t block_size = index->block_size;
+   uint64_t pos = 0, literal_start = 0;
+   uint64_t hint = 0;
+   if (index->count > 0 && size >= block_size) {
+      // The two sums roll separately and are only masked and joined for the
+      // lookup, which keeps the chain from one byte to the next short
+      uint32_t weak = delta_weak(data, block_size);
+      uint32_t s1 = weak & 0xffff, s2 = weak >> 16;
+      while (1) {
+         weak = (s1 & 0xffff) | s2 << 16;
+         int64_t block = may_contain(index, weak) ? find_block(index, weak, data + pos, block_size, hint) : -1;
+         if (block >= 0) {
+            add_literal(plan, literal_start, pos - literal_start);
+            add_copy(plan, block);
+            hint = block + 1;
+            pos += block_size;
+            literal_start = pos;
+            if (size - pos < block_size) break;
+            weak = delta_weak(data + pos, block_size);
+            s1 = weak & 0xffff;
+            s2 = weak >> 16;
+            continue;
+         }
+         if (size - pos == block_size) break;
+         uint32_t out = data[pos], in = data[pos + block_size];
+         s1 += in - out;
+         s2 += s1 - (uint32_t)block_size * out;
+         pos++;
+      }
+   }
+   // A short last block of the base can only match the end of the file
+   size_t tail = index->last_len;
+   if (index->count > 0 && tail < block_size && size - literal_start >= tail) {
+      const uint8_t *end = data + size - tail;
+      if (find_block(index, delta_weak(end, tail), end, tail, index->count - 1) >= 0) {
+         add_literal(plan, literal_start, size - tail - literal_start);
+         add_copy(plan, index->count - 1);
+         literal_start = size;
+      }
+   }
+   add_literal(plan, literal_start, size - literal_start);
+   if (plan->failed) delta_plan_free(plan);
+   return plan->failed ? -1 : 0;
+}
+
+void delta_plan_free(DeltaPlan *plan) {
+   free(plan->ops);
+   plan->ops = NULL;
+   plan->count = plan->capacity = 0;
+}
+
+size_t delta_op_encode(const DeltaOp *op, uint8_t out[DELTA_COPY_SIZE]) {
+   if (op->copy) {
+      out[0] = DELTA_COPY;
+      put_u64(out + 1, op->start);
+      put_u32(out + 9, op->len);
+      return DELTA_COPY_SIZE;
+   }
+   out[0] = DELTA_LITERAL;
+   put_u32(out + 1, op->len);
+   return DELTA_LITERAL_HEADER;
+}
+
+void delta_decoder_init(DeltaDecoder *dec, int (*copy)(void *, uint64_t, uint32_t),
+                        int (*literal)(void *, const uint8_t *, size_t), void *ctx) {
+   memset(dec, 0, sizeof(*dec));
+   dec->copy = copy;
+   dec->literal = literal;
+   dec->ctx = ctx;
+}
+
+int delta_decoder_feed(DeltaDecoder *dec, const uint8_t *data, size_t len) {
+   while (len > 0) {
+      if (dec->literal_left > 0) {
+         size_t n = dec->literal_left < len ? dec->literal_left : len;
+         int error = dec->literal(dec->ctx, data, n);
+         if (error) return error;
+         dec->literal_left -= n;
+         data += n;
+         len -= n;
+         continue;
+      }
+      // Instruction headers may be split across pieces
+      uint8_t tag = dec->header_len ? dec->header[0] : data[0];
+      size_t need = tag == DELTA_COPY ? DELTA_COPY_SIZE : tag == DELTA_LITERAL ? DELTA_LITERAL_HEADER : 0;
+      if (need == 0) return EINVAL;
+      size_t n = need - dec->header_len < len ? need - dec->header_len : len;
+      memcpy(dec->header + dec->header_len, data, n);
+      dec->header_len += n;
+      data += n;
+      len -= n;
+      if (dec->header_len < need) break;
+      dec->header_len = 0;
+      if (tag == DELTA_COPY) {
+         int error = dec->copy(dec->ctx, get_u64(dec->header + 1), get_u32(dec->header + 9));
+         if (error) return error;
+      }
+      else {
+         dec->literal_left = get_u32(dec->header + 1);
+      }
+   }
+   return 0;
+}
+
+int delta_decoder_complete(const DeltaDecoder *dec) {
+   return dec->header_len == 0 && dec->literal_left == 0;
+}
@@ -0,0 +1,113 @@
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include "headers.h"
+#include <stdint.h>
+
+// rsync-style delta encoding of a file against an older version of it (the
+// base) held by the other end.
+//
+// The holder of the base sends a signature per block of block_size bytes: a
+// weak checksum that can be rolled along one byte at a time and a strong
+// 128-bit hash, seeded by the sender so blocks cannot be crafted to collide
+// ahead of time. The sender of the new version slides a window over it,
+// looks the window's weak checksum up among the signatures, confirms a hit
+// with the strong hash, and describes the file as runs of base blocks and
+// literal bytes. The receiver checks what it rebuilds against the CRC32C of
+// the whole new file, so a block that matched by hash but differs is caught
+// and the file can be sent whole instead.
+//
+// A delta is a sequence of instructions, integers big-endian:
+//
+//   DELTA_COPY     u8 tag, u64 first block, u32 count    blocks of the base
+//   DELTA_LITERAL  u8 tag, u32 len, then len bytes        new data
+
+#define DELTA_COPY 'C'
+#define DELTA_LITERAL 'L'
+#define DELTA_COPY_SIZE 13
+#define DELTA_LITERAL_HEADER 5
+#define DELTA_MAX_LITERAL (1u << 30)   // Longer runs are split
+#define DELTA_MIN_BLOCK (2 << 10)
+#define DELTA_MAX_BLOCK (128 << 10)
+#define DELTA_SIGNATURE_SIZE 20       // Weak u32, then the strong hash
+
+typedef struct {
+   uint32_t weak;
+   uint8_t strong[16];
+} BlockSignature;
+
+// About the square root of size, so that the signatures and the data resent
+// around each change grow alike
+size_t delta_block_size(uint64_t size);
+
+// The weak checksum of len bytes: the sums of the bytes and of their running
+// sums, 16 bits each, as in rsync
+uint32_t delta_weak(const uint8_t *data, size_t len);
+void delta_signature(BlockSignature *sig, const uint8_t *data, size_t len, uint32_t seed);
+void block_signature_encode(const BlockSignature *sig, uint8_t out[DELTA_SIGNATURE_SIZE]);
+void block_signature_decode(BlockSignature *sig, const uint8_t in[DELTA_SIGNATURE_SIZE]);
+
+// The signatures of a base, indexed by weak checksum
+typedef struct {
+   const BlockSignature *sigs;
+   uint64_t count;
+   size_t block_size;
+   size_t last_len;             // Of the last block, which may be short
+   uint32_t seed;
+   int64_t *heads;              // Chains of blocks by weak checksum
+   int64_t *next;
+   int shift;                   // Turns a mixed weak checksum into a chain
+   uint64_t *filter;            // Bits of the weak checksums present, sparse
+   int filter_shift;            // enough that most misses stop there
+} SignatureIndex;
+
+// Returns -1 if the index could not be allocated
+int signature_index_init(SignatureIndex *index, const BlockSignature *sigs, uint64_t count,
+                         size_t block_size, uint64_t base_size, uint32_t seed);
+void signature_index_free(SignatureIndex *index);
+
+// One instruction of a delta being planned: start and len are a run of
+// blocks for a copy, and an offset and length in the new file for a literal
+typedef struct {
+   int copy;
+   uint64_t start;
+   uint64_t len;
+} DeltaOp;
+
+typedef struct {
+   DeltaOp *ops;
+   size_t count;
+   size_t capacity;
+   uint64_t encoded_size;       // Of the whole delta, literal bytes included
+   uint64_t literal_bytes;
+   uint64_t copied_blocks;
+   int failed;                  // Ran out of memory
+} DeltaPlan;
+
+// Describes the size bytes of data in terms of the base behind index.
+// Returns -1, leaving nothing to free, if the plan could not be allocated.
+int delta_plan_build(DeltaPlan *plan, const SignatureIndex *index, const uint8_t *data, uint64_t size);
+void delta_plan_free(DeltaPlan *plan);
+// Writes the instruction header of op, which for a literal precedes its
+// bytes, and returns its length
+size_t delta_op_encode(const DeltaOp *op, uint8_t out[DELTA_COPY_SIZE]);
+
+// Applies a delta as it arrives, in pieces of any size. The callbacks return
+// 0 or an errno, which stops decoding.
+typedef struct {
+   int (*copy)(void *ctx, uint64_t first_block, uint32_t count);
+   int (*literal)(void *ctx, const uint8_t *data, size_t len);
+   void *ctx;
+   uint8_t header[DELTA_COPY_SIZE];
+   size_t header_len;
+   uint64_t literal_left;
+} DeltaDecoder;
+
+void delta_decoder_init(DeltaDecoder *dec, int (*copy)(void *, uint64_t, uint32_t),
+                        int (*literal)(void *, const uint8_t *, size_t), void *ctx);
+// Returns 0, EINVAL for a malformed instruction, or a callback's error
+int delta_decoder_feed(DeltaDecoder *dec, const uint8_t *data, size_t len);
+// 1 if the delta so far ends on an instruction boundary
+int delta_decoder_complete(const DeltaDecoder *dec);
+
+#endif
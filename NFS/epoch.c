@@ -0,0 +1,87 @@
+#include "epoch.h"
+
+#define EPOCH_ACTIVE (1ULL << 63)
+
+typedef struct {
+   uint64_t state;             // 0 when idle, else EPOCH_ACTIVE | observed epoch
+   char pad[64 - sizeof(uint64_t)];
+} EpochSlot;
+
+typedef struct Retired {
+   void *ptr;
+   void (*free_fn)(void *);
+   uint64_t epoch;
+   struct Retired *next;
+} Retired;
+
+static EpochSlot slots[EPOCH_MAX_THREADS] __attribute__((aligned(64)));
+static int num_slots;
+static uint64_t global_epoch = 1;
+
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+static Retired *retired;
+
+static __thread int my_slot = -1;
+
+void epoch_enter(void) {
+   if (my_slot < 0) {
+      my_slot = __atomic_fetch_add(&num_slots, 1, __ATOMIC_RELAXED);
+      if (my_slot >= EPOCH_MAX_THREADS) {
+         fprintf(stderr, "Too many threads for epoch reclamation\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+   uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+   // Publishing our epoch must be ordered before any load of shared pointers
+   __atomic_store_n(&slots[my_slot].state, EPOCH_ACTIVE | epoch, __ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void) {
+   __atomic_store_n(&slots[my_slot].state, 0, __ATOMIC_RELEASE);
+}
+
+// The global epoch may move forward once every active reader has observed it
+static void try_advance(void) {
+   uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+   int n = __atomic_load_n(&num_slots, __ATOMIC_ACQUIRE);
+   if (n > EPOCH_MAX_THREADS) n = EPOCH_MAX_THREADS;
+   for (int i = 0; i < n; i++) {
+      uint64_t state = __atomic_load_n(&slots[i].state, __ATOMIC_SEQ_CST);
+      if ((state & EPOCH_ACTIVE) && (state & ~EPOCH_ACTIVE) != epoch) {
+         return;
+      }
+   }
+   __atomic_store_n(&global_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+}
+
+void epoch_retire(void *ptr, void (*free_fn)(void *)) {
+   Retired *item = malloc(sizeof(Retired));
+   if (item == NULL) {
+      perror("Retire allocation failed");
+      exit(EXIT_FAILURE);
+   }
+   item->ptr = ptr;
+   item->free_fn = free_fn;
+
+   pthread_mutex_lock(&retire_lock);
+   item->epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+   item->next = retired;
+   retired = item;
+
+   try_advance();
+
+   // Anything retired two epochs ago can no longer be seen by a reader
+   uint64_t safe = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+   Retired **link = &retired;
+   while (*link) {
+      Retired *cur = *link;
+      if (cur->epoch + 2 <= safe) {
+         *link = cur->next;
+         cur->free_fn(cur->ptr);
+         free(cur);
+      } else {
+         link = &cur->next;
+      }
+   }
+   pthread_mutex_unlock(&retire_lock);
+}
@@ -0,0 +1,21 @@
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+#include "headers.h"
+#include <stdint.h>
+
+// Epoch-based reclamation for lock-free readers.
+//
+// Readers bracket every traversal of a shared structure with epoch_enter() /
+// epoch_exit(); they never take a lock. Writers unlink nodes under their own
+// mutex and hand them to epoch_retire(), which frees them only once every
+// reader that could still hold a reference has left its critical section
+// (two global epoch advances later).
+
+#define EPOCH_MAX_THREADS 256
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+
+#endif
@@ -0,0 +1,144 @@
+#include "hash_ring.h"
+
+static inline uint64_t mix64(uint64_t x) {
+   x ^= x >> 33;
+   x *= 0xff51afd7ed558ccdULL;
+   x ^= x >> 33;
+   x *= 0xc4ceb9fe1a85ec53ULL;
+   x ^= x >> 33;
+   return x;
+}
+
+// FNV-1a with a murmur finalizer, so neighbouring keys and virtual node
+// labels scatter over the whole ring
+static uint64_t ring_hash(const char *key, size_t len) {
+   uint64_t h = 0xcbf29ce484222325ULL;
+   for (size_t i = 0; i < len; i++) {
+      h ^= (unsigned char)key[i];
+      h *= 0x100000001b3ULL;
+   }
+   return mix64(h);
+}
+
+int shard_address_compare(const ShardAddress *a, const ShardAddress *b) {
+   int rc = strcmp(a->ip, b->ip);
+   return rc ? rc : a->port - b->port;
+}
+
+static int compare_shards(const void *a, const void *b) {
+   return shard_address_compare(a, b);
+}
+
+static int compare_points(const void *a, const void *b) {
+   const RingPoint *x = a, *y = b;
+   if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+   return x->shard - y->shard;   // Ties resolve the same way everywhere
+}
+
+HashRing *hash_ring_create(const ShardAddress *shards, int n) {
+   HashRing *ring = calloc(1, sizeof(HashRing));
+   if (ring == NULL) return NULL;
+   for (int i = 0; i < n; i++) {
+      if (ring->num_shards == MAX_SHARDS) break;
+      if (hash_ring_find(ring, &shards[i]) < 0) ring->shards[ring->num_shards++] = shards[i];
+   }
+   qsort(ring->shards, ring->num_shards, sizeof(ShardAddress), compare_shards);
+
+   ring->points = malloc((ring->num_shards ? ring->num_shards : 1) * RING_VNODES * sizeof(RingPoint));
+   if (ring->points == NULL) {
+      free(ring);
+      return NULL;
+   }
+   for (int s = 0; s < ring->num_shards; s++) {
+      for (int v = 0; v < RING_VNODES; v++) {
+         char label[48];
+         int len = snprintf(label, sizeof(label), "%s:%d#%d", ring->shards[s].ip, ring->shards[s].port, v);
+         ring->points[ring->num_points].hash = ring_hash(label, len);
+         ring->points[ring->num_points++].shard = s;
+      }
+   }
+   qsort(ring->points, ring->num_points, sizeof(RingPoint), compare_points);
+   return ring;
+}
+
+void hash_ring_free(HashRing *ring) {
+   if (ring == NULL) return;
+   free(ring->points);
+   free(ring);
+}
+
+int hash_ring_owner(const HashRing *ring, const char *path) {
+   if (ring == NULL || ring->num_points == 0) return -1;
+   size_t len = strcspn(path, "/");
+   uint64_t h = ring_hash(path, len);
+
+   // First point at or after h, wrapping past the end
+   int lo = 0, hi = ring->num_points;
+   while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (ring->points[mid].hash < h) lo = mid + 1;
+      else hi = mid;
+   }
+   return ring->points[lo == ring->num_points ? 0 : lo].shard;
+}
+
+int hash_ring_find(const HashRing *ring, const ShardAddress *shard) {
+   for (int i = 0; i < ring->num_shards; i++) {
+      if (shard_address_compare(&ring->shards[i], shard) == 0) return i;
+   }
+   return -1;
+}
+
+int hash_ring_equal(const HashRing *a, const HashRing *b) {
+   if (a == NULL || b == NULL) return a == b;
+   if (a->num_shards != b->num_shards) return 0;
+   for (int i = 0; i < a->num_shards; i++) {
+      if (shard_address_compare(&a->shards[i], &b->shards[i]) != 0) return 0;
+   }
+   return 1;
+}
+
+void hash_ring_encode(const HashRing *ring, PayloadBuilder *b) {
+   payload_put_u32(b, ring->num_shards);
+   for (int i = 0; i < ring->num_shards; i++) {
+      payload_put_str(b, ring->shards[i].ip);
+      payload_put_u32(b, ring->shards[i].port);
+   }
+}
+
+HashRing *hash_ring_decode(const uint8_t *payload, size_t len) {
+   PayloadReader reader;
+   ShardAddress shards[MAX_SHARDS];
+   payload_reader_init(&reader, payload, len);
+   uint32_t count = payload_get_u32(&reader);
+   if (count == 0 || count > MAX_SHARDS) return NULL;
+   for (uint32_t i = 0; i < count; i++) {
+      payload_get_str(&reader, shards[i].ip, sizeof(shards[i].ip));
+      shards[i].port = payload_get_u32(&reader);
+   }
+   if (reader.error) return NULL;
+   return hash_ring_create(shards, count);
+}
+
+HashRing *hash_ring_fetch(const char *ip, int port) {
+   int fd = socket(AF_INET, SOCK_STREAM, 0);
+   if (fd < 0) return NULL;
+   struct sockaddr_in addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = inet_addr(ip);
+   addr.sin_port = htons(port);
+
+   HashRing *ring = NULL;
+   FrameHeader hdr;
+   uint8_t *payload = NULL;
+   if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+       send_frame(fd, OP_GET_SHARDS, 0, 1, NULL, 0) == 0 &&
+       recv_frame(fd, &hdr, &payload, MAX_CONTROL_PAYLOAD) == 0 &&
+       hdr.opcode == OP_SHARD_MAP) {
+      ring = hash_ring_decode(payload, hdr.payload_len);
+   }
+   free(payload);
+   close(fd);
+   return ring;
+}
@@ -0,0 +1,54 @@
+#ifndef _HASH_RING_H_
+#define _HASH_RING_H_
+
+#include "headers.h"
+#include "protocol.h"
+#include <stdint.h>
+
+// Consistent hash ring partitioning the namespace across naming server
+// shards. Each shard puts RING_VNODES points on a 64-bit ring and owns the
+// keys hashing up to each of its points, so a shard joining or leaving moves
+// only about 1/n of the keys, spread evenly over the others.
+//
+// Paths are keyed by their first component: a claim and every path below it
+// land on the same shard, which keeps longest-prefix lookups shard-local.
+
+#define RING_VNODES 128
+#define MAX_SHARDS 32
+
+typedef struct {
+   char ip[16];
+   int port;
+} ShardAddress;
+
+typedef struct {
+   uint64_t hash;
+   int shard;                        // Index into shards
+} RingPoint;
+
+// Immutable once built; a membership change builds a new ring
+typedef struct {
+   ShardAddress shards[MAX_SHARDS];  // Sorted, so every node numbers them alike
+   int num_shards;
+   RingPoint *points;                // Sorted by hash
+   int num_points;
+} HashRing;
+
+// Orders shards by ip, then port
+int shard_address_compare(const ShardAddress *a, const ShardAddress *b);
+// Builds a ring over shards (duplicates are dropped, at most MAX_SHARDS kept)
+HashRing *hash_ring_create(const ShardAddress *shards, int n);
+void hash_ring_free(HashRing *ring);
+// Index of the shard owning path, or -1 if the ring is empty
+int hash_ring_owner(const HashRing *ring, const char *path);
+// Index of shard in the ring, or -1
+int hash_ring_find(const HashRing *ring, const ShardAddress *shard);
+int hash_ring_equal(const HashRing *a, const HashRing *b);
+
+// OP_SHARD_MAP payload: count, then (ip, port) per shard
+void hash_ring_encode(const HashRing *ring, PayloadBuilder *b);
+HashRing *hash_ring_decode(const uint8_t *payload, size_t len);
+// Asks the naming server at ip:port for the current shard map
+HashRing *hash_ring_fetch(const char *ip, int port);
+
+#endif
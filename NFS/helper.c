@@ -1,4 +1,5 @@
 #include "helper.h"
+#include <time.h>
 
 void get_local_ip(char *ip_address) {
     struct ifaddrs *ifaddr, *ifa;
@@ -36,4 +37,11 @@ void get_local_ip(char *ip_address) {
     }
 
     freeifaddrs(ifaddr);
-}
\ No newline at end of file
+}
+
+// Milliseconds on the monotonic clock, for timeouts and elapsed times
+uint64_t monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
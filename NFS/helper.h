@@ -2,7 +2,10 @@
 #define _HELPER_H_
 
 #include "headers.h"
+#include <stdint.h>
 
 void get_local_ip(char *ip_address);
+// Milliseconds on a clock that never jumps, for timeouts
+uint64_t monotonic_ms(void);
     
 #endif
\ No newline at end of file
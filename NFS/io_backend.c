@@ -0,0 +1,352 @@
+#include "io_backend.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#define RING_ENTRIES 64
+
+typedef struct {
+   int fd;
+   unsigned *sq_head;
+   unsigned *sq_tail;
+   unsigned *sq_mask;
+   unsigned *sq_array;
+   unsigned *cq_head;
+   unsigned *cq_tail;
+   unsigned *cq_mask;
+   struct io_uring_sqe *sqes;
+   struct io_uring_cqe *cqes;
+   unsigned entries;
+   unsigned pending;            // SQEs prepared but not yet submitted
+   int has_fixed_buffer;
+   int has_files;
+   int registered_fd;           // fd in file slot 0, or -1
+} Ring;
+
+static IoBackend backend = IO_BLOCKING;
+static size_t fixed_size;
+static int can_unlink;          // Kernel supports IORING_OP_UNLINKAT
+
+static __thread Ring *thread_ring;
+static __thread uint8_t *thread_buffer;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+   return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+   return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+   return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static Ring *ring_create(unsigned entries) {
+   struct io_uring_params p;
+   memset(&p, 0, sizeof(p));
+   int fd = sys_io_uring_setup(entries, &p);
+   if (fd < 0) return NULL;
+
+   size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+   size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+   int single = p.features & IORING_FEAT_SINGLE_MMAP;
+   if (single && cq_len > sq_len) sq_len = cq_len;
+
+   uint8_t *sq_ptr = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+   uint8_t *cq_ptr = single ? sq_ptr
+                            : mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+   struct io_uring_sqe *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+   Ring *ring = malloc(sizeof(Ring));
+   if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqes == MAP_FAILED || ring == NULL) {
+      // Mappings are torn down with the ring fd
+      free(ring);
+      close(fd);
+      return NULL;
+   }
+   ring->fd = fd;
+   ring->sq_head = (unsigned *)(sq_ptr + p.sq_off.head);
+   ring->sq_tail = (unsigned *)(sq_ptr + p.sq_off.tail);
+   ring->sq_mask = (unsigned *)(sq_ptr + p.sq_off.ring_mask);
+   ring->sq_array = (unsigned *)(sq_ptr + p.sq_off.array);
+   ring->cq_head = (unsigned *)(cq_ptr + p.cq_off.head);
+   ring->cq_tail = (unsigned *)(cq_ptr + p.cq_off.tail);
+   ring->cq_mask = (unsigned *)(cq_ptr + p.cq_off.ring_mask);
+   ring->cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+   ring->sqes = sqes;
+   ring->entries = p.sq_entries;
+   ring->pending = 0;
+   ring->has_fixed_buffer = 0;
+   ring->registered_fd = -1;
+
+   // A one-slot sparse file table, updated per upload
+   int empty = -1;
+   ring->has_files = sys_io_uring_register(fd, IORING_REGISTER_FILES, &empty, 1) == 0;
+   return ring;
+}
+
+// The calling thread's ring, created on first use
+static Ring *get_ring(void) {
+   if (thread_ring == NULL && backend == IO_URING) {
+      thread_ring = ring_create(RING_ENTRIES);
+      if (thread_ring && io_fixed_buffer()) {
+         struct iovec iov = { thread_buffer, fixed_size };
+         // Fails under a low RLIMIT_MEMLOCK; plain WRITEs still work
+         thread_ring->has_fixed_buffer =
+            sys_io_uring_register(thread_ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+      }
+   }
+   return thread_ring;
+}
+
+static struct io_uring_sqe *ring_next_sqe(Ring *ring, uint8_t opcode, int fd, uint64_t user_data) {
+   unsigned tail = *ring->sq_tail + ring->pending;
+   unsigned index = tail & *ring->sq_mask;
+   struct io_uring_sqe *sqe = &ring->sqes[index];
+   memset(sqe, 0, sizeof(*sqe));
+   sqe->opcode = opcode;
+   sqe->fd = fd;
+   sqe->user_data = user_data;
+   if (fd >= 0 && fd == ring->registered_fd) {
+      sqe->fd = 0;
+      sqe->flags |= IOSQE_FIXED_FILE;
+   }
+   ring->sq_array[index] = index;
+   ring->pending++;
+   return sqe;
+}
+
+// Submits the prepared SQEs and waits for all of them. results[user_data]
+// receives each completion's res. Returns -1 if the kernel refused the batch.
+static int ring_run(Ring *ring, int *results) {
+   unsigned count = ring->pending;
+   __atomic_store_n(ring->sq_tail, *ring->sq_tail + count, __ATOMIC_RELEASE);
+   ring->pending = 0;
+
+   unsigned submitted = 0, reaped = 0;
+   while (reaped < count) {
+      int rc = sys_io_uring_enter(ring->fd, count - submitted, 1, IORING_ENTER_GETEVENTS);
+      if (rc < 0) {
+         if (errno == EINTR) continue;
+         return -1;
+      }
+      submitted += rc;
+      unsigned head = *ring->cq_head;
+      unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+      while (head != tail) {
+         struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+         results[cqe->user_data] = cqe->res;
+         head++;
+         reaped++;
+      }
+      __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+   }
+   return 0;
+}
+
+static int probe_unlink(int ring_fd) {
+   size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+   struct io_uring_probe *probe = calloc(1, len);
+   if (probe == NULL) return 0;
+   int supported = sys_io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+                   probe->last_op >= IORING_OP_UNLINKAT &&
+                   (probe->ops[IORING_OP_UNLINKAT].flags & IO_URING_OP_SUPPORTED);
+   free(probe);
+   return supported;
+}
+
+IoBackend io_backend_init(IoBackend requested, size_t fixed_buffer_size) {
+   fixed_size = fixed_buffer_size;
+   backend = IO_BLOCKING;
+   if (requested == IO_URING) {
+      struct io_uring_params p;
+      memset(&p, 0, sizeof(p));
+      int fd = sys_io_uring_setup(4, &p);
+      if (fd < 0) {
+         perror("io_uring unavailable, using blocking I/O");
+      }
+      else if (!(p.features & IORING_FEAT_NODROP)) {
+         // READ/WRITE opcodes arrived after NODROP; older kernels lack them
+         printf("io_uring too old, using blocking I/O\n");
+         close(fd);
+      }
+      else {
+         can_unlink = probe_unlink(fd);
+         close(fd);
+         backend = IO_URING;
+      }
+   }
+   return backend;
+}
+
+const char *io_backend_name(void) {
+   return backend == IO_URING ? "io_uring" : "blocking";
+}
+
+uint8_t *io_fixed_buffer(void) {
+   if (thread_buffer == NULL) {
+      // Page aligned so the registration pins whole pages
+      if (posix_memalign((void **)&thread_buffer, 4096, fixed_size) != 0) thread_buffer = NULL;
+   }
+   return thread_buffer;
+}
+
+void io_use_file(int fd) {
+   Ring *ring = get_ring();
+   if (ring == NULL || !ring->has_files || ring->registered_fd == fd) return;
+   struct io_uring_files_update update = { .offset = 0, .fds = (uint64_t)(uintptr_t)&fd };
+   if (sys_io_uring_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1) {
+      ring->registered_fd = fd;
+   }
+}
+
+void io_release_file(void) {
+   Ring *ring = thread_ring;
+   if (ring == NULL || ring->registered_fd < 0) return;
+   int empty = -1;
+   struct io_uring_files_update update = { .offset = 0, .fds = (uint64_t)(uintptr_t)&empty };
+   sys_io_uring_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+   ring->registered_fd = -1;
+}
+
+static ssize_t pread_full(int fd, uint8_t *buf, size_t len, off_t offset) {
+   size_t done = 0;
+   while (done < len) {
+      ssize_t n = pread(fd, buf + done, len - done, offset + done);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) return -errno;
+      if (n == 0) break;
+      done += n;
+   }
+   return done;
+}
+
+static int pwrite_full(int fd, const uint8_t *buf, size_t len, off_t offset) {
+   while (len > 0) {
+      ssize_t n = pwrite(fd, buf, len, offset);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) return -1;
+      buf += n;
+      len -= n;
+      offset += n;
+   }
+   return 0;
+}
+
+int io_read_batch(int fd, IoRead *reads, int count) {
+   Ring *ring = get_ring();
+   int results[RING_ENTRIES];
+   for (int done = 0; ring && done < count;) {
+      int batch = count - done < (int)ring->entries ? count - done : (int)ring->entries;
+      for (int i = 0; i < batch; i++) {
+         IoRead *read = &reads[done + i];
+         struct io_uring_sqe *sqe = ring_next_sqe(ring, IORING_OP_READ, fd, i);
+         sqe->addr = (uint64_t)(uintptr_t)read->buf;
+         sqe->len = read->len;
+         sqe->off = read->offset;
+      }
+      if (ring_run(ring, results) < 0) {
+         ring = NULL;   // Finish with the blocking path
+         break;
+      }
+      for (int i = 0; i < batch; i++) {
+         reads[done + i].result = results[i];
+      }
+      done += batch;
+   }
+
+   for (int i = 0; i < count; i++) {
+      IoRead *read = &reads[i];
+      if (ring == NULL || read->result == -EINVAL || read->result == -EOPNOTSUPP) {
+         read->result = pread_full(fd, read->buf, read->len, read->offset);
+      }
+      else if (read->result > 0 && (size_t)read->result < read->len) {
+         // Short read: the rest is either past EOF or needs another call
+         ssize_t more = pread_full(fd, (uint8_t *)read->buf + read->result,
+                                   read->len - read->result, read->offset + read->result);
+         if (more > 0) read->result += more;
+      }
+   }
+   return 0;
+}
+
+int io_write_at(int fd, const void *buf, size_t len, off_t offset, int sync) {
+   Ring *ring = get_ring();
+   if (ring == NULL || len > UINT32_MAX) {
+      if (pwrite_full(fd, buf, len, offset) < 0) return -1;
+      return sync ? fdatasync(fd) : 0;
+   }
+
+   struct io_uring_sqe *sqe;
+   const uint8_t *p = buf;
+   if (ring->has_fixed_buffer && p >= thread_buffer && p + len <= thread_buffer + fixed_size) {
+      sqe = ring_next_sqe(ring, IORING_OP_WRITE_FIXED, fd, 0);
+      sqe->buf_index = 0;
+   } else {
+      sqe = ring_next_sqe(ring, IORING_OP_WRITE, fd, 0);
+   }
+   sqe->addr = (uint64_t)(uintptr_t)buf;
+   sqe->len = len;
+   sqe->off = offset;
+   if (sync) {
+      // The sync only runs if the write completed in full
+      sqe->flags |= IOSQE_IO_LINK;
+      struct io_uring_sqe *fsync_sqe = ring_next_sqe(ring, IORING_OP_FSYNC, fd, 1);
+      fsync_sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+   }
+
+   int results[2] = { 0, 0 };
+   if (ring_run(ring, results) < 0) {
+      if (pwrite_full(fd, buf, len, offset) < 0) return -1;
+      return sync ? fdatasync(fd) : 0;
+   }
+   if (results[0] < 0) {
+      errno = -results[0];
+      return -1;
+   }
+   if ((size_t)results[0] < len) {
+      // Short write; the linked sync was cancelled
+      if (pwrite_full(fd, p + results[0], len - results[0], offset + results[0]) < 0) return -1;
+      return sync ? fdatasync(fd) : 0;
+   }
+   if (sync && results[1] < 0) {
+      errno = -results[1];
+      return -1;
+   }
+   return 0;
+}
+
+int io_fdatasync(int fd) {
+   Ring *ring = get_ring();
+   if (ring == NULL) return fdatasync(fd);
+   struct io_uring_sqe *sqe = ring_next_sqe(ring, IORING_OP_FSYNC, fd, 0);
+   sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+   int result = 0;
+   if (ring_run(ring, &result) < 0) return fdatasync(fd);
+   if (result < 0) {
+      errno = -result;
+      return -1;
+   }
+   return 0;
+}
+
+int io_remove(const char *path) {
+   Ring *ring = get_ring();
+   if (ring == NULL || !can_unlink) return remove(path);
+   int result = 0;
+   for (int flags = 0;; flags = AT_REMOVEDIR) {
+      struct io_uring_sqe *sqe = ring_next_sqe(ring, IORING_OP_UNLINKAT, AT_FDCWD, 0);
+      sqe->addr = (uint64_t)(uintptr_t)path;
+      sqe->unlink_flags = flags;
+      if (ring_run(ring, &result) < 0) return remove(path);
+      // Like remove(), fall back to rmdir for directories
+      if (result != -EISDIR || flags == AT_REMOVEDIR) break;
+   }
+   if (result < 0) {
+      errno = -result;
+      return -1;
+   }
+   return 0;
+}
@@ -0,0 +1,53 @@
+#ifndef _IO_BACKEND_H_
+#define _IO_BACKEND_H_
+
+#include "headers.h"
+#include <stdint.h>
+
+// File I/O used by the storage server's workers, backed either by plain
+// blocking syscalls or by io_uring.
+//
+// With io_uring each worker thread owns a small ring. Related operations
+// are submitted together and reaped with a single io_uring_enter: all the
+// missing blocks of a cached read at once, or a write with its fdatasync
+// linked behind it. Each ring registers the worker's write buffer, so
+// uploads go out as WRITE_FIXED without pinning pages per call, and the
+// file being uploaded can be registered to skip the per-op fd lookup.
+// Rings are built with raw syscalls; any operation the kernel rejects falls
+// back to the blocking call.
+
+typedef enum {
+   IO_BLOCKING = 0,
+   IO_URING
+} IoBackend;
+
+typedef struct {
+   void *buf;
+   size_t len;
+   off_t offset;
+   ssize_t result;              // Bytes read (short only at end of file) or -errno
+} IoRead;
+
+// Selects the backend for every thread. Returns the backend actually in use,
+// which is IO_BLOCKING if io_uring was requested but is unavailable.
+IoBackend io_backend_init(IoBackend requested, size_t fixed_buffer_size);
+const char *io_backend_name(void);
+
+// The calling thread's buffer of fixed_buffer_size bytes, registered with its
+// ring when io_uring is in use
+uint8_t *io_fixed_buffer(void);
+
+// Registers fd with the calling thread's ring for the writes that follow;
+// io_release_file drops it again so the kernel does not keep it open
+void io_use_file(int fd);
+void io_release_file(void);
+
+// Performs every read; returns 0 unless the batch could not be issued
+int io_read_batch(int fd, IoRead *reads, int count);
+// Writes all len bytes at offset, then fdatasyncs if sync is set
+int io_write_at(int fd, const void *buf, size_t len, off_t offset, int sync);
+int io_fdatasync(int fd);
+// Removes a file or an empty directory, like remove()
+int io_remove(const char *path);
+
+#endif
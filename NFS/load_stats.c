@@ -0,0 +1,99 @@
+#include "load_stats.h"
+#include "helper.h"
+
+// Buckets 0-15 hold single microseconds; above that each power of two is
+// split into four equal buckets
+static int latency_bucket(uint64_t us) {
+   if (us < 16) return (int)us;
+   int exponent = 63 - __builtin_clzll(us);
+   int bucket = 16 + (exponent - 4) * 4 + (int)((us >> (exponent - 2)) & 3);
+   return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+// Largest latency that falls in bucket
+static uint32_t bucket_upper_us(int bucket) {
+   if (bucket < 16) return bucket;
+   int exponent = (bucket - 16) / 4 + 4;
+   uint64_t width = 1ULL << (exponent - 2);
+   uint64_t upper = (1ULL << exponent) + ((bucket - 16) % 4 + 1) * width - 1;
+   return upper > UINT32_MAX ? UINT32_MAX : (uint32_t)upper;
+}
+
+void load_stats_init(LoadStats *stats) {
+   memset(stats, 0, sizeof(LoadStats));
+   stats->last_report_ms = monotonic_ms();
+}
+
+void load_stats_connection(LoadStats *stats, int delta) {
+   __atomic_add_fetch(&stats->active_connections, delta, __ATOMIC_RELAXED);
+}
+
+void load_stats_add_bytes(LoadStats *stats, uint64_t read, uint64_t written) {
+   if (read) __atomic_add_fetch(&stats->bytes_read, read, __ATOMIC_RELAXED);
+   if (written) __atomic_add_fetch(&stats->bytes_written, written, __ATOMIC_RELAXED);
+}
+
+void load_stats_record_latency(LoadStats *stats, uint64_t latency_us) {
+   __atomic_add_fetch(&stats->latency_counts[latency_bucket(latency_us)], 1, __ATOMIC_RELAXED);
+}
+
+void load_stats_report(LoadStats *stats, LoadReport *report) {
+   uint64_t now = monotonic_ms();
+   uint64_t elapsed = now > stats->last_report_ms ? now - stats->last_report_ms : 1;
+   uint64_t bytes_read = __atomic_load_n(&stats->bytes_read, __ATOMIC_RELAXED);
+   uint64_t bytes_written = __atomic_load_n(&stats->bytes_written, __ATOMIC_RELAXED);
+   report->active_connections = __atomic_load_n(&stats->active_connections, __ATOMIC_RELAXED);
+   report->read_bytes_per_sec = (bytes_read - stats->last_bytes_read) * 1000 / elapsed;
+   report->write_bytes_per_sec = (bytes_written - stats->last_bytes_written) * 1000 / elapsed;
+   stats->last_report_ms = now;
+   stats->last_bytes_read = bytes_read;
+   stats->last_bytes_written = bytes_written;
+
+   // Take this interval's samples; requests finishing meanwhile land in the next
+   uint64_t counts[LATENCY_BUCKETS];
+   uint64_t total = 0;
+   for (int i = 0; i < LATENCY_BUCKETS; i++) {
+      counts[i] = __atomic_exchange_n(&stats->latency_counts[i], 0, __ATOMIC_RELAXED);
+      total += counts[i];
+   }
+   if (total > 0) {
+      uint64_t ranks[3] = { (total * 50 + 99) / 100, (total * 95 + 99) / 100, (total * 99 + 99) / 100 };
+      uint32_t *out[3] = { &stats->last_p50_us, &stats->last_p95_us, &stats->last_p99_us };
+      uint64_t seen = 0;
+      int next = 0;
+      for (int i = 0; i < LATENCY_BUCKETS && next < 3; i++) {
+         seen += counts[i];
+         while (next < 3 && seen >= ranks[next]) *out[next++] = bucket_upper_us(i);
+      }
+   }
+   report->latency_p50_us = stats->last_p50_us;
+   report->latency_p95_us = stats->last_p95_us;
+   report->latency_p99_us = stats->last_p99_us;
+}
+
+void load_report_encode(PayloadBuilder *b, const LoadReport *report) {
+   payload_put_u32(b, report->active_connections);
+   payload_put_u32(b, report->queue_depth);
+   payload_put_u32(b, report->in_flight);
+   payload_put_u64(b, report->read_bytes_per_sec);
+   payload_put_u64(b, report->write_bytes_per_sec);
+   payload_put_u64(b, report->free_bytes);
+   payload_put_u64(b, report->total_bytes);
+   payload_put_u32(b, report->latency_p50_us);
+   payload_put_u32(b, report->latency_p95_us);
+   payload_put_u32(b, report->latency_p99_us);
+}
+
+int load_report_decode(PayloadReader *r, LoadReport *report) {
+   report->active_connections = payload_get_u32(r);
+   report->queue_depth = payload_get_u32(r);
+   report->in_flight = payload_get_u32(r);
+   report->read_bytes_per_sec = payload_get_u64(r);
+   report->write_bytes_per_sec = payload_get_u64(r);
+   report->free_bytes = payload_get_u64(r);
+   report->total_bytes = payload_get_u64(r);
+   report->latency_p50_us = payload_get_u32(r);
+   report->latency_p95_us = payload_get_u32(r);
+   report->latency_p99_us = payload_get_u32(r);
+   return r->error ? -1 : 0;
+}
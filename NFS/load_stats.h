@@ -0,0 +1,60 @@
+#ifndef _LOAD_STATS_H_
+#define _LOAD_STATS_H_
+
+#include "headers.h"
+#include "protocol.h"
+#include <stdint.h>
+
+// Storage server load as pushed to the naming server in OP_LOAD_REPORT.
+//
+// The storage server accumulates counters and a latency histogram in a
+// LoadStats while serving requests; every report turns them into rates and
+// percentiles over the interval since the previous one and starts afresh.
+// Latencies are bucketed log-linearly (4 buckets per power of two), so a
+// percentile is exact to within 25% at any scale for a fixed 1KB of counters.
+
+#define LATENCY_BUCKETS 128
+
+typedef struct {
+   uint32_t active_connections;
+   uint32_t queue_depth;        // Requests waiting for a worker
+   uint32_t in_flight;          // Queued plus running
+   uint64_t read_bytes_per_sec; // Sent to clients
+   uint64_t write_bytes_per_sec;// Received from clients
+   uint64_t free_bytes;         // On the file system holding the exports
+   uint64_t total_bytes;
+   uint32_t latency_p50_us;     // Request service time percentiles
+   uint32_t latency_p95_us;
+   uint32_t latency_p99_us;
+} LoadReport;
+
+typedef struct {
+   uint32_t active_connections;
+   uint64_t bytes_read;
+   uint64_t bytes_written;
+   uint64_t latency_counts[LATENCY_BUCKETS];
+
+   // Updated only by load_stats_report
+   uint64_t last_report_ms;
+   uint64_t last_bytes_read;
+   uint64_t last_bytes_written;
+   uint32_t last_p50_us;
+   uint32_t last_p95_us;
+   uint32_t last_p99_us;
+} LoadStats;
+
+void load_stats_init(LoadStats *stats);
+// Safe to call from any thread
+void load_stats_connection(LoadStats *stats, int delta);
+void load_stats_add_bytes(LoadStats *stats, uint64_t read, uint64_t written);
+void load_stats_record_latency(LoadStats *stats, uint64_t latency_us);
+// Fills the connection, throughput and latency fields of report for the
+// interval since the last call. An interval without requests repeats the
+// previous percentiles. Calls must not overlap; with several consumers,
+// build one report per interval and share it.
+void load_stats_report(LoadStats *stats, LoadReport *report);
+
+void load_report_encode(PayloadBuilder *b, const LoadReport *report);
+int load_report_decode(PayloadReader *r, LoadReport *report);
+
+#endif
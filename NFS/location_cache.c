@@ -0,0 +1,154 @@
+#include "location_cache.h"
+
+static size_t key_hash(const char *key, size_t len) {
+   // FNV-1a; keys are short and the table is small
+   size_t hash = 14695981039346656037ULL;
+   for (size_t i = 0; i < len; i++) {
+      hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+   }
+   return hash;
+}
+
+static void lru_unlink(LocationCache *cache, CacheEntry *entry) {
+   if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+   else cache->lru_head = entry->lru_next;
+   if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+   else cache->lru_tail = entry->lru_prev;
+   entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(LocationCache *cache, CacheEntry *entry) {
+   entry->lru_prev = NULL;
+   entry->lru_next = cache->lru_head;
+   if (cache->lru_head) cache->lru_head->lru_prev = entry;
+   cache->lru_head = entry;
+   if (cache->lru_tail == NULL) cache->lru_tail = entry;
+}
+
+static CacheEntry **find_link(LocationCache *cache, const char *key, size_t len) {
+   CacheEntry **link = &cache->buckets[key_hash(key, len) & (cache->num_buckets - 1)];
+   while (*link) {
+      if (strlen((*link)->key) == len && memcmp((*link)->key, key, len) == 0) break;
+      link = &(*link)->hash_next;
+   }
+   return link;
+}
+
+static void remove_entry(LocationCache *cache, CacheEntry *entry) {
+   CacheEntry **link = find_link(cache, entry->key, strlen(entry->key));
+   *link = entry->hash_next;
+   lru_unlink(cache, entry);
+   cache->count--;
+   free(entry->key);
+   free(entry);
+}
+
+void location_cache_init(LocationCache *cache, size_t capacity, int ttl_sec) {
+   cache->num_buckets = 16;
+   while (cache->num_buckets < capacity * 2) cache->num_buckets *= 2;
+   cache->buckets = calloc(cache->num_buckets, sizeof(CacheEntry *));
+   cache->count = 0;
+   cache->capacity = capacity;
+   cache->ttl_sec = ttl_sec;
+   cache->lru_head = cache->lru_tail = NULL;
+   cache->hits = cache->misses = 0;
+}
+
+// Looks up key[0..len); expired entries are dropped on sight
+static CacheEntry *get_live(LocationCache *cache, const char *key, size_t len) {
+   CacheEntry *entry = *find_link(cache, key, len);
+   if (entry && entry->expires_at <= time(NULL)) {
+      remove_entry(cache, entry);
+      return NULL;
+   }
+   return entry;
+}
+
+int location_cache_lookup(LocationCache *cache, const char *path, char *ip, int *port) {
+   size_t len = strlen(path);
+   CacheEntry *entry = get_live(cache, path, len);
+
+   // Then the enclosing directories, deepest first
+   while (entry == NULL && len > 0) {
+      while (len > 0 && path[len - 1] != '/') len--;
+      if (len == 0) break;
+      len--;   // Drop the slash
+      CacheEntry *candidate = get_live(cache, path, len);
+      if (candidate && candidate->is_prefix) entry = candidate;
+   }
+
+   if (entry == NULL) {
+      cache->misses++;
+      return 0;
+   }
+   cache->hits++;
+   lru_unlink(cache, entry);
+   lru_push_front(cache, entry);
+   strcpy(ip, entry->ip);
+   *port = entry->port;
+   return 1;
+}
+
+void location_cache_insert(LocationCache *cache, const char *key, int is_prefix,
+                           const char *ip, int port) {
+   size_t len = strlen(key);
+   CacheEntry *entry = *find_link(cache, key, len);
+   if (entry == NULL) {
+      if (cache->count >= cache->capacity && cache->lru_tail) {
+         remove_entry(cache, cache->lru_tail);
+      }
+      entry = calloc(1, sizeof(CacheEntry));
+      entry->key = strdup(key);
+      CacheEntry **bucket = &cache->buckets[key_hash(key, len) & (cache->num_buckets - 1)];
+      entry->hash_next = *bucket;
+      *bucket = entry;
+      cache->count++;
+   } else {
+      lru_unlink(cache, entry);
+   }
+   snprintf(entry->ip, sizeof(entry->ip), "%s", ip);
+   entry->port = port;
+   entry->is_prefix = is_prefix;
+   entry->expires_at = time(NULL) + cache->ttl_sec;
+   lru_push_front(cache, entry);
+}
+
+// 1 if a is b or a directory containing b
+static int covers(const char *a, size_t a_len, const char *b) {
+   return strncmp(a, b, a_len) == 0 && (b[a_len] == '\0' || b[a_len] == '/');
+}
+
+void location_cache_invalidate(LocationCache *cache, const char *path) {
+   CacheEntry *entry = cache->lru_head;
+   while (entry) {
+      CacheEntry *next = entry->lru_next;
+      size_t len = strlen(entry->key);
+      if (strcmp(entry->key, path) == 0 || (entry->is_prefix && covers(entry->key, len, path))) {
+         remove_entry(cache, entry);
+      }
+      entry = next;
+   }
+}
+
+void location_cache_invalidate_prefix(LocationCache *cache, const char *prefix) {
+   size_t prefix_len = strlen(prefix);
+   CacheEntry *entry = cache->lru_head;
+   while (entry) {
+      CacheEntry *next = entry->lru_next;
+      size_t len = strlen(entry->key);
+      if (prefix_len == 0 || covers(prefix, prefix_len, entry->key) ||
+          (entry->is_prefix && covers(entry->key, len, prefix))) {
+         remove_entry(cache, entry);
+      }
+      entry = next;
+   }
+}
+
+void location_cache_invalidate_server(LocationCache *cache, const char *ip, int port) {
+   CacheEntry *entry = cache->lru_head;
+   while (entry) {
+      CacheEntry *next = entry->lru_next;
+      if (entry->port == port && strcmp(entry->ip, ip) == 0) remove_entry(cache, entry);
+      entry = next;
+   }
+}
@@ -0,0 +1,50 @@
+#ifndef _LOCATION_CACHE_H_
+#define _LOCATION_CACHE_H_
+
+#include "headers.h"
+#include <time.h>
+
+// Client-side LRU cache of path -> storage server locations.
+//
+// Entries are either exact paths or directory prefixes (when the naming
+// server resolved a path through a claimed directory); a lookup tries the
+// exact path and then each parent directory, longest first. Entries expire
+// after a TTL and are dropped explicitly when a storage server disowns a path
+// or the naming server pushes a remap.
+
+typedef struct CacheEntry {
+   char *key;
+   char ip[16];
+   int port;
+   int is_prefix;               // Covers every path below key
+   time_t expires_at;
+   struct CacheEntry *hash_next;
+   struct CacheEntry *lru_prev;
+   struct CacheEntry *lru_next;
+} CacheEntry;
+
+typedef struct {
+   CacheEntry **buckets;
+   size_t num_buckets;          // Power of two
+   size_t count;
+   size_t capacity;
+   int ttl_sec;
+   CacheEntry *lru_head;        // Most recently used
+   CacheEntry *lru_tail;
+   unsigned long hits;
+   unsigned long misses;
+} LocationCache;
+
+void location_cache_init(LocationCache *cache, size_t capacity, int ttl_sec);
+int location_cache_lookup(LocationCache *cache, const char *path, char *ip, int *port);
+void location_cache_insert(LocationCache *cache, const char *key, int is_prefix,
+                           const char *ip, int port);
+// Drops the entries that could resolve path (its exact entry and any prefix
+// entry covering it)
+void location_cache_invalidate(LocationCache *cache, const char *path);
+// Drops everything at or below prefix as well as prefix entries covering it
+void location_cache_invalidate_prefix(LocationCache *cache, const char *prefix);
+// Drops every entry pointing at the storage server ip:port
+void location_cache_invalidate_server(LocationCache *cache, const char *ip, int port);
+
+#endif
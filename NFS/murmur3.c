@@ -0,0 +1,58 @@
+#include "murmur3.h"
+
+// MurmurHash3 x64_128 (Austin Appleby, public domain)
+static inline uint64_t rotl64(uint64_t x, int r) {
+   return (x << r) | (x >> (64 - r));
+}
+
+void murmur3_128(const void *buf, size_t len, uint32_t seed, uint8_t out[16]) {
+   const uint8_t *data = buf;
+   const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+   uint64_t h1 = seed, h2 = seed, k1, k2;
+   size_t blocks = len / 16;
+   for (size_t i = 0; i < blocks; i++) {
+      memcpy(&k1, data + i * 16, sizeof(k1));
+      memcpy(&k2, data + i * 16 + 8, sizeof(k2));
+      k1 *= c1;
+      k1 = rotl64(k1, 31);
+      k1 *= c2;
+      h1 ^= k1;
+      h1 = rotl64(h1, 27);
+      h1 += h2;
+      h1 = h1 * 5 + 0x52dce729;
+      k2 *= c2;
+      k2 = rotl64(k2, 33);
+      k2 *= c1;
+      h2 ^= k2;
+      h2 = rotl64(h2, 31);
+      h2 += h1;
+      h2 = h2 * 5 + 0x38495ab5;
+   }
+   const uint8_t *tail = data + blocks * 16;
+   size_t rest = len & 15;
+   k1 = k2 = 0;
+   for (size_t i = rest; i > 8; i--) k2 ^= (uint64_t)tail[i - 1] << ((i - 9) * 8);
+   if (rest > 8) {
+      k2 *= c2;
+      k2 = rotl64(k2, 33);
+      k2 *= c1;
+      h2 ^= k2;
+   }
+   for (size_t i = rest < 8 ? rest : 8; i > 0; i--) k1 ^= (uint64_t)tail[i - 1] << ((i - 1) * 8);
+   if (rest > 0) {
+      k1 *= c1;
+      k1 = rotl64(k1, 31);
+      k1 *= c2;
+      h1 ^= k1;
+   }
+   h1 ^= len;
+   h2 ^= len;
+   h1 += h2;
+   h2 += h1;
+   h1 = murmur3_fmix64(h1);
+   h2 = murmur3_fmix64(h2);
+   h1 += h2;
+   h2 += h1;
+   memcpy(out, &h1, sizeof(h1));
+   memcpy(out + 8, &h2, sizeof(h2));
+}
@@ -0,0 +1,24 @@
+#ifndef _MURMUR3_H_
+#define _MURMUR3_H_
+
+#include "headers.h"
+#include <stdint.h>
+
+// MurmurHash3 x64_128: a fast 128-bit hash of data, for naming and matching
+// blocks by content. Not cryptographic, so whoever relies on two blocks with
+// equal hashes being equal must be able to afford the rare exception, or
+// compare the data.
+
+void murmur3_128(const void *buf, size_t len, uint32_t seed, uint8_t out[16]);
+
+// The hash's 64-bit finalizer, a good mixer of any key on its own
+static inline uint64_t murmur3_fmix64(uint64_t k) {
+   k ^= k >> 33;
+   k *= 0xff51afd7ed558ccdULL;
+   k ^= k >> 33;
+   k *= 0xc4ceb9fe1a85ec53ULL;
+   k ^= k >> 33;
+   return k;
+}
+
+#endif
@@ -1,237 +1,1134 @@
 #include "headers.h"
 #include "helper.h"
 #include "namingServer.h"
+#include "protocol.h"
+#include "epoch.h"
 
 NamingServer naming_server;
 
-// Hash function
-unsigned int hash(const char *key) {
-   unsigned int hash = 0;
-   while (*key) {
-      hash = (hash * 31) + *key++;
+void register_client(Connection *conn) {
+   pthread_mutex_lock(&naming_server.clients_lock);
+   if (naming_server.num_clients == naming_server.clients_capacity) {
+      int capacity = naming_server.clients_capacity ? naming_server.clients_capacity * 2 : 64;
+      Connection **clients = realloc(naming_server.clients, capacity * sizeof(Connection *));
+      if (clients == NULL) {
+         pthread_mutex_unlock(&naming_server.clients_lock);
+         return;
+      }
+      naming_server.clients = clients;
+      naming_server.clients_capacity = capacity;
+   }
+   conn_get(conn);
+   naming_server.clients[naming_server.num_clients++] = conn;
+   pthread_mutex_unlock(&naming_server.clients_lock);
+}
+
+void unregister_client(Connection *conn) {
+   pthread_mutex_lock(&naming_server.clients_lock);
+   for (int i = 0; i < naming_server.num_clients; i++) {
+      if (naming_server.clients[i] == conn) {
+         naming_server.clients[i] = naming_server.clients[--naming_server.num_clients];
+         conn_put(conn);
+         break;
+      }
+   }
+   pthread_mutex_unlock(&naming_server.clients_lock);
+}
+
+// Tells every client to drop cached locations at or above prefix. Sends are
+// queued without blocking, so a slow client cannot stall the broadcast.
+void broadcast_invalidate(const char *prefix) {
+   PayloadBuilder message;
+   payload_init(&message);
+   payload_put_str(&message, prefix);
+   pthread_mutex_lock(&naming_server.clients_lock);
+   for (int i = 0; i < naming_server.num_clients; i++) {
+      conn_send_frame(naming_server.clients[i], OP_INVALIDATE, 0, 0, message.data, message.len);
    }
-   return hash % HASH_TABLE_SIZE;
+   pthread_mutex_unlock(&naming_server.clients_lock);
+   payload_free(&message);
 }
 
-// Initialize the hash map
-void initialize_hash_map(HashMap *map) {
-   for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-      map->table[i] = NULL;
+// Tells every client that a storage server stopped answering, so they drop
+// its cached locations and pooled connections instead of timing out on them
+void broadcast_server_down(StorageServer *server) {
+   PayloadBuilder message;
+   payload_init(&message);
+   payload_put_str(&message, server->ip_address);
+   payload_put_u32(&message, server->client_port);
+   pthread_mutex_lock(&naming_server.clients_lock);
+   for (int i = 0; i < naming_server.num_clients; i++) {
+      conn_send_frame(naming_server.clients[i], OP_SERVER_DOWN, 0, 0, message.data, message.len);
    }
-   pthread_mutex_init(&map->lock, NULL);
+   pthread_mutex_unlock(&naming_server.clients_lock);
+   payload_free(&message);
+}
+
+// 1 if path belongs to this shard under the current shard map
+static int owns_path(const char *path) {
+   epoch_enter();
+   HashRing *ring = __atomic_load_n(&naming_server.ring, __ATOMIC_ACQUIRE);
+   int owner = hash_ring_owner(ring, path);
+   int mine = owner < 0 || shard_address_compare(&ring->shards[owner], &naming_server.self) == 0;
+   epoch_exit();
+   return mine;
 }
 
-// Add a path-to-server mapping
-void hash_map_insert(HashMap *map, const char *path, StorageServer *server) {
-   unsigned int index = hash(path);
+// Answers requests for paths another shard owns with ST_NOT_OWNER, which
+// tells the client its shard map is stale. Returns 1 if it rejected one.
+static int reject_foreign_path(Connection *conn, uint32_t request_id, const char *path) {
+   if (owns_path(path)) return 0;
+   conn_send_error(conn, request_id, ST_NOT_OWNER, "Path belongs to another naming server shard");
+   return 1;
+}
+
+static void send_shard_map(Connection *conn, uint32_t request_id) {
+   PayloadBuilder message;
+   payload_init(&message);
+   epoch_enter();
+   hash_ring_encode(__atomic_load_n(&naming_server.ring, __ATOMIC_ACQUIRE), &message);
+   epoch_exit();
+   conn_send_frame(conn, OP_SHARD_MAP, 0, request_id, message.data, message.len);
+   payload_free(&message);
+}
 
-   pthread_mutex_lock(&map->lock);
-   HashNode *new_node = malloc(sizeof(HashNode));
-   strcpy(new_node->path, path);
-   new_node->server = server;
-   new_node->next = map->table[index];
-   map->table[index] = new_node;
-   pthread_mutex_unlock(&map->lock);
+// 1 if clients may be sent to server. A server still streaming its
+// registration may not be listening for clients yet. Read without the lock.
+static int server_is_available(StorageServer *server) {
+   return __atomic_load_n(&server->is_active, __ATOMIC_ACQUIRE) &&
+          !__atomic_load_n(&server->registering, __ATOMIC_ACQUIRE) &&
+          !__atomic_load_n(&server->suspected, __ATOMIC_ACQUIRE);
 }
 
-// Find a storage server by path
-StorageServer* hash_map_find(HashMap *map, const char *path) {
-   unsigned int index = hash(path);
+// Copies the members of set that may take clients into live. Members
+// change in place, so a concurrent writer may make a member appear twice or
+// not at all for one lookup; both are harmless.
+static int live_replicas(ReplicaSet *set, StorageServer *live[MAX_REPLICAS]) {
+   int count = __atomic_load_n(&set->count, __ATOMIC_ACQUIRE);
+   int n = 0;
+   for (int i = 0; i < count && i < MAX_REPLICAS; i++) {
+      StorageServer *server = __atomic_load_n(&set->members[i], __ATOMIC_ACQUIRE);
+      if (server != NULL && server_is_available(server)) live[n++] = server;
+   }
+   return n;
+}
+
+static int set_is_available(void *value, void *ctx) {
+   StorageServer *live[MAX_REPLICAS];
+   return live_replicas(value, live) > 0;
+}
+
+// Resolves path to the replica set serving it: an exact claim first, then
+// the longest claimed directory prefix. Claims without a live replica are
+// skipped, so a path claimed at several depths falls back to the next live
+// owner. matched_len receives the length of the claim used.
+ReplicaSet *lookup_replicas(const char *path, size_t *matched_len) {
+   ReplicaSet *set = path_map_find(&naming_server.path_to_server_map, path);
+   if (set && set_is_available(set, NULL)) {
+      *matched_len = strlen(path);
+      return set;
+   }
+   return radix_tree_longest_prefix_if(&naming_server.path_tree, path, set_is_available,
+                                       NULL, matched_len);
+}
+
+// Expected wait for one more request: the requests ahead of it times the
+// server's median service time from its last load report
+static uint32_t replica_load(StorageServer *server) {
+   uint64_t queued = (uint64_t)__atomic_load_n(&server->outstanding, __ATOMIC_RELAXED) +
+                     __atomic_load_n(&server->assigned, __ATOMIC_RELAXED) + 1;
+   uint32_t service_us = __atomic_load_n(&server->service_us, __ATOMIC_RELAXED);
+   uint64_t load = queued * (service_us ? service_us : DEFAULT_SERVICE_US);
+   return load > UINT32_MAX ? UINT32_MAX : (uint32_t)load;
+}
+
+// Orders the live replicas of set with the policy's choice first and counts
+// the client against it until the server's next load report. Returns the
+// number of live replicas.
+static int rank_replicas(ReplicaSet *set, StorageServer *live[MAX_REPLICAS]) {
+   int n = live_replicas(set, live);
+   if (n == 0) return 0;
+   uint32_t loads[MAX_REPLICAS];
+   for (int i = 0; i < n; i++) loads[i] = replica_load(live[i]);
+   int chosen = naming_server.policy->choose(loads, n, &set->cursor);
+   StorageServer *first = live[chosen];
+   live[chosen] = live[0];
+   live[0] = first;
+   __atomic_fetch_add(&first->assigned, 1, __ATOMIC_RELAXED);
+   return n;
+}
+
+// Resolves path to the replica that should serve one client
+StorageServer *lookup_server(const char *path, size_t *matched_len) {
+   ReplicaSet *set = lookup_replicas(path, matched_len);
+   StorageServer *live[MAX_REPLICAS];
+   return set && rank_replicas(set, live) > 0 ? live[0] : NULL;
+}
+
+// Adds a server to the registry. Caller holds the naming server lock.
+static StorageServer *add_storage_server(void) {
+   if (naming_server.num_storage_servers == naming_server.storage_servers_capacity) {
+      int capacity = naming_server.storage_servers_capacity ? naming_server.storage_servers_capacity * 2 : 16;
+      StorageServer **servers = realloc(naming_server.storage_servers, capacity * sizeof(StorageServer *));
+      if (servers == NULL) return NULL;
+      naming_server.storage_servers = servers;
+      naming_server.storage_servers_capacity = capacity;
+   }
+   StorageServer *server = calloc(1, sizeof(StorageServer));
+   if (server == NULL) return NULL;
+   arena_init(&server->paths_arena, PATH_ARENA_BLOCK_SIZE);
+   naming_server.storage_servers[naming_server.num_storage_servers++] = server;
+   return server;
+}
 
-   pthread_mutex_lock(&map->lock);
-   HashNode *current = map->table[index];
-   while (current) {
-      if (strcmp(current->path, path) == 0) {
-         pthread_mutex_unlock(&map->lock);
-         return current->server;
+// Adds server to set. Caller holds the naming server lock.
+static int replica_add(ReplicaSet *set, StorageServer *server) {
+   for (int i = 0; i < set->count; i++) {
+      if (set->members[i] == server) return 0;
+   }
+   if (set->count == MAX_REPLICAS) return -1;
+   // Publish the member before the count that exposes it
+   __atomic_store_n(&set->members[set->count], server, __ATOMIC_RELEASE);
+   __atomic_store_n(&set->count, set->count + 1, __ATOMIC_RELEASE);
+   return 1;
+}
+
+// Caller holds the naming server lock
+static void replica_remove(ReplicaSet *set, StorageServer *server) {
+   for (int i = 0; i < set->count; i++) {
+      if (set->members[i] != server) continue;
+      __atomic_store_n(&set->members[i], set->members[set->count - 1], __ATOMIC_RELEASE);
+      __atomic_store_n(&set->count, set->count - 1, __ATOMIC_RELEASE);
+      return;
+   }
+}
+
+// Claims one path for server, as a replica if other servers claim it too.
+// Caller holds the naming server lock.
+static int add_claim(StorageServer *server, const char *path, size_t len) {
+   if (server->num_paths == server->paths_capacity) {
+      size_t capacity = server->paths_capacity ? server->paths_capacity * 2 : 64;
+      const char **paths = realloc(server->accessible_paths, capacity * sizeof(char *));
+      if (paths == NULL) return -1;
+      server->accessible_paths = paths;
+      server->paths_capacity = capacity;
+   }
+   const char *claim = arena_strndup(&server->paths_arena, path, len);
+
+   // Clients can only hold a stale location for this path if it used to
+   // resolve through some other claim; fresh exports and new replicas of an
+   // existing claim shadow nothing and need no broadcast
+   size_t matched_len;
+   ReplicaSet *previous = lookup_replicas(claim, &matched_len);
+
+   // Claims go in the exact map for O(1) hits and in the tree so that a
+   // claimed directory covers every path beneath it
+   ReplicaSet *set = path_map_find(&naming_server.path_to_server_map, claim);
+   if (set == NULL) {
+      set = arena_alloc(&naming_server.replica_arena, sizeof(ReplicaSet), _Alignof(ReplicaSet));
+      memset(set, 0, sizeof(ReplicaSet));
+      path_map_insert(&naming_server.path_to_server_map, claim, set);
+      radix_tree_insert(&naming_server.path_tree, claim, set);
+   }
+   int added = replica_add(set, server);
+   if (added < 0) {
+      printf("Ignoring claim on %s: it already has %d replicas\n", claim, MAX_REPLICAS);
+   }
+   if (added <= 0) return 0;
+   server->accessible_paths[server->num_paths++] = claim;
+   if (previous != NULL && previous != set) broadcast_invalidate(claim);
+   return 0;
+}
+
+// Claims a batch of (count, paths) for server. Caller holds the naming
+// server lock.
+static Status add_claim_batch(StorageServer *server, PayloadReader *reader) {
+   uint32_t count = payload_get_u32(reader);
+   for (uint32_t i = 0; i < count && !reader->error; i++) {
+      uint16_t len = payload_get_u16(reader);
+      const uint8_t *path = payload_get_bytes(reader, len);
+      if (path == NULL || len == 0 || len >= MAX_PATH_LENGTH || memchr(path, '\0', len)) {
+         reader->error = 1;
+         break;
       }
-      current = current->next;
+      if (add_claim(server, (const char *)path, len) < 0) return ST_FULL;
    }
-   pthread_mutex_unlock(&map->lock);
-   return NULL; // Path not found
+   return reader->error ? ST_INVALID : ST_OK;
 }
 
-// Function to print the entire hash map
-void hash_map_print(HashMap *map) {
-   pthread_mutex_lock(&map->lock);
+// Registration is a stream of OP_REGISTER frames. The first carries the
+// server's address and ports, every frame carries a batch of (count, paths),
+// and all but the last are flagged FRAME_F_MORE. Batches are claimed as they
+// arrive, so exports of any size register without being buffered whole.
+void handle_storage_server_registration(Connection *conn, const FrameHeader *hdr, const uint8_t *payload) {
+   PayloadReader reader;
+   payload_reader_init(&reader, payload, hdr->payload_len);
 
-   printf("Hash Map Contents:\n");
-   for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-      HashNode *current = map->table[i];
-      while (current != NULL) {
-         printf("Path: %s, Server: %s:%d\n", current->path,
-                  current->server->ip_address, current->server->client_port);
-         current = current->next;
+   pthread_mutex_lock(&naming_server.lock);
+   StorageServer *server = conn->user;
+   if (server != NULL && !server->registering) {
+      pthread_mutex_unlock(&naming_server.lock);
+      conn_send_error(conn, hdr->request_id, ST_INVALID, "Already registered");
+      return;
+   }
+   if (server == NULL) {
+      printf("Storage Server registration initiated\n");
+      char ip_address[16];
+      payload_get_str(&reader, ip_address, sizeof(ip_address));
+      int nm_port = payload_get_u32(&reader);
+      int server_port = payload_get_u32(&reader);
+      int client_port = payload_get_u32(&reader);
+      if (reader.error) {
+         pthread_mutex_unlock(&naming_server.lock);
+         conn_send_error(conn, hdr->request_id, ST_INVALID, "Invalid registration format");
+         return;
       }
+      server = add_storage_server();
+      if (server == NULL) {
+         pthread_mutex_unlock(&naming_server.lock);
+         conn_send_error(conn, hdr->request_id, ST_FULL, "Out of memory");
+         return;
+      }
+      strcpy(server->ip_address, ip_address);
+      server->nm_port = nm_port;
+      server->server_port = server_port;
+      server->client_port = client_port;
+      server->socket = conn->fd;
+      server->conn = conn;
+      conn_get(conn);
+      server->last_seen_ms = monotonic_ms();
+      __atomic_store_n(&server->registering, 1, __ATOMIC_RELEASE);
+      __atomic_store_n(&server->is_active, 1, __ATOMIC_RELEASE);
+      conn->user = server;
    }
 
-   pthread_mutex_unlock(&map->lock);
+   Status status = add_claim_batch(server, &reader);
+   if (status != ST_OK) {
+      // Claims accepted so far stay until the connection closes
+      __atomic_store_n(&server->registering, 0, __ATOMIC_RELEASE);
+      pthread_mutex_unlock(&naming_server.lock);
+      conn_send_error(conn, hdr->request_id, status,
+                      status == ST_FULL ? "Out of memory" : "Invalid registration format");
+      return;
+   }
+   if (hdr->flags & FRAME_F_MORE) {
+      pthread_mutex_unlock(&naming_server.lock);
+      return;
+   }
+
+   __atomic_store_n(&server->registering, 0, __ATOMIC_RELEASE);
+   printf("Storage Server registered: %s:%d with %zu paths (%zu distinct paths known)\n",
+          server->ip_address, server->nm_port, server->num_paths,
+          path_map_size(&naming_server.path_to_server_map));
+   pthread_mutex_unlock(&naming_server.lock);
+   conn_send_ack(conn, hdr->request_id, "Registration successful");
 }
 
-void handle_storage_server_registration(int client_socket) {
-   printf("Storage Server registration initiated\n");
-   char buffer[BUFFER_SIZE];
-   StorageServer new_ss;
-   new_ss.num_paths = 0;
+// Claims a registered storage server adds later, such as the ones a shard
+// map change moved here from another shard
+void handle_claims(Connection *conn, const FrameHeader *hdr, const uint8_t *payload) {
+   StorageServer *server = conn->user;
+   if (server == NULL) {
+      conn_send_error(conn, hdr->request_id, ST_INVALID, "Not registered");
+      return;
+   }
+   PayloadReader reader;
+   payload_reader_init(&reader, payload, hdr->payload_len);
+   pthread_mutex_lock(&naming_server.lock);
+   Status status = add_claim_batch(server, &reader);
+   pthread_mutex_unlock(&naming_server.lock);
+   if (status != ST_OK) {
+      conn_send_error(conn, hdr->request_id, status,
+                      status == ST_FULL ? "Out of memory" : "Invalid claim format");
+   }
+}
 
-   // Receive storage server details
-   ssize_t bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-   if (bytes_received > 0) {
-      buffer[bytes_received] = '\0';
+void handle_get_server(Connection *conn, const FrameHeader *hdr, const uint8_t *payload) {
+   char path[MAX_PATH_LENGTH];
+   PayloadReader reader;
+   payload_reader_init(&reader, payload, hdr->payload_len);
+   if (payload_get_str(&reader, path, sizeof(path)) < 0) {
+      conn_send_error(conn, hdr->request_id, ST_INVALID, "Malformed path");
+      return;
+   }
+   if (reject_foreign_path(conn, hdr->request_id, path)) return;
 
-      // Parse registration message
-      char paths_str[BUFFER_SIZE];
-      int num_paths;
+   // Find appropriate storage server. The map is read lock-free, and servers
+   // whose claims are in it but that are still registering are skipped.
+   size_t matched_len;
+   StorageServer *server = lookup_server(path, &matched_len);
 
-      // Parse the basic information (IP, nm_port, client_port, num_paths)
-      // Parse the basic information (IP, nm_port, server_port, client_port, num_paths)
-      int parsed_fields = sscanf(buffer, "%s %d %d %d %d %[^\n]", 
-         new_ss.ip_address, 
-         &new_ss.nm_port,  
-         &new_ss.server_port, 
-         &new_ss.client_port, 
-         &num_paths, 
-         paths_str);
+   if (server) {
+      PayloadBuilder response;
+      payload_init(&response);
+      payload_put_str(&response, server->ip_address);
+      payload_put_u32(&response, server->client_port);
+      path[matched_len] = '\0';
+      payload_put_str(&response, path);
+      if (conn_send_frame(conn, OP_SERVER_INFO, 0, hdr->request_id, response.data, response.len) < 0) {
+         perror("Failed to send server info to client");
+      }
+      payload_free(&response);
+   } 
+   else {
+      conn_send_error(conn, hdr->request_id, ST_NOT_FOUND, "No server found for the requested path");
+   }
+}
 
-      if (parsed_fields < 5) {
-         const char *error = "Invalid registration format";
-         send(client_socket, error, strlen(error), 0);
-         return;
+static void send_replicas(Connection *conn, uint32_t request_id, const char *matched,
+                          StorageServer **live, int n) {
+   PayloadBuilder response;
+   payload_init(&response);
+   payload_put_str(&response, matched);
+   payload_put_u32(&response, n);
+   for (int i = 0; i < n; i++) {
+      payload_put_str(&response, live[i]->ip_address);
+      payload_put_u32(&response, live[i]->client_port);
+   }
+   if (conn_send_frame(conn, OP_REPLICAS_REPLY, 0, request_id, response.data, response.len) < 0) {
+      perror("Failed to send replicas to client");
+   }
+   payload_free(&response);
+}
+
+// Returns every live replica of path, the policy's choice first. Clients use
+// it to send writes to all replicas and to spread large reads across them.
+void handle_get_replicas(Connection *conn, const FrameHeader *hdr, const uint8_t *payload) {
+   char path[MAX_PATH_LENGTH];
+   PayloadReader reader;
+   payload_reader_init(&reader, payload, hdr->payload_len);
+   if (payload_get_str(&reader, path, sizeof(path)) < 0) {
+      conn_send_error(conn, hdr->request_id, ST_INVALID, "Malformed path");
+      return;
+   }
+   if (reject_foreign_path(conn, hdr->request_id, path)) return;
+
+   size_t matched_len;
+   ReplicaSet *set = lookup_replicas(path, &matched_len);
+   StorageServer *live[MAX_REPLICAS];
+   int n = set ? rank_replicas(set, live) : 0;
+   if (n == 0) {
+      conn_send_error(conn, hdr->request_id, ST_NOT_FOUND, "No server found for the requested path");
+      return;
+   }
+
+   path[matched_len] = '\0';
+   send_replicas(conn, hdr->request_id, path, live, n);
+}
+
+// Picks the storage server for a path no claim covers. The policy weighs
+// each server's expected wait, scaled up as its disk fills; servers that are
+// nearly full, unavailable or still registering are not considered. Caller
+// holds the naming server lock.
+static StorageServer *place_path(void) {
+   int total = naming_server.num_storage_servers;
+   StorageServer **candidates = malloc((total ? total : 1) * sizeof(StorageServer *));
+   uint32_t *loads = malloc((total ? total : 1) * sizeof(uint32_t));
+   StorageServer *chosen = NULL;
+   int n = 0;
+   for (int i = 0; candidates && loads && i < total; i++) {
+      StorageServer *server = naming_server.storage_servers[i];
+      if (!server_is_available(server)) continue;
+      if (server->has_load && server->load.free_bytes < MIN_FREE_BYTES) continue;
+      uint64_t load = (uint64_t)replica_load(server) * 1000 / (server->free_permille + 1);
+      candidates[n] = server;
+      loads[n++] = load > UINT32_MAX ? UINT32_MAX : (uint32_t)load;
+   }
+   if (n > 0) {
+      chosen = candidates[naming_server.policy->choose(loads, n, &naming_server.placement_cursor)];
+      __atomic_fetch_add(&chosen->assigned, 1, __ATOMIC_RELAXED);
+   }
+   free(candidates);
+   free(loads);
+   return chosen;
+}
+
+// Creates path. A path already covered by a claim is created by the client
+// on each replica, so the reply lists them. Otherwise the path is placed on
+// a storage server chosen by load: the naming server forwards the CREATE to
+// it and, once it confirms, claims the path for it and acknowledges.
+void handle_create(Connection *conn, const FrameHeader *hdr, const uint8_t *payload) {
+   char path[MAX_PATH_LENGTH];
+   PayloadReader reader;
+   payload_reader_init(&reader, payload, hdr->payload_len);
+   if (payload_get_str(&reader, path, sizeof(path)) < 0 || path[0] == '\0' || path[0] == '/') {
+      conn_send_error(conn, hdr->request_id, ST_INVALID, "Malformed path");
+      return;
+   }
+   if (reject_foreign_path(conn, hdr->request_id, path)) return;
+
+   size_t matched_len;
+   ReplicaSet *set = lookup_replicas(path, &matched_len);
+   StorageServer *live[MAX_REPLICAS];
+   int n = set ? rank_replicas(set, live) : 0;
+   if (n > 0) {
+      path[matched_len] = '\0';
+      send_replicas(conn, hdr->request_id, path, live, n);
+      return;
+   }
+
+   PendingCreate *pending = malloc(sizeof(PendingCreate));
+   if (pending == NULL) {
+      conn_send_error(conn, hdr->request_id, ST_FULL, "Out of memory");
+      return;
+   }
+   pthread_mutex_lock(&naming_server.lock);
+   StorageServer *server = place_path();
+   if (server == NULL) {
+      pthread_mutex_unlock(&naming_server.lock);
+      free(pending);
+      conn_send_error(conn, hdr->request_id, ST_FULL, "No storage server can take the path");
+      return;
+   }
+   pending->id = ++naming_server.next_forward_id;
+   pending->server = server;
+   pending->client = conn;
+   conn_get(conn);
+   pending->client_request_id = hdr->request_id;
+   strcpy(pending->path, path);
+   pending->next = naming_server.pending_creates;
+   naming_server.pending_creates = pending;
+   printf("Placing %s on Storage Server %s:%d\n", path, server->ip_address, server->client_port);
+
+   PayloadBuilder request;
+   payload_init(&request);
+   payload_put_str(&request, path);
+   conn_send_frame(server->conn, OP_CREATE, 0, pending->id, request.data, request.len);
+   payload_free(&request);
+   pthread_mutex_unlock(&naming_server.lock);
+}
+
+// Removes and returns the pending CREATE server answers with id, or any of
+// its pending CREATEs when id is 0. Caller holds the naming server lock.
+static PendingCreate *take_pending_create(StorageServer *server, uint32_t id) {
+   for (PendingCreate **link = &naming_server.pending_creates; *link; link = &(*link)->next) {
+      PendingCreate *pending = *link;
+      if (pending->server == server && (id == 0 || pending->id == id)) {
+         *link = pending->next;
+         return pending;
       }
+   }
+   return NULL;
+}
+
+// Relays a storage server's answer to a forwarded CREATE
+void complete_create(StorageServer *server, const FrameHeader *hdr, const uint8_t *payload) {
+   pthread_mutex_lock(&naming_server.lock);
+   PendingCreate *pending = take_pending_create(server, hdr->request_id);
+   if (pending == NULL) {
+      pthread_mutex_unlock(&naming_server.lock);
+      return;
+   }
+   if (hdr->opcode == OP_ACK) {
+      size_t len = strlen(pending->path);
+      while (len > 1 && pending->path[len - 1] == '/') len--;
+      add_claim(server, pending->path, len);
+   }
+   pthread_mutex_unlock(&naming_server.lock);
+
+   if (hdr->opcode == OP_ACK) {
+      char message[64];
+      snprintf(message, sizeof(message), "Created on %s:%d", server->ip_address, server->client_port);
+      conn_send_ack(pending->client, pending->client_request_id, message);
+   } else {
+      conn_send_frame(pending->client, OP_ERROR, 0, pending->client_request_id, payload, hdr->payload_len);
+   }
+   conn_put(pending->client);
+   free(pending);
+}
+
+// Text summary of the latest load report of every connected storage server
+void handle_server_loads(Connection *conn, const FrameHeader *hdr) {
+   PayloadBuilder text;
+   payload_init(&text);
+   char line[512];
+   pthread_mutex_lock(&naming_server.lock);
+   for (int i = 0; i < naming_server.num_storage_servers; i++) {
+      StorageServer *server = naming_server.storage_servers[i];
+      if (!server->is_active) continue;
+      const LoadReport *load = &server->load;
+      int len = snprintf(line, sizeof(line),
+                         "%s:%d%s conns %u queue %u in-flight %u read %.1f MB/s write %.1f MB/s "
+                         "free %.1f/%.1f GB latency p50/p95/p99 %u/%u/%u us\n",
+                         server->ip_address, server->client_port, server->suspected ? " (suspected)" : "",
+                         load->active_connections, load->queue_depth, load->in_flight,
+                         load->read_bytes_per_sec / 1048576.0, load->write_bytes_per_sec / 1048576.0,
+                         load->free_bytes / 1073741824.0, load->total_bytes / 1073741824.0,
+                         load->latency_p50_us, load->latency_p95_us, load->latency_p99_us);
+      payload_put_bytes(&text, line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1);
+   }
+   pthread_mutex_unlock(&naming_server.lock);
+   payload_put_u8(&text, '\0');
+   conn_send_ack(conn, hdr->request_id, (const char *)text.data);
+   payload_free(&text);
+}
+
+typedef struct {
+   PayloadBuilder entries;
+   uint32_t count;
+} ListResult;
 
-       // Parse accessible paths (space-separated, not comma-separated)
-      char *path = strtok(paths_str, " ");
-      while (path != NULL && new_ss.num_paths < 10) {
-         strncpy(new_ss.accessible_paths[new_ss.num_paths], path, MAX_PATH_LENGTH - 1);
-         new_ss.accessible_paths[new_ss.num_paths][MAX_PATH_LENGTH - 1] = '\0';  // Null-terminate
-         new_ss.num_paths++;
-         path = strtok(NULL, " ");
+// One entry per live replica of each claim
+static void add_list_entry(const char *path, void *value, void *ctx) {
+   ListResult *result = ctx;
+   StorageServer *live[MAX_REPLICAS];
+   int n = live_replicas(value, live);
+   for (int i = 0; i < n; i++) {
+      payload_put_str(&result->entries, path);
+      payload_put_str(&result->entries, live[i]->ip_address);
+      payload_put_u32(&result->entries, live[i]->client_port);
+      result->count++;
+   }
+}
+
+// Lists every claim at or below a prefix by walking the tree directly
+void handle_list(Connection *conn, const FrameHeader *hdr, const uint8_t *payload) {
+   char prefix[MAX_PATH_LENGTH];
+   PayloadReader reader;
+   payload_reader_init(&reader, payload, hdr->payload_len);
+   if (payload_get_str(&reader, prefix, sizeof(prefix)) < 0) {
+      conn_send_error(conn, hdr->request_id, ST_INVALID, "Malformed prefix");
+      return;
+   }
+   // The whole namespace is spread over every shard; a subtree lives on one
+   if (prefix[0] != '\0' && reject_foreign_path(conn, hdr->request_id, prefix)) return;
+
+   ListResult result;
+   payload_init(&result.entries);
+   result.count = 0;
+   radix_tree_walk_prefix(&naming_server.path_tree, prefix, add_list_entry, &result);
+
+   PayloadBuilder response;
+   payload_init(&response);
+   payload_put_u32(&response, result.count);
+   payload_put_bytes(&response, result.entries.data, result.entries.len);
+   conn_send_frame(conn, OP_LIST_REPLY, 0, hdr->request_id, response.data, response.len);
+   payload_free(&response);
+   payload_free(&result.entries);
+}
+
+// One path of an OP_GET_SERVERS batch
+typedef struct {
+   char path[MAX_PATH_LENGTH];
+   StorageServer *owner;
+   size_t matched_len;
+} BatchEntry;
+
+// Resolves a batch of paths in one request. Results are grouped by storage
+// server so the client can fan out one connection per server.
+void handle_get_servers(Connection *conn, const FrameHeader *hdr, const uint8_t *payload) {
+   PayloadReader reader;
+   payload_reader_init(&reader, payload, hdr->payload_len);
+   uint32_t count = payload_get_u32(&reader);
+   if (reader.error || count > MAX_BATCH_PATHS) {
+      conn_send_error(conn, hdr->request_id, ST_INVALID, "Malformed or oversized batch");
+      return;
+   }
+   // A batch can touch at most count distinct servers
+   BatchEntry *entries = malloc((count ? count : 1) * sizeof(BatchEntry));
+   StorageServer **groups = malloc((count ? count : 1) * sizeof(StorageServer *));
+   uint32_t *group_sizes = calloc(count ? count : 1, sizeof(uint32_t));
+   if (entries == NULL || groups == NULL || group_sizes == NULL) {
+      conn_send_error(conn, hdr->request_id, ST_FULL, "Out of memory");
+      free(entries);
+      free(groups);
+      free(group_sizes);
+      return;
+   }
+
+   uint32_t num_groups = 0;
+   uint32_t unresolved = 0;
+   for (uint32_t i = 0; i < count; i++) {
+      BatchEntry *entry = &entries[i];
+      if (payload_get_str(&reader, entry->path, sizeof(entry->path)) < 0) break;
+      // Paths of other shards come back unresolved
+      entry->owner = owns_path(entry->path) ? lookup_server(entry->path, &entry->matched_len) : NULL;
+      if (entry->owner == NULL) {
+         unresolved++;
+         continue;
       }
+      uint32_t g = 0;
+      while (g < num_groups && groups[g] != entry->owner) g++;
+      if (g == num_groups) groups[num_groups++] = entry->owner;
+      group_sizes[g]++;
+   }
+   if (reader.error) {
+      conn_send_error(conn, hdr->request_id, ST_INVALID, "Malformed path in batch");
+      free(entries);
+      free(groups);
+      free(group_sizes);
+      return;
+   }
 
-      new_ss.socket = client_socket;
-      new_ss.is_active = 1;
+   PayloadBuilder response;
+   payload_init(&response);
+   payload_put_u32(&response, num_groups);
+   for (uint32_t g = 0; g < num_groups; g++) {
+      payload_put_str(&response, groups[g]->ip_address);
+      payload_put_u32(&response, groups[g]->client_port);
+      payload_put_u32(&response, group_sizes[g]);
+      for (uint32_t i = 0; i < count; i++) {
+         if (entries[i].owner != groups[g]) continue;
+         entries[i].path[entries[i].matched_len] = '\0';
+         payload_put_u32(&response, i);
+         payload_put_str(&response, entries[i].path);
+      }
+   }
+   payload_put_u32(&response, unresolved);
+   for (uint32_t i = 0; i < count; i++) {
+      if (entries[i].owner == NULL) payload_put_u32(&response, i);
+   }
 
-      // Add to storage servers list
-      pthread_mutex_lock(&naming_server.lock);
-      if (naming_server.num_storage_servers < MAX_STORAGE_SERVERS) {
-         naming_server.storage_servers[naming_server.num_storage_servers++] = new_ss;
-         printf("Storage Server registered: %s:%d\n", new_ss.ip_address, new_ss.nm_port);
-         printf("Accessible paths:\n");
-         for (int i = 0; i < new_ss.num_paths; i++) {
-            printf("  %s\n", new_ss.accessible_paths[i]);
-         }
-         // Add paths to hash map
-         for (int i = 0; i < new_ss.num_paths; i++){
-            hash_map_insert(&naming_server.path_to_server_map,
-                            new_ss.accessible_paths[i],
-                            &naming_server.storage_servers[naming_server.num_storage_servers - 1]);
+   if (response.len > MAX_CONTROL_PAYLOAD) {
+      conn_send_error(conn, hdr->request_id, ST_FULL, "Batch reply too large");
+   }
+   else if (conn_send_frame(conn, OP_SERVERS_REPLY, 0, hdr->request_id, response.data, response.len) < 0) {
+      perror("Failed to send batch server info to client");
+   }
+   payload_free(&response);
+   free(entries);
+   free(groups);
+   free(group_sizes);
+}
+
+// Any frame from a storage server shows it is alive; a suspected server that
+// speaks up again before eviction is routed to again
+static void note_storage_alive(StorageServer *server) {
+   __atomic_store_n(&server->last_seen_ms, monotonic_ms(), __ATOMIC_RELEASE);
+   if (!__atomic_load_n(&server->suspected, __ATOMIC_ACQUIRE)) return;
+   pthread_mutex_lock(&naming_server.lock);
+   if (server->suspected && server->is_active) {
+      __atomic_store_n(&server->suspected, 0, __ATOMIC_RELEASE);
+      printf("Storage Server %s:%d recovered\n", server->ip_address, server->nm_port);
+   }
+   pthread_mutex_unlock(&naming_server.lock);
+}
+
+void handle_load_report(StorageServer *server, const FrameHeader *hdr, const uint8_t *payload) {
+   LoadReport report;
+   PayloadReader reader;
+   payload_reader_init(&reader, payload, hdr->payload_len);
+   if (load_report_decode(&reader, &report) < 0) return;
+   pthread_mutex_lock(&naming_server.lock);
+   server->load = report;
+   server->has_load = 1;
+   pthread_mutex_unlock(&naming_server.lock);
+   if (report.latency_p50_us > 0) {
+      __atomic_store_n(&server->service_us, report.latency_p50_us, __ATOMIC_RELAXED);
+   }
+   uint32_t free_permille = report.total_bytes ? report.free_bytes * 1000 / report.total_bytes : 1000;
+   __atomic_store_n(&server->free_permille, free_permille, __ATOMIC_RELAXED);
+}
+
+static void retire_ring(void *ring) {
+   hash_ring_free(ring);
+}
+
+// Drops the claims the shard map now gives to other shards. The storage
+// servers holding them see the same map and send them to their new owners.
+// Caller holds the naming server lock.
+static void drop_moved_claims(void) {
+   size_t moved = 0;
+   for (int i = 0; i < naming_server.num_storage_servers; i++) {
+      StorageServer *server = naming_server.storage_servers[i];
+      size_t kept = 0;
+      for (size_t p = 0; p < server->num_paths; p++) {
+         const char *claim = server->accessible_paths[p];
+         if (owns_path(claim)) {
+            server->accessible_paths[kept++] = claim;
+            continue;
          }
+         ReplicaSet *set = path_map_find(&naming_server.path_to_server_map, claim);
+         if (set) replica_remove(set, server);
+         moved++;
+      }
+      server->num_paths = kept;
+   }
+   if (moved > 0) printf("Handed %zu claims over to other shards\n", moved);
+}
 
-         printf("Storage Server registered: %s:%d\n", new_ss.ip_address, new_ss.nm_port);
+// Pushes the shard map to every client, storage server and peer shard.
+// Caller holds the naming server lock.
+static void broadcast_shard_map(void) {
+   PayloadBuilder message;
+   payload_init(&message);
+   hash_ring_encode(naming_server.ring, &message);
+   pthread_mutex_lock(&naming_server.clients_lock);
+   for (int i = 0; i < naming_server.num_clients; i++) {
+      conn_send_frame(naming_server.clients[i], OP_SHARD_MAP, 0, 0, message.data, message.len);
+   }
+   pthread_mutex_unlock(&naming_server.clients_lock);
+   for (int i = 0; i < naming_server.num_storage_servers; i++) {
+      StorageServer *server = naming_server.storage_servers[i];
+      if (server->is_active) conn_send_frame(server->conn, OP_SHARD_MAP, 0, 0, message.data, message.len);
+   }
+   for (int i = 0; i < naming_server.num_peers; i++) {
+      conn_send_frame(naming_server.peers[i]->conn, OP_SHARD_MAP, 0, 0, message.data, message.len);
+   }
+   payload_free(&message);
+}
+
+// Rebuilds the shard map from this shard and the peers connected now. If
+// membership changed, claims that moved away are dropped and everyone is
+// told to route by the new map. Caller holds the naming server lock.
+static void update_shard_map(void) {
+   ShardAddress members[MAX_SHARDS + 1];
+   int n = 0;
+   members[n++] = naming_server.self;
+   for (int i = 0; i < naming_server.num_peers; i++) members[n++] = naming_server.peers[i]->address;
+   HashRing *ring = hash_ring_create(members, n);
+   if (ring == NULL) {
+      perror("Shard map allocation failed");
+      return;
+   }
+   if (hash_ring_equal(ring, naming_server.ring)) {
+      hash_ring_free(ring);
+      return;
+   }
+   HashRing *old = naming_server.ring;
+   __atomic_store_n(&naming_server.ring, ring, __ATOMIC_RELEASE);
+   epoch_retire(old, retire_ring);
+   printf("Shard map now has %d naming server(s)\n", ring->num_shards);
+   drop_moved_claims();
+   broadcast_shard_map();
+}
+
+static void *peer_connector(void *arg) {
+   ShardAddress *address = arg;
+   Connection *conn = reactor_connect(address->ip, address->port, CONN_SHARD);
+   if (conn != NULL) {
+      PayloadBuilder hello;
+      payload_init(&hello);
+      payload_put_str(&hello, naming_server.self.ip);
+      payload_put_u32(&hello, naming_server.self.port);
+      conn_send_frame(conn, OP_HELLO_SHARD, 0, 0, hello.data, hello.len);
+      payload_free(&hello);
+      conn_put(conn);
+   } else {
+      printf("Failed to reach naming server %s:%d\n", address->ip, address->port);
+   }
 
-         // Send acknowledgment
-         const char *ack = "Registration successful";
-         send(client_socket, ack, strlen(ack), 0);
-      } 
-      else {
-         const char *error = "Maximum number of storage servers reached";
-         send(client_socket, error, strlen(error), 0);
+   pthread_mutex_lock(&naming_server.lock);
+   for (int i = 0; i < naming_server.num_connecting; i++) {
+      if (shard_address_compare(&naming_server.connecting[i], address) == 0) {
+         naming_server.connecting[i] = naming_server.connecting[--naming_server.num_connecting];
+         break;
       }
+   }
+   pthread_mutex_unlock(&naming_server.lock);
+   free(address);
+   return NULL;
+}
+
+// Dials a shard unless it is connected or being dialed already. The peer
+// adds this shard when our HELLO arrives. Caller holds the naming server lock.
+static void connect_peer(const ShardAddress *address) {
+   for (int i = 0; i < naming_server.num_peers; i++) {
+      if (shard_address_compare(&naming_server.peers[i]->address, address) == 0) return;
+   }
+   for (int i = 0; i < naming_server.num_connecting; i++) {
+      if (shard_address_compare(&naming_server.connecting[i], address) == 0) return;
+   }
+   ShardAddress *arg = malloc(sizeof(ShardAddress));
+   if (arg == NULL || naming_server.num_connecting == MAX_SHARDS) {
+      free(arg);
+      return;
+   }
+   *arg = *address;
+   pthread_t thread;
+   if (pthread_create(&thread, NULL, peer_connector, arg) != 0) {
+      free(arg);
+      return;
+   }
+   pthread_detach(thread);
+   naming_server.connecting[naming_server.num_connecting++] = *address;
+}
+
+// Adds the shard on the other end of conn, once it has said where it
+// listens. The accepting side answers with its own HELLO; both then send
+// their shard map so each learns of members it has not met yet.
+static void add_peer(Connection *conn, const FrameHeader *hdr, const uint8_t *payload, int accepted) {
+   ShardAddress address;
+   PayloadReader reader;
+   payload_reader_init(&reader, payload, hdr->payload_len);
+   payload_get_str(&reader, address.ip, sizeof(address.ip));
+   address.port = payload_get_u32(&reader);
+   ShardPeer *peer = calloc(1, sizeof(ShardPeer));
+   if (reader.error || peer == NULL || shard_address_compare(&address, &naming_server.self) == 0) {
+      free(peer);
+      conn_shutdown(conn);
+      return;
+   }
+
+   pthread_mutex_lock(&naming_server.lock);
+   if (naming_server.num_peers == MAX_SHARDS) {
       pthread_mutex_unlock(&naming_server.lock);
-      // Print the entire hash map to verify
-      hash_map_print(&naming_server.path_to_server_map);
-   } 
-   else {
-      perror("Failed to receive registration message");
+      free(peer);
+      conn_shutdown(conn);
+      return;
    }
+   peer->address = address;
+   peer->conn = conn;
+   peer->last_seen_ms = monotonic_ms();
+   conn_get(conn);
+   conn->user = peer;
+   naming_server.peers[naming_server.num_peers++] = peer;
+   printf("Naming server %s:%d joined\n", address.ip, address.port);
+   update_shard_map();
+   pthread_mutex_unlock(&naming_server.lock);
+
+   if (accepted) {
+      PayloadBuilder hello;
+      payload_init(&hello);
+      payload_put_str(&hello, naming_server.self.ip);
+      payload_put_u32(&hello, naming_server.self.port);
+      conn_send_frame(conn, OP_HELLO_SHARD, 0, hdr->request_id, hello.data, hello.len);
+      payload_free(&hello);
+   }
+   send_shard_map(conn, 0);
 }
 
+// A peer's view of the membership. Members this shard has not met are
+// dialed by whichever of the pair has the lower address.
+static void handle_peer_shard_map(const FrameHeader *hdr, const uint8_t *payload) {
+   HashRing *ring = hash_ring_decode(payload, hdr->payload_len);
+   if (ring == NULL) return;
+   pthread_mutex_lock(&naming_server.lock);
+   for (int i = 0; i < ring->num_shards; i++) {
+      if (shard_address_compare(&naming_server.self, &ring->shards[i]) < 0) {
+         connect_peer(&ring->shards[i]);
+      }
+   }
+   pthread_mutex_unlock(&naming_server.lock);
+   hash_ring_free(ring);
+}
 
-void handle_client_request(int client_socket) {
-   printf("Client request\n");
-   char buffer[BUFFER_SIZE];
-   
+static void remove_peer(ShardPeer *peer) {
+   pthread_mutex_lock(&naming_server.lock);
+   for (int i = 0; i < naming_server.num_peers; i++) {
+      if (naming_server.peers[i] == peer) {
+         naming_server.peers[i] = naming_server.peers[--naming_server.num_peers];
+         break;
+      }
+   }
+   printf("Naming server %s:%d left\n", peer->address.ip, peer->address.port);
+   update_shard_map();
+   pthread_mutex_unlock(&naming_server.lock);
+   conn_put(peer->conn);
+   free(peer);
+}
+
+// Sends heartbeats to every storage server and acts on the silent ones:
+// suspected servers get no new clients, evicted ones are disconnected and
+// their claims dropped by handle_close
+void *heartbeat_monitor(void *arg) {
    while (1) {
-      memset(buffer, 0, BUFFER_SIZE);
-      ssize_t bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-      
-      if (bytes_received <= 0) {
-         // printf("")
-         // Client disconnected
+      usleep(HEARTBEAT_INTERVAL_MS * 1000);
+      uint64_t now = monotonic_ms();
+      pthread_mutex_lock(&naming_server.lock);
+      for (int i = 0; i < naming_server.num_storage_servers; i++) {
+         StorageServer *server = naming_server.storage_servers[i];
+         if (!server->is_active) continue;
+         conn_send_frame(server->conn, OP_HEARTBEAT, 0, 0, NULL, 0);
+
+         uint64_t last_seen = __atomic_load_n(&server->last_seen_ms, __ATOMIC_ACQUIRE);
+         uint64_t silence = now > last_seen ? now - last_seen : 0;
+         if (silence >= HEARTBEAT_EVICT_MS) {
+            printf("Evicting Storage Server %s:%d after %llu ms of silence\n",
+                   server->ip_address, server->nm_port, (unsigned long long)silence);
+            __atomic_store_n(&server->is_active, 0, __ATOMIC_RELEASE);
+            if (!server->suspected) broadcast_server_down(server);
+            conn_shutdown(server->conn);
+         }
+         else if (silence >= HEARTBEAT_SUSPECT_MS && !server->suspected) {
+            printf("Storage Server %s:%d suspected after %llu ms of silence\n",
+                   server->ip_address, server->nm_port, (unsigned long long)silence);
+            __atomic_store_n(&server->suspected, 1, __ATOMIC_RELEASE);
+            broadcast_server_down(server);
+         }
+      }
+      // Shards that stop answering leave the membership when handle_close
+      // sees their connection go
+      for (int i = 0; i < naming_server.num_peers; i++) {
+         ShardPeer *peer = naming_server.peers[i];
+         conn_send_frame(peer->conn, OP_HEARTBEAT, 0, 0, NULL, 0);
+         uint64_t last_seen = __atomic_load_n(&peer->last_seen_ms, __ATOMIC_ACQUIRE);
+         if (now > last_seen && now - last_seen >= HEARTBEAT_EVICT_MS) {
+            printf("Naming server %s:%d silent for %llu ms\n", peer->address.ip, peer->address.port,
+                   (unsigned long long)(now - last_seen));
+            conn_shutdown(peer->conn);
+         }
+      }
+      pthread_mutex_unlock(&naming_server.lock);
+   }
+   return NULL;
+}
+
+// Called by the reactor for every complete frame. The first frame on a
+// connection determines if it's a storage server or client.
+void handle_frame(Connection *conn, const FrameHeader *hdr, const uint8_t *payload) {
+   switch (conn->kind) {
+      case CONN_UNKNOWN:
+         if (hdr->opcode == OP_HELLO_STORAGE) {
+            conn->kind = CONN_STORAGE;
+         } 
+         else if (hdr->opcode == OP_HELLO_CLIENT) {
+            conn->kind = CONN_CLIENT;
+            register_client(conn);
+            printf("Client connected\n");
+         }
+         else if (hdr->opcode == OP_HELLO_SHARD) {
+            conn->kind = CONN_SHARD;
+            add_peer(conn, hdr, payload, 1);
+         }
+         else if (hdr->opcode == OP_GET_SHARDS) {
+            // Anyone may ask for the map before choosing which shards to join
+            send_shard_map(conn, hdr->request_id);
+         }
+         else {
+            conn_send_error(conn, hdr->request_id, ST_INVALID, "Expected HELLO");
+         }
          break;
-      }      
-      buffer[bytes_received] = '\0';
-
-      printf(" buffer: %s\n",buffer);
-      
-      // Parse client request
-      char command[32];
-      char path[MAX_PATH_LENGTH];
-      sscanf(buffer, "%s %s", command, path);      
-      if (strcmp(command, "GET_SERVER") == 0) {
-         printf("entered\n");
-         // Find appropriate storage server
-         pthread_mutex_lock(&naming_server.lock);
-         StorageServer *server = hash_map_find(&naming_server.path_to_server_map, path);
-
-         if (server) {
-            printf("storage Server found\n");
-            char response[BUFFER_SIZE];
-            sprintf(response, "%s %d", server->ip_address, server->client_port);
-            if(send(client_socket, response, strlen(response), 0) < 0){
-               perror("Failed to send server info to client");
+      case CONN_STORAGE:
+         if (conn->user != NULL) note_storage_alive(conn->user);
+         if (hdr->opcode == OP_HEARTBEAT) {
+            // Storage servers report their in-flight requests with each beat
+            if (conn->user != NULL && hdr->payload_len >= 4) {
+               StorageServer *server = conn->user;
+               PayloadReader reader;
+               payload_reader_init(&reader, payload, hdr->payload_len);
+               __atomic_store_n(&server->outstanding, payload_get_u32(&reader), __ATOMIC_RELAXED);
+               __atomic_store_n(&server->assigned, 0, __ATOMIC_RELAXED);
             }
-         } 
+            break;
+         }
+         else if (hdr->opcode == OP_REGISTER) {
+            handle_storage_server_registration(conn, hdr, payload);
+         }
+         else if (hdr->opcode == OP_CLAIM) {
+            handle_claims(conn, hdr, payload);
+         }
+         else if (hdr->opcode == OP_GET_SHARDS) {
+            send_shard_map(conn, hdr->request_id);
+         }
+         else if (hdr->opcode == OP_LOAD_REPORT && conn->user != NULL) {
+            handle_load_report(conn->user, hdr, payload);
+         }
+         else if ((hdr->opcode == OP_ACK || hdr->opcode == OP_ERROR) && conn->user != NULL) {
+            complete_create(conn->user, hdr, payload);
+         }
          else {
-            printf("No storage server found\n");
-            const char *error = "No server found for the requested path";
-            send(client_socket, error, strlen(error), 0);
+            conn_send_error(conn, hdr->request_id, ST_INVALID, "Unknown command");
          }
-         pthread_mutex_unlock(&naming_server.lock);
+         break;
+      case CONN_CLIENT:
+         if (hdr->opcode == OP_GET_SERVER) {
+            handle_get_server(conn, hdr, payload);
+         }
+         else if (hdr->opcode == OP_GET_SERVERS) {
+            handle_get_servers(conn, hdr, payload);
+         }
+         else if (hdr->opcode == OP_GET_REPLICAS) {
+            handle_get_replicas(conn, hdr, payload);
+         }
+         else if (hdr->opcode == OP_LIST) {
+            handle_list(conn, hdr, payload);
+         }
+         else if (hdr->opcode == OP_CREATE) {
+            handle_create(conn, hdr, payload);
+         }
+         else if (hdr->opcode == OP_SERVER_LOADS) {
+            handle_server_loads(conn, hdr);
+         }
+         else if (hdr->opcode == OP_GET_SHARDS) {
+            send_shard_map(conn, hdr->request_id);
+         }
+         else {
+            conn_send_error(conn, hdr->request_id, ST_INVALID, "Unknown command");
+         }
+         break;
+      case CONN_SHARD:
+         if (conn->user == NULL) {
+            // Our HELLO's answer, on a connection this shard opened
+            if (hdr->opcode == OP_HELLO_SHARD) add_peer(conn, hdr, payload, 0);
+            break;
+         }
+         __atomic_store_n(&((ShardPeer *)conn->user)->last_seen_ms, monotonic_ms(), __ATOMIC_RELEASE);
+         if (hdr->opcode == OP_SHARD_MAP) {
+            handle_peer_shard_map(hdr, payload);
+         }
+         break;
+   }
+}
+
+void handle_close(Connection *conn) {
+   if (conn->kind == CONN_CLIENT) {
+      unregister_client(conn);
+   }
+   if (conn->kind == CONN_SHARD && conn->user != NULL) {
+      remove_peer(conn->user);
+   }
+   if (conn->kind == CONN_STORAGE && conn->user != NULL) {
+      StorageServer *server = conn->user;
+      printf("Lost connection to Storage Server %s:%d\n", server->ip_address, server->nm_port);
+
+      // Stop routing clients to it. One notice covers every location clients
+      // cached for it, however many paths it claimed.
+      pthread_mutex_lock(&naming_server.lock);
+      int was_routable = server_is_available(server);
+      __atomic_store_n(&server->is_active, 0, __ATOMIC_RELEASE);
+      __atomic_store_n(&server->registering, 0, __ATOMIC_RELEASE);
+      if (was_routable) broadcast_server_down(server);
+      // Its replica sets stay in the map and tree for whoever claims the
+      // paths next; the map and tree hold their own copies of the keys
+      for (size_t i = 0; i < server->num_paths; i++) {
+         ReplicaSet *set = path_map_find(&naming_server.path_to_server_map, server->accessible_paths[i]);
+         if (set) replica_remove(set, server);
       }
-   }   
-   close(client_socket);
-}
-
-void* connection_handler(void* socket_desc) {
-   int client_socket = *(int*)socket_desc;
-   free(socket_desc);
-   
-   // First message determines if it's a storage server or client
-   char buffer[BUFFER_SIZE];
-   ssize_t bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-   
-   if (bytes_received > 0) {
-      buffer[bytes_received] = '\0';
-      printf("Received message: %s\n", buffer);
-      if (strcmp(buffer, "STORAGE_SERVER") == 0) {
-         handle_storage_server_registration(client_socket);
-         printf("Storage Server registration..\n");
-      } 
-      else if (strcmp(buffer, "CLIENT") == 0) {
-         handle_client_request(client_socket);
+      PendingCreate *pending;
+      while ((pending = take_pending_create(server, 0)) != NULL) {
+         conn_send_error(pending->client, pending->client_request_id, ST_IO_ERROR,
+                         "Storage server disconnected");
+         conn_put(pending->client);
+         free(pending);
       }
+      free(server->accessible_paths);
+      server->accessible_paths = NULL;
+      server->num_paths = server->paths_capacity = 0;
+      arena_destroy(&server->paths_arena);
+      server->conn = NULL;
+      pthread_mutex_unlock(&naming_server.lock);
+      conn_put(conn);
    }
-   else{
-      perror("recv failed");
-   }
-   
-   return NULL;
 }
 
 int main(int argc, char *argv[]) {
-   if (argc != 2) {
-      printf("Usage: %s <port>\n", argv[0]);
+   const char *policy_name = DEFAULT_REPLICA_POLICY;
+   ShardAddress seed = { "", 0 };
+   int opt;
+   while ((opt = getopt(argc, argv, "r:j:")) != -1) {
+      if (opt == 'r') policy_name = optarg;
+      else if (opt == 'j' && sscanf(optarg, "%15[^:]:%d", seed.ip, &seed.port) == 2) continue;
+      else policy_name = NULL;
+   }
+   naming_server.policy = policy_name ? replica_policy_find(policy_name) : NULL;
+   if ((argc - optind != 1 && argc - optind != 2) || naming_server.policy == NULL) {
+      printf("Usage: %s [-r round-robin|least-outstanding|power-of-two] [-j shard_ip:port] <port> [reactor_threads]\n", argv[0]);
       return 1;
    }
+   argv += optind - 1;
+   argc -= optind - 1;
 
    char ip_address[16] = {0};
    int port = atoi(argv[1]);
+   int reactor_threads = argc == 3 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+   if (reactor_threads < 1) reactor_threads = 1;
 
    // Get the local IP address
    get_local_ip(ip_address);
 
    printf("Naming Server will use IP Address: %s and Port: %d\n", ip_address, port);
+   printf("Replica policy: %s\n", naming_server.policy->name);
 
    int server_socket;
    struct sockaddr_in server_addr;
@@ -239,6 +1136,15 @@ int main(int argc, char *argv[]) {
    // Initialize naming server
    pthread_mutex_init(&naming_server.lock, NULL);
    naming_server.num_storage_servers = 0;
+   path_map_init(&naming_server.path_to_server_map, INITIAL_PATH_CAPACITY);
+   radix_tree_init(&naming_server.path_tree);
+   arena_init(&naming_server.replica_arena, PATH_ARENA_BLOCK_SIZE);
+   pthread_mutex_init(&naming_server.clients_lock, NULL);
+
+   // A lone naming server is a shard map of one
+   strcpy(naming_server.self.ip, ip_address);
+   naming_server.self.port = port;
+   naming_server.ring = hash_ring_create(&naming_server.self, 1);
 
    // Create socket
    server_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -260,42 +1166,31 @@ int main(int argc, char *argv[]) {
    }
 
    // Listen for connections
-   if (listen(server_socket, MAX_STORAGE_SERVERS + MAX_CLIENTS) < 0) {
+   if (listen(server_socket, SOMAXCONN) < 0) {
       perror("Listen failed");
       return 1;
    }
 
    printf("Naming Server started on %s:%d\n", ip_address, port);
 
-   while (1) {
-      struct sockaddr_in client_addr;
-      socklen_t addr_len = sizeof(client_addr);
-      int *client_socket = malloc(sizeof(int));
-      *client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &addr_len);
-
-      if (*client_socket < 0) {
-         perror("Accept failed");
-         free(client_socket);
-         continue;
-      }
-
-      printf("New connection from %s:%d\n",
-            inet_ntoa(client_addr.sin_addr),
-            ntohs(client_addr.sin_port));
-
-      // Create thread to handle connection
-      pthread_t thread_id;
-      if (pthread_create(&thread_id, NULL, connection_handler, (void *)client_socket) < 0) {
-         perror("Thread creation failed");
-         free(client_socket);
-         continue;
-      } 
-      else {
-         printf("Thread created\n");
-      }
+   // All client and storage server sockets are multiplexed by the reactor
+   if (reactor_start(server_socket, reactor_threads, handle_frame, handle_close) < 0) {
+      return 1;
+   }
+   pthread_t heartbeat_thread;
+   if (pthread_create(&heartbeat_thread, NULL, heartbeat_monitor, NULL) != 0) {
+      perror("Failed to start heartbeat monitor");
+      return 1;
+   }
 
-      pthread_detach(thread_id);
+   // Joining shards introduce themselves to one member; its shard map
+   // introduces them to the rest
+   if (seed.port > 0) {
+      pthread_mutex_lock(&naming_server.lock);
+      connect_peer(&seed);
+      pthread_mutex_unlock(&naming_server.lock);
    }
+   pause();
 
    close(server_socket);
    pthread_mutex_destroy(&naming_server.lock);
@@ -1,39 +1,98 @@
 #ifndef _NS_H_
 #define _NS_H_
 
-#define MAX_STORAGE_SERVERS 10
+#include "path_map.h"
+#include "radix_tree.h"
+#include "reactor.h"
+#include "replica_policy.h"
+#include "load_stats.h"
+#include "hash_ring.h"
+
 #define MAX_CLIENTS 50
 #define BUFFER_SIZE 1024
 #define MAX_PATH_LENGTH 256
-#define HASH_TABLE_SIZE 100 // Size of the hash map
+#define INITIAL_PATH_CAPACITY 1024 // Path map grows beyond this as needed
+#define MAX_BATCH_PATHS 16384      // Per-request limit; larger batches are refused
+#define PATH_ARENA_BLOCK_SIZE (64 * 1024)
+#define MAX_REPLICAS 8
+#define DEFAULT_REPLICA_POLICY "power-of-two"
+#define DEFAULT_SERVICE_US 1000          // Assumed until a server reports latency
+#define MIN_FREE_BYTES (64ULL << 20)     // Servers with less get no new paths
 
 typedef struct {
    char ip_address[16];
    int nm_port;
    int client_port;
    int server_port;
-   char accessible_paths[10][MAX_PATH_LENGTH];
-   int num_paths;
+   const char **accessible_paths;     // Interned in paths_arena
+   size_t num_paths;
+   size_t paths_capacity;
+   Arena paths_arena;
    int socket;
-   int is_active;
+   Connection *conn;                  // Referenced until the connection closes
+   uint64_t last_seen_ms;             // Last frame received (monotonic)
+   int is_active;                     // Cleared on eviction or disconnect
+   int suspected;                     // Silent past HEARTBEAT_SUSPECT_MS
+   int registering;                   // More OP_REGISTER batches to come
+   uint32_t outstanding;              // Requests in flight, from its last heartbeat
+   uint32_t assigned;                 // Clients sent to it since that heartbeat
+   LoadReport load;                   // Latest OP_LOAD_REPORT, under the lock
+   int has_load;
+   uint32_t service_us;               // Median request latency, read lock-free
+   uint32_t free_permille;            // Free disk, read lock-free
 } StorageServer;
 
-typedef struct HashNode {
-    char path[MAX_PATH_LENGTH];        // Key: Path
-    StorageServer *server;             // Value: Pointer to StorageServer
-    struct HashNode *next;             // Linked list for collision handling
-} HashNode;
-
+// Every storage server claiming one path. Allocated once per distinct path
+// and never freed, so lock-free readers may hold one indefinitely; writers
+// add and remove members in place under the naming server lock. A set whose
+// members have all left stays in the map and tree and resolves to nothing.
 typedef struct {
-    HashNode *table[HASH_TABLE_SIZE];  // Hash table array
-    pthread_mutex_t lock;              // Mutex for thread safety
-} HashMap;
+   StorageServer *members[MAX_REPLICAS];
+   int count;
+   unsigned int cursor;               // Policy state, e.g. round-robin position
+} ReplicaSet;
 
+// A CREATE the naming server forwarded to the storage server it placed the
+// path on, waiting for that server's answer
+typedef struct PendingCreate {
+   uint32_t id;                       // Request id towards the storage server
+   StorageServer *server;
+   Connection *client;                // Referenced until answered
+   uint32_t client_request_id;
+   char path[MAX_PATH_LENGTH];
+   struct PendingCreate *next;
+} PendingCreate;
+
+// Another naming server shard. Shards keep a connection to each other (one
+// per pair, opened by the lower address or by a joining shard) and their
+// membership is the set of shards connected right now.
+typedef struct {
+   ShardAddress address;
+   Connection *conn;
+   uint64_t last_seen_ms;
+} ShardPeer;
 
 typedef struct {
-    StorageServer storage_servers[MAX_STORAGE_SERVERS];
+    StorageServer **storage_servers;   // Never freed: lock-free lookups may hold them
     int num_storage_servers;
-    HashMap path_to_server_map;        // Hash map for path-to-server mapping
+    int storage_servers_capacity;
+    PathMap path_to_server_map;        // Exact claimed path -> ReplicaSet
+    RadixTree path_tree;               // Claimed prefixes -> ReplicaSet, for longest-prefix lookup
+    Arena replica_arena;               // ReplicaSets
+    const ReplicaPolicy *policy;       // Chooses among a path's replicas, and where new paths go
+    unsigned int placement_cursor;
+    PendingCreate *pending_creates;
+    uint32_t next_forward_id;
+    ShardAddress self;                 // Where this shard listens
+    HashRing *ring;                    // Current shard map; lock-free readers, epoch-retired
+    ShardPeer *peers[MAX_SHARDS];      // Under the lock
+    int num_peers;
+    ShardAddress connecting[MAX_SHARDS]; // Peers being dialed, so maps don't dial twice
+    int num_connecting;
+    Connection **clients;              // Connected clients, for remap pushes
+    int num_clients;
+    int clients_capacity;
+    pthread_mutex_t clients_lock;
     pthread_mutex_t lock;
 } NamingServer;
 
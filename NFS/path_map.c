@@ -0,0 +1,296 @@
+#include "path_map.h"
+#include "epoch.h"
+
+#define SLOT_EMPTY 0ULL
+#define SLOT_TOMBSTONE 1ULL
+#define SLOT_PTR_MASK ((1ULL << 48) - 1)
+#define MAX_LOAD_PERCENT 70
+#define MIGRATE_STEP 64          // Old slots moved per write during a resize
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+   return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t mix64(uint64_t x) {
+   x ^= x >> 33;
+   x *= 0xff51afd7ed558ccdULL;
+   x ^= x >> 33;
+   x *= 0xc4ceb9fe1a85ec53ULL;
+   x ^= x >> 33;
+   return x;
+}
+
+// Word-at-a-time multiply/rotate hash with a murmur finalizer. Much better
+// dispersion than hash*31 for paths sharing long prefixes.
+uint64_t path_hash(const char *key, size_t len) {
+   uint64_t h = 0x9e3779b97f4a7c15ULL ^ (len * 0xc2b2ae3d27d4eb4fULL);
+   const char *p = key;
+   size_t remaining = len;
+
+   while (remaining >= 8) {
+      uint64_t w;
+      memcpy(&w, p, 8);
+      h = rotl64(h ^ (w * 0x87c37b91114253d5ULL), 31) * 0x4cf5ad432745937fULL;
+      p += 8;
+      remaining -= 8;
+   }
+   uint64_t tail = 0;
+   memcpy(&tail, p, remaining);
+   h ^= tail * 0x87c37b91114253d5ULL;
+   return mix64(h);
+}
+
+static inline uint64_t make_slot(PathEntry *entry) {
+   uintptr_t ptr = (uintptr_t)entry;
+   if (ptr & ~SLOT_PTR_MASK) {
+      fprintf(stderr, "Path map entry outside 48-bit address space\n");
+      abort();
+   }
+   return ((entry->hash >> 48) << 48) | ptr;
+}
+
+static inline int slot_is_entry(uint64_t slot) {
+   return slot != SLOT_EMPTY && slot != SLOT_TOMBSTONE;
+}
+
+static inline PathEntry *slot_entry(uint64_t slot) {
+   return (PathEntry *)(uintptr_t)(slot & SLOT_PTR_MASK);
+}
+
+static inline int slot_matches(uint64_t slot, uint64_t hash, const char *key, size_t len) {
+   if (!slot_is_entry(slot) || (slot >> 48) != (hash >> 48)) return 0;
+   PathEntry *entry = slot_entry(slot);
+   return entry->hash == hash && entry->key_len == len && memcmp(entry->key, key, len) == 0;
+}
+
+static PathTable *table_create(size_t capacity) {
+   PathTable *table = malloc(sizeof(PathTable));
+   if (table == NULL) {
+      perror("Path table allocation failed");
+      exit(EXIT_FAILURE);
+   }
+   table->capacity = capacity;
+   table->used = 0;
+   table->tombstones = 0;
+   table->slots = calloc(capacity, sizeof(uint64_t));
+   if (table->slots == NULL) {
+      perror("Path table allocation failed");
+      exit(EXIT_FAILURE);
+   }
+   return table;
+}
+
+static void table_free(void *ptr) {
+   PathTable *table = ptr;
+   free(table->slots);
+   free(table);
+}
+
+// Returns the slot index holding key, or -1. Safe without the lock.
+static ssize_t table_lookup(PathTable *table, uint64_t hash, const char *key, size_t len) {
+   size_t mask = table->capacity - 1;
+   for (size_t i = hash & mask, probes = 0; probes < table->capacity; i = (i + 1) & mask, probes++) {
+      uint64_t slot = __atomic_load_n(&table->slots[i], __ATOMIC_ACQUIRE);
+      if (slot == SLOT_EMPTY) return -1;
+      if (slot_matches(slot, hash, key, len)) return (ssize_t)i;
+   }
+   return -1;
+}
+
+// Places an entry known to be absent. Caller holds the lock.
+static void table_place(PathTable *table, PathEntry *entry) {
+   size_t mask = table->capacity - 1;
+   size_t i = entry->hash & mask;
+   while (1) {
+      uint64_t slot = table->slots[i];
+      if (slot == SLOT_EMPTY || slot == SLOT_TOMBSTONE) {
+         if (slot == SLOT_TOMBSTONE) table->tombstones--;
+         table->used++;
+         __atomic_store_n(&table->slots[i], make_slot(entry), __ATOMIC_RELEASE);
+         return;
+      }
+      i = (i + 1) & mask;
+   }
+}
+
+static void publish_view(PathMap *map, PathTable *active, PathTable *migrating) {
+   PathMapView *view = malloc(sizeof(PathMapView));
+   if (view == NULL) {
+      perror("Path map view allocation failed");
+      exit(EXIT_FAILURE);
+   }
+   view->active = active;
+   view->migrating = migrating;
+   PathMapView *old = map->view;
+   __atomic_store_n(&map->view, view, __ATOMIC_RELEASE);
+   epoch_retire(old, free);
+}
+
+// Moves up to budget slots from the old table. The old table itself is never
+// modified by migration, so readers holding an older view still see every
+// entry. Caller holds the lock.
+static void migrate_step(PathMap *map, size_t budget) {
+   PathTable *old = map->view->migrating;
+   if (old == NULL) return;
+
+   PathTable *active = map->view->active;
+   while (budget-- > 0 && map->migrate_pos < old->capacity) {
+      uint64_t slot = old->slots[map->migrate_pos++];
+      if (!slot_is_entry(slot)) continue;
+      PathEntry *entry = slot_entry(slot);
+      if (table_lookup(active, entry->hash, entry->key, entry->key_len) < 0) {
+         table_place(active, entry);
+      }
+   }
+   if (map->migrate_pos == old->capacity) {
+      publish_view(map, active, NULL);
+      epoch_retire(old, table_free);
+   }
+}
+
+// Starts a resize when the active table is too full. Caller holds the lock.
+static void maybe_grow(PathMap *map) {
+   PathTable *active = map->view->active;
+   if ((active->used + active->tombstones + 1) * 100 < active->capacity * MAX_LOAD_PERCENT) {
+      return;
+   }
+   // Finish any resize still in progress before starting another
+   migrate_step(map, SIZE_MAX);
+   active = map->view->active;
+
+   // Tables full of tombstones are rebuilt at the same size
+   size_t capacity = active->capacity;
+   if ((active->used + 1) * 100 >= capacity * MAX_LOAD_PERCENT / 2) {
+      capacity *= 2;
+   }
+   map->migrate_pos = 0;
+   publish_view(map, table_create(capacity), active);
+}
+
+void path_map_init(PathMap *map, size_t initial_capacity) {
+   size_t capacity = 16;
+   while (capacity < initial_capacity) capacity *= 2;
+   map->view = malloc(sizeof(PathMapView));
+   map->view->active = table_create(capacity);
+   map->view->migrating = NULL;
+   map->migrate_pos = 0;
+   map->count = 0;
+   arena_init(&map->arena, ARENA_BLOCK_SIZE);
+   pthread_mutex_init(&map->lock, NULL);
+}
+
+// Not safe against concurrent readers; only for shutdown
+void path_map_destroy(PathMap *map) {
+   table_free(map->view->active);
+   if (map->view->migrating) table_free(map->view->migrating);
+   free(map->view);
+   arena_destroy(&map->arena);
+   pthread_mutex_destroy(&map->lock);
+}
+
+void *path_map_insert(PathMap *map, const char *key, void *value) {
+   size_t len = strlen(key);
+   uint64_t hash = path_hash(key, len);
+
+   pthread_mutex_lock(&map->lock);
+   migrate_step(map, MIGRATE_STEP);
+
+   PathMapView *view = map->view;
+   ssize_t index = table_lookup(view->active, hash, key, len);
+   PathTable *owner = view->active;
+   if (index < 0 && view->migrating) {
+      owner = view->migrating;
+      index = table_lookup(owner, hash, key, len);
+   }
+   if (index >= 0) {
+      // Entries are shared by both tables, so one store updates both
+      PathEntry *entry = slot_entry(owner->slots[index]);
+      void *previous = entry->value;
+      __atomic_store_n(&entry->value, value, __ATOMIC_RELEASE);
+      pthread_mutex_unlock(&map->lock);
+      return previous;
+   }
+
+   maybe_grow(map);
+
+   PathEntry *entry = arena_alloc(&map->arena, sizeof(PathEntry), _Alignof(PathEntry));
+   entry->hash = hash;
+   entry->value = value;
+   entry->key_len = len;
+   entry->key = arena_strndup(&map->arena, key, len);
+   table_place(map->view->active, entry);
+   map->count++;
+   pthread_mutex_unlock(&map->lock);
+   return NULL;
+}
+
+void *path_map_find(PathMap *map, const char *key) {
+   size_t len = strlen(key);
+   uint64_t hash = path_hash(key, len);
+   void *value = NULL;
+
+   epoch_enter();
+   PathMapView *view = __atomic_load_n(&map->view, __ATOMIC_ACQUIRE);
+   PathTable *tables[2] = { view->active, view->migrating };
+   for (int t = 0; t < 2 && tables[t]; t++) {
+      ssize_t index = table_lookup(tables[t], hash, key, len);
+      if (index >= 0) {
+         uint64_t slot = __atomic_load_n(&tables[t]->slots[index], __ATOMIC_ACQUIRE);
+         if (slot_is_entry(slot)) {
+            value = __atomic_load_n(&slot_entry(slot)->value, __ATOMIC_ACQUIRE);
+         }
+         break;
+      }
+   }
+   epoch_exit();
+   return value;
+}
+
+static int table_erase(PathTable *table, uint64_t hash, const char *key, size_t len, void *expected) {
+   ssize_t index = table_lookup(table, hash, key, len);
+   if (index < 0) return 0;
+   PathEntry *entry = slot_entry(table->slots[index]);
+   if (expected != NULL && entry->value != expected) return 0;
+   __atomic_store_n(&table->slots[index], SLOT_TOMBSTONE, __ATOMIC_RELEASE);
+   table->used--;
+   table->tombstones++;
+   return 1;
+}
+
+int path_map_erase(PathMap *map, const char *key, void *expected) {
+   size_t len = strlen(key);
+   uint64_t hash = path_hash(key, len);
+
+   pthread_mutex_lock(&map->lock);
+   migrate_step(map, MIGRATE_STEP);
+   // The entry memory stays in the arena; readers may still be looking at it
+   int removed = table_erase(map->view->active, hash, key, len, expected);
+   if (map->view->migrating) {
+      removed |= table_erase(map->view->migrating, hash, key, len, expected);
+   }
+   if (removed) map->count--;
+   pthread_mutex_unlock(&map->lock);
+   return removed;
+}
+
+void path_map_iterate(PathMap *map, PathMapVisitor visit, void *ctx) {
+   pthread_mutex_lock(&map->lock);
+   migrate_step(map, SIZE_MAX);
+   PathTable *table = map->view->active;
+   for (size_t i = 0; i < table->capacity; i++) {
+      uint64_t slot = table->slots[i];
+      if (slot_is_entry(slot)) {
+         PathEntry *entry = slot_entry(slot);
+         visit(entry->key, entry->value, ctx);
+      }
+   }
+   pthread_mutex_unlock(&map->lock);
+}
+
+size_t path_map_size(PathMap *map) {
+   pthread_mutex_lock(&map->lock);
+   size_t count = map->count;
+   pthread_mutex_unlock(&map->lock);
+   return count;
+}
@@ -0,0 +1,67 @@
+#ifndef _PATH_MAP_H_
+#define _PATH_MAP_H_
+
+#include "headers.h"
+#include "arena.h"
+#include <stdint.h>
+
+// Growable open-addressing map from path strings to opaque values.
+//
+// Slots are single 64-bit words packing a 16-bit hash fingerprint above a
+// 48-bit entry pointer, so a probe compares fingerprints without touching the
+// entry and most misses never leave the slot array. Keys are interned in an
+// arena next to their entries.
+//
+// Growth is incremental: a resize allocates the larger table and every later
+// write migrates a few slots from the old one, so no single insert pays for a
+// full rehash. Readers are lock-free (see epoch.h) and consult the new table
+// before the old one while a migration is in flight; writers serialize on
+// the map lock.
+
+typedef struct {
+   uint64_t hash;
+   void *value;
+   size_t key_len;
+   const char *key;
+} PathEntry;
+
+typedef struct {
+   size_t capacity;             // Power of two
+   size_t used;                 // Live entries
+   size_t tombstones;
+   uint64_t *slots;
+} PathTable;
+
+typedef struct {
+   PathTable *active;           // Receives all inserts
+   PathTable *migrating;        // Older table still being drained, or NULL
+} PathMapView;
+
+typedef struct {
+   PathMapView *view;           // Swapped atomically, retired through epochs
+   size_t migrate_pos;          // Next slot of view->migrating to move
+   size_t count;
+   Arena arena;                 // Interned keys and entries
+   pthread_mutex_t lock;        // Serializes writers
+} PathMap;
+
+typedef void (*PathMapVisitor)(const char *key, void *value, void *ctx);
+
+uint64_t path_hash(const char *key, size_t len);
+
+void path_map_init(PathMap *map, size_t initial_capacity);
+void path_map_destroy(PathMap *map);
+
+// Inserts key or updates its value. Returns the previous value, if any.
+void *path_map_insert(PathMap *map, const char *key, void *value);
+// Lock-free lookup. Returns NULL if key is absent.
+void *path_map_find(PathMap *map, const char *key);
+// Removes key if it maps to expected (or to anything when expected is NULL).
+// Returns 1 if an entry was removed.
+int path_map_erase(PathMap *map, const char *key, void *expected);
+// Visits every entry under the writer lock; visitors must not call back into
+// the map.
+void path_map_iterate(PathMap *map, PathMapVisitor visit, void *ctx);
+size_t path_map_size(PathMap *map);
+
+#endif
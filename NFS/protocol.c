@@ -0,0 +1,266 @@
+#include "protocol.h"
+
+static void put_be16(uint8_t *p, uint16_t v) {
+   p[0] = v >> 8;
+   p[1] = v;
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+   p[0] = v >> 24;
+   p[1] = v >> 16;
+   p[2] = v >> 8;
+   p[3] = v;
+}
+
+static void put_be64(uint8_t *p, uint64_t v) {
+   put_be32(p, (uint32_t)(v >> 32));
+   put_be32(p + 4, (uint32_t)v);
+}
+
+static uint16_t get_be16(const uint8_t *p) {
+   return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+   return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+          ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t get_be64(const uint8_t *p) {
+   return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+int send_all(int fd, const void *buf, size_t len) {
+   const char *p = buf;
+   while (len > 0) {
+      ssize_t sent = send(fd, p, len, MSG_NOSIGNAL);
+      if (sent < 0) {
+         if (errno == EINTR) continue;
+         return -1;
+      }
+      p += sent;
+      len -= sent;
+   }
+   return 0;
+}
+
+int recv_all(int fd, void *buf, size_t len) {
+   char *p = buf;
+   while (len > 0) {
+      ssize_t received = recv(fd, p, len, 0);
+      if (received < 0 && errno == EINTR) continue;
+      if (received <= 0) return -1;   // Error or orderly shutdown mid-frame
+      p += received;
+      len -= received;
+   }
+   return 0;
+}
+
+void frame_header_encode(const FrameHeader *hdr, uint8_t out[FRAME_HEADER_SIZE]) {
+   put_be16(out, FRAME_MAGIC);
+   out[2] = hdr->opcode;
+   out[3] = hdr->flags;
+   put_be32(out + 4, hdr->request_id);
+   put_be64(out + 8, hdr->payload_len);
+}
+
+int frame_header_decode(const uint8_t in[FRAME_HEADER_SIZE], FrameHeader *hdr) {
+   if (get_be16(in) != FRAME_MAGIC) {
+      return -1;
+   }
+   hdr->opcode = in[2];
+   hdr->flags = in[3];
+   hdr->request_id = get_be32(in + 4);
+   hdr->payload_len = get_be64(in + 8);
+   return 0;
+}
+
+int send_frame(int fd, uint8_t opcode, uint8_t flags, uint32_t request_id,
+               const void *payload, uint64_t payload_len) {
+   FrameHeader hdr = { opcode, flags, request_id, payload_len };
+   uint8_t raw[FRAME_HEADER_SIZE];
+   frame_header_encode(&hdr, raw);
+
+   // Small frames go out in a single segment
+   if (payload_len > 0 && payload_len <= BUFSIZ) {
+      uint8_t frame[FRAME_HEADER_SIZE + BUFSIZ];
+      memcpy(frame, raw, FRAME_HEADER_SIZE);
+      memcpy(frame + FRAME_HEADER_SIZE, payload, payload_len);
+      return send_all(fd, frame, FRAME_HEADER_SIZE + payload_len);
+   }
+   if (send_all(fd, raw, FRAME_HEADER_SIZE) < 0) return -1;
+   if (payload_len > 0 && send_all(fd, payload, payload_len) < 0) return -1;
+   return 0;
+}
+
+int recv_frame_header(int fd, FrameHeader *hdr) {
+   uint8_t raw[FRAME_HEADER_SIZE];
+   if (recv_all(fd, raw, FRAME_HEADER_SIZE) < 0) return -1;
+   if (frame_header_decode(raw, hdr) < 0) {
+      errno = EPROTO;
+      return -1;
+   }
+   return 0;
+}
+
+int recv_frame(int fd, FrameHeader *hdr, uint8_t **payload, size_t max_payload) {
+   *payload = NULL;
+   if (recv_frame_header(fd, hdr) < 0) return -1;
+   if (hdr->payload_len > max_payload) {
+      errno = EMSGSIZE;
+      return -1;
+   }
+   *payload = malloc(hdr->payload_len + 1);
+   if (*payload == NULL) return -1;
+   if (recv_all(fd, *payload, hdr->payload_len) < 0) {
+      free(*payload);
+      *payload = NULL;
+      return -1;
+   }
+   (*payload)[hdr->payload_len] = '\0';
+   return 0;
+}
+
+int discard_payload(int fd, uint64_t len) {
+   char scratch[BUFSIZ];
+   while (len > 0) {
+      size_t chunk = len < sizeof(scratch) ? len : sizeof(scratch);
+      if (recv_all(fd, scratch, chunk) < 0) return -1;
+      len -= chunk;
+   }
+   return 0;
+}
+
+int send_ack(int fd, uint32_t request_id, const char *message) {
+   return send_frame(fd, OP_ACK, 0, request_id, message, message ? strlen(message) : 0);
+}
+
+int send_error(int fd, uint32_t request_id, Status status, const char *message) {
+   PayloadBuilder b;
+   payload_init(&b);
+   payload_put_u32(&b, status);
+   payload_put_str(&b, message ? message : status_str(status));
+   int rc = send_frame(fd, OP_ERROR, 0, request_id, b.data, b.len);
+   payload_free(&b);
+   return rc;
+}
+
+void payload_init(PayloadBuilder *b) {
+   b->data = NULL;
+   b->len = 0;
+   b->cap = 0;
+}
+
+void payload_free(PayloadBuilder *b) {
+   free(b->data);
+   payload_init(b);
+}
+
+static uint8_t *payload_reserve(PayloadBuilder *b, size_t n) {
+   if (b->len + n > b->cap) {
+      size_t cap = b->cap ? b->cap : 64;
+      while (cap < b->len + n) cap *= 2;
+      uint8_t *data = realloc(b->data, cap);
+      if (data == NULL) {
+         perror("Payload allocation failed");
+         exit(EXIT_FAILURE);
+      }
+      b->data = data;
+      b->cap = cap;
+   }
+   uint8_t *p = b->data + b->len;
+   b->len += n;
+   return p;
+}
+
+void payload_put_u8(PayloadBuilder *b, uint8_t v) {
+   *payload_reserve(b, 1) = v;
+}
+
+void payload_put_u16(PayloadBuilder *b, uint16_t v) {
+   put_be16(payload_reserve(b, 2), v);
+}
+
+void payload_put_u32(PayloadBuilder *b, uint32_t v) {
+   put_be32(payload_reserve(b, 4), v);
+}
+
+void payload_put_u64(PayloadBuilder *b, uint64_t v) {
+   put_be64(payload_reserve(b, 8), v);
+}
+
+void payload_put_bytes(PayloadBuilder *b, const void *data, size_t len) {
+   if (len > 0) memcpy(payload_reserve(b, len), data, len);
+}
+
+void payload_put_str(PayloadBuilder *b, const char *s) {
+   size_t len = strlen(s);
+   if (len > UINT16_MAX) len = UINT16_MAX;
+   payload_put_u16(b, (uint16_t)len);
+   payload_put_bytes(b, s, len);
+}
+
+void payload_reader_init(PayloadReader *r, const uint8_t *data, size_t len) {
+   r->data = data;
+   r->len = len;
+   r->pos = 0;
+   r->error = 0;
+}
+
+const uint8_t *payload_get_bytes(PayloadReader *r, size_t len) {
+   if (r->error || r->len - r->pos < len) {
+      r->error = 1;
+      return NULL;
+   }
+   const uint8_t *p = r->data + r->pos;
+   r->pos += len;
+   return p;
+}
+
+uint8_t payload_get_u8(PayloadReader *r) {
+   const uint8_t *p = payload_get_bytes(r, 1);
+   return p ? p[0] : 0;
+}
+
+uint16_t payload_get_u16(PayloadReader *r) {
+   const uint8_t *p = payload_get_bytes(r, 2);
+   return p ? get_be16(p) : 0;
+}
+
+uint32_t payload_get_u32(PayloadReader *r) {
+   const uint8_t *p = payload_get_bytes(r, 4);
+   return p ? get_be32(p) : 0;
+}
+
+uint64_t payload_get_u64(PayloadReader *r) {
+   const uint8_t *p = payload_get_bytes(r, 8);
+   return p ? get_be64(p) : 0;
+}
+
+// Copies a length-prefixed string into out. Strings that do not fit are an
+// error rather than being silently truncated.
+int payload_get_str(PayloadReader *r, char *out, size_t out_size) {
+   uint16_t len = payload_get_u16(r);
+   const uint8_t *p = payload_get_bytes(r, len);
+   if (p == NULL || len >= out_size) {
+      r->error = 1;
+      if (out_size > 0) out[0] = '\0';
+      return -1;
+   }
+   memcpy(out, p, len);
+   out[len] = '\0';
+   return 0;
+}
+
+const char *status_str(Status status) {
+   switch (status) {
+      case ST_OK: return "OK";
+      case ST_INVALID: return "Invalid request";
+      case ST_NOT_FOUND: return "Not found";
+      case ST_IO_ERROR: return "I/O error";
+      case ST_FULL: return "Capacity exhausted";
+      case ST_NOT_OWNER: return "Path not served here";
+      case ST_CONFLICT: return "Delta base changed";
+   }
+   return "Unknown status";
+}
@@ -0,0 +1,175 @@
+#ifndef _PROTOCOL_H_
+#define _PROTOCOL_H_
+
+#include "headers.h"
+#include <stdint.h>
+
+// Every message between the naming server, storage servers and clients is a
+// frame: a fixed 16 byte header followed by payload_len bytes of payload.
+//
+//   0      2        3       4            8                 16
+//   +------+--------+-------+------------+-----------------+
+//   | magic| opcode | flags | request_id |   payload_len   |
+//   +------+--------+-------+------------+-----------------+
+//
+// All integers are big-endian. Bulk file contents travel as OP_DATA frames so
+// the receiver always knows up front how many bytes to expect.
+
+#define FRAME_MAGIC 0x4E46           // "NF"
+#define FRAME_HEADER_SIZE 16
+#define MAX_CONTROL_PAYLOAD (1 << 20) // Upper bound for non-DATA payloads
+
+#define READ_TO_END UINT64_MAX       // READ length covering the rest of the file
+
+// Liveness of the naming server <-> storage server link. Both ends send
+// OP_HEARTBEAT every interval; any frame counts as a sign of life. A peer
+// silent for SUSPECT_MS stops receiving new clients, and one silent for
+// EVICT_MS is dropped.
+#define HEARTBEAT_INTERVAL_MS 100
+#define HEARTBEAT_SUSPECT_MS 300
+#define HEARTBEAT_EVICT_MS 800
+
+// Frame flags
+#define FRAME_F_MORE 0x01            // More DATA frames follow for this reply
+#define FRAME_F_COMPRESSED 0x02      // DATA payload is a compressed chunk (see codec.h)
+#define FRAME_F_CHECKSUM 0x04        // DATA payload ends with the CRC32C of its data
+
+// Options of OP_NEGOTIATE
+#define NEGOTIATE_CHECKSUMS 0x01     // Checksum every DATA frame sent
+
+typedef enum {
+   OP_HELLO_CLIENT = 1,   // Client identifies itself to the naming server
+   OP_HELLO_STORAGE,      // Storage server identifies itself to the naming server
+   OP_REGISTER,           // SS -> NM: ip and ports (first frame only), then a batch
+                          // of count claimed paths; FRAME_F_MORE if more follow
+   OP_GET_SERVER,         // Client -> NM: path
+   OP_SERVER_INFO,        // NM -> Client: ip, client port, matched prefix. Paths
+                          // with several replicas get one chosen per request
+   OP_READ,               // Client -> SS: path, optionally offset and length
+                          // (READ_TO_END for the rest of the file)
+   OP_WRITE,              // Client -> SS: path, total size, durability, sync
+                          // interval (MB), then total size bytes of DATA frames
+   OP_DELETE,             // Client -> SS: path
+   OP_CREATE,             // Client -> SS: path. Client -> NM: path; a path no claim
+                          // covers is placed on a storage server (ACK), else the
+                          // replicas to create it on are returned (REPLICAS_REPLY).
+                          // NM -> SS: path to create and claim
+   OP_INFO,               // Client -> SS: path
+   OP_INFO_REPLY,         // SS -> Client: size, mode
+   OP_STREAM,             // Client -> SS: path
+   OP_DATA,               // Bulk payload bytes
+   OP_ACK,                // Generic success, optional message
+   OP_ERROR,              // Generic failure: status, message
+   OP_LIST,               // Client -> NM: prefix
+   OP_LIST_REPLY,         // NM -> Client: count, then (path, ip, client port)
+   OP_INVALIDATE,         // NM -> Client, unsolicited: prefix whose owner changed
+   OP_GET_SERVERS,        // Client -> NM: count, then paths
+   OP_SERVERS_REPLY,      // NM -> Client: groups of (ip, client port, count, then
+                          // (path index, matched prefix)), then unresolved indices
+   OP_STATS,              // Client -> SS: no payload; ACK carries a text report
+   OP_HEARTBEAT,          // NM -> SS: no payload. SS -> NM: requests in flight
+   OP_SERVER_DOWN,        // NM -> Client, unsolicited: ip, client port of a storage
+                          // server that stopped answering
+   OP_GET_REPLICAS,       // Client -> NM: path
+   OP_REPLICAS_REPLY,     // NM -> Client: matched prefix, count, then (ip, client
+                          // port) per live replica, preferred replica first
+   OP_LOAD_REPORT,        // SS -> NM: LoadReport (see load_stats.h)
+   OP_SERVER_LOADS,       // Client -> NM: no payload; ACK carries a text report
+   OP_HELLO_SHARD,        // NM -> NM: ip, port the sender listens on
+   OP_GET_SHARDS,         // Client/SS -> NM: no payload; answered with OP_SHARD_MAP
+   OP_SHARD_MAP,          // NM -> any: count, then (ip, port) per naming server
+                          // shard. Also pushed unsolicited when membership changes
+   OP_CLAIM,              // SS -> NM: count, then paths claimed after registration,
+                          // e.g. ones a membership change moved to this shard
+   OP_NEGOTIATE,          // Client -> SS: count, then codecs in order of preference,
+                          // then the options wanted. SS -> Client: the codec and
+                          // the options both ends use on this connection
+   OP_SIGNATURES,         // Client -> SS: path, strong hash seed. SS -> Client: size,
+                          // mtime (ns), inode, block size, block count, then the
+                          // block signatures as DATA frames (see delta.h)
+   OP_DELTA_WRITE         // Client -> SS: path, new size, CRC32C of the new contents,
+                          // base size, mtime and inode, block size, durability, sync
+                          // interval (MB), delta size, then the delta as DATA frames
+} Opcode;
+
+typedef enum {
+   ST_OK = 0,
+   ST_INVALID,            // Malformed request
+   ST_NOT_FOUND,          // No such path
+   ST_IO_ERROR,           // Local file system failure
+   ST_FULL,               // Capacity exhausted
+   ST_NOT_OWNER,          // Storage server does not serve this path
+   ST_CONFLICT            // A delta's base is gone, or the delta did not rebuild the
+                          // file; the client sends it whole instead
+} Status;
+
+// How hard a WRITE pushes data to stable storage before it is acknowledged
+typedef enum {
+   DURABILITY_NONE = 0,   // Leave it to the page cache
+   DURABILITY_END,        // fdatasync once before the file is renamed into place
+   DURABILITY_PERIODIC    // fdatasync every sync interval MB and at the end
+} Durability;
+
+typedef struct {
+   uint8_t opcode;
+   uint8_t flags;
+   uint32_t request_id;
+   uint64_t payload_len;
+} FrameHeader;
+
+// Growable payload under construction
+typedef struct {
+   uint8_t *data;
+   size_t len;
+   size_t cap;
+} PayloadBuilder;
+
+// Bounds-checked cursor over a received payload. Any short read sets error and
+// makes all further getters return zero values.
+typedef struct {
+   const uint8_t *data;
+   size_t len;
+   size_t pos;
+   int error;
+} PayloadReader;
+
+// Raw socket helpers that loop over short reads/writes
+int send_all(int fd, const void *buf, size_t len);
+int recv_all(int fd, void *buf, size_t len);
+
+// Pure encoder/decoder, usable on any buffer (blocking or non-blocking I/O)
+void frame_header_encode(const FrameHeader *hdr, uint8_t out[FRAME_HEADER_SIZE]);
+int frame_header_decode(const uint8_t in[FRAME_HEADER_SIZE], FrameHeader *hdr);
+
+// Blocking frame I/O. recv_frame allocates *payload (NUL-terminated for
+// convenience, caller frees) and rejects payloads larger than max_payload.
+int send_frame(int fd, uint8_t opcode, uint8_t flags, uint32_t request_id,
+               const void *payload, uint64_t payload_len);
+int recv_frame_header(int fd, FrameHeader *hdr);
+int recv_frame(int fd, FrameHeader *hdr, uint8_t **payload, size_t max_payload);
+int discard_payload(int fd, uint64_t len);
+
+// Replies shared by every component
+int send_ack(int fd, uint32_t request_id, const char *message);
+int send_error(int fd, uint32_t request_id, Status status, const char *message);
+
+void payload_init(PayloadBuilder *b);
+void payload_free(PayloadBuilder *b);
+void payload_put_u8(PayloadBuilder *b, uint8_t v);
+void payload_put_u16(PayloadBuilder *b, uint16_t v);
+void payload_put_u32(PayloadBuilder *b, uint32_t v);
+void payload_put_u64(PayloadBuilder *b, uint64_t v);
+void payload_put_bytes(PayloadBuilder *b, const void *data, size_t len);
+void payload_put_str(PayloadBuilder *b, const char *s);   // u16 length + bytes
+
+void payload_reader_init(PayloadReader *r, const uint8_t *data, size_t len);
+uint8_t payload_get_u8(PayloadReader *r);
+uint16_t payload_get_u16(PayloadReader *r);
+uint32_t payload_get_u32(PayloadReader *r);
+uint64_t payload_get_u64(PayloadReader *r);
+const uint8_t *payload_get_bytes(PayloadReader *r, size_t len);
+int payload_get_str(PayloadReader *r, char *out, size_t out_size);
+
+const char *status_str(Status status);
+
+#endif
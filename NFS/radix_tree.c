@@ -0,0 +1,287 @@
+#include "radix_tree.h"
+#include "epoch.h"
+
+#define RADIX_MAX_KEY 4096
+
+static RadixNode *node_create(const char *label, size_t len, void *value, RadixChildren *children) {
+   RadixNode *node = malloc(sizeof(RadixNode));
+   char *copy = malloc(len + 1);
+   if (node == NULL || copy == NULL) {
+      perror("Radix node allocation failed");
+      exit(EXIT_FAILURE);
+   }
+   memcpy(copy, label, len);
+   copy[len] = '\0';
+   node->label = copy;
+   node->label_len = len;
+   node->value = value;
+   node->children = children;
+   return node;
+}
+
+// Frees a node replaced by a copy. Its child array lives on in the copy.
+static void node_free(void *ptr) {
+   RadixNode *node = ptr;
+   free(node->label);
+   free(node);
+}
+
+static RadixNode *find_child(const RadixChildren *children, unsigned char first) {
+   if (children == NULL) return NULL;
+   int lo = 0, hi = children->count - 1;
+   while (lo <= hi) {
+      int mid = (lo + hi) / 2;
+      if (children->items[mid].first == first) return children->items[mid].node;
+      if (children->items[mid].first < first) lo = mid + 1;
+      else hi = mid - 1;
+   }
+   return NULL;
+}
+
+// Returns a new sorted array equal to old with node added, or replacing the
+// child that starts with the same byte.
+static RadixChildren *children_with(const RadixChildren *old, RadixNode *node) {
+   unsigned char first = (unsigned char)node->label[0];
+   int old_count = old ? old->count : 0;
+   RadixChildren *children = malloc(sizeof(RadixChildren) + (old_count + 1) * sizeof(children->items[0]));
+   if (children == NULL) {
+      perror("Radix children allocation failed");
+      exit(EXIT_FAILURE);
+   }
+   int n = 0, placed = 0;
+   for (int i = 0; i < old_count; i++) {
+      if (!placed && old->items[i].first >= first) {
+         children->items[n].first = first;
+         children->items[n++].node = node;
+         placed = 1;
+         if (old->items[i].first == first) continue;   // Replaced
+      }
+      children->items[n++] = old->items[i];
+   }
+   if (!placed) {
+      children->items[n].first = first;
+      children->items[n++].node = node;
+   }
+   children->count = n;
+   return children;
+}
+
+static RadixChildren *children_without(const RadixChildren *old, unsigned char first) {
+   if (old->count == 1) return NULL;
+   RadixChildren *children = malloc(sizeof(RadixChildren) + (old->count - 1) * sizeof(children->items[0]));
+   if (children == NULL) {
+      perror("Radix children allocation failed");
+      exit(EXIT_FAILURE);
+   }
+   int n = 0;
+   for (int i = 0; i < old->count; i++) {
+      if (old->items[i].first != first) children->items[n++] = old->items[i];
+   }
+   children->count = n;
+   return children;
+}
+
+// Swaps in a new child array; readers still on the old one keep it alive
+static void publish_children(RadixNode *node, RadixChildren *children) {
+   RadixChildren *old = node->children;
+   __atomic_store_n(&node->children, children, __ATOMIC_RELEASE);
+   if (old) epoch_retire(old, free);
+}
+
+static size_t normalized_length(const char *key) {
+   size_t len = strlen(key);
+   while (len > 0 && key[len - 1] == '/') len--;
+   return len;
+}
+
+void radix_tree_init(RadixTree *tree) {
+   tree->root = node_create("", 0, NULL, NULL);
+   tree->count = 0;
+   pthread_mutex_init(&tree->lock, NULL);
+}
+
+void *radix_tree_insert(RadixTree *tree, const char *key, void *value) {
+   size_t len = normalized_length(key);
+   size_t pos = 0;
+   void *previous = NULL;
+
+   pthread_mutex_lock(&tree->lock);
+   RadixNode *node = tree->root;
+   while (1) {
+      if (pos == len) {
+         previous = node->value;
+         __atomic_store_n(&node->value, value, __ATOMIC_RELEASE);
+         if (previous == NULL) tree->count++;
+         break;
+      }
+
+      RadixNode *child = find_child(node->children, (unsigned char)key[pos]);
+      if (child == NULL) {
+         RadixNode *leaf = node_create(key + pos, len - pos, value, NULL);
+         publish_children(node, children_with(node->children, leaf));
+         tree->count++;
+         break;
+      }
+
+      size_t common = 0;
+      while (common < child->label_len && pos + common < len &&
+             child->label[common] == key[pos + common]) {
+         common++;
+      }
+      if (common == child->label_len) {
+         node = child;
+         pos += common;
+         continue;
+      }
+
+      // Split child: a new node for the shared part takes its place and a
+      // copy of child with the remaining label hangs below it
+      RadixNode *tail = node_create(child->label + common, child->label_len - common,
+                                    child->value, child->children);
+      RadixNode *mid = node_create(child->label, common, NULL, NULL);
+      RadixChildren *mid_children = children_with(NULL, tail);
+      if (pos + common == len) {
+         mid->value = value;
+      } else {
+         RadixNode *leaf = node_create(key + pos + common, len - pos - common, value, NULL);
+         RadixChildren *both = children_with(mid_children, leaf);
+         free(mid_children);
+         mid_children = both;
+      }
+      mid->children = mid_children;
+      publish_children(node, children_with(node->children, mid));
+      epoch_retire(child, node_free);
+      tree->count++;
+      break;
+   }
+   pthread_mutex_unlock(&tree->lock);
+   return previous;
+}
+
+int radix_tree_erase(RadixTree *tree, const char *key, void *expected) {
+   size_t len = normalized_length(key);
+   size_t pos = 0;
+   int removed = 0;
+
+   pthread_mutex_lock(&tree->lock);
+   RadixNode *parent = NULL;
+   RadixNode *node = tree->root;
+   while (pos < len) {
+      RadixNode *child = find_child(node->children, (unsigned char)key[pos]);
+      if (child == NULL || child->label_len > len - pos ||
+          memcmp(child->label, key + pos, child->label_len) != 0) {
+         node = NULL;
+         break;
+      }
+      parent = node;
+      node = child;
+      pos += child->label_len;
+   }
+
+   if (node != NULL && node->value != NULL && (expected == NULL || node->value == expected)) {
+      __atomic_store_n(&node->value, NULL, __ATOMIC_RELEASE);
+      tree->count--;
+      removed = 1;
+      // Prune leaves that no longer carry a claim
+      if (parent != NULL && node->children == NULL) {
+         publish_children(parent, children_without(parent->children, (unsigned char)node->label[0]));
+         epoch_retire(node, node_free);
+      }
+   }
+   pthread_mutex_unlock(&tree->lock);
+   return removed;
+}
+
+void *radix_tree_longest_prefix(RadixTree *tree, const char *path, size_t *matched_len) {
+   return radix_tree_longest_prefix_if(tree, path, NULL, NULL, matched_len);
+}
+
+void *radix_tree_longest_prefix_if(RadixTree *tree, const char *path, RadixFilter accept,
+                                   void *ctx, size_t *matched_len) {
+   size_t len = strlen(path);
+   size_t pos = 0;
+
+   epoch_enter();
+   RadixNode *node = tree->root;
+   void *best = __atomic_load_n(&node->value, __ATOMIC_ACQUIRE);
+   if (best != NULL && accept != NULL && !accept(best, ctx)) best = NULL;
+   size_t best_len = 0;
+   while (pos < len) {
+      RadixChildren *children = __atomic_load_n(&node->children, __ATOMIC_ACQUIRE);
+      RadixNode *child = find_child(children, (unsigned char)path[pos]);
+      if (child == NULL || child->label_len > len - pos ||
+          memcmp(child->label, path + pos, child->label_len) != 0) {
+         break;
+      }
+      node = child;
+      pos += child->label_len;
+
+      // Only whole path components count as a match
+      void *value = __atomic_load_n(&node->value, __ATOMIC_ACQUIRE);
+      if (value != NULL && (pos == len || path[pos] == '/') &&
+          (accept == NULL || accept(value, ctx))) {
+         best = value;
+         best_len = pos;
+      }
+   }
+   epoch_exit();
+
+   if (matched_len) *matched_len = best_len;
+   return best;
+}
+
+// Visits claims in node's subtree. key holds the path down to node's parent;
+// subtrees that diverge from the prefix mid-component (e.g. "fold10" under a
+// walk of "fold1") are skipped.
+static void walk_subtree(RadixNode *node, char *key, size_t key_len, size_t prefix_len,
+                         RadixVisitor visit, void *ctx) {
+   if (key_len + node->label_len >= RADIX_MAX_KEY) return;
+   memcpy(key + key_len, node->label, node->label_len);
+   key_len += node->label_len;
+   key[key_len] = '\0';
+
+   if (prefix_len > 0 && key_len > prefix_len && key[prefix_len] != '/') return;
+
+   void *value = __atomic_load_n(&node->value, __ATOMIC_ACQUIRE);
+   if (value != NULL && key_len >= prefix_len) visit(key, value, ctx);
+
+   RadixChildren *children = __atomic_load_n(&node->children, __ATOMIC_ACQUIRE);
+   for (int i = 0; children && i < children->count; i++) {
+      walk_subtree(children->items[i].node, key, key_len, prefix_len, visit, ctx);
+   }
+}
+
+void radix_tree_walk_prefix(RadixTree *tree, const char *prefix, RadixVisitor visit, void *ctx) {
+   size_t len = normalized_length(prefix);
+   size_t pos = 0;
+   char key[RADIX_MAX_KEY];
+
+   epoch_enter();
+   RadixNode *node = tree->root;
+   while (node != NULL && pos < len) {
+      RadixChildren *children = __atomic_load_n(&node->children, __ATOMIC_ACQUIRE);
+      RadixNode *child = find_child(children, (unsigned char)prefix[pos]);
+      size_t n = child ? child->label_len : 0;
+      if (n > len - pos) n = len - pos;
+      if (child == NULL || memcmp(child->label, prefix + pos, n) != 0) {
+         node = NULL;
+         break;
+      }
+      // The prefix may end part way through the child's label
+      if (pos + child->label_len > len) {
+         memcpy(key, prefix, pos);
+         walk_subtree(child, key, pos, len, visit, ctx);
+         node = NULL;
+         break;
+      }
+      node = child;
+      pos += child->label_len;
+   }
+   if (node != NULL) {
+      // node's own label is the tail of prefix; let walk_subtree re-append it
+      size_t base = pos - node->label_len;
+      memcpy(key, prefix, base);
+      walk_subtree(node, key, base, len, visit, ctx);
+   }
+   epoch_exit();
+}
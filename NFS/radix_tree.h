@@ -0,0 +1,57 @@
+#ifndef _RADIX_TREE_H_
+#define _RADIX_TREE_H_
+
+#include "headers.h"
+
+// Compressed radix tree over path strings, used to let a storage server claim
+// a whole directory subtree with one entry.
+//
+// Lookups resolve to the longest claimed prefix that ends on a path component
+// boundary, so a claim on "fold1" covers "fold1/a/b.c" but not "fold10".
+// Readers are lock-free: node labels and child arrays are immutable once
+// published, writers (serialized on the tree lock) build replacements and
+// swap them in with release stores, retiring the old copies through epochs.
+
+typedef struct RadixNode RadixNode;
+
+typedef struct {
+   int count;
+   struct {
+      unsigned char first;      // First byte of the child's label
+      RadixNode *node;
+   } items[];                   // Sorted by first
+} RadixChildren;
+
+struct RadixNode {
+   char *label;
+   size_t label_len;
+   void *value;                 // Owner of this exact prefix, or NULL
+   RadixChildren *children;     // NULL when the node is a leaf
+};
+
+typedef struct {
+   RadixNode *root;             // Empty label; never replaced
+   size_t count;
+   pthread_mutex_t lock;
+} RadixTree;
+
+typedef void (*RadixVisitor)(const char *key, void *value, void *ctx);
+typedef int (*RadixFilter)(void *value, void *ctx);
+
+void radix_tree_init(RadixTree *tree);
+// Claims key (trailing '/' ignored). Returns the previous owner, if any.
+void *radix_tree_insert(RadixTree *tree, const char *key, void *value);
+// Drops the claim on key if it is owned by expected (or anyone when NULL).
+int radix_tree_erase(RadixTree *tree, const char *key, void *expected);
+// Returns the owner of the longest claimed prefix of path and, if
+// matched_len is non-NULL, the length of that prefix.
+void *radix_tree_longest_prefix(RadixTree *tree, const char *path, size_t *matched_len);
+// Same, but claims whose owner fails accept are passed over in favour of
+// shorter ones
+void *radix_tree_longest_prefix_if(RadixTree *tree, const char *path, RadixFilter accept,
+                                   void *ctx, size_t *matched_len);
+// Visits every claim equal to prefix or below it as a directory, in
+// lexicographic order. An empty prefix visits the whole tree.
+void radix_tree_walk_prefix(RadixTree *tree, const char *prefix, RadixVisitor visit, void *ctx);
+
+#endif
@@ -0,0 +1,299 @@
+#define _GNU_SOURCE   // accept4(), EPOLLEXCLUSIVE
+#include "reactor.h"
+#include <sys/epoll.h>
+
+#define MAX_EVENTS 256
+#define READ_CHUNK (64 * 1024)
+
+typedef struct {
+   int epoll_fd;
+   int listen_fd;
+   pthread_t thread_id;
+} ReactorThread;
+
+static FrameHandler frame_handler;
+static CloseHandler close_handler;
+static ReactorThread **reactor_threads;
+static int num_reactor_threads;
+static unsigned int next_reactor_thread;
+
+void conn_get(Connection *conn) {
+   __atomic_add_fetch(&conn->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void conn_put(Connection *conn) {
+   if (__atomic_sub_fetch(&conn->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+      pthread_mutex_destroy(&conn->out_lock);
+      free(conn->in_buf);
+      free(conn->out_buf);
+      free(conn);
+   }
+}
+
+static int set_nonblocking(int fd) {
+   int flags = fcntl(fd, F_GETFL, 0);
+   if (flags < 0) return -1;
+   return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int buffer_reserve(uint8_t **buf, size_t *cap, size_t needed) {
+   if (needed <= *cap) return 0;
+   size_t new_cap = *cap ? *cap : 4096;
+   while (new_cap < needed) new_cap *= 2;
+   uint8_t *p = realloc(*buf, new_cap);
+   if (p == NULL) return -1;
+   *buf = p;
+   *cap = new_cap;
+   return 0;
+}
+
+// Writes as much of the queued output as the socket accepts. Caller holds
+// out_lock. Returns -1 if the peer is gone.
+static int flush_locked(Connection *conn) {
+   while (conn->out_off < conn->out_len) {
+      ssize_t sent = send(conn->fd, conn->out_buf + conn->out_off,
+                          conn->out_len - conn->out_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (sent < 0) {
+         if (errno == EINTR) continue;
+         if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;   // Wait for EPOLLOUT
+         return -1;
+      }
+      conn->out_off += sent;
+   }
+   conn->out_off = conn->out_len = 0;
+   return 0;
+}
+
+int conn_send_frame(Connection *conn, uint8_t opcode, uint8_t flags, uint32_t request_id,
+                    const void *payload, size_t payload_len) {
+   FrameHeader hdr = { opcode, flags, request_id, payload_len };
+   int rc = -1;
+
+   pthread_mutex_lock(&conn->out_lock);
+   if (!conn->closed &&
+       buffer_reserve(&conn->out_buf, &conn->out_cap,
+                      conn->out_len + FRAME_HEADER_SIZE + payload_len) == 0) {
+      frame_header_encode(&hdr, conn->out_buf + conn->out_len);
+      if (payload_len > 0) {
+         memcpy(conn->out_buf + conn->out_len + FRAME_HEADER_SIZE, payload, payload_len);
+      }
+      conn->out_len += FRAME_HEADER_SIZE + payload_len;
+      rc = flush_locked(conn);
+   }
+   pthread_mutex_unlock(&conn->out_lock);
+   return rc;
+}
+
+int conn_send_ack(Connection *conn, uint32_t request_id, const char *message) {
+   return conn_send_frame(conn, OP_ACK, 0, request_id, message, message ? strlen(message) : 0);
+}
+
+int conn_send_error(Connection *conn, uint32_t request_id, Status status, const char *message) {
+   PayloadBuilder b;
+   payload_init(&b);
+   payload_put_u32(&b, status);
+   payload_put_str(&b, message ? message : status_str(status));
+   int rc = conn_send_frame(conn, OP_ERROR, 0, request_id, b.data, b.len);
+   payload_free(&b);
+   return rc;
+}
+
+void conn_shutdown(Connection *conn) {
+   pthread_mutex_lock(&conn->out_lock);
+   if (!conn->closed) shutdown(conn->fd, SHUT_RDWR);
+   pthread_mutex_unlock(&conn->out_lock);
+}
+
+static void close_connection(Connection *conn) {
+   if (close_handler) close_handler(conn);
+
+   pthread_mutex_lock(&conn->out_lock);
+   conn->closed = 1;
+   epoll_ctl(conn->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+   close(conn->fd);
+   pthread_mutex_unlock(&conn->out_lock);
+
+   conn_put(conn);
+}
+
+// Hands every complete frame in the input buffer to the frame handler.
+// Returns -1 on a protocol violation.
+static int dispatch_frames(Connection *conn) {
+   size_t consumed = 0;
+   while (conn->in_len - consumed >= FRAME_HEADER_SIZE) {
+      FrameHeader hdr;
+      if (frame_header_decode(conn->in_buf + consumed, &hdr) < 0 ||
+          hdr.payload_len > MAX_CONTROL_PAYLOAD) {
+         return -1;
+      }
+      size_t frame_len = FRAME_HEADER_SIZE + hdr.payload_len;
+      if (conn->in_len - consumed < frame_len) break;   // Partial frame, wait for more
+
+      frame_handler(conn, &hdr, conn->in_buf + consumed + FRAME_HEADER_SIZE);
+      consumed += frame_len;
+   }
+   if (consumed > 0) {
+      memmove(conn->in_buf, conn->in_buf + consumed, conn->in_len - consumed);
+      conn->in_len -= consumed;
+   }
+   return 0;
+}
+
+// Drains the socket (required with EPOLLET). Returns -1 when the connection
+// should be closed.
+static int handle_readable(Connection *conn) {
+   while (1) {
+      if (buffer_reserve(&conn->in_buf, &conn->in_cap, conn->in_len + READ_CHUNK) < 0) return -1;
+      ssize_t received = recv(conn->fd, conn->in_buf + conn->in_len, READ_CHUNK, 0);
+      if (received < 0) {
+         if (errno == EINTR) continue;
+         if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+         return -1;
+      }
+      if (received == 0) {
+         // Peer closed; still process anything it sent before leaving
+         dispatch_frames(conn);
+         return -1;
+      }
+      conn->in_len += received;
+      if (dispatch_frames(conn) < 0) return -1;
+   }
+}
+
+// Creates the connection state for fd and adds it to rt's epoll set
+static Connection *add_connection(ReactorThread *rt, int fd, ConnectionKind kind, int refcount) {
+   Connection *conn = calloc(1, sizeof(Connection));
+   if (conn == NULL) {
+      close(fd);
+      return NULL;
+   }
+   conn->fd = fd;
+   conn->epoll_fd = rt->epoll_fd;
+   conn->kind = kind;
+   conn->refcount = refcount;
+   pthread_mutex_init(&conn->out_lock, NULL);
+
+   struct epoll_event ev;
+   ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+   ev.data.ptr = conn;
+   if (epoll_ctl(rt->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      perror("epoll_ctl failed");
+      close(fd);
+      pthread_mutex_destroy(&conn->out_lock);
+      free(conn);
+      return NULL;
+   }
+   return conn;
+}
+
+static void accept_connections(ReactorThread *rt) {
+   while (1) {
+      struct sockaddr_in client_addr;
+      socklen_t addr_len = sizeof(client_addr);
+      int fd = accept4(rt->listen_fd, (struct sockaddr *)&client_addr, &addr_len, SOCK_NONBLOCK);
+      if (fd < 0) {
+         if (errno == EINTR) continue;
+         if (errno != EAGAIN && errno != EWOULDBLOCK) perror("Accept failed");
+         return;
+      }
+
+      printf("New connection from %s:%d\n",
+            inet_ntoa(client_addr.sin_addr),
+            ntohs(client_addr.sin_port));
+
+      // Owned by the reactor until closed
+      add_connection(rt, fd, CONN_UNKNOWN, 1);
+   }
+}
+
+Connection *reactor_connect(const char *ip, int port, ConnectionKind kind) {
+   if (num_reactor_threads == 0) return NULL;
+   int fd = socket(AF_INET, SOCK_STREAM, 0);
+   if (fd < 0) return NULL;
+   struct sockaddr_in addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = inet_addr(ip);
+   addr.sin_port = htons(port);
+   if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || set_nonblocking(fd) < 0) {
+      close(fd);
+      return NULL;
+   }
+   unsigned int i = __atomic_fetch_add(&next_reactor_thread, 1, __ATOMIC_RELAXED);
+   // One reference for the reactor, one for the caller
+   return add_connection(reactor_threads[i % num_reactor_threads], fd, kind, 2);
+}
+
+static void* reactor_loop(void *arg) {
+   ReactorThread *rt = arg;
+   struct epoll_event events[MAX_EVENTS];
+
+   while (1) {
+      int n = epoll_wait(rt->epoll_fd, events, MAX_EVENTS, -1);
+      if (n < 0) {
+         if (errno == EINTR) continue;
+         perror("epoll_wait failed");
+         break;
+      }
+      for (int i = 0; i < n; i++) {
+         Connection *conn = events[i].data.ptr;
+         if (conn == NULL) {
+            accept_connections(rt);
+            continue;
+         }
+
+         int drop = 0;
+         if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            drop = handle_readable(conn) < 0;
+         }
+         if (!drop && (events[i].events & EPOLLOUT)) {
+            pthread_mutex_lock(&conn->out_lock);
+            drop = flush_locked(conn) < 0;
+            pthread_mutex_unlock(&conn->out_lock);
+         }
+         if (drop) close_connection(conn);
+      }
+   }
+   return NULL;
+}
+
+int reactor_start(int listen_fd, int num_threads, FrameHandler on_frame, CloseHandler on_close) {
+   frame_handler = on_frame;
+   close_handler = on_close;
+
+   if (set_nonblocking(listen_fd) < 0) {
+      perror("Failed to make listening socket non-blocking");
+      return -1;
+   }
+
+   reactor_threads = calloc(num_threads, sizeof(ReactorThread *));
+   if (reactor_threads == NULL) return -1;
+   for (int i = 0; i < num_threads; i++) {
+      ReactorThread *rt = malloc(sizeof(ReactorThread));
+      rt->listen_fd = listen_fd;
+      rt->epoll_fd = epoll_create1(0);
+      if (rt->epoll_fd < 0) {
+         perror("epoll_create1 failed");
+         free(rt);
+         return -1;
+      }
+
+      // EPOLLEXCLUSIVE wakes only one reactor per incoming connection
+      struct epoll_event ev;
+      ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+      ev.data.ptr = NULL;
+      if (epoll_ctl(rt->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+         perror("epoll_ctl on listening socket failed");
+         return -1;
+      }
+
+      if (pthread_create(&rt->thread_id, NULL, reactor_loop, rt) != 0) {
+         perror("Reactor thread creation failed");
+         return -1;
+      }
+      pthread_detach(rt->thread_id);
+      reactor_threads[num_reactor_threads++] = rt;
+   }
+   printf("Started %d reactor thread(s)\n", num_threads);
+   return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include "headers.h"
+#include "protocol.h"
+
+// Edge-triggered epoll event loop. Each reactor thread owns an epoll set; the
+// listening socket is shared between them with EPOLLEXCLUSIVE so accepted
+// connections spread across threads, and a connection is only ever read by
+// the thread that accepted it. Frames are reassembled from partial reads and
+// replies are queued and flushed on EPOLLOUT, so no thread ever blocks on a
+// slow peer.
+
+typedef enum {
+   CONN_UNKNOWN = 0,   // Waiting for the HELLO frame
+   CONN_CLIENT,
+   CONN_STORAGE,
+   CONN_SHARD          // Another naming server
+} ConnectionKind;
+
+typedef struct Connection {
+   int fd;
+   int epoll_fd;
+   ConnectionKind kind;
+   void *user;                 // Owner-defined state, e.g. a StorageServer
+   int refcount;
+   int closed;
+
+   uint8_t *in_buf;            // Bytes received but not yet consumed as frames
+   size_t in_len;
+   size_t in_cap;
+
+   pthread_mutex_t out_lock;   // Replies may be queued from any thread
+   uint8_t *out_buf;
+   size_t out_len;
+   size_t out_off;
+   size_t out_cap;
+} Connection;
+
+typedef void (*FrameHandler)(Connection *conn, const FrameHeader *hdr, const uint8_t *payload);
+typedef void (*CloseHandler)(Connection *conn);
+
+// Starts num_threads reactor threads on listen_fd and returns immediately.
+int reactor_start(int listen_fd, int num_threads, FrameHandler on_frame, CloseHandler on_close);
+
+// Opens a connection to ip:port and hands it to one of the reactor threads,
+// for links this process initiates. Returns it with a reference held for
+// the caller, or NULL if the peer cannot be reached.
+Connection *reactor_connect(const char *ip, int port, ConnectionKind kind);
+
+// Queue a frame on a connection. Safe to call from any thread.
+int conn_send_frame(Connection *conn, uint8_t opcode, uint8_t flags, uint32_t request_id,
+                    const void *payload, size_t payload_len);
+int conn_send_ack(Connection *conn, uint32_t request_id, const char *message);
+int conn_send_error(Connection *conn, uint32_t request_id, Status status, const char *message);
+
+// Shuts the socket down from any thread. The owning reactor thread then sees
+// the hangup and closes the connection as if the peer had left.
+void conn_shutdown(Connection *conn);
+
+// Keep a connection alive while it is referenced outside its reactor thread
+void conn_get(Connection *conn);
+void conn_put(Connection *conn);
+
+#endif
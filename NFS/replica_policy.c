@@ -0,0 +1,52 @@
+#include "replica_policy.h"
+#include <time.h>
+
+// Cycles through the replicas regardless of load
+static int choose_round_robin(const uint32_t *loads, int n, unsigned int *cursor) {
+   return __atomic_fetch_add(cursor, 1, __ATOMIC_RELAXED) % n;
+}
+
+// Scans every replica for the fewest outstanding requests; ties go to the
+// earliest, so stale equal loads still converge through the assigned counts
+static int choose_least_outstanding(const uint32_t *loads, int n, unsigned int *cursor) {
+   int best = 0;
+   for (int i = 1; i < n; i++) {
+      if (loads[i] < loads[best]) best = i;
+   }
+   return best;
+}
+
+// Fast per-thread xorshift; the choice only needs to be spread, not secure
+static uint32_t next_random(void) {
+   static __thread uint32_t state;
+   if (state == 0) state = (uint32_t)(uintptr_t)&state ^ (uint32_t)time(NULL) ^ 0x9e3779b9;
+   state ^= state << 13;
+   state ^= state >> 17;
+   state ^= state << 5;
+   return state;
+}
+
+// Samples two distinct replicas and keeps the less loaded. Nearly as good as
+// least-outstanding while staying O(1) and avoiding the herd that forms when
+// every lookup sees the same stale minimum.
+static int choose_power_of_two(const uint32_t *loads, int n, unsigned int *cursor) {
+   if (n == 1) return 0;
+   int a = next_random() % n;
+   int b = next_random() % (n - 1);
+   if (b >= a) b++;
+   return loads[b] < loads[a] ? b : a;
+}
+
+const ReplicaPolicy replica_policies[] = {
+   { "round-robin", choose_round_robin },
+   { "least-outstanding", choose_least_outstanding },
+   { "power-of-two", choose_power_of_two },
+   { NULL, NULL }
+};
+
+const ReplicaPolicy *replica_policy_find(const char *name) {
+   for (const ReplicaPolicy *policy = replica_policies; policy->name; policy++) {
+      if (strcmp(policy->name, name) == 0) return policy;
+   }
+   return NULL;
+}
@@ -0,0 +1,25 @@
+#ifndef _REPLICA_POLICY_H_
+#define _REPLICA_POLICY_H_
+
+#include "headers.h"
+#include <stdint.h>
+
+// Strategies for picking which replica of a path serves a client.
+//
+// A policy sees only the live replicas' current loads (outstanding requests
+// as last reported, plus clients sent there since) and a per-path cursor it
+// may use as state. New policies are added to replica_policies in
+// replica_policy.c.
+
+typedef struct {
+   const char *name;
+   // Returns the index in [0, n) of the replica to use. n is at least 1.
+   int (*choose)(const uint32_t *loads, int n, unsigned int *cursor);
+} ReplicaPolicy;
+
+extern const ReplicaPolicy replica_policies[];
+
+// Looks a policy up by name; NULL if there is none
+const ReplicaPolicy *replica_policy_find(const char *name);
+
+#endif
@@ -1,5 +1,5 @@
 #!/usr/bin/bash
 
-gcc namingServer.c helper.c -o namingServer
-gcc storageServer.c helper.c -o storageServer
-gcc client.c -o client
+gcc namingServer.c helper.c protocol.c reactor.c epoch.c arena.c path_map.c radix_tree.c replica_policy.c load_stats.c hash_ring.c -o namingServer
+gcc storageServer.c helper.c protocol.c transfer.c codec.c crc32c.c checksum_store.c thread_pool.c block_cache.c io_backend.c epoch.c arena.c path_map.c load_stats.c hash_ring.c write_behind.c murmur3.c dedup_store.c delta.c -o storageServer -lz
+gcc client.c protocol.c location_cache.c conn_pool.c transfer.c codec.c crc32c.c hash_ring.c murmur3.c delta.c -o client -lz
@@ -1,354 +1,1927 @@
 #include "headers.h"
 #include "helper.h"
 #include "storageServer.h"
+#include "protocol.h"
+#include "transfer.h"
+#include "thread_pool.h"
+#include "block_cache.h"
+#include "io_backend.h"
+#include "path_map.h"
+#include "load_stats.h"
+#include "write_behind.h"
+#include "codec.h"
+#include "checksum_store.h"
+#include "dedup_store.h"
+#include "delta.h"
+#include <sys/statvfs.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <poll.h>
 
-// Add this function to get all accessible paths
-void get_accessible_paths(const char* base_path, char paths[][MAX_PATH_LENGTH], int* num_paths) {
-   DIR* dir = opendir(base_path);
-   if (dir == NULL) {
-      printf("Failed to open directory: %s\n", base_path);
-      return;
-   }
-   struct dirent* entry;
-   char full_path[MAX_PATH_LENGTH];
+ThreadPool worker_pool;
+BlockCache block_cache;
+LoadStats load_stats;
+CodecStats codec_stats;
+int client_epoll_fd;
 
-   while ((entry = readdir(dir)) != NULL) {
-      // Skip . and .. directories
-      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-         continue;
-      }
-      // Construct full path for the file/directory
-      snprintf(full_path, MAX_PATH_LENGTH, "%s/%s", base_path, entry->d_name);
+// Small uploads are logged and written out in batches when -b is given
+WriteBehind write_behind;
+int write_behind_enabled;
 
-      if (entry->d_type == DT_REG) {
-         snprintf(paths[*num_paths], MAX_PATH_LENGTH, "%s", full_path);
-         (*num_paths)++;
-      } else if (entry->d_type == DT_DIR) {
-         get_accessible_paths(full_path, paths, num_paths);
-      }
+// Files written here get per-block checksums, checked on read, when -k is
+// given
+ChecksumStore checksum_store;
+int checksums_enabled;
+
+// Files written here are kept as deduplicated chunks when -d is given
+DedupStore dedup_store;
+int dedup_enabled;
+
+// Files rewritten from a delta against their previous version
+DeltaStats delta_stats;
+
+// Paths and directories registered with the naming server, plus any it
+// places here later. Lookups are lock-free, so workers never wait on it.
+PathMap claimed_paths;
+
+// 1 if any component of path is ".."
+static int has_parent_component(const char *path) {
+   const char *p = path;
+   while ((p = strstr(p, "..")) != NULL) {
+      if ((p == path || p[-1] == '/') && (p[2] == '\0' || p[2] == '/')) return 1;
+      p += 2;
    }
-   closedir(dir);
+   return 0;
 }
 
-void handle_create(const char* path) {
+// 1 if path is a claimed path or lies below a claimed directory. Costs one
+// hash lookup per path component, however many claims there are.
+int path_is_claimed(const char *path) {
+   if (has_parent_component(path)) return 0;   // Never let a request escape a claim
+   char prefix[MAX_PATH_LENGTH];
+   if (snprintf(prefix, sizeof(prefix), "%s", path) >= (int)sizeof(prefix)) return 0;
+   while (1) {
+      if (path_map_find(&claimed_paths, prefix) != NULL) return 1;
+      char *slash = strrchr(prefix, '/');
+      if (slash == NULL) return 0;
+      *slash = '\0';
+   }
+}
+
+// Creates a file, or a directory when path ends in '/'
+void handle_create(int client_socket, uint32_t request_id, const char* path) {
+   size_t len = strlen(path);
+   if (len > 0 && path[len - 1] == '/') {
+      if (mkdir(path, 0755) == 0) {
+         printf("Created directory: %s\n", path);
+         send_ack(client_socket, request_id, "Directory created");
+         return;
+      }
+      int error = errno;   // perror may clobber it
+      perror("Directory creation failed");
+      send_error(client_socket, request_id, ST_IO_ERROR, strerror(error));
+      return;
+   }
+   struct stat old_stat;
+   int existed = stat(path, &old_stat) == 0 && S_ISREG(old_stat.st_mode);
    FILE* file = fopen(path, "w");
    if (file != NULL) {
       fclose(file);
+      // Truncating a deduplicated file leaves nothing for its chunks to fill
+      if (existed && dedup_enabled) dedup_store_remove(&dedup_store, &old_stat);
       printf("Created file: %s\n", path);
+      send_ack(client_socket, request_id, "File created");
    } else {
+      int error = errno;   // perror may clobber it
       perror("File creation failed");
+      send_error(client_socket, request_id, ST_IO_ERROR, strerror(error));
    }
 }
 
-void handle_delete(const char* path) {
-   if (remove(path) == 0) {
+void handle_delete(int client_socket, uint32_t request_id, const char* path) {
+   struct stat old_stat;
+   int existed = stat(path, &old_stat) == 0;
+   if (io_remove(path) == 0) {
+      if (existed) block_cache_invalidate_file(&block_cache, old_stat.st_dev, old_stat.st_ino);
+      if (existed && checksums_enabled && S_ISREG(old_stat.st_mode)) {
+         checksum_store_remove(&checksum_store, &old_stat);
+      }
+      if (existed && dedup_enabled && S_ISREG(old_stat.st_mode)) dedup_store_remove(&dedup_store, &old_stat);
       printf("Deleted: %s\n", path);
+      send_ack(client_socket, request_id, "Deleted");
    } else {
+      int error = errno;   // perror may clobber it
       perror("Delete failed");
+      send_error(client_socket, request_id, ST_IO_ERROR, strerror(error));
+   }
+}
+
+// The handlers below return 1 if the connection can serve another request,
+// or 0 after closing it because the reply could not be delivered.
+
+// Checks the blocks of a cached read that were just loaded from disk, whose
+// checksums have been taken, against the stored ones. If none are stored and
+// the read loaded the whole file, they are saved instead. Returns 0 if a
+// block does not match.
+static int check_loaded_blocks(const struct stat *file_stat, uint64_t first, int num_blocks,
+                               CachedBlock **blocks, const int *misses, int num_misses) {
+   uint32_t stored[CACHE_MAX_READ / CACHE_BLOCK_SIZE + 1];
+   if (checksum_store_load(&checksum_store, file_stat, first, num_blocks, stored) == 0) {
+      for (int i = 0; i < num_misses; i++) {
+         if (!checksum_store_check(&checksum_store, stored[misses[i]], blocks[misses[i]]->crc)) return 0;
+      }
+      return 1;
    }
+   if (first == 0 && (uint64_t)num_blocks * CACHE_BLOCK_SIZE >= (uint64_t)file_stat->st_size) {
+      BlockChecksums sums;
+      block_checksums_init(&sums, CACHE_BLOCK_SIZE);
+      for (int i = 0; i < num_blocks; i++) {
+         if (blocks[i]->has_crc) block_checksums_add(&sums, blocks[i]->crc);
+         else block_checksums_update(&sums, blocks[i]->data, blocks[i]->len);
+      }
+      checksum_store_save(&checksum_store, file_stat, &sums);
+      block_checksums_free(&sums);
+   }
+   return 1;
 }
 
-void handle_read(int client_socket, const char* path) {
-   // Receive the file path from the client
-   int bytes_received = recv(client_socket, path, sizeof(path), 0);
-   if (bytes_received <= 0) {
-      perror("Failed to receive file path from client");
+// Serves count bytes at offset from the block cache, loading missing blocks
+// from the file and checking them against any stored checksums. Returns 1
+// when the reply (or an error for a corrupt block) was sent, 0 if the connection had
+// to be closed and -1 if nothing was sent because the file changed under us
+// (the caller then falls back to the uncached path).
+static int send_cached_range(int client_socket, uint32_t request_id, const char *path,
+                             const struct stat *file_stat, uint64_t offset, uint64_t count,
+                             DataEncoder *enc) {
+   FileVersion version;
+   file_version_from_stat(&version, file_stat);
+   size_t block_size = block_cache.block_size;
+   uint64_t first = offset / block_size;
+   int num_blocks = count ? (offset + count - 1) / block_size - first + 1 : 0;
+   CachedBlock *blocks[CACHE_MAX_READ / CACHE_BLOCK_SIZE + 1];
+   struct iovec iov[CACHE_MAX_READ / CACHE_BLOCK_SIZE + 2];
+
+   // Take what is cached, then read every missing block in one batch
+   IoRead reads[CACHE_MAX_READ / CACHE_BLOCK_SIZE + 1];
+   int misses[CACHE_MAX_READ / CACHE_BLOCK_SIZE + 1];
+   int num_misses = 0, loaded = 0, ok = 1, intact = 1;
+   for (; loaded < num_blocks; loaded++) {
+      uint64_t index = first + loaded;
+      blocks[loaded] = block_cache_get(&block_cache, &version, index);
+      if (blocks[loaded] != NULL) continue;
+      uint64_t start = index * block_size;
+      size_t len = file_stat->st_size - start < block_size ? file_stat->st_size - start : block_size;
+      blocks[loaded] = block_cache_alloc(&block_cache, len);
+      if (blocks[loaded] == NULL) {
+         ok = 0;
+         break;
+      }
+      reads[num_misses] = (IoRead){ blocks[loaded]->data, len, start, 0 };
+      misses[num_misses++] = loaded;
+   }
+
+   if (ok && num_misses > 0) {
+      // The file may have been replaced since the caller's stat
+      struct stat current;
+      FileVersion opened;
+      int fd = open(path, O_RDONLY);
+      ok = fd >= 0 && fstat(fd, &current) == 0;
+      if (ok) {
+         file_version_from_stat(&opened, &current);
+         ok = file_version_equal(&opened, &version) && io_read_batch(fd, reads, num_misses) == 0;
+      }
+      for (int i = 0; ok && i < num_misses; i++) {
+         ok = reads[i].result == (ssize_t)reads[i].len;
+      }
+      // Blocks keep their checksum in the cache, for checksummed replies
+      for (int i = 0; ok && (checksums_enabled || enc->checksums) && i < num_misses; i++) {
+         CachedBlock *block = blocks[misses[i]];
+         block->crc = data_checksum(&codec_stats, 0, block->data, block->len);
+         block->has_crc = 1;
+      }
+      // Whatever is cached has passed this check already
+      if (ok && checksums_enabled) {
+         intact = check_loaded_blocks(file_stat, first, num_blocks, blocks, misses, num_misses);
+      }
+      for (int i = 0; ok && intact && i < num_misses; i++) {
+         block_cache_insert(&block_cache, &version, first + misses[i], blocks[misses[i]]);
+      }
+      if (fd >= 0) close(fd);
+   }
+
+   int rc = -1;
+   if (ok && !intact) {
+      printf("Stored checksum mismatch in %s\n", path);
+      rc = send_error(client_socket, request_id, ST_IO_ERROR, "Stored checksum mismatch") < 0 ? 0 : 1;
+   }
+   else if (ok && data_encoder_transforms(enc)) {
+      // Blocks are no larger than a chunk, so each becomes one DATA frame
+      rc = num_blocks == 0 ? (send_frame(client_socket, OP_DATA, 0, request_id, NULL, 0) < 0 ? 0 : 1) : 1;
+      for (int i = 0; rc == 1 && i < num_blocks; i++) {
+         uint64_t block_start = (first + i) * block_size;
+         size_t from = i == 0 ? offset - block_start : 0;
+         size_t to = offset + count - block_start < blocks[i]->len ? offset + count - block_start : blocks[i]->len;
+         uint8_t flags = i + 1 < num_blocks ? FRAME_F_MORE : 0;
+         int sent;
+         if (enc->checksums && enc->codec == CODEC_NONE && blocks[i]->has_crc && to - from == blocks[i]->len) {
+            sent = send_checksummed_frame(client_socket, flags, request_id, blocks[i]->data, to - from,
+                                          blocks[i]->crc);
+         }
+         else {
+            sent = send_data_chunk(client_socket, flags, request_id, enc, blocks[i]->data + from, to - from);
+         }
+         if (sent < 0) rc = 0;
+      }
+   }
+   else if (ok) {
+      FrameHeader hdr = { OP_DATA, 0, request_id, count };
+      uint8_t raw[FRAME_HEADER_SIZE];
+      frame_header_encode(&hdr, raw);
+      iov[0].iov_base = raw;
+      iov[0].iov_len = FRAME_HEADER_SIZE;
+      for (int i = 0; i < num_blocks; i++) {
+         uint64_t block_start = (first + i) * block_size;
+         size_t from = i == 0 ? offset - block_start : 0;
+         size_t to = offset + count - block_start < blocks[i]->len ? offset + count - block_start : blocks[i]->len;
+         iov[i + 1].iov_base = blocks[i]->data + from;
+         iov[i + 1].iov_len = to - from;
+      }
+      rc = send_iov_all(client_socket, iov, num_blocks + 1) < 0 ? 0 : 1;
+   }
+   for (int i = 0; i < loaded; i++) block_cache_release(blocks[i]);
+   if (rc == 0) {
+      perror("Failed to send file content to client");
       close(client_socket);
-      return;
+   }
+   return rc;
+}
+
+// Sends count bytes of fd at offset as one zero-copy DATA frame, with a
+// checksum combined from the stored block checksums rather than read from
+// the data. A whole-file read finds them computed first if none are stored.
+// Returns 0 once a reply went out, -1 if sending failed, and 1 without
+// sending anything if the checksums are not available.
+static int send_stored_range(int client_socket, uint32_t request_id, const char *path, int fd,
+                             const struct stat *file_stat, uint64_t offset, uint64_t count) {
+   uint32_t crc;
+   int rc = checksum_store_range(&checksum_store, fd, file_stat, offset, count, &crc);
+   if (rc < 0 && errno != EBADMSG && offset == 0 && count == (uint64_t)file_stat->st_size &&
+       checksum_store_build(&checksum_store, fd, file_stat) == 0) {
+      rc = checksum_store_range(&checksum_store, fd, file_stat, offset, count, &crc);
+   }
+   if (rc < 0 && errno == EBADMSG) {
+      printf("Stored checksum mismatch in %s\n", path);
+      return send_error(client_socket, request_id, ST_IO_ERROR, "Stored checksum mismatch");
+   }
+   if (rc < 0) return 1;
+   return send_file_frame_checksummed(client_socket, 0, request_id, fd, offset, count, crc);
+}
+
+// Sends count bytes at offset of a deduplicated file, reassembled from its
+// chunks. Reads small enough for the cache load and check every chunk before
+// replying, and keep them cached; larger ones check only the first and send
+// whole chunks straight from their files. Unless the data is compressed the
+// reply is one DATA frame, whose checksum is combined from the chunks' stored
+// ones. Returns 1 when the reply (or an error for an unreadable chunk) was
+// sent, 0 if the connection had to be closed.
+static int send_manifest_range(int client_socket, uint32_t request_id, const char *path,
+                               const DedupManifest *manifest, uint64_t offset, uint64_t count,
+                               DataEncoder *enc) {
+   int keep = count <= CACHE_MAX_READ;
+   uint32_t first = dedup_manifest_find(manifest, offset);
+   uint32_t num = count ? dedup_manifest_find(manifest, offset + count - 1) - first + 1 : 0;
+   CachedBlock **blocks = calloc(num + 1, sizeof(CachedBlock *));
+   struct iovec *iov = calloc(num + 1, sizeof(struct iovec));
+   if (blocks == NULL || iov == NULL) {
+      perror("Failed to allocate a read");
+      free(blocks);
+      free(iov);
+      send_error(client_socket, request_id, ST_FULL, "Out of memory");
+      close(client_socket);
+      return 0;
+   }
+   int error = 0;
+   for (uint32_t i = 0; !error && i < (keep ? num : num > 0); i++) {
+      blocks[i] = dedup_chunk_get(&dedup_store, &block_cache, &manifest->chunks[first + i], keep);
+      if (blocks[i] == NULL) error = errno;
+   }
+
+   int rc = 1;
+   if (error) {
+      printf("Failed to read a chunk of %s: %s\n", path, strerror(error));
+      rc = send_error(client_socket, request_id, ST_IO_ERROR,
+                      error == EBADMSG ? "Stored checksum mismatch" : strerror(error)) < 0 ? 0 : 1;
+   }
+   else if (enc->codec != CODEC_NONE) {
+      // Chunks are no larger than a codec chunk, so each piece is one frame
+      if (num == 0 && send_frame(client_socket, OP_DATA, 0, request_id, NULL, 0) < 0) rc = 0;
+      for (uint32_t i = 0; rc && i < num; i++) {
+         const DedupChunk *chunk = &manifest->chunks[first + i];
+         uint64_t from = offset > chunk->offset ? offset - chunk->offset : 0;
+         uint64_t to = offset + count - chunk->offset < chunk->len ? offset + count - chunk->offset : chunk->len;
+         if (blocks[i] == NULL) blocks[i] = dedup_chunk_get(&dedup_store, &block_cache, chunk, 0);
+         if (blocks[i] == NULL ||
+             send_data_chunk(client_socket, i + 1 < num ? FRAME_F_MORE : 0, request_id, enc,
+                             blocks[i]->data + from, to - from) < 0) {
+            rc = 0;
+         }
+         if (!keep && blocks[i]) {
+            block_cache_release(blocks[i]);
+            blocks[i] = NULL;
+         }
+      }
    }
    else {
-      printf("Received file path from client: %s\n", path);
+      uint8_t flags = enc->checksums ? FRAME_F_CHECKSUM : 0;
+      if (send_data_header(client_socket, flags, request_id,
+                           count + (enc->checksums ? CHECKSUM_TRAILER_SIZE : 0)) < 0) {
+         rc = 0;
+      }
+      uint32_t crc = 0;
+      int pieces = 0;
+      for (uint32_t i = 0; rc && i < num; i++) {
+         const DedupChunk *chunk = &manifest->chunks[first + i];
+         uint64_t from = offset > chunk->offset ? offset - chunk->offset : 0;
+         uint64_t to = offset + count - chunk->offset < chunk->len ? offset + count - chunk->offset : chunk->len;
+         int whole = from == 0 && to == chunk->len;
+         // Only the pieces of chunks cut by the range need their data here
+         if (blocks[i] == NULL && !whole) blocks[i] = dedup_chunk_get(&dedup_store, &block_cache, chunk, 0);
+         if (blocks[i] == NULL && !whole) {
+            rc = 0;
+            break;
+         }
+         if (enc->checksums) {
+            uint32_t piece = whole ? chunk->crc : data_checksum(&codec_stats, 0, blocks[i]->data + from, to - from);
+            crc = crc32c_combine(crc, piece, to - from);
+         }
+         if (blocks[i]) {
+            iov[pieces].iov_base = blocks[i]->data + from;
+            iov[pieces++].iov_len = to - from;
+            continue;
+         }
+         int fd = dedup_chunk_open(&dedup_store, chunk);
+         if ((pieces > 0 && send_iov_all(client_socket, iov, pieces) < 0) || fd < 0 ||
+             send_file_range(client_socket, fd, 0, chunk->len) < 0) {
+            rc = 0;
+         }
+         pieces = 0;
+         if (fd >= 0) close(fd);
+      }
+      if (rc && pieces > 0 && send_iov_all(client_socket, iov, pieces) < 0) rc = 0;
+      if (rc && enc->checksums) {
+         uint8_t trailer[CHECKSUM_TRAILER_SIZE] = { crc >> 24, crc >> 16, crc >> 8, crc };
+         if (send_all(client_socket, trailer, sizeof(trailer)) < 0) rc = 0;
+      }
+   }
+   for (uint32_t i = 0; i < num; i++) {
+      if (blocks[i]) block_cache_release(blocks[i]);
+   }
+   free(blocks);
+   free(iov);
+   if (rc == 0) {
+      perror("Failed to send file content to client");
+      close(client_socket);
+   }
+   return rc;
+}
+
+// The manifest of a deduplicated file, referenced, in *manifest, or NULL if
+// the file is stored as is. Returns -1 for a placeholder whose manifest is of
+// another version (touched, say): its own content is only zeros.
+static int lookup_manifest(const struct stat *st, DedupManifest **manifest) {
+   *manifest = dedup_enabled ? dedup_store_lookup(&dedup_store, st) : NULL;
+   return dedup_enabled && *manifest == NULL && errno == ESTALE ? -1 : 0;
+}
+
+// Sends length bytes of path starting at offset, clamped to the end of the
+// file. The DATA frame header announces the exact count before any data, so
+// a client can tell a short file from a broken transfer and resume.
+int handle_read(int client_socket, uint32_t request_id, const char* path,
+                uint64_t offset, uint64_t length, DataEncoder *enc) {
+   printf("Read request for: %s\n", path);
+
+   struct stat file_stat;
+   int found = stat(path, &file_stat) == 0 && S_ISREG(file_stat.st_mode);
+   DedupManifest *manifest = NULL;
+   if (found && lookup_manifest(&file_stat, &manifest) < 0) {
+      send_error(client_socket, request_id, ST_IO_ERROR, "File changed outside the server");
+      return 1;
+   }
+   if (manifest != NULL) {
+      int rc = 1;
+      if (offset > (uint64_t)file_stat.st_size) {
+         send_error(client_socket, request_id, ST_INVALID, "Range not satisfiable");
+      }
+      else {
+         uint64_t available = file_stat.st_size - offset;
+         uint64_t count = length < available ? length : available;
+         rc = send_manifest_range(client_socket, request_id, path, manifest, offset, count, enc);
+         if (rc) load_stats_add_bytes(&load_stats, count, 0);
+      }
+      dedup_manifest_release(&dedup_store, manifest);
+      return rc;
+   }
+
+   // Reads of hot files and of small pieces of big ones come from RAM
+   if (block_cache.max_bytes > 0 && found && offset <= (uint64_t)file_stat.st_size) {
+      uint64_t available = file_stat.st_size - offset;
+      uint64_t count = length < available ? length : available;
+      if (count <= CACHE_MAX_READ) {
+         int rc = send_cached_range(client_socket, request_id, path, &file_stat, offset, count, enc);
+         if (rc > 0) load_stats_add_bytes(&load_stats, count, 0);
+         if (rc >= 0) return rc;
+      }
    }
 
    // Open the requested file
-   FILE *file = fopen(path, "rb");
-   if (!file) {
+   int fd = open(path, O_RDONLY);
+   if (fd < 0) {
       perror("Failed to open file");
-      const char *error_msg = "Error: File not found or unable to open\n";
-      send(client_socket, error_msg, strlen(error_msg) + 1, 0);
-      close(client_socket);
-      return;
+      send_error(client_socket, request_id, ST_NOT_FOUND, "File not found or unable to open");
+      return 1;
    }
    else{
       printf("File opened successfully\n");
    }
-   // Send the file contents to the client
-   char buffer[BUFFER_SIZE];
-   size_t bytes_read;
 
-   while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-      if (send(client_socket, buffer, bytes_read, 0) < 0) {
-         perror("Failed to send file content to client");
-         fclose(file);
-         close(client_socket);
-         return;
+   int whole_file = offset == 0 && length == READ_TO_END;
+   int rc;
+   uint64_t sent = 0;
+   if (fstat(fd, &file_stat) != 0) {
+      rc = send_error(client_socket, request_id, ST_IO_ERROR, strerror(errno));
+   }
+   else if (whole_file && !S_ISREG(file_stat.st_mode)) {
+      // Pipes and devices stream until they end
+      rc = send_file_reply(client_socket, request_id, fd, enc);
+   }
+   else if (!S_ISREG(file_stat.st_mode) || offset > (uint64_t)file_stat.st_size) {
+      rc = send_error(client_socket, request_id, ST_INVALID, "Range not satisfiable");
+   }
+   else {
+      uint64_t available = file_stat.st_size - offset;
+      sent = length < available ? length : available;
+      // A checksum the store can vouch for keeps the body zero-copy
+      rc = 1;
+      if (checksums_enabled && enc->checksums && enc->codec == CODEC_NONE) {
+         rc = send_stored_range(client_socket, request_id, path, fd, &file_stat, offset, sent);
       }
+      if (rc > 0) {
+         rc = data_encoder_transforms(enc) ? send_file_compressed(client_socket, request_id, fd, offset, sent, enc)
+                                           : send_file_frame(client_socket, 0, request_id, fd, offset, sent);
+      }
+   }
+   if (rc == 0) load_stats_add_bytes(&load_stats, sent, 0);
+   close(fd);
+   if (rc < 0) {
+      perror("Failed to send file content to client");
+      close(client_socket);
+      return 0;
    }
-   // Send an EOF marker or a message indicating the end of the file
-   const char *end_msg = "END_OF_FILE";
-   send(client_socket, end_msg, strlen(end_msg) + 1, 0);
+   return 1;
+}
 
-   // Close the file and the client socket
-   fclose(file);
-   close(client_socket);
+// Makes a rename in path's directory durable
+static void sync_parent_dir(const char *path) {
+   char dir[MAX_PATH_LENGTH];
+   snprintf(dir, sizeof(dir), "%s", path);
+   char *slash = strrchr(dir, '/');
+   if (slash == NULL) strcpy(dir, ".");
+   else if (slash == dir) dir[1] = '\0';
+   else *slash = '\0';
+   int fd = open(dir, O_RDONLY | O_DIRECTORY);
+   if (fd >= 0) {
+      fsync(fd);
+      close(fd);
+   }
 }
 
-void handle_write(int client_socket) {
-   char file_path[256];
-   char data[1024];
+// An upload being received into a temporary file beside its destination,
+// which is renamed into place once complete so readers never see a partial
+// file. After a local failure the rest of the upload is still taken in, so
+// the connection stays usable for the error reply.
+typedef struct {
+   char temp_path[MAX_PATH_LENGTH + 8];
+   int fd;
+   int created;
+   int error;                   // First local failure, as an errno
+   uint8_t *buffer;             // WRITE_BUFFER_SIZE bytes, written out when full
+   size_t buffered;
+   uint64_t flushed;            // Bytes written out so far
+   uint64_t synced;
+   uint64_t sync_interval;      // 0 for no periodic sync
+   uint64_t total_size;
+   BlockChecksums block_sums;   // Taken as the data goes to disk
+   BlockChecksums *sums;
+   DedupWriter dedup;           // Deduplicated files keep their data, and its
+   DedupWriter *chunker;        // checksums, in the chunk store
+} Upload;
 
-   // Receive file path
-   if (recv(client_socket, file_path, sizeof(file_path), 0) <= 0) {
-      perror("Failed to receive file path");
-      close(client_socket);
-      return;
+static void upload_begin(Upload *up, const char *file_path, uint64_t total_size, Durability durability,
+                         uint32_t sync_interval_mb) {
+   snprintf(up->temp_path, sizeof(up->temp_path), "%s.XXXXXX", file_path);
+   up->fd = mkstemp(up->temp_path);
+   up->created = up->fd >= 0;
+   up->error = up->created ? 0 : errno;
+   up->buffer = io_fixed_buffer();
+   if (up->buffer == NULL && up->error == 0) up->error = ENOMEM;
+   if (up->created) io_use_file(up->fd);
+   up->buffered = 0;
+   up->flushed = up->synced = 0;
+   up->sync_interval = durability == DURABILITY_PERIODIC ? (uint64_t)sync_interval_mb << 20 : 0;
+   up->total_size = total_size;
+   block_checksums_init(&up->block_sums, CACHE_BLOCK_SIZE);
+   up->sums = checksums_enabled ? &up->block_sums : NULL;
+   up->chunker = NULL;
+   if (dedup_enabled && up->created && total_size >= DEDUP_MIN_FILE_SIZE) {
+      dedup_writer_init(&up->dedup, &dedup_store);
+      up->chunker = &up->dedup;
+      up->sums = NULL;
    }
-   // Receive data to be written
-   if (recv(client_socket, data, sizeof(data), 0) <= 0) {
-      perror("Failed to receive data");
-      close(client_socket);
-      return;
+}
+
+// Writes out the full buffer, summing its blocks or handing it to the
+// chunker. A periodic sync rides along with the write that crosses the sync
+// interval.
+static void upload_flush(Upload *up) {
+   if (up->chunker) {
+      if (dedup_writer_update(up->chunker, up->buffer, up->buffered) < 0) up->error = errno;
    }
-   // Write data to the file
-   FILE *file = fopen(file_path, "w");
-   if (!file) {
-      perror("Failed to open file for writing");
-      const char *error_msg = "Error: Unable to write to file";
-      send(client_socket, error_msg, strlen(error_msg) + 1, 0);
-      close(client_socket);
-      return;
+   else {
+      if (up->sums) block_checksums_update(up->sums, up->buffer, up->buffered);
+      int sync = up->sync_interval > 0 && up->flushed + up->buffered - up->synced >= up->sync_interval;
+      if (io_write_at(up->fd, up->buffer, up->buffered, up->flushed, sync) < 0) up->error = errno;
+      if (sync) up->synced = up->flushed + up->buffered;
+   }
+   up->flushed += up->buffered;
+   up->buffered = 0;
+}
+
+// Adds len bytes to the upload unless it has already failed
+static void upload_append(Upload *up, const uint8_t *data, size_t len) {
+   while (!up->error && len > 0) {
+      size_t n = WRITE_BUFFER_SIZE - up->buffered;
+      if (n > len) n = len;
+      memcpy(up->buffer + up->buffered, data, n);
+      up->buffered += n;
+      data += n;
+      len -= n;
+      if (up->buffered == WRITE_BUFFER_SIZE) upload_flush(up);
+   }
+}
+
+// Writes out the rest of the upload and renames it over file_path, replacing
+// the old version's cached blocks, checksums and manifest. Returns 0, or an
+// errno once the temporary file has been removed.
+static int upload_finish(Upload *up, const char *file_path, Durability durability) {
+   int error = up->error;
+   int final_sync = durability != DURABILITY_NONE;
+   if (!error && up->chunker) {
+      // The placeholder only needs its size; the chunks are synced on commit
+      if (dedup_writer_update(up->chunker, up->buffer, up->buffered) < 0 ||
+          ftruncate(up->fd, up->total_size) < 0 || (final_sync && io_fdatasync(up->fd) < 0)) {
+         error = errno;
+      }
+   }
+   else if (!error && up->buffered > 0) {
+      if (up->sums) block_checksums_update(up->sums, up->buffer, up->buffered);
+      if (io_write_at(up->fd, up->buffer, up->buffered, up->flushed, final_sync) < 0) error = errno;
+   }
+   else if (!error && final_sync && io_fdatasync(up->fd) < 0) {
+      error = errno;
+   }
+   io_release_file();
+   BlockChecksums *sums = up->sums;
+   struct stat written;
+   if (!error) {
+      // Keep the permissions of the file being replaced
+      struct stat old_stat;
+      fchmod(up->fd, stat(file_path, &old_stat) == 0 ? (old_stat.st_mode & 0777) : 0644);
+      if ((sums || up->chunker) && fstat(up->fd, &written) != 0) {
+         if (up->chunker) error = errno;
+         sums = NULL;
+      }
+   }
+   if (up->fd >= 0 && close(up->fd) < 0 && !error) error = errno;
+   up->fd = -1;
+   struct stat replaced;
+   int had_file = stat(file_path, &replaced) == 0;
+   // The manifest goes in before the rename, so the file never reads as its
+   // placeholder
+   if (up->chunker) {
+      if (!error && dedup_writer_commit(up->chunker, file_path, &written, final_sync) < 0) error = errno;
+      else if (error) dedup_writer_abort(up->chunker);
+   }
+   if (!error && rename(up->temp_path, file_path) < 0) {
+      error = errno;
+      if (up->chunker) dedup_store_remove(&dedup_store, &written);
+   }
+   if (!error && had_file) {
+      block_cache_invalidate_file(&block_cache, replaced.st_dev, replaced.st_ino);
+      if (checksums_enabled) checksum_store_remove(&checksum_store, &replaced);
+      if (dedup_enabled) dedup_store_remove(&dedup_store, &replaced);
+   }
+   // The inode keeps its size and mtime through the rename
+   if (!error && sums && checksum_store_save(&checksum_store, &written, sums) < 0) {
+      perror("Failed to save block checksums");
+   }
+   block_checksums_free(&up->block_sums);
+   if (error && up->created) unlink(up->temp_path);
+   if (!error && final_sync) sync_parent_dir(file_path);
+   return error;
+}
+
+// Gives up on an upload whose stream broke off
+static void upload_abort(Upload *up) {
+   block_checksums_free(&up->block_sums);
+   if (up->chunker) dedup_writer_abort(up->chunker);
+   io_release_file();
+   if (up->fd >= 0) {
+      close(up->fd);
+      unlink(up->temp_path);
+   }
+}
+
+// Receives an upload of total_size bytes carried by DATA frames of any size,
+// compressed or not. A frame that fails its checksum fails the write but,
+// like a local failure, keeps the upload draining.
+int handle_write(int client_socket, uint32_t request_id, const char *file_path,
+                 uint64_t total_size, Durability durability, uint32_t sync_interval_mb) {
+   Upload up;
+   upload_begin(&up, file_path, total_size, durability, sync_interval_mb);
+   uint64_t received = 0;
+   uint8_t chunk[CODEC_CHUNK_SIZE];
+   while (received < total_size) {
+      FrameHeader hdr;
+      ssize_t raw_len = -1;
+      int corrupt = 0;
+      if (recv_frame_header(client_socket, &hdr) == 0 && hdr.opcode == OP_DATA) {
+         raw_len = hdr.flags & FRAME_F_COMPRESSED
+                      ? recv_compressed_chunk(client_socket, &hdr, chunk, &corrupt, &codec_stats)
+                      : data_frame_length(&hdr);
+      }
+      if (raw_len < 0 || (uint64_t)raw_len > total_size - received) {
+         // Truncated or malformed upload: the stream cannot be resynchronized
+         perror("Upload aborted");
+         goto abort;
+      }
+      if (corrupt && !up.error) up.error = EBADMSG;
+      if (hdr.flags & FRAME_F_COMPRESSED) {
+         upload_append(&up, chunk, raw_len);
+         received += raw_len;
+         continue;
+      }
+      codec_stats_received_raw(&codec_stats, raw_len);
+      int checked = (hdr.flags & FRAME_F_CHECKSUM) != 0;
+      uint32_t crc = 0;
+      uint64_t remaining = raw_len;
+      while (remaining > 0) {
+         if (up.error) {
+            // Nothing more is kept, so the trailer goes unchecked too
+            if (discard_payload(client_socket, hdr.payload_len - (raw_len - remaining)) < 0) goto abort;
+            checked = 0;
+            break;
+         }
+         size_t want = WRITE_BUFFER_SIZE - up.buffered;
+         if (want > remaining) want = remaining;
+         if (recv_all(client_socket, up.buffer + up.buffered, want) < 0) goto abort;
+         if (checked) crc = data_checksum(&codec_stats, crc, up.buffer + up.buffered, want);
+         up.buffered += want;
+         remaining -= want;
+         if (up.buffered == WRITE_BUFFER_SIZE) upload_flush(&up);
+      }
+      if (checked && recv_checksum_trailer(client_socket, crc, &corrupt, &codec_stats) < 0) goto abort;
+      if (corrupt && !up.error) up.error = EBADMSG;
+      received += raw_len;
+   }
+
+   int error = upload_finish(&up, file_path, durability);
+   if (error) {
+      errno = error;
+      perror("Failed to write file");
+      send_error(client_socket, request_id, ST_IO_ERROR,
+                 error == EBADMSG ? "Checksum mismatch in uploaded data" : strerror(error));
+      return 1;
    }
-   fwrite(data, 1, strlen(data), file);
-   fclose(file);
-   // Send success message
-   const char *success_msg = "File written successfully";
-   send(client_socket, success_msg, strlen(success_msg) + 1, 0);
+   printf("Wrote %llu bytes to %s\n", (unsigned long long)total_size, file_path);
+   load_stats_add_bytes(&load_stats, 0, total_size);
+   send_ack(client_socket, request_id, "File written successfully");
+   return 1;
+
+abort:
+   upload_abort(&up);
    close(client_socket);
+   return 0;
+}
+
+// Receives an upload small enough to hold in memory and hands it to the
+// write-behind log. It is acknowledged once logged (durably, unless the
+// client asked for no durability); the file itself is replaced later.
+int handle_buffered_write(int client_socket, uint32_t request_id, const char *file_path,
+                          uint64_t total_size, Durability durability) {
+   uint8_t *data = malloc(total_size ? total_size : 1);
+   uint64_t received = 0;
+   uint8_t chunk[CODEC_CHUNK_SIZE];
+   int corrupt = 0;
+   while (received < total_size) {
+      FrameHeader hdr;
+      ssize_t raw_len = -1;
+      if (recv_frame_header(client_socket, &hdr) == 0 && hdr.opcode == OP_DATA) {
+         raw_len = hdr.flags & FRAME_F_COMPRESSED
+                      ? recv_compressed_chunk(client_socket, &hdr, chunk, &corrupt, &codec_stats)
+                      : data_frame_length(&hdr);
+      }
+      if (raw_len < 0 || (uint64_t)raw_len > total_size - received) {
+         perror("Upload aborted");
+         free(data);
+         close(client_socket);
+         return 0;
+      }
+      int rc = 0;
+      if (hdr.flags & FRAME_F_COMPRESSED) {
+         if (data) memcpy(data + received, chunk, raw_len);
+      }
+      else if (data == NULL) {
+         rc = discard_payload(client_socket, hdr.payload_len);
+      }
+      else {
+         codec_stats_received_raw(&codec_stats, raw_len);
+         rc = recv_all(client_socket, data + received, raw_len);
+         if (rc == 0 && (hdr.flags & FRAME_F_CHECKSUM)) {
+            uint32_t crc = data_checksum(&codec_stats, 0, data + received, raw_len);
+            rc = recv_checksum_trailer(client_socket, crc, &corrupt, &codec_stats);
+         }
+      }
+      if (rc < 0) {
+         perror("Upload aborted");
+         free(data);
+         close(client_socket);
+         return 0;
+      }
+      received += raw_len;
+   }
+   if (data == NULL || corrupt) {
+      free(data);
+      send_error(client_socket, request_id, ST_IO_ERROR,
+                 corrupt ? "Checksum mismatch in uploaded data" : strerror(ENOMEM));
+      return 1;
+   }
+
+   if (write_behind_submit(&write_behind, file_path, data, total_size,
+                           durability != DURABILITY_NONE) < 0) {
+      int error = errno;   // perror may clobber it
+      perror("Failed to log write");
+      send_error(client_socket, request_id, ST_IO_ERROR, strerror(error));
+      return 1;
+   }
+   printf("Logged %llu bytes for %s\n", (unsigned long long)total_size, file_path);
+   load_stats_add_bytes(&load_stats, 0, total_size);
+   send_ack(client_socket, request_id, "File written successfully");
+   return 1;
 }
 
-void handle_get_file_info(int client_socket) {
-   char file_path[256];
+// Reads len bytes at offset of the file open as fd, or of its chunks when it
+// has a manifest. Returns 0, or -1 with errno set.
+static int read_stored(int fd, const DedupManifest *manifest, uint8_t *out, size_t len, uint64_t offset) {
+   while (len > 0) {
+      size_t n;
+      if (manifest) {
+         const DedupChunk *chunk = &manifest->chunks[dedup_manifest_find(manifest, offset)];
+         CachedBlock *block = dedup_chunk_get(&dedup_store, &block_cache, chunk, 0);
+         if (block == NULL) return -1;
+         n = chunk->offset + chunk->len - offset;
+         if (n > len) n = len;
+         memcpy(out, block->data + (offset - chunk->offset), n);
+         block_cache_release(block);
+      }
+      else {
+         ssize_t bytes_read = pread(fd, out, len, offset);
+         if (bytes_read < 0 && errno == EINTR) continue;
+         if (bytes_read <= 0) {
+            if (bytes_read == 0) errno = EIO;   // Shrank behind the server's back
+            return -1;
+         }
+         n = bytes_read;
+      }
+      out += n;
+      len -= n;
+      offset += n;
+   }
+   return 0;
+}
 
-   // Receive file path
-   if (recv(client_socket, file_path, sizeof(file_path), 0) <= 0) {
-      perror("Failed to receive file path");
+// Replies with the block signatures of path, against which the client works
+// out a delta of its new version (see delta.h). They are computed as they
+// are sent, a frame's worth at a time.
+int handle_signatures(int client_socket, uint32_t request_id, const char *path, uint32_t seed,
+                      DataEncoder *enc) {
+   int fd = open(path, O_RDONLY);
+   struct stat file_stat;
+   if (fd < 0 || fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+      if (fd >= 0) close(fd);
+      send_error(client_socket, request_id, ST_NOT_FOUND, "File not found or unable to open");
+      return 1;
+   }
+   DedupManifest *manifest;
+   if (lookup_manifest(&file_stat, &manifest) < 0) {
+      close(fd);
+      send_error(client_socket, request_id, ST_IO_ERROR, "File changed outside the server");
+      return 1;
+   }
+   FileVersion version;
+   file_version_from_stat(&version, &file_stat);
+   size_t block_size = delta_block_size(version.size);
+   uint64_t count = (version.size + block_size - 1) / block_size;
+   size_t per_frame = CODEC_CHUNK_SIZE / DELTA_SIGNATURE_SIZE;
+   uint8_t *block = malloc(block_size);
+   uint8_t *table = malloc(per_frame * DELTA_SIGNATURE_SIZE);
+   if (block == NULL || table == NULL) {
+      perror("Failed to allocate block signatures");
+      free(block);
+      free(table);
+      if (manifest) dedup_manifest_release(&dedup_store, manifest);
+      close(fd);
+      send_error(client_socket, request_id, ST_FULL, "Out of memory");
+      return 1;
+   }
+
+   PayloadBuilder reply;
+   payload_init(&reply);
+   payload_put_u64(&reply, version.size);
+   payload_put_u64(&reply, version.mtime_ns);
+   payload_put_u64(&reply, version.ino);
+   payload_put_u32(&reply, block_size);
+   payload_put_u64(&reply, count);
+   int rc = send_frame(client_socket, OP_SIGNATURES, 0, request_id, reply.data, reply.len);
+   payload_free(&reply);
+   if (rc == 0 && count == 0) rc = send_frame(client_socket, OP_DATA, 0, request_id, NULL, 0);
+   size_t filled = 0;
+   for (uint64_t i = 0; rc == 0 && i < count; i++) {
+      // After the header an unreadable block can only end the connection
+      size_t len = i + 1 < count ? block_size : version.size - i * block_size;
+      if (read_stored(fd, manifest, block, len, i * block_size) < 0) {
+         rc = -1;
+         break;
+      }
+      BlockSignature sig;
+      delta_signature(&sig, block, len, seed);
+      block_signature_encode(&sig, table + filled * DELTA_SIGNATURE_SIZE);
+      if (++filled == per_frame || i + 1 == count) {
+         rc = send_data_chunk(client_socket, i + 1 < count ? FRAME_F_MORE : 0, request_id, enc,
+                              table, filled * DELTA_SIGNATURE_SIZE);
+         filled = 0;
+      }
+   }
+   free(block);
+   free(table);
+   if (manifest) dedup_manifest_release(&dedup_store, manifest);
+   close(fd);
+   if (rc < 0) {
+      perror("Failed to send block signatures");
       close(client_socket);
-      return;
+      return 0;
+   }
+   __atomic_add_fetch(&delta_stats.signatures_sent, 1, __ATOMIC_RELAXED);
+   return 1;
+}
+
+// Rebuilds a file into an upload from its base and a delta as it arrives
+typedef struct {
+   Upload *up;
+   int base_fd;
+   const DedupManifest *manifest;
+   uint64_t base_size;
+   size_t block_size;
+   uint64_t size;               // Promised by the client; the delta may not outgrow it
+   uint64_t rebuilt;
+   uint32_t crc;
+   uint64_t copied;             // Bytes taken from the base
+} DeltaTarget;
+
+static int delta_copy(void *arg, uint64_t first_block, uint32_t count) {
+   DeltaTarget *target = arg;
+   Upload *up = target->up;
+   uint64_t blocks = (target->base_size + target->block_size - 1) / target->block_size;
+   if (count == 0 || first_block >= blocks || count > blocks - first_block) return EINVAL;
+   uint64_t offset = first_block * target->block_size;
+   uint64_t len = (uint64_t)count * target->block_size;
+   if (len > target->base_size - offset) len = target->base_size - offset;
+   if (len > target->size - target->rebuilt) return EINVAL;
+   target->rebuilt += len;
+   target->copied += len;
+   while (!up->error && len > 0) {
+      size_t n = WRITE_BUFFER_SIZE - up->buffered;
+      if (n > len) n = len;
+      uint8_t *out = up->buffer + up->buffered;
+      if (read_stored(target->base_fd, target->manifest, out, n, offset) < 0) return errno;
+      target->crc = crc32c(target->crc, out, n);
+      up->buffered += n;
+      offset += n;
+      len -= n;
+      if (up->buffered == WRITE_BUFFER_SIZE) upload_flush(up);
+   }
+   return up->error;
+}
+
+static int delta_literal(void *arg, const uint8_t *data, size_t len) {
+   DeltaTarget *target = arg;
+   if (len > target->size - target->rebuilt) return EINVAL;
+   target->rebuilt += len;
+   target->crc = crc32c(target->crc, data, len);
+   upload_append(target->up, data, len);
+   return target->up->error;
+}
+
+// Rebuilds path from the version the client computed its delta against and
+// the delta, which arrives as DATA frames of at most CODEC_CHUNK_SIZE bytes,
+// through the same temporary file and rename as a WRITE. If that version has
+// been replaced, or what is rebuilt does not match the client's checksum, the
+// client is told to send the file whole.
+int handle_delta_write(int client_socket, uint32_t request_id, const char *file_path,
+                       const DeltaRequest *req) {
+   const char *conflict = NULL;
+   int base_fd = open(file_path, O_RDONLY);
+   struct stat base_stat;
+   FileVersion base = { 0 };
+   if (base_fd < 0 || fstat(base_fd, &base_stat) != 0 || !S_ISREG(base_stat.st_mode)) {
+      conflict = "Delta base is gone";
+   }
+   else {
+      file_version_from_stat(&base, &base_stat);
+      if ((uint64_t)base.size != req->base_size || base.mtime_ns != req->base_mtime_ns ||
+          (uint64_t)base.ino != req->base_ino || req->block_size != delta_block_size(base.size)) {
+         conflict = "Delta base changed";
+      }
+   }
+   DedupManifest *manifest = NULL;
+   if (!conflict && lookup_manifest(&base_stat, &manifest) < 0) conflict = "Delta base is unreadable";
+
+   Upload up;
+   upload_begin(&up, file_path, req->size, req->durability, req->sync_interval_mb);
+   if (conflict) up.error = ESTALE;
+   DeltaTarget target = { &up, base_fd, manifest, base.size, req->block_size, req->size, 0, 0, 0 };
+   DeltaDecoder dec;
+   delta_decoder_init(&dec, delta_copy, delta_literal, &target);
+   uint64_t received = 0;
+   uint8_t chunk[CODEC_CHUNK_SIZE];
+   while (received < req->delta_size) {
+      FrameHeader hdr;
+      ssize_t raw_len = -1;
+      int corrupt = 0;
+      if (recv_frame_header(client_socket, &hdr) == 0 && hdr.opcode == OP_DATA) {
+         raw_len = recv_data_chunk(client_socket, &hdr, chunk, &corrupt, &codec_stats);
+      }
+      if (raw_len < 0 || (uint64_t)raw_len > req->delta_size - received) {
+         perror("Delta upload aborted");
+         upload_abort(&up);
+         if (manifest) dedup_manifest_release(&dedup_store, manifest);
+         if (base_fd >= 0) close(base_fd);
+         close(client_socket);
+         return 0;
+      }
+      if (corrupt && !up.error) up.error = EBADMSG;
+      if (!up.error) {
+         int error = delta_decoder_feed(&dec, chunk, raw_len);
+         if (error) up.error = error;
+      }
+      received += raw_len;
    }
+   if (!up.error && (!delta_decoder_complete(&dec) || target.rebuilt != req->size)) up.error = EINVAL;
+   if (!up.error && target.crc != req->crc) {
+      // A block matched by hash alone, or the base no longer reads as it did
+      conflict = "Delta did not rebuild the file";
+      up.error = ESTALE;
+   }
+   if (manifest) dedup_manifest_release(&dedup_store, manifest);
+   if (base_fd >= 0) close(base_fd);
+
+   int error = upload_finish(&up, file_path, req->durability);
+   if (error == ESTALE) {
+      printf("Delta write of %s refused: %s\n", file_path, conflict);
+      __atomic_add_fetch(&delta_stats.conflicts, 1, __ATOMIC_RELAXED);
+      send_error(client_socket, request_id, ST_CONFLICT, conflict);
+      return 1;
+   }
+   if (error) {
+      errno = error;
+      perror("Failed to apply delta");
+      send_error(client_socket, request_id, error == EINVAL ? ST_INVALID : ST_IO_ERROR,
+                 error == EBADMSG ? "Checksum mismatch in uploaded data"
+                 : error == EINVAL ? "Malformed delta" : strerror(error));
+      return 1;
+   }
+   printf("Rebuilt %s (%llu bytes) from a %llu byte delta, %llu bytes reused\n", file_path,
+          (unsigned long long)req->size, (unsigned long long)req->delta_size,
+          (unsigned long long)target.copied);
+   __atomic_add_fetch(&delta_stats.files_rebuilt, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&delta_stats.bytes_received, req->delta_size, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&delta_stats.bytes_rebuilt, req->size, __ATOMIC_RELAXED);
+   load_stats_add_bytes(&load_stats, 0, req->size);
+   send_ack(client_socket, request_id, "File written successfully");
+   return 1;
+}
+
+int handle_get_file_info(int client_socket, uint32_t request_id, const char *file_path) {
    // Get file information
    struct stat file_stat;
    if (stat(file_path, &file_stat) != 0) {
       perror("Failed to get file info");
-      const char *error_msg = "Error: Unable to retrieve file info";
-      send(client_socket, error_msg, strlen(error_msg) + 1, 0);
-      close(client_socket);
-      return;
+      send_error(client_socket, request_id, ST_NOT_FOUND, "Unable to retrieve file info");
+      return 1;
    }
    // Prepare and send file info
-   char response[256];
-   snprintf(response, sizeof(response), "Size: %ld bytes, Permissions: %o",
-            file_stat.st_size, file_stat.st_mode & 0777);
-   send(client_socket, response, strlen(response) + 1, 0);
-   close(client_socket);
+   PayloadBuilder response;
+   payload_init(&response);
+   payload_put_u64(&response, file_stat.st_size);
+   payload_put_u32(&response, file_stat.st_mode & 0777);
+   send_frame(client_socket, OP_INFO_REPLY, 0, request_id, response.data, response.len);
+   payload_free(&response);
+   return 1;
 }
 
-void handle_stream_audio(int client_socket) {
-   char file_path[256];
-
-   // Receive file path
-   if (recv(client_socket, file_path, sizeof(file_path), 0) <= 0) {
-      perror("Failed to receive file path");
-      close(client_socket);
-      return;
+int handle_stream_audio(int client_socket, uint32_t request_id, const char *file_path,
+                        DataEncoder *enc) {
+   struct stat file_stat;
+   DedupManifest *manifest = NULL;
+   if (stat(file_path, &file_stat) == 0 && S_ISREG(file_stat.st_mode) &&
+       lookup_manifest(&file_stat, &manifest) < 0) {
+      send_error(client_socket, request_id, ST_IO_ERROR, "File changed outside the server");
+      return 1;
+   }
+   if (manifest != NULL) {
+      int rc = send_manifest_range(client_socket, request_id, file_path, manifest, 0, file_stat.st_size, enc);
+      dedup_manifest_release(&dedup_store, manifest);
+      return rc;
    }
    // Open the audio file
-   FILE *file = fopen(file_path, "rb");
-   if (!file) {
+   int fd = open(file_path, O_RDONLY);
+   if (fd < 0) {
       perror("Failed to open audio file");
-      const char *error_msg = "Error: Unable to open audio file";
-      send(client_socket, error_msg, strlen(error_msg) + 1, 0);
-      close(client_socket);
-      return;
+      send_error(client_socket, request_id, ST_NOT_FOUND, "Unable to open audio file");
+      return 1;
    }
    // Stream the file contents
-   char buffer[BUFFER_SIZE];
-   size_t bytes_read;
+   int rc = send_file_reply(client_socket, request_id, fd, enc);
+   close(fd);
+   if (rc < 0) {
+      perror("Failed to send audio data");
+      close(client_socket);
+      return 0;
+   }
+   return 1;
+}
+
+// Skips the DATA frames of a refused upload. Compressed chunks still have
+// to be expanded to learn how much of the upload they carried.
+static int discard_upload(int client_socket, uint64_t total_size) {
+   uint8_t chunk[CODEC_CHUNK_SIZE];
+   int corrupt = 0;   // Of no consequence, the data is dropped
+   while (total_size > 0) {
+      FrameHeader hdr;
+      if (recv_frame_header(client_socket, &hdr) < 0 || hdr.opcode != OP_DATA) return -1;
+      ssize_t raw_len = data_frame_length(&hdr);
+      if (hdr.flags & FRAME_F_COMPRESSED) {
+         raw_len = recv_compressed_chunk(client_socket, &hdr, chunk, &corrupt, &codec_stats);
+      }
+      else if (raw_len < 0 || (uint64_t)raw_len > total_size ||
+               discard_payload(client_socket, hdr.payload_len) < 0) {
+         return -1;
+      }
+      if (raw_len < 0 || (uint64_t)raw_len > total_size) return -1;
+      total_size -= raw_len;
+   }
+   return 0;
+}
+
+// Settles how DATA frames are sent on this connection: compressed with the
+// first codec the client offers that this server supports, and checksummed
+// if the client asks for it
+void handle_negotiate(ClientHandler *handler, uint32_t request_id, const uint8_t *payload, size_t len) {
+   PayloadReader reader;
+   payload_reader_init(&reader, payload, len);
+   uint8_t count = payload_get_u8(&reader);
+   const uint8_t *offered = payload_get_bytes(&reader, count);
+   uint8_t options = reader.pos < reader.len ? payload_get_u8(&reader) : 0;
+   handler->codec = offered ? codec_choose(offered, count) : CODEC_NONE;
+   handler->checksums = (options & NEGOTIATE_CHECKSUMS) != 0;
+   uint8_t chosen[2] = { handler->codec, options & NEGOTIATE_CHECKSUMS };
+   send_frame(handler->client_socket, OP_NEGOTIATE, 0, request_id, chosen, sizeof(chosen));
+}
+
+// Replies with a text report of the block cache, write-behind, checksum,
+// deduplication, delta write and compression counters
+void handle_stats(int client_socket, uint32_t request_id) {
+   BlockCacheStats stats;
+   block_cache_stats(&block_cache, &stats);
+   unsigned long lookups = stats.hits + stats.misses;
+   char report[BUFFER_SIZE];
+   snprintf(report, sizeof(report),
+            "block cache: %lu hits, %lu misses (%.1f%% hit rate), %lu evictions, %zu blocks, %zu/%zu bytes",
+            stats.hits, stats.misses, lookups ? 100.0 * stats.hits / lookups : 0.0,
+            stats.evictions, stats.blocks, stats.bytes, block_cache.max_bytes);
+   if (write_behind_enabled) {
+      WriteBehindStats wb;
+      write_behind_stats(&write_behind, &wb);
+      size_t len = strlen(report);
+      snprintf(report + len, sizeof(report) - len,
+               "\nwrite-behind: %lu records, %lu log syncs (%.1f records/sync), %lu coalesced, "
+               "%lu files flushed in %lu batches, %lu replayed",
+               wb.records, wb.log_syncs, wb.log_syncs ? (double)wb.records / wb.log_syncs : 0.0,
+               wb.coalesced, wb.files_flushed, wb.batches, wb.replayed);
+   }
+   if (checksums_enabled) {
+      size_t len = strlen(report);
+      snprintf(report + len, sizeof(report) - len,
+               "\nstored checksums: %lu blocks verified, %lu mismatches, %lu files summed",
+               __atomic_load_n(&checksum_store.blocks_verified, __ATOMIC_RELAXED),
+               __atomic_load_n(&checksum_store.mismatches, __ATOMIC_RELAXED),
+               __atomic_load_n(&checksum_store.files_saved, __ATOMIC_RELAXED));
+   }
+   if (dedup_enabled) {
+      DedupStats dedup;
+      dedup_store_stats(&dedup_store, &dedup);
+      size_t len = strlen(report);
+      snprintf(report + len, sizeof(report) - len,
+               "\ndedup (%s chunking): %lu chunks written, %lu deduplicated, %.1f MB written, %.1f MB saved, "
+               "%zu unique chunks in %zu manifests, %lu collisions, %lu read mismatches",
+               dedup_store.chunking == CHUNKING_FIXED ? "fixed" : "cdc",
+               dedup.chunks_written, dedup.chunks_deduplicated, dedup.bytes_written / 1048576.0,
+               dedup.bytes_deduplicated / 1048576.0, dedup.unique_chunks, dedup.manifests,
+               dedup.collisions, dedup.mismatches);
+   }
+   unsigned long rebuilt = __atomic_load_n(&delta_stats.files_rebuilt, __ATOMIC_RELAXED);
+   unsigned long conflicts = __atomic_load_n(&delta_stats.conflicts, __ATOMIC_RELAXED);
+   if (rebuilt || conflicts) {
+      size_t len = strlen(report);
+      snprintf(report + len, sizeof(report) - len,
+               "\ndelta writes: %lu signature tables sent, %lu files rebuilt from %.1f MB of deltas "
+               "into %.1f MB, %lu sent back whole",
+               __atomic_load_n(&delta_stats.signatures_sent, __ATOMIC_RELAXED), rebuilt,
+               __atomic_load_n(&delta_stats.bytes_received, __ATOMIC_RELAXED) / 1048576.0,
+               __atomic_load_n(&delta_stats.bytes_rebuilt, __ATOMIC_RELAXED) / 1048576.0, conflicts);
+   }
+   size_t len = strlen(report);
+   report[len++] = '\n';
+   codec_stats_format(&codec_stats, report + len, sizeof(report) - len);
+   send_ack(client_socket, request_id, report);
+}
+
+// Executes one framed request. Returns 1 if the connection is still open.
+int dispatch_request(ClientHandler *handler, const FrameHeader *hdr, const uint8_t *payload) {
+   int client_socket = handler->client_socket;
+   if (hdr->opcode == OP_STATS) {
+      handle_stats(client_socket, hdr->request_id);
+      return 1;
+   }
+   if (hdr->opcode == OP_NEGOTIATE) {
+      handle_negotiate(handler, hdr->request_id, payload, hdr->payload_len);
+      return 1;
+   }
+
+   PayloadReader reader;
+   char path[MAX_PATH_LENGTH];
+   payload_reader_init(&reader, payload, hdr->payload_len);
+   payload_get_str(&reader, path, sizeof(path));
 
-   while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-      if (send(client_socket, buffer, bytes_read, 0) < 0) {
-         perror("Failed to send audio data");
-         fclose(file);
+   // A WRITE or DELTA_WRITE header is followed by its data; parse it up
+   // front so a refused upload can still be skipped over
+   uint64_t total_size = 0;
+   Durability durability = DURABILITY_NONE;
+   uint32_t sync_interval_mb = 0;
+   uint64_t offset = 0, length = READ_TO_END;
+   if (hdr->opcode == OP_READ && reader.pos < reader.len) {
+      offset = payload_get_u64(&reader);
+      length = payload_get_u64(&reader);
+   }
+   if (hdr->opcode == OP_WRITE) {
+      total_size = payload_get_u64(&reader);
+      durability = payload_get_u8(&reader);
+      sync_interval_mb = payload_get_u32(&reader);
+      if (reader.error) {
+         // Without the size the data that follows cannot be skipped
+         send_error(client_socket, hdr->request_id, ST_INVALID, "Malformed write header");
          close(client_socket);
-         return;
+         return 0;
       }
    }
-   fclose(file);
-   close(client_socket);
+   DeltaRequest delta = { 0 };
+   if (hdr->opcode == OP_DELTA_WRITE) {
+      delta.size = payload_get_u64(&reader);
+      delta.crc = payload_get_u32(&reader);
+      delta.base_size = payload_get_u64(&reader);
+      delta.base_mtime_ns = payload_get_u64(&reader);
+      delta.base_ino = payload_get_u64(&reader);
+      delta.block_size = payload_get_u32(&reader);
+      delta.durability = payload_get_u8(&reader);
+      delta.sync_interval_mb = payload_get_u32(&reader);
+      delta.delta_size = payload_get_u64(&reader);
+      if (reader.error) {
+         send_error(client_socket, hdr->request_id, ST_INVALID, "Malformed write header");
+         close(client_socket);
+         return 0;
+      }
+   }
+   uint32_t seed = 0;
+   if (hdr->opcode == OP_SIGNATURES) seed = payload_get_u32(&reader);
+   if (reader.error) {
+      send_error(client_socket, hdr->request_id, ST_INVALID, "Malformed path");
+      return 1;
+   }
+   uint64_t upload_size = hdr->opcode == OP_WRITE ? total_size
+                        : hdr->opcode == OP_DELTA_WRITE ? delta.delta_size : 0;
+   if (!path_is_claimed(path)) {
+      if (discard_upload(client_socket, upload_size) < 0) {
+         close(client_socket);
+         return 0;
+      }
+      // Lets clients drop a stale cached location and ask the naming server
+      send_error(client_socket, hdr->request_id, ST_NOT_OWNER, NULL);
+      return 1;
+   }
+
+   if (write_behind_enabled) {
+      if (hdr->opcode == OP_WRITE && total_size <= WRITE_BEHIND_MAX_UPLOAD) {
+         return handle_buffered_write(client_socket, hdr->request_id, path, total_size, durability);
+      }
+      // Everything else sees the file only after any logged upload of it
+      // has been written out. A delete may take a directory holding some.
+      // One that cannot be written out yet would later overtake this request.
+      if (write_behind_settle(&write_behind, path, hdr->opcode == OP_DELETE) < 0) {
+         if (discard_upload(client_socket, upload_size) < 0) {
+            close(client_socket);
+            return 0;
+         }
+         send_error(client_socket, hdr->request_id, ST_IO_ERROR, "An earlier upload is not written out yet");
+         return 1;
+      }
+   }
+
+   DataEncoder enc;
+   data_encoder_init(&enc, handler->codec, handler->checksums, &codec_stats);
+   switch (hdr->opcode) {
+      case OP_READ:
+         return handle_read(client_socket, hdr->request_id, path, offset, length, &enc);
+      case OP_STREAM:
+         return handle_stream_audio(client_socket, hdr->request_id, path, &enc);
+      case OP_WRITE:
+         return handle_write(client_socket, hdr->request_id, path,
+                             total_size, durability, sync_interval_mb);
+      case OP_SIGNATURES:
+         return handle_signatures(client_socket, hdr->request_id, path, seed, &enc);
+      case OP_DELTA_WRITE:
+         return handle_delta_write(client_socket, hdr->request_id, path, &delta);
+      case OP_INFO:
+         return handle_get_file_info(client_socket, hdr->request_id, path);
+      case OP_DELETE:
+         handle_delete(client_socket, hdr->request_id, path);
+         return 1;
+      case OP_CREATE:
+         handle_create(client_socket, hdr->request_id, path);
+         return 1;
+      default:
+         send_error(client_socket, hdr->request_id, ST_INVALID, "Unknown command");
+         return 1;
+   }
 }
 
-void* handle_client(void* arg) {
+// Worker job: executes one request on a connection that the dispatcher saw
+// become readable, then hands the connection back to epoll if still open.
+void serve_request(void* arg) {
    ClientHandler* handler = (ClientHandler*)arg;
-   char buffer[BUFFER_SIZE];
-   printf("Client connected\n");
-   while (1) {
-      memset(buffer, 0, BUFFER_SIZE);
-      ssize_t bytes_received = recv(handler->client_socket, buffer, BUFFER_SIZE - 1, 0);
+   FrameHeader hdr;
+   uint8_t *payload;
+   if (recv_frame(handler->client_socket, &hdr, &payload, MAX_CONTROL_PAYLOAD) < 0) {
+      close(handler->client_socket);
+      free(handler);
+      load_stats_connection(&load_stats, -1);
+      return;
+   }
+   printf("Received request %u (opcode %d) from the client\n", hdr.request_id, hdr.opcode);
+   struct timespec start, end;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   int keep_open = dispatch_request(handler, &hdr, payload);
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   load_stats_record_latency(&load_stats, (end.tv_sec - start.tv_sec) * 1000000ULL +
+                                          (end.tv_nsec - start.tv_nsec) / 1000);
+   free(payload);
+   if (!keep_open) {
+      free(handler);
+      load_stats_connection(&load_stats, -1);
+      return;
+   }
+
+   struct epoll_event ev;
+   ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+   ev.data.ptr = handler;
+   if (epoll_ctl(client_epoll_fd, EPOLL_CTL_MOD, handler->client_socket, &ev) < 0) {
+      perror("Failed to re-arm client connection");
+      close(handler->client_socket);
+      free(handler);
+      load_stats_connection(&load_stats, -1);
+   }
+}
+
+void accept_client(int server_socket) {
+   struct sockaddr_in client_addr;
+   socklen_t addr_len = sizeof(client_addr);
+   int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &addr_len);
+
+   if (client_socket < 0) {
+      perror("Accept failed");
+      return;
+   }
+   printf("New connection from %s:%d\n",
+         inet_ntoa(client_addr.sin_addr),
+         ntohs(client_addr.sin_port));
+
+   // A worker only reads once data is waiting, but never hangs forever on a
+   // peer that stalls mid-request
+   struct timeval timeout = { REQUEST_TIMEOUT_SEC, 0 };
+   setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+   ClientHandler *handler = malloc(sizeof(ClientHandler));
+   handler->client_socket = client_socket;
+   handler->codec = CODEC_NONE;   // Until the client negotiates otherwise
+   handler->checksums = 0;
+
+   struct epoll_event ev;
+   ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+   ev.data.ptr = handler;
+   if (epoll_ctl(client_epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+      perror("Failed to watch client connection");
+      close(client_socket);
+      free(handler);
+      return;
+   }
+   load_stats_connection(&load_stats, 1);
+}
+
+// Naming server shards this server is linked to. The shard map and the
+// links change together under shard_lock.
+NamingServerLink *nm_links[MAX_SHARDS];
+int num_nm_links;
+HashRing *shard_ring;
+pthread_mutex_t shard_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Identity sent when registering with each shard
+char server_ip[16];
+int ss_port;
+int client_port;
+
+void* handle_naming_server(void* arg);
+
+static int link_send(NamingServerLink *link, uint8_t opcode, uint8_t flags, uint32_t request_id,
+                     const void *payload, uint64_t payload_len) {
+   pthread_mutex_lock(&link->send_lock);
+   int rc = send_frame(link->nm_socket, opcode, flags, request_id, payload, payload_len);
+   pthread_mutex_unlock(&link->send_lock);
+   return rc;
+}
+
+// Caller holds shard_lock
+static NamingServerLink *find_link(const ShardAddress *address) {
+   for (int i = 0; i < num_nm_links; i++) {
+      if (shard_address_compare(&nm_links[i]->address, address) == 0) return nm_links[i];
+   }
+   return NULL;
+}
+
+// Connects to a shard from the storage server port and starts the thread
+// serving the link. Caller holds shard_lock.
+static NamingServerLink *link_open(const ShardAddress *address) {
+   if (num_nm_links == MAX_SHARDS) return NULL;
+   int nm_socket = socket(AF_INET, SOCK_STREAM, 0);
+   if (nm_socket < 0) {
+      perror("Socket creation failed");
+      return NULL;
+   }
+   // Every shard is reached from the same source IP and port
+   int reuse = 1;
+   setsockopt(nm_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+   struct sockaddr_in source_addr;
+   memset(&source_addr, 0, sizeof(source_addr));
+   source_addr.sin_family = AF_INET;
+   source_addr.sin_addr.s_addr = inet_addr(server_ip);
+   source_addr.sin_port = htons(ss_port);
+   if (bind(nm_socket, (struct sockaddr *)&source_addr, sizeof(source_addr)) < 0) {
+      perror("Bind to source IP and port failed");
+      close(nm_socket);
+      return NULL;
+   }
+
+   struct sockaddr_in nm_addr;
+   memset(&nm_addr, 0, sizeof(nm_addr));
+   nm_addr.sin_family = AF_INET;
+   nm_addr.sin_addr.s_addr = inet_addr(address->ip);
+   nm_addr.sin_port = htons(address->port);
+   if (connect(nm_socket, (struct sockaddr *)&nm_addr, sizeof(nm_addr)) < 0 ||
+       send_frame(nm_socket, OP_HELLO_STORAGE, 0, 0, NULL, 0) < 0) {
+      perror("Connection to Naming Server failed");
+      close(nm_socket);
+      return NULL;
+   }
+
+   NamingServerLink *link = calloc(1, sizeof(NamingServerLink));
+   if (link == NULL) {
+      close(nm_socket);
+      return NULL;
+   }
+   link->address = *address;
+   link->nm_socket = nm_socket;
+   pthread_mutex_init(&link->send_lock, NULL);
+   pthread_t thread_id;
+   if (pthread_create(&thread_id, NULL, handle_naming_server, link) != 0) {
+      perror("Naming server thread creation failed");
+      close(nm_socket);
+      free(link);
+      return NULL;
+   }
+   pthread_detach(thread_id);
+   nm_links[num_nm_links++] = link;
+   printf("Linked to naming server %s:%d\n", address->ip, address->port);
+   return link;
+}
+
+// Opens streams towards every shard of ring. Caller holds shard_lock until
+// registration_finish.
+static void registration_start(Registration *reg, const HashRing *ring) {
+   reg->ring = ring;
+   reg->total = 0;
+   for (int i = 0; i < ring->num_shards; i++) {
+      RegistrationStream *stream = &reg->streams[i];
+      stream->link = find_link(&ring->shards[i]);
+      stream->opcode = stream->link && stream->link->registered ? OP_CLAIM : OP_REGISTER;
+      stream->count = 0;
+      payload_init(&stream->batch);
+      payload_init(&stream->paths);
+      if (stream->opcode == OP_REGISTER) {
+         payload_put_str(&stream->batch, server_ip);
+         payload_put_u32(&stream->batch, ring->shards[i].port);
+         payload_put_u32(&stream->batch, ss_port);
+         payload_put_u32(&stream->batch, client_port);
+      }
+   }
+}
 
-      if (bytes_received <= 0) break;
+// Sends the stream's pending batch; more marks it as not being the last
+static int registration_flush(RegistrationStream *stream, int more) {
+   int rc = 0;
+   payload_put_u32(&stream->batch, stream->count);
+   payload_put_bytes(&stream->batch, stream->paths.data, stream->paths.len);
+   if (stream->link != NULL) {
+      rc = link_send(stream->link, stream->opcode, more ? FRAME_F_MORE : 0, 1,
+                     stream->batch.data, stream->batch.len);
+   }
+   stream->batch.len = 0;
+   stream->paths.len = 0;
+   stream->count = 0;
+   return rc;
+}
 
-      buffer[bytes_received] = '\0';
-      printf("Received message from the client: %s\n", buffer);
-      char command[32];
-      char path[MAX_PATH_LENGTH];
-      sscanf(buffer, "%s %s", command, path);
+// Queues an already claimed path for the shard owning it
+static int registration_route(Registration *reg, const char *claim) {
+   int owner = hash_ring_owner(reg->ring, claim);
+   if (owner < 0) return 0;
+   RegistrationStream *stream = &reg->streams[owner];
+   size_t len = strlen(claim);
+   if (stream->paths.len + 2 + len > REGISTER_BATCH_BYTES && registration_flush(stream, 1) < 0) {
+      perror("Registration send failed");
+      return -1;
+   }
+   payload_put_str(&stream->paths, claim);
+   stream->count++;
+   reg->total++;
+   return 0;
+}
+
+// Claims path locally and queues it for the naming server
+static int registration_add(Registration *reg, const char *path) {
+   char claim[MAX_PATH_LENGTH];
+   struct stat path_stat;
+   if (snprintf(claim, sizeof(claim), "%s", path) >= (int)sizeof(claim) || claim[0] == '\0') {
+      printf("Skipping invalid path: %s\n", path);
+      return 0;
+   }
+   if (stat(claim, &path_stat) != 0) {
+      printf("Skipping missing path: %s\n", claim);
+      return 0;
+   }
+   // Claims are stored without trailing slashes
+   size_t len = strlen(claim);
+   while (len > 1 && claim[len - 1] == '/') claim[--len] = '\0';
+   if (path_map_insert(&claimed_paths, claim, &claimed_paths) != NULL) return 0;   // Duplicate
+   return registration_route(reg, claim);
+}
 
-      if (strcmp(command, "READ") == 0){
-         printf("Read request for: %s\n", path);
-         handle_read(handler->client_socket, path);
+// Claims every line of a path list file ("-" for stdin)
+static int registration_add_list(Registration *reg, const char *list_path) {
+   FILE *list = strcmp(list_path, "-") == 0 ? stdin : fopen(list_path, "r");
+   if (list == NULL) {
+      perror("Failed to open path list");
+      return -1;
+   }
+   char *line = NULL;
+   size_t line_cap = 0;
+   ssize_t line_len;
+   int rc = 0;
+   while (rc == 0 && (line_len = getline(&line, &line_cap, list)) >= 0) {
+      while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')) {
+         line[--line_len] = '\0';
+      }
+      if (line_len > 0) rc = registration_add(reg, line);
+   }
+   free(line);
+   if (list != stdin) fclose(list);
+   return rc;
+}
+
+// Ends every stream. Shards registering for the first time always get a
+// final frame, even without claims, so they know this server.
+static int registration_finish(Registration *reg) {
+   int rc = 0;
+   for (int i = 0; i < reg->ring->num_shards; i++) {
+      RegistrationStream *stream = &reg->streams[i];
+      if (stream->opcode == OP_REGISTER || stream->count > 0) {
+         if (registration_flush(stream, 0) < 0) rc = -1;
+         else if (stream->link != NULL) stream->link->registered = 1;
       }
-      else if (strcmp(command, "DELETE") == 0){
-         handle_delete(path);
+      payload_free(&stream->batch);
+      payload_free(&stream->paths);
+   }
+   return rc;
+}
+
+typedef struct {
+   Registration *reg;
+   const HashRing *old_ring;
+   int rc;
+} MoveContext;
+
+// Path map visitor: queues claims whose owning shard changed
+static void queue_moved_claim(const char *claim, void *value, void *arg) {
+   MoveContext *ctx = arg;
+   int owner = hash_ring_owner(ctx->reg->ring, claim);
+   int old_owner = hash_ring_owner(ctx->old_ring, claim);
+   if (ctx->rc < 0 || owner < 0) return;
+   if (old_owner >= 0 &&
+       shard_address_compare(&ctx->old_ring->shards[old_owner], &ctx->reg->ring->shards[owner]) == 0) {
+      return;
+   }
+   ctx->rc = registration_route(ctx->reg, claim);
+}
+
+// Adopts a shard map pushed by a naming server: links to shards that
+// joined, sends every shard the claims it gained (claims that stay put are
+// not resent) and drops links to shards that left. Takes ownership of ring.
+static void apply_shard_map(HashRing *ring) {
+   pthread_mutex_lock(&shard_lock);
+   if (hash_ring_equal(ring, shard_ring)) {
+      pthread_mutex_unlock(&shard_lock);
+      hash_ring_free(ring);
+      return;
+   }
+   printf("Shard map now has %d naming server(s)\n", ring->num_shards);
+   for (int i = 0; i < ring->num_shards; i++) {
+      if (find_link(&ring->shards[i]) == NULL) link_open(&ring->shards[i]);
+   }
+
+   Registration reg;
+   MoveContext ctx = { &reg, shard_ring, 0 };
+   registration_start(&reg, ring);
+   path_map_iterate(&claimed_paths, queue_moved_claim, &ctx);
+   size_t moved = reg.total;
+   if (registration_finish(&reg) < 0 || ctx.rc < 0) perror("Sending moved claims failed");
+   else if (moved > 0) printf("Sent %zu moved claims to their new shards\n", moved);
+
+   // The link threads notice the shutdown and free their links
+   for (int i = 0; i < num_nm_links; i++) {
+      if (hash_ring_find(ring, &nm_links[i]->address) < 0) {
+         shutdown(nm_links[i]->nm_socket, SHUT_RDWR);
+         nm_links[i--] = nm_links[--num_nm_links];
       }
-      else if (strcmp(command, "WRITE") == 0){
-         handle_write(handler->client_socket);
+   }
+   hash_ring_free(shard_ring);
+   shard_ring = ring;
+   pthread_mutex_unlock(&shard_lock);
+}
+
+// Creates path (a directory if it ends in '/') and any missing parents.
+// An existing file is left as it is. Returns 0, or -1 with errno set.
+static int create_placed_path(const char *path) {
+   char partial[MAX_PATH_LENGTH];
+   snprintf(partial, sizeof(partial), "%s", path);
+   size_t len = strlen(partial);
+   int is_directory = partial[len - 1] == '/';
+   for (char *p = partial + 1; *p; p++) {
+      if (*p != '/') continue;
+      *p = '\0';
+      if (mkdir(partial, 0755) < 0 && errno != EEXIST) return -1;
+      *p = '/';
+   }
+   if (is_directory) return 0;   // The loop created the last component
+   int fd = open(partial, O_WRONLY | O_CREAT, 0644);
+   if (fd < 0) return -1;
+   close(fd);
+   return 0;
+}
+
+// Creates and takes ownership of a path the naming server placed here
+static void handle_placement(NamingServerLink *link, const FrameHeader *hdr, const uint8_t *payload) {
+   char path[MAX_PATH_LENGTH];
+   PayloadReader reader;
+   payload_reader_init(&reader, payload, hdr->payload_len);
+   Status status = ST_OK;
+   int error = 0;
+   if (payload_get_str(&reader, path, sizeof(path)) < 0 || path[0] == '\0' || path[0] == '/' ||
+       has_parent_component(path)) {
+      status = ST_INVALID;
+   }
+   else if (create_placed_path(path) < 0) {
+      error = errno;
+      status = ST_IO_ERROR;
+   }
+   else {
+      size_t len = strlen(path);
+      while (len > 1 && path[len - 1] == '/') path[--len] = '\0';
+      path_map_insert(&claimed_paths, path, &claimed_paths);
+      printf("Naming Server placed %s here\n", path);
+   }
+
+   pthread_mutex_lock(&link->send_lock);
+   if (status == ST_OK) send_ack(link->nm_socket, hdr->request_id, "Created");
+   else send_error(link->nm_socket, hdr->request_id, status, error ? strerror(error) : NULL);
+   pthread_mutex_unlock(&link->send_lock);
+}
+
+// The report every shard is sent. Link threads report on their own timers,
+// so the first one due in an interval builds it and the rest reuse it;
+// otherwise each would take a share of the interval's latency samples.
+static LoadReport cached_report;
+static uint64_t cached_report_ms;
+static int have_cached_report;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Tells the naming server how busy this server is and how much room it has
+static int send_load_report(NamingServerLink *link) {
+   LoadReport report;
+   pthread_mutex_lock(&report_lock);
+   uint64_t now = monotonic_ms();
+   if (!have_cached_report || now - cached_report_ms >= LOAD_REPORT_INTERVAL_MS) {
+      load_stats_report(&load_stats, &cached_report);
+      cached_report.queue_depth = thread_pool_queue_depth(&worker_pool);
+      cached_report.in_flight = cached_report.queue_depth + thread_pool_active(&worker_pool);
+      struct statvfs fs;
+      if (statvfs(".", &fs) == 0) {
+         cached_report.free_bytes = (uint64_t)fs.f_bavail * fs.f_frsize;
+         cached_report.total_bytes = (uint64_t)fs.f_blocks * fs.f_frsize;
+      } else {
+         cached_report.free_bytes = cached_report.total_bytes = 0;
       }
+      cached_report_ms = now;
+      have_cached_report = 1;
    }
-   // close(handler->client_socket);
-   // free(handler);
-   return NULL;
+   report = cached_report;
+   pthread_mutex_unlock(&report_lock);
+
+   PayloadBuilder message;
+   payload_init(&message);
+   load_report_encode(&message, &report);
+   int rc = link_send(link, OP_LOAD_REPORT, 0, 0, message.data, message.len);
+   payload_free(&message);
+   return rc;
 }
 
+// Exchanges heartbeats with one naming server shard and reports its
+// replies. The shard stops routing clients here if these heartbeats stop, so
+// they keep flowing even while registration is still streaming.
 void* handle_naming_server(void* arg) {
-   NamingServerHandler* handler = (NamingServerHandler*)arg;
-   char buffer[BUFFER_SIZE];
+   NamingServerLink *link = arg;
+   uint64_t last_heard = monotonic_ms();
+   uint64_t next_heartbeat = last_heard;
+   uint64_t next_report = last_heard;
+   int nm_suspected = 0;
 
    while (1) {
-      memset(buffer, 0, BUFFER_SIZE);
-      ssize_t bytes_received = recv(handler->nm_socket, buffer, BUFFER_SIZE - 1, 0);
+      uint64_t now = monotonic_ms();
+      if (now >= next_heartbeat) {
+         // Requests queued or running, for the naming server's replica choice
+         PayloadBuilder beat;
+         payload_init(&beat);
+         payload_put_u32(&beat, thread_pool_queue_depth(&worker_pool) + thread_pool_active(&worker_pool));
+         int rc = link_send(link, OP_HEARTBEAT, 0, 0, beat.data, beat.len);
+         payload_free(&beat);
+         if (rc < 0) {
+            perror("Lost connection to naming server");
+            break;
+         }
+         next_heartbeat = now + HEARTBEAT_INTERVAL_MS;
+      }
+      if (now >= next_report) {
+         if (send_load_report(link) < 0) {
+            perror("Lost connection to naming server");
+            break;
+         }
+         next_report = now + LOAD_REPORT_INTERVAL_MS;
+      }
+      if (!nm_suspected && now - last_heard >= HEARTBEAT_SUSPECT_MS) {
+         printf("Naming Server %s:%d silent for %llu ms\n", link->address.ip, link->address.port,
+                (unsigned long long)(now - last_heard));
+         nm_suspected = 1;
+      }
 
-      if (bytes_received <= 0) {
-         perror("Lost connection to naming server");
+      struct pollfd pfd = { .fd = link->nm_socket, .events = POLLIN };
+      uint64_t wake = next_heartbeat < next_report ? next_heartbeat : next_report;
+      int ready = poll(&pfd, 1, (int)(wake - now));
+      if (ready < 0 && errno != EINTR) {
+         perror("poll on naming server connection failed");
          break;
       }
+      if (ready <= 0) continue;
 
-      buffer[bytes_received] = '\0';
-      printf("Message from Naming Server: %s\n", buffer);
+      FrameHeader hdr;
+      uint8_t *payload;
+      if (recv_frame(link->nm_socket, &hdr, &payload, MAX_CONTROL_PAYLOAD) < 0) {
+         printf("Lost connection to Naming Server %s:%d\n", link->address.ip, link->address.port);
+         break;
+      }
+      last_heard = monotonic_ms();
+      if (nm_suspected) {
+         printf("Naming Server %s:%d is responding again\n", link->address.ip, link->address.port);
+         nm_suspected = 0;
+      }
 
-      // Handle commands from naming server if any
+      if (hdr.opcode == OP_ERROR) {
+         PayloadReader reader;
+         char message[BUFFER_SIZE];
+         payload_reader_init(&reader, payload, hdr.payload_len);
+         payload_get_u32(&reader);
+         payload_get_str(&reader, message, sizeof(message));
+         printf("Naming Server rejected registration: %s\n", message);
+      }
+      else if (hdr.opcode == OP_CREATE) {
+         handle_placement(link, &hdr, payload);
+      }
+      else if (hdr.opcode == OP_SHARD_MAP) {
+         HashRing *ring = hash_ring_decode(payload, hdr.payload_len);
+         if (ring != NULL) apply_shard_map(ring);
+      }
+      else if (hdr.opcode != OP_HEARTBEAT) {
+         printf("Message from Naming Server: opcode %d\n", hdr.opcode);
+      }
+      free(payload);
    }
 
-   close(handler->nm_socket);
-   free(handler);
+   pthread_mutex_lock(&shard_lock);
+   for (int i = 0; i < num_nm_links; i++) {
+      if (nm_links[i] == link) {
+         nm_links[i] = nm_links[--num_nm_links];
+         break;
+      }
+   }
+   pthread_mutex_unlock(&shard_lock);
+   close(link->nm_socket);
+   pthread_mutex_destroy(&link->send_lock);
+   free(link);
    return NULL;
 }
 
 int main(int argc, char *argv[]) {
-   if (argc < 6){
-      printf("Usage: %s <naming_server_ip> <naming_server_port> <ss_port> <port_for_clients> <base_path>\n", argv[0]);
+   int num_workers = DEFAULT_WORKERS;
+   int queue_depth = DEFAULT_QUEUE_DEPTH;
+   int cache_mb = DEFAULT_CACHE_MB;
+   IoBackend io_requested = IO_BLOCKING;
+   const char *path_list = NULL;
+   const char *log_dir = NULL;
+   const char *checksum_dir = NULL;
+   const char *dedup_dir = NULL;
+   Chunking chunking = CHUNKING_CDC;
+   int opt;
+   while ((opt = getopt(argc, argv, "w:q:c:i:p:b:k:d:s:")) != -1) {
+      switch (opt) {
+         case 'w': num_workers = atoi(optarg); break;
+         case 'q': queue_depth = atoi(optarg); break;
+         case 'c': cache_mb = atoi(optarg); break;
+         case 'i':
+            if (strcmp(optarg, "uring") == 0) io_requested = IO_URING;
+            else if (strcmp(optarg, "blocking") != 0) num_workers = 0;
+            break;
+         case 'p': path_list = optarg; break;
+         case 'b': log_dir = optarg; break;
+         case 'k': checksum_dir = optarg; break;
+         case 'd': dedup_dir = optarg; break;
+         case 's':
+            if (strcmp(optarg, "fixed") == 0) chunking = CHUNKING_FIXED;
+            else if (strcmp(optarg, "cdc") != 0) num_workers = 0;
+            break;
+         default: num_workers = 0; break;
+      }
+   }
+   int have_paths = argc - optind >= 5 || (path_list != NULL && argc - optind == 4);
+   if (!have_paths || num_workers < 1 || queue_depth < 1 || cache_mb < 0){
+      printf("Usage: %s [-w workers] [-q queue_depth] [-c cache_mb] [-i blocking|uring] [-p path_list] [-b write_behind_log_dir] [-k checksum_dir] [-d dedup_dir] [-s cdc|fixed] <naming_server_ip> <naming_server_port> <ss_port> <port_for_clients> [paths...]\n", argv[0]);
       return 1;
    }
+   // Shift so the positional arguments start at argv[1] as before
+   argv += optind - 1;
+   argc -= optind - 1;
 
    char *nm_ip = argv[1];           // Naming server IP
    int nm_port = atoi(argv[2]);     // Naming server port
-   int sn_server_port = atoi(argv[3]); // Storage server port
-   int client_port = atoi(argv[4]); // Client communication port
+   ss_port = atoi(argv[3]);         // Storage server port
+   client_port = atoi(argv[4]);     // Client communication port
 
    // Get local IP address
-   char server_ip[16] = {0};
    get_local_ip(server_ip);
 
-   // Connect to Naming Server
-   int nm_socket = socket(AF_INET, SOCK_STREAM, 0);
-   if (nm_socket < 0) {
-      perror("Socket creation failed");
+   // Any naming server tells us which shards exist; each gets a link
+   HashRing *ring = hash_ring_fetch(nm_ip, nm_port);
+   if (ring == NULL) {
+      printf("Could not get the shard map from Naming Server %s:%d\n", nm_ip, nm_port);
       return 1;
    }
-   
-   // Bind to the specific source IP and port
-   struct sockaddr_in source_addr;
-   memset(&source_addr, 0, sizeof(source_addr));
-   source_addr.sin_family = AF_INET;
-   source_addr.sin_addr.s_addr = inet_addr(server_ip); // Use the server's IP
-   source_addr.sin_port = htons(sn_server_port);       // Use the specified port
 
-   if (bind(nm_socket, (struct sockaddr *)&source_addr, sizeof(source_addr)) < 0) {
-      perror("Bind to source IP and port failed");
+   // Connection handling stays on this thread; disk work runs on the pool.
+   // Connections are armed EPOLLONESHOT so only one worker serves each at a
+   // time, and a full queue stalls this loop rather than spawning threads.
+   // The pool exists before the heartbeats that report its load.
+   if (thread_pool_init(&worker_pool, num_workers, queue_depth) < 0) {
+      perror("Worker pool creation failed");
       return 1;
    }
 
-   // Configure Naming Server address
-   struct sockaddr_in nm_addr;
-   memset(&nm_addr, 0, sizeof(nm_addr));
-   nm_addr.sin_family = AF_INET;
-   nm_addr.sin_addr.s_addr = inet_addr(nm_ip);
-   nm_addr.sin_port = htons(nm_port);
+   load_stats_init(&load_stats);
+   path_map_init(&claimed_paths, INITIAL_CLAIM_CAPACITY);
 
-   if (connect(nm_socket, (struct sockaddr *)&nm_addr, sizeof(nm_addr)) < 0) {
-      perror("Connection to Naming Server failed");
-      return 1;
+   // The cache and I/O backend exist before write-behind, whose flusher
+   // (and any replay it leaves pending) writes through them
+   block_cache_init(&block_cache, (size_t)cache_mb << 20, CACHE_BLOCK_SIZE, CACHE_SHARDS);
+   io_backend_init(io_requested, WRITE_BUFFER_SIZE);
+   printf("File I/O backend: %s\n", io_backend_name());
+
+   if (checksum_dir != NULL) {
+      if (checksum_store_init(&checksum_store, checksum_dir, CACHE_BLOCK_SIZE) < 0) {
+         perror("Checksum store setup failed");
+         return 1;
+      }
+      checksums_enabled = 1;
+      printf("Block checksums (crc32c, %s) kept in %s\n", crc32c_backend(), checksum_dir);
    }
 
-   // Send registration type
-   const char *reg_type = "STORAGE_SERVER";
-   if (send(nm_socket, reg_type, strlen(reg_type), 0) < 0) {
-      perror("Initial registration send failed");
-   } else {
-      printf("Registration type sent to Naming Server\n");
-   }
-
-   // Create and send registration message
-   char reg_msg[BUFFER_SIZE];
-   char paths_str[BUFFER_SIZE] = "";
-
-    // Create an array to store accessible paths
-   char accessible_paths[100][MAX_PATH_LENGTH];
-   int num_paths = 0;
-
-   // Loop through all the remaining arguments to process base_path and directories/files
-   printf("Count of files/directories: %d\n", argc - 5);
-   for (int i = 5; i < argc; i++) {
-      char *path = argv[i];
-      printf("Processing path: %s\n", path);
-      // Try to open the directory
-      DIR *dir = opendir(path);
-      if (dir != NULL) {
-         // It's a directory, so get all files in the directory
-         get_accessible_paths(path, accessible_paths, &num_paths);
-         closedir(dir);
-      } else {
-         // It's a file, so just add the file path to the accessible paths array
-         snprintf(accessible_paths[num_paths], MAX_PATH_LENGTH, "%s", path);
-         num_paths++;
+   // Startup reloads every manifest and deletes chunks none of them use
+   if (dedup_dir != NULL) {
+      if (dedup_store_init(&dedup_store, dedup_dir, chunking, CACHE_BLOCK_SIZE) < 0) {
+         perror("Dedup store setup failed");
+         return 1;
       }
+      dedup_enabled = 1;
+      DedupStats dedup;
+      dedup_store_stats(&dedup_store, &dedup);
+      printf("Deduplicating files (%s chunking) into %s: %zu chunks in %zu manifests\n",
+             chunking == CHUNKING_FIXED ? "fixed" : "cdc", dedup_dir, dedup.unique_chunks, dedup.manifests);
    }
-   // Print out all accessible paths
-   printf("\nAll accessible paths:\n");
-   for (int i = 0; i < num_paths; i++) {
-      printf("%s\n", accessible_paths[i]);
+
+   // Uploads logged before a crash reach their files before anything is
+   // served
+   if (log_dir != NULL) {
+      if (write_behind_init(&write_behind, log_dir, &block_cache, checksums_enabled ? &checksum_store : NULL,
+                            dedup_enabled ? &dedup_store : NULL,
+                            (uint64_t)WRITE_BEHIND_MAX_PENDING_MB << 20, WRITE_BEHIND_FLUSH_MS) < 0) {
+         perror("Write-behind log setup failed");
+         return 1;
+      }
+      write_behind_enabled = 1;
+      printf("Write-behind enabled, intent log in %s\n", log_dir);
    }
-   // Start with the number of paths as the first part of the message
-   sprintf(reg_msg, "%s %d %d %d %d", server_ip, nm_port, sn_server_port, client_port, num_paths);
 
-   // Append each path to the message
-   for (int i = 0; i < num_paths; i++) {
-      strcat(reg_msg, " ");
-      strcat(reg_msg, accessible_paths[i]);
+   // Link threads start first, so a rejection is reported while the rest of
+   // the claims are still streaming. Each argument is claimed as a whole: a
+   // directory covers everything beneath it. Exports listing individual
+   // files can pass millions of them through -p; they are sent in batches,
+   // each to the shard owning it, while the list is still being read.
+   pthread_mutex_lock(&shard_lock);
+   shard_ring = ring;
+   for (int i = 0; i < ring->num_shards; i++) link_open(&ring->shards[i]);
+   if (num_nm_links == 0) {
+      printf("No naming server shard could be reached\n");
+      return 1;
+   }
+   Registration reg;
+   registration_start(&reg, ring);
+   int reg_rc = 0;
+   for (int i = 5; i < argc && reg_rc == 0; i++) {
+      reg_rc = registration_add(&reg, argv[i]);
    }
-   
-   ssize_t bytesSent = send(nm_socket, reg_msg, strlen(reg_msg), 0);
-   if (bytesSent < 0) {
+   if (reg_rc == 0 && path_list != NULL) {
+      reg_rc = registration_add_list(&reg, path_list);
+   }
+   size_t total_claims = reg.total;
+   if (reg_rc < 0) return 1;
+   if (registration_finish(&reg) < 0) {
       perror("Registration send failed");
-   } 
-   else {
-      printf("Storage Server registered. Message: %s\n", reg_msg);
+      return 1;
    }
-
-   // Start Naming Server handler thread
-   NamingServerHandler *nm_handler = malloc(sizeof(NamingServerHandler));
-   nm_handler->nm_socket = nm_socket;
-
-   pthread_t nm_thread_id;
-   pthread_create(&nm_thread_id, NULL, handle_naming_server, nm_handler);
+   pthread_mutex_unlock(&shard_lock);
+   printf("Storage Server registered with %zu paths across %d naming server(s)\n",
+          total_claims, ring->num_shards);
 
    // Start Client Server
    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -365,6 +1938,11 @@ int main(int argc, char *argv[]) {
    server_addr.sin_addr.s_addr = inet_addr(ip_address);
    server_addr.sin_port = htons(client_port);
 
+   // Clients keep pooled connections open, so a restart always finds the
+   // previous instance's connections in TIME_WAIT
+   int reuse = 1;
+   setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
       perror("Bind failed");
       return 1;
@@ -377,30 +1955,34 @@ int main(int argc, char *argv[]) {
 
    printf("Storage Server started. Listening for clients on port %d\n", client_port);
 
-   while (1) {
-      struct sockaddr_in client_addr;
-      socklen_t addr_len = sizeof(client_addr);
-      int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &addr_len);
+   client_epoll_fd = epoll_create1(0);
+   struct epoll_event listen_ev;
+   listen_ev.events = EPOLLIN;
+   listen_ev.data.ptr = NULL;
+   if (client_epoll_fd < 0 || epoll_ctl(client_epoll_fd, EPOLL_CTL_ADD, server_socket, &listen_ev) < 0) {
+      perror("epoll setup failed");
+      return 1;
+   }
+   printf("Serving clients with %d workers, queue depth %d\n", num_workers, queue_depth);
 
-      if (client_socket < 0) {
-         perror("Accept failed");
-         continue;
+   struct epoll_event events[MAX_CLIENTS];
+   while (1) {
+      int n = epoll_wait(client_epoll_fd, events, MAX_CLIENTS, -1);
+      if (n < 0) {
+         if (errno == EINTR) continue;
+         perror("epoll_wait failed");
+         break;
       }
-      else {
-         printf("New connection from %s:%d\n",
-               inet_ntoa(client_addr.sin_addr),
-               ntohs(client_addr.sin_port));
+      for (int i = 0; i < n; i++) {
+         if (events[i].data.ptr == NULL) {
+            accept_client(server_socket);
+         }
+         else {
+            thread_pool_submit(&worker_pool, serve_request, events[i].data.ptr);
+         }
       }
-
-      ClientHandler *handler = malloc(sizeof(ClientHandler));
-      handler->client_socket = client_socket;
-
-      pthread_t thread_id;
-      pthread_create(&thread_id, NULL, handle_client, handler);
-      pthread_detach(thread_id);
    }
 
    close(server_socket);
-   close(nm_socket);
    return 0;
 }
\ No newline at end of file
@@ -1,16 +1,81 @@
 #ifndef _SS_H_
 #define _SS_H_
 
+#include "protocol.h"
+#include "hash_ring.h"
+#include "codec.h"
+
 #define BUFFER_SIZE 4096
 #define MAX_PATH_LENGTH 256
 #define MAX_CLIENTS 20
+#define INITIAL_CLAIM_CAPACITY 1024
+#define REGISTER_BATCH_BYTES (64 * 1024)   // Registration streams claims in frames this large
+#define DEFAULT_WORKERS 8
+#define DEFAULT_QUEUE_DEPTH 64
+#define REQUEST_TIMEOUT_SEC 30   // Bound on how long a worker waits for a request body
+#define WRITE_BUFFER_SIZE (1 << 20)   // Uploads reach the disk in writes this large
+#define DEFAULT_CACHE_MB 128
+#define CACHE_BLOCK_SIZE (64 * 1024)
+#define CACHE_SHARDS 16
+#define CACHE_MAX_READ (8 << 20)      // Larger reads bypass the cache and use sendfile
+#define LOAD_REPORT_INTERVAL_MS 1000
+#define WRITE_BEHIND_MAX_UPLOAD (4 << 20)   // Larger uploads are written directly
+#define WRITE_BEHIND_MAX_PENDING_MB 64      // Memory held by logged uploads
+#define WRITE_BEHIND_FLUSH_MS 50
 
 typedef struct {
    int client_socket;
+   Codec codec;                 // Compresses DATA frames sent on this connection
+   int checksums;               // DATA frames sent carry a CRC32C
 } ClientHandler;
 
+// What an OP_DELTA_WRITE asks for
+typedef struct {
+   uint64_t size;               // Of the new contents
+   uint32_t crc;                // Their CRC32C
+   uint64_t base_size;          // The version the delta was computed against
+   int64_t base_mtime_ns;
+   uint64_t base_ino;
+   uint32_t block_size;
+   Durability durability;
+   uint32_t sync_interval_mb;
+   uint64_t delta_size;
+} DeltaRequest;
+
+typedef struct {
+   unsigned long signatures_sent;
+   unsigned long files_rebuilt;
+   unsigned long conflicts;     // Sent back to be written whole
+   unsigned long long bytes_received;
+   unsigned long long bytes_rebuilt;
+} DeltaStats;
+
+// Connection to one naming server shard. Every shard hears this server's
+// heartbeats and load reports and may place paths here; each is registered
+// with only the claims it owns.
 typedef struct {
+   ShardAddress address;
    int nm_socket;
-} NamingServerHandler;
+   pthread_mutex_t send_lock;   // Registration, replies and heartbeats share the socket
+   int registered;              // Later claims go out as OP_CLAIM
+} NamingServerLink;
+
+// Claims queued for one shard
+typedef struct {
+   NamingServerLink *link;      // NULL if the shard could not be reached
+   uint8_t opcode;              // OP_REGISTER until the link is registered, then OP_CLAIM
+   PayloadBuilder batch;        // Identity (first REGISTER frame only), count, paths
+   PayloadBuilder paths;
+   uint32_t count;
+} RegistrationStream;
+
+// Registration under construction: claims are routed to the shard owning
+// them and sent in batches as they are read rather than collected into one
+// message
+typedef struct {
+   const HashRing *ring;
+   RegistrationStream streams[MAX_SHARDS];   // Parallel to ring->shards
+   size_t total;
+} Registration;
 
 #endif
\ No newline at end of file
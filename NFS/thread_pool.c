@@ -0,0 +1,84 @@
+#include "thread_pool.h"
+
+static void* worker_loop(void *arg) {
+   ThreadPool *pool = arg;
+
+   while (1) {
+      pthread_mutex_lock(&pool->lock);
+      while (pool->count == 0) {
+         pthread_cond_wait(&pool->not_empty, &pool->lock);
+      }
+      Job job = pool->queue[pool->head];
+      pool->head = (pool->head + 1) % pool->capacity;
+      pool->count--;
+      pool->active++;
+      pthread_cond_signal(&pool->not_full);
+      pthread_mutex_unlock(&pool->lock);
+
+      job.function(job.arg);
+
+      pthread_mutex_lock(&pool->lock);
+      pool->active--;
+      pthread_mutex_unlock(&pool->lock);
+   }
+   return NULL;
+}
+
+int thread_pool_init(ThreadPool *pool, int num_workers, int queue_capacity) {
+   pool->num_workers = num_workers;
+   pool->capacity = queue_capacity;
+   pool->head = 0;
+   pool->count = 0;
+   pool->active = 0;
+   pool->queue = calloc(queue_capacity, sizeof(Job));
+   pool->workers = calloc(num_workers, sizeof(pthread_t));
+   if (pool->queue == NULL || pool->workers == NULL) {
+      free(pool->queue);
+      free(pool->workers);
+      return -1;
+   }
+   pthread_mutex_init(&pool->lock, NULL);
+   pthread_cond_init(&pool->not_empty, NULL);
+   pthread_cond_init(&pool->not_full, NULL);
+
+   for (int i = 0; i < num_workers; i++) {
+      if (pthread_create(&pool->workers[i], NULL, worker_loop, pool) != 0) {
+         perror("Worker thread creation failed");
+         return -1;
+      }
+      pthread_detach(pool->workers[i]);
+   }
+   return 0;
+}
+
+static void enqueue_locked(ThreadPool *pool, JobFunction function, void *arg) {
+   int tail = (pool->head + pool->count) % pool->capacity;
+   pool->queue[tail].function = function;
+   pool->queue[tail].arg = arg;
+   pool->count++;
+   pthread_cond_signal(&pool->not_empty);
+}
+
+// Blocks while the queue is full
+void thread_pool_submit(ThreadPool *pool, JobFunction function, void *arg) {
+   pthread_mutex_lock(&pool->lock);
+   while (pool->count == pool->capacity) {
+      pthread_cond_wait(&pool->not_full, &pool->lock);
+   }
+   enqueue_locked(pool, function, arg);
+   pthread_mutex_unlock(&pool->lock);
+}
+
+int thread_pool_queue_depth(ThreadPool *pool) {
+   pthread_mutex_lock(&pool->lock);
+   int depth = pool->count;
+   pthread_mutex_unlock(&pool->lock);
+   return depth;
+}
+
+int thread_pool_active(ThreadPool *pool) {
+   pthread_mutex_lock(&pool->lock);
+   int active = pool->active;
+   pthread_mutex_unlock(&pool->lock);
+   return active;
+}
@@ -0,0 +1,36 @@
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include "headers.h"
+
+typedef void (*JobFunction)(void *arg);
+
+typedef struct {
+   JobFunction function;
+   void *arg;
+} Job;
+
+// Fixed set of worker threads draining a bounded ring of jobs. Submitting to
+// a full queue blocks the caller, which pushes backpressure onto whoever is
+// producing work (the accept/dispatch loop) instead of growing memory.
+typedef struct {
+   pthread_t *workers;
+   int num_workers;
+
+   Job *queue;
+   int capacity;
+   int head;
+   int count;
+   int active;                  // Jobs currently executing
+
+   pthread_mutex_t lock;
+   pthread_cond_t not_empty;
+   pthread_cond_t not_full;
+} ThreadPool;
+
+int thread_pool_init(ThreadPool *pool, int num_workers, int queue_capacity);
+void thread_pool_submit(ThreadPool *pool, JobFunction function, void *arg);
+int thread_pool_queue_depth(ThreadPool *pool);
+int thread_pool_active(ThreadPool *pool);
+
+#endif
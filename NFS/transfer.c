@@ -0,0 +1,191 @@
+#define _GNU_SOURCE   // splice()
+#include "transfer.h"
+#include "protocol.h"
+#include <sys/sendfile.h>
+#include <limits.h>
+
+#define TRANSFER_CHUNK (64 * 1024)
+#define SENDFILE_MAX 0x7ffff000   // Largest count the kernel moves per call
+
+static int send_file_sendfile(int sock, int fd, off_t *offset, uint64_t *remaining) {
+   while (*remaining > 0) {
+      size_t count = *remaining < SENDFILE_MAX ? *remaining : SENDFILE_MAX;
+      ssize_t sent = sendfile(sock, fd, offset, count);
+      if (sent < 0) {
+         if (errno == EINTR || errno == EAGAIN) continue;
+         return -1;
+      }
+      if (sent == 0) {
+         errno = EIO;   // File shorter than announced
+         return -1;
+      }
+      *remaining -= sent;
+   }
+   return 0;
+}
+
+static int send_file_splice(int sock, int fd, off_t *offset, uint64_t *remaining) {
+   int pipefd[2];
+   if (pipe(pipefd) < 0) return -1;
+
+   int rc = 0;
+   while (*remaining > 0 && rc == 0) {
+      size_t count = *remaining < TRANSFER_CHUNK ? *remaining : TRANSFER_CHUNK;
+      ssize_t in_pipe = splice(fd, offset, pipefd[1], NULL, count, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (in_pipe < 0 && errno == EINTR) continue;
+      if (in_pipe <= 0) {
+         if (in_pipe == 0) errno = EIO;
+         rc = -1;
+         break;
+      }
+      // Drain the pipe completely before refilling it
+      while (in_pipe > 0) {
+         ssize_t out = splice(pipefd[0], NULL, sock, NULL, in_pipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+         if (out < 0 && errno == EINTR) continue;
+         if (out <= 0) {
+            rc = -1;
+            break;
+         }
+         in_pipe -= out;
+         *remaining -= out;
+      }
+   }
+   close(pipefd[0]);
+   close(pipefd[1]);
+   return rc;
+}
+
+static int send_file_buffered(int sock, int fd, off_t *offset, uint64_t *remaining) {
+   char buffer[TRANSFER_CHUNK];
+   while (*remaining > 0) {
+      size_t want = *remaining < sizeof(buffer) ? *remaining : sizeof(buffer);
+      ssize_t bytes_read = pread(fd, buffer, want, *offset);
+      if (bytes_read < 0 && errno == EINTR) continue;
+      if (bytes_read <= 0) {
+         if (bytes_read == 0) errno = EIO;
+         return -1;
+      }
+      if (send_all(sock, buffer, bytes_read) < 0) return -1;
+      *offset += bytes_read;
+      *remaining -= bytes_read;
+   }
+   return 0;
+}
+
+int send_file_range(int sock, int fd, off_t offset, uint64_t len) {
+   uint64_t remaining = len;
+
+   if (send_file_sendfile(sock, fd, &offset, &remaining) == 0) return 0;
+   // sendfile is refused for some file systems; anything it already moved
+   // has advanced offset/remaining, so the fallbacks pick up from there
+   if (errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) return -1;
+
+   if (send_file_splice(sock, fd, &offset, &remaining) == 0) return 0;
+   if (errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) return -1;
+
+   return send_file_buffered(sock, fd, &offset, &remaining);
+}
+
+// Buffered path for files whose size is unknown: a DATA frame per chunk with
+// FRAME_F_MORE set, terminated by an empty DATA frame.
+static int send_stream_chunks(int sock, uint32_t request_id, int fd, DataEncoder *enc) {
+   uint8_t buffer[TRANSFER_CHUNK];
+   DataEncoder raw;
+   if (enc == NULL) {
+      data_encoder_init(&raw, CODEC_NONE, 0, NULL);
+      enc = &raw;
+   }
+   while (1) {
+      ssize_t bytes_read = read(fd, buffer, sizeof(buffer));
+      if (bytes_read < 0 && errno == EINTR) continue;
+      if (bytes_read < 0) return -1;
+      if (bytes_read == 0) break;
+      if (send_data_chunk(sock, FRAME_F_MORE, request_id, enc, buffer, bytes_read) < 0) return -1;
+   }
+   return send_frame(sock, OP_DATA, 0, request_id, NULL, 0);
+}
+
+int send_file_compressed(int sock, uint32_t request_id, int fd, off_t offset, uint64_t len,
+                         DataEncoder *enc) {
+   uint8_t buffer[CODEC_CHUNK_SIZE];
+   if (len == 0) return send_frame(sock, OP_DATA, 0, request_id, NULL, 0);
+   while (len > 0) {
+      size_t want = len < sizeof(buffer) ? len : sizeof(buffer);
+      ssize_t bytes_read = pread(fd, buffer, want, offset);
+      if (bytes_read < 0 && errno == EINTR) continue;
+      if (bytes_read <= 0) {
+         if (bytes_read == 0) errno = EIO;   // File shorter than announced
+         return -1;
+      }
+      offset += bytes_read;
+      len -= bytes_read;
+      uint8_t flags = len > 0 ? FRAME_F_MORE : 0;
+      if (send_data_chunk(sock, flags, request_id, enc, buffer, bytes_read) < 0) return -1;
+   }
+   return 0;
+}
+
+int send_iov_all(int sock, struct iovec *iov, int count) {
+   while (count > 0) {
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = count < IOV_MAX ? count : IOV_MAX;
+      ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+      if (sent < 0) {
+         if (errno == EINTR) continue;
+         return -1;
+      }
+      while (count > 0 && (size_t)sent >= iov->iov_len) {
+         sent -= iov->iov_len;
+         iov++;
+         count--;
+      }
+      if (count > 0) {
+         iov->iov_base = (char *)iov->iov_base + sent;
+         iov->iov_len -= sent;
+      }
+   }
+   return 0;
+}
+
+int send_data_header(int sock, uint8_t flags, uint32_t request_id, uint64_t payload_len) {
+   FrameHeader hdr = { OP_DATA, flags, request_id, payload_len };
+   uint8_t raw[FRAME_HEADER_SIZE];
+   frame_header_encode(&hdr, raw);
+   // MSG_MORE lets the header share a segment with the first payload bytes
+   ssize_t sent = send(sock, raw, FRAME_HEADER_SIZE, MSG_MORE | MSG_NOSIGNAL);
+   if (sent < 0 || send_all(sock, raw + sent, FRAME_HEADER_SIZE - sent) < 0) {
+      return -1;
+   }
+   return 0;
+}
+
+int send_file_frame(int sock, uint8_t flags, uint32_t request_id, int fd, off_t offset, uint64_t len) {
+   if (send_data_header(sock, flags, request_id, len) < 0) return -1;
+   return send_file_range(sock, fd, offset, len);
+}
+
+int send_file_frame_checksummed(int sock, uint8_t flags, uint32_t request_id, int fd, off_t offset,
+                                uint64_t len, uint32_t crc) {
+   uint8_t trailer[CHECKSUM_TRAILER_SIZE] = { crc >> 24, crc >> 16, crc >> 8, crc };
+   if (send_data_header(sock, flags | FRAME_F_CHECKSUM, request_id, len + sizeof(trailer)) < 0 ||
+       send_file_range(sock, fd, offset, len) < 0) {
+      return -1;
+   }
+   return send_all(sock, trailer, sizeof(trailer));
+}
+
+int send_file_reply(int sock, uint32_t request_id, int fd, DataEncoder *enc) {
+   struct stat file_stat;
+   if (fstat(fd, &file_stat) != 0) {
+      return send_error(sock, request_id, ST_IO_ERROR, strerror(errno));
+   }
+   if (!S_ISREG(file_stat.st_mode)) {
+      return send_stream_chunks(sock, request_id, fd, enc);
+   }
+   if (enc != NULL && data_encoder_transforms(enc)) {
+      return send_file_compressed(sock, request_id, fd, 0, file_stat.st_size, enc);
+   }
+   return send_file_frame(sock, 0, request_id, fd, 0, file_stat.st_size);
+}
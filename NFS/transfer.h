@@ -0,0 +1,39 @@
+#ifndef _TRANSFER_H_
+#define _TRANSFER_H_
+
+#include "headers.h"
+#include "codec.h"
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Sends len bytes of fd starting at offset straight from the page cache to
+// the socket. Tries sendfile first, then splice through a pipe, and finally a
+// buffered pread/send loop. Returns 0 once all len bytes are on the wire.
+int send_file_range(int sock, int fd, off_t offset, uint64_t len);
+
+// Sends every byte described by iov (which is consumed in the process)
+int send_iov_all(int sock, struct iovec *iov, int count);
+
+// Sends the header of a DATA frame whose payload the caller sends next
+int send_data_header(int sock, uint8_t flags, uint32_t request_id, uint64_t payload_len);
+
+// Sends one DATA frame whose body is len bytes of fd starting at offset
+int send_file_frame(int sock, uint8_t flags, uint32_t request_id, int fd, off_t offset, uint64_t len);
+// Same, ending with crc as its checksum trailer. The caller knows the
+// checksum of those bytes without reading them, so the body stays zero-copy.
+int send_file_frame_checksummed(int sock, uint8_t flags, uint32_t request_id, int fd, off_t offset,
+                                uint64_t len, uint32_t crc);
+
+// Sends len bytes of fd starting at offset through enc, as DATA frames of at
+// most CODEC_CHUNK_SIZE raw bytes, each but the last flagged FRAME_F_MORE
+int send_file_compressed(int sock, uint32_t request_id, int fd, off_t offset, uint64_t len,
+                         DataEncoder *enc);
+
+// Streams a whole open file as a READ/STREAM reply. Regular files are sent as
+// one DATA frame whose header announces the size, followed by a zero-copy
+// body, unless enc compresses or checksums; anything else (pipes, devices)
+// falls back to buffered chunks flagged FRAME_F_MORE because their length is
+// not known up front. enc may be NULL.
+int send_file_reply(int sock, uint32_t request_id, int fd, DataEncoder *enc);
+
+#endif
@@ -0,0 +1,653 @@
+#define _GNU_SOURCE   // syncfs()
+#include "write_behind.h"
+#include "path_map.h"
+#include "protocol.h"
+#include <limits.h>
+
+#define LOG_MAGIC 0x4E465742       // "NFWB"
+#define LOG_PREFIX "intent."
+#define PENDING_BUCKETS 1024
+#define MAX_RECORD_SIZE (1ULL << 32)   // Anything larger is a corrupt header
+#define MAX_SYNC_DEVICES 8
+
+// One fd per file system touched by a batch, so each is synced once
+typedef struct {
+   dev_t devs[MAX_SYNC_DEVICES];
+   int fds[MAX_SYNC_DEVICES];
+   int count;
+} SyncSet;
+
+static uint64_t record_checksum(const char *path, const uint8_t *data, uint64_t size) {
+   return path_hash(path, strlen(path)) ^ (path_hash((const char *)data, size) + size);
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+   const uint8_t *p = buf;
+   while (len > 0) {
+      ssize_t written = write(fd, p, len);
+      if (written < 0) {
+         if (errno == EINTR) continue;
+         return -1;
+      }
+      p += written;
+      len -= written;
+   }
+   return 0;
+}
+
+static int read_exact(int fd, void *buf, size_t len) {
+   uint8_t *p = buf;
+   while (len > 0) {
+      ssize_t got = read(fd, p, len);
+      if (got < 0 && errno == EINTR) continue;
+      if (got <= 0) return -1;   // Error or a record cut short by the crash
+      p += got;
+      len -= got;
+   }
+   return 0;
+}
+
+static void log_name(const WriteBehind *wb, uint64_t generation, char *out, size_t out_size) {
+   snprintf(out, out_size, "%s/" LOG_PREFIX "%llu", wb->dir, (unsigned long long)generation);
+}
+
+static void sync_dir(const char *dir) {
+   int fd = open(dir, O_RDONLY | O_DIRECTORY);
+   if (fd >= 0) {
+      fsync(fd);
+      close(fd);
+   }
+}
+
+// Remembers fd's file system for sync_set_flush. Batches spanning more file
+// systems than fit sync the extra files one by one.
+static void sync_set_add(SyncSet *set, int fd) {
+   struct stat st;
+   if (fstat(fd, &st) != 0) return;
+   for (int i = 0; i < set->count; i++) {
+      if (set->devs[i] == st.st_dev) return;
+   }
+   if (set->count == MAX_SYNC_DEVICES) {
+      fdatasync(fd);
+      return;
+   }
+   int copy = dup(fd);
+   if (copy < 0) {
+      fdatasync(fd);
+      return;
+   }
+   set->devs[set->count] = st.st_dev;
+   set->fds[set->count++] = copy;
+}
+
+static int sync_set_flush(SyncSet *set) {
+   int rc = 0;
+   for (int i = 0; i < set->count; i++) {
+      if (syncfs(set->fds[i]) < 0) rc = -1;
+      close(set->fds[i]);
+   }
+   set->count = 0;
+   return rc;
+}
+
+// Replaces path with data the way a direct WRITE does: through a temporary
+// file renamed into place, keeping the permissions of the file it replaces,
+// and with its block checksums saved if they are kept. Nothing is synced
+// here; the caller syncs the whole batch.
+static int apply_file(WriteBehind *wb, const char *path, const uint8_t *data, uint64_t size,
+                      SyncSet *set) {
+   char temp_path[PATH_MAX];
+   snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path);
+   int fd = mkstemp(temp_path);
+   if (fd < 0) return -1;
+   struct stat old_stat, written;
+   int had_file = stat(path, &old_stat) == 0;
+   // A deduplicated file is a placeholder of its size until its chunks are
+   // recorded; the batch's sync covers them and the manifest
+   DedupWriter dedup, *chunker = NULL;
+   if (wb->dedup && size >= DEDUP_MIN_FILE_SIZE) {
+      dedup_writer_init(&dedup, wb->dedup);
+      chunker = &dedup;
+   }
+   int stored = chunker ? dedup_writer_update(chunker, data, size) == 0 && ftruncate(fd, size) == 0
+                        : write_all(fd, data, size) == 0;
+   if (!stored ||
+       fchmod(fd, had_file ? (old_stat.st_mode & 0777) : 0644) < 0 ||
+       fstat(fd, &written) < 0 ||
+       (chunker && dedup_writer_commit(chunker, path, &written, 0) < 0) ||
+       rename(temp_path, path) < 0) {
+      int error = errno;
+      // A commit frees the writer, after which only its manifest is left
+      if (chunker && chunker->window) dedup_writer_abort(chunker);
+      else if (chunker) dedup_store_remove(wb->dedup, &written);
+      close(fd);
+      unlink(temp_path);
+      errno = error;
+      return -1;
+   }
+   sync_set_add(set, fd);
+   if (chunker) sync_set_add(set, wb->dedup->dir_fd);
+   close(fd);
+   if (had_file && wb->cache) block_cache_invalidate_file(wb->cache, old_stat.st_dev, old_stat.st_ino);
+   if (had_file && wb->dedup) dedup_store_remove(wb->dedup, &old_stat);
+   if (wb->checksums && had_file) checksum_store_remove(wb->checksums, &old_stat);
+   // Chunks carry their own checksums
+   if (wb->checksums && !chunker) {
+      BlockChecksums sums;
+      block_checksums_init(&sums, wb->checksums->block_size);
+      block_checksums_update(&sums, data, size);
+      checksum_store_save(wb->checksums, &written, &sums);
+      block_checksums_free(&sums);
+   }
+   return 0;
+}
+
+static size_t bucket_of(WriteBehind *wb, const char *path) {
+   return path_hash(path, strlen(path)) & (wb->num_buckets - 1);
+}
+
+// Caller holds the lock
+static PendingWrite **find_slot(WriteBehind *wb, const char *path) {
+   PendingWrite **slot = &wb->buckets[bucket_of(wb, path)];
+   while (*slot != NULL && strcmp((*slot)->path, path) != 0) slot = &(*slot)->next;
+   return slot;
+}
+
+static void pending_free(PendingWrite *entry) {
+   free(entry->path);
+   free(entry->data);
+   free(entry);
+}
+
+// Makes entry the pending upload of its path. An older one is dropped unless
+// a batch is writing it out, in which case the batch frees it. Caller holds
+// the lock.
+static void pending_insert(WriteBehind *wb, PendingWrite *entry) {
+   PendingWrite **slot = find_slot(wb, entry->path);
+   PendingWrite *previous = *slot;
+   if (previous != NULL) {
+      entry->next = previous->next;
+      *slot = entry;
+      if (!previous->flushing) {
+         wb->pending_bytes -= previous->size;
+         wb->stats.coalesced++;
+         pending_free(previous);
+      }
+   }
+   else {
+      entry->next = NULL;
+      *slot = entry;
+      __atomic_store_n(&wb->num_pending, wb->num_pending + 1, __ATOMIC_RELEASE);
+   }
+   wb->pending_bytes += entry->size;
+}
+
+// Drops the pending upload of path, if any, which no batch may be writing
+// out. Caller holds the lock.
+static void pending_remove(WriteBehind *wb, const char *path) {
+   PendingWrite **slot = find_slot(wb, path);
+   PendingWrite *entry = *slot;
+   if (entry == NULL) return;
+   *slot = entry->next;
+   __atomic_store_n(&wb->num_pending, wb->num_pending - 1, __ATOMIC_RELEASE);
+   wb->pending_bytes -= entry->size;
+   pending_free(entry);
+}
+
+// Whether an upload of path, or with subtree of anything beneath it, is
+// pending. Caller holds the lock.
+static int pending_under(WriteBehind *wb, const char *path, int subtree) {
+   if (*find_slot(wb, path) != NULL) return 1;
+   if (!subtree) return 0;
+   size_t len = strlen(path);
+   while (len > 0 && path[len - 1] == '/') len--;
+   for (size_t b = 0; b < wb->num_buckets; b++) {
+      for (PendingWrite *e = wb->buckets[b]; e != NULL; e = e->next) {
+         if (strncmp(e->path, path, len) == 0 && e->path[len] == '/') return 1;
+      }
+   }
+   return 0;
+}
+
+static void build_record(PayloadBuilder *record, const char *path, const uint8_t *data, uint64_t size) {
+   payload_init(record);
+   payload_put_u32(record, LOG_MAGIC);
+   payload_put_str(record, path);
+   payload_put_u64(record, size);
+   payload_put_u64(record, record_checksum(path, data, size));
+   // Records are small enough to go out in one write
+   payload_put_bytes(record, data, size);
+}
+
+// Appends a record to the current log. Replay stops at a torn record,
+// losing every one appended after it, so a partial append is cut off again,
+// or failing that the log is marked torn for the next batch to rotate away.
+// Caller holds the lock.
+static int append_record(WriteBehind *wb, const PayloadBuilder *record) {
+   if (wb->log_torn) {
+      errno = EIO;
+      return -1;
+   }
+   off_t start = lseek(wb->log_fd, 0, SEEK_END);
+   if (write_all(wb->log_fd, record->data, record->len) < 0) {
+      int error = errno;
+      if (start < 0 || ftruncate(wb->log_fd, start) < 0) {
+         perror("Could not cut a failed record off the intent log");
+         __atomic_store_n(&wb->log_torn, 1, __ATOMIC_RELEASE);
+      }
+      errno = error;
+      return -1;
+   }
+   wb->appended += record->len;
+   return 0;
+}
+
+// Logs a pending upload again in the current log. Caller holds the lock.
+static int relog(WriteBehind *wb, const PendingWrite *entry) {
+   PayloadBuilder record;
+   build_record(&record, entry->path, entry->data, entry->size);
+   int rc = append_record(wb, &record);
+   payload_free(&record);
+   return rc;
+}
+
+// Waits until the log is durable up to lsn, syncing it ourselves if nobody
+// else is. Caller holds the lock.
+static int wait_committed(WriteBehind *wb, uint64_t lsn) {
+   while (wb->synced < lsn) {
+      if (wb->syncing) {
+         pthread_cond_wait(&wb->committed, &wb->lock);
+         continue;
+      }
+      // Everything appended so far rides along with this sync
+      wb->syncing = 1;
+      uint64_t target = wb->appended;
+      int fd = wb->log_fd;
+      pthread_mutex_unlock(&wb->lock);
+      int rc = fdatasync(fd);
+      int error = errno;
+      pthread_mutex_lock(&wb->lock);
+      wb->syncing = 0;
+      wb->stats.log_syncs++;
+      if (rc == 0 && target > wb->synced) wb->synced = target;
+      pthread_cond_broadcast(&wb->committed);
+      if (rc < 0) {
+         errno = error;
+         return -1;
+      }
+   }
+   return 0;
+}
+
+static int open_log(WriteBehind *wb, uint64_t generation) {
+   char name[PATH_MAX];
+   log_name(wb, generation, name, sizeof(name));
+   int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+   if (fd < 0) return -1;
+   // The log's directory entry must survive a crash as well as its contents
+   sync_dir(wb->dir);
+   return fd;
+}
+
+// Switches appends to a new log and claims every pending upload for a batch.
+// The old log is synced before returning, so nobody waits on it afterwards.
+// Returns the number of entries placed in *batch, or -1.
+static ssize_t start_batch(WriteBehind *wb, PendingWrite ***batch, int *old_fd) {
+   int new_fd = open_log(wb, wb->generation + 1);
+   if (new_fd < 0) return -1;
+
+   pthread_mutex_lock(&wb->lock);
+   while (wb->syncing) pthread_cond_wait(&wb->committed, &wb->lock);
+   *batch = malloc((wb->num_pending ? wb->num_pending : 1) * sizeof(PendingWrite *));
+   if (*batch == NULL) {
+      pthread_mutex_unlock(&wb->lock);
+      close(new_fd);
+      return -1;
+   }
+   size_t count = 0;
+   for (size_t b = 0; b < wb->num_buckets; b++) {
+      for (PendingWrite *e = wb->buckets[b]; e != NULL; e = e->next) {
+         e->flushing = 1;
+         (*batch)[count++] = e;
+      }
+   }
+   *old_fd = wb->log_fd;
+   wb->log_fd = new_fd;
+   wb->log_torn = 0;
+   wb->generation++;
+
+   uint64_t old_end = wb->appended;
+   if (wb->synced < old_end) {
+      wb->syncing = 1;
+      pthread_mutex_unlock(&wb->lock);
+      int rc = fdatasync(*old_fd);
+      pthread_mutex_lock(&wb->lock);
+      wb->syncing = 0;
+      wb->stats.log_syncs++;
+      if (rc == 0) wb->synced = old_end;
+      else perror("Intent log sync failed");
+      pthread_cond_broadcast(&wb->committed);
+   }
+   pthread_mutex_unlock(&wb->lock);
+   return count;
+}
+
+// Deletes the logs from the oldest retained one through last
+static void retire_logs(WriteBehind *wb, uint64_t last) {
+   char name[PATH_MAX];
+   for (uint64_t g = wb->retained ? wb->retained : last; g <= last; g++) {
+      log_name(wb, g, name, sizeof(name));
+      unlink(name);
+   }
+   __atomic_store_n(&wb->retained, 0, __ATOMIC_RELEASE);
+   sync_dir(wb->dir);
+}
+
+// Writes out every pending upload. Caller holds flush_lock. A torn log is
+// rotated even with nothing pending.
+static void run_batch(WriteBehind *wb) {
+   if (__atomic_load_n(&wb->num_pending, __ATOMIC_ACQUIRE) == 0 &&
+       !__atomic_load_n(&wb->log_torn, __ATOMIC_ACQUIRE)) return;
+
+   PendingWrite **batch;
+   int old_fd;
+   ssize_t count = start_batch(wb, &batch, &old_fd);
+   if (count < 0) {
+      perror("Could not start a write-behind batch");
+      return;
+   }
+
+   SyncSet set = { .count = 0 };
+   int failures = 0;
+   for (ssize_t i = 0; i < count; i++) {
+      batch[i]->failed = apply_file(wb, batch[i]->path, batch[i]->data, batch[i]->size, &set) < 0;
+      if (batch[i]->failed) {
+         fprintf(stderr, "Write-behind flush of %s failed, will retry: %s\n", batch[i]->path,
+                 strerror(errno));
+         failures++;
+      }
+   }
+   int synced = sync_set_flush(&set) == 0;
+   if (!synced) perror("Write-behind batch sync failed; will retry");
+
+   // Only once the files are durable may the records for them go. An upload
+   // that did not make it stays pending, to be retried, and is logged again
+   // in the new log, so the old one can still go. No log is left holding a
+   // record of a path written out since, which a replay would bring back
+   // over a later delete or direct write. Only if logging them again fails
+   // are the old logs kept, and settling refused, until a batch manages it.
+   close(old_fd);
+   uint64_t old_generation = wb->generation - 1;
+   int relogged = 1;
+   pthread_mutex_lock(&wb->lock);
+   for (ssize_t i = 0; i < count && relogged; i++) {
+      if (*find_slot(wb, batch[i]->path) == batch[i] && (batch[i]->failed || !synced) &&
+          relog(wb, batch[i]) < 0) {
+         relogged = 0;
+      }
+   }
+   if (relogged && (failures > 0 || !synced) && wait_committed(wb, wb->appended) < 0) relogged = 0;
+   if (!relogged) {
+      perror("Could not log unwritten uploads again, keeping their logs");
+      if (wb->retained == 0) __atomic_store_n(&wb->retained, old_generation, __ATOMIC_RELEASE);
+   }
+
+   for (ssize_t i = 0; i < count; i++) {
+      PendingWrite **slot = find_slot(wb, batch[i]->path);
+      int current = *slot == batch[i];
+      if (current && (batch[i]->failed || !synced)) {
+         batch[i]->flushing = 0;
+         continue;
+      }
+      if (current) {
+         *slot = batch[i]->next;
+         __atomic_store_n(&wb->num_pending, wb->num_pending - 1, __ATOMIC_RELEASE);
+      }
+      wb->pending_bytes -= batch[i]->size;
+      if (!batch[i]->failed && synced) wb->stats.files_flushed++;
+      pending_free(batch[i]);
+   }
+   wb->stats.batches++;
+   pthread_mutex_unlock(&wb->lock);
+   free(batch);
+   if (relogged) retire_logs(wb, old_generation);
+}
+
+static void flush_now(WriteBehind *wb) {
+   pthread_mutex_lock(&wb->flush_lock);
+   run_batch(wb);
+   pthread_mutex_unlock(&wb->flush_lock);
+}
+
+static void *flusher(void *arg) {
+   WriteBehind *wb = arg;
+   while (1) {
+      usleep(wb->flush_interval_ms * 1000);
+      flush_now(wb);
+   }
+   return NULL;
+}
+
+// Applies every complete record of one log. A record cut short or failing
+// its checksum marks where the crash interrupted the log. A record that
+// cannot be applied becomes a pending upload of its path, for the flusher to
+// retry, and one applied later supersedes it. Returns the number of records
+// left pending.
+static int replay_log(WriteBehind *wb, const char *name, SyncSet *set) {
+   int fd = open(name, O_RDONLY);
+   if (fd < 0) return 0;
+   int failures = 0;
+   while (1) {
+      uint8_t head[6];
+      if (read_exact(fd, head, sizeof(head)) < 0) break;
+      PayloadReader r;
+      payload_reader_init(&r, head, sizeof(head));
+      uint32_t magic = payload_get_u32(&r);
+      uint16_t path_len = payload_get_u16(&r);
+      if (magic != LOG_MAGIC || path_len == 0 || path_len >= PATH_MAX) break;
+
+      char path[PATH_MAX];
+      uint8_t tail[16];
+      if (read_exact(fd, path, path_len) < 0 || read_exact(fd, tail, sizeof(tail)) < 0) break;
+      path[path_len] = '\0';
+      payload_reader_init(&r, tail, sizeof(tail));
+      uint64_t size = payload_get_u64(&r);
+      uint64_t checksum = payload_get_u64(&r);
+      if (size > MAX_RECORD_SIZE) break;
+
+      uint8_t *data = malloc(size ? size : 1);
+      if (data == NULL || read_exact(fd, data, size) < 0 ||
+          record_checksum(path, data, size) != checksum) {
+         free(data);
+         break;
+      }
+      if (apply_file(wb, path, data, size, set) < 0) {
+         fprintf(stderr, "Replay of %s failed, will retry: %s\n", path, strerror(errno));
+         PendingWrite *entry = malloc(sizeof(PendingWrite));
+         if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+            perror("Failed to allocate a write-behind record");
+            exit(1);
+         }
+         entry->data = data;
+         entry->size = size;
+         entry->flushing = 0;
+         entry->failed = 0;
+         pending_insert(wb, entry);
+         failures++;
+         continue;
+      }
+      pending_remove(wb, path);
+      wb->stats.replayed++;
+      free(data);
+   }
+   close(fd);
+   return failures;
+}
+
+static int compare_generations(const void *a, const void *b) {
+   uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+   return x < y ? -1 : x > y;
+}
+
+// Replays leftover logs oldest first, then removes them. If a record could
+// not be applied they all stay, for write_behind_init to log what is pending
+// from them again before retiring them. Returns the highest generation seen.
+static uint64_t recover(WriteBehind *wb) {
+   DIR *dir = opendir(wb->dir);
+   if (dir == NULL) return 0;
+   uint64_t *generations = NULL;
+   size_t count = 0, cap = 0;
+   struct dirent *entry;
+   while ((entry = readdir(dir)) != NULL) {
+      if (strncmp(entry->d_name, LOG_PREFIX, strlen(LOG_PREFIX)) != 0) continue;
+      char *end;
+      uint64_t generation = strtoull(entry->d_name + strlen(LOG_PREFIX), &end, 10);
+      if (*end != '\0') continue;
+      if (count == cap) {
+         cap = cap ? cap * 2 : 8;
+         uint64_t *grown = realloc(generations, cap * sizeof(uint64_t));
+         if (grown == NULL) break;
+         generations = grown;
+      }
+      generations[count++] = generation;
+   }
+   closedir(dir);
+   qsort(generations, count, sizeof(uint64_t), compare_generations);
+
+   SyncSet set = { .count = 0 };
+   char name[PATH_MAX];
+   int failures = 0;
+   for (size_t i = 0; i < count; i++) {
+      log_name(wb, generations[i], name, sizeof(name));
+      failures += replay_log(wb, name, &set);
+   }
+   if (sync_set_flush(&set) == 0) {
+      if (failures > 0) wb->retained = generations[0];
+      for (size_t i = 0; i < count && failures == 0; i++) {
+         log_name(wb, generations[i], name, sizeof(name));
+         unlink(name);
+      }
+      sync_dir(wb->dir);
+   }
+   uint64_t highest = count ? generations[count - 1] : 0;
+   if (wb->stats.replayed > 0) {
+      printf("Replayed %lu write-behind records from %zu intent log(s)\n", wb->stats.replayed, count);
+   }
+   free(generations);
+   return highest;
+}
+
+int write_behind_init(WriteBehind *wb, const char *log_dir, BlockCache *cache, ChecksumStore *checksums,
+                      DedupStore *dedup, uint64_t max_pending_bytes, int flush_interval_ms) {
+   memset(wb, 0, sizeof(*wb));
+   snprintf(wb->dir, sizeof(wb->dir), "%s", log_dir);
+   if (mkdir(wb->dir, 0700) < 0 && errno != EEXIST) return -1;
+   wb->cache = cache;
+   wb->checksums = checksums;
+   wb->dedup = dedup;
+   wb->max_pending_bytes = max_pending_bytes;
+   wb->flush_interval_ms = flush_interval_ms;
+   pthread_mutex_init(&wb->lock, NULL);
+   pthread_mutex_init(&wb->flush_lock, NULL);
+   pthread_cond_init(&wb->committed, NULL);
+   wb->num_buckets = PENDING_BUCKETS;
+   wb->buckets = calloc(wb->num_buckets, sizeof(PendingWrite *));
+   if (wb->buckets == NULL) return -1;
+
+   wb->generation = recover(wb) + 1;
+   wb->log_fd = open_log(wb, wb->generation);
+   if (wb->log_fd < 0) return -1;
+
+   // Uploads a replay could not apply move to the new log, and the logs
+   // they came from go
+   if (wb->retained) {
+      int relogged = 1;
+      pthread_mutex_lock(&wb->lock);
+      for (size_t b = 0; b < wb->num_buckets && relogged; b++) {
+         for (PendingWrite *e = wb->buckets[b]; e != NULL && relogged; e = e->next) {
+            relogged = relog(wb, e) == 0;
+         }
+      }
+      if (relogged) relogged = wait_committed(wb, wb->appended) == 0;
+      pthread_mutex_unlock(&wb->lock);
+      if (relogged) retire_logs(wb, wb->generation - 1);
+   }
+
+   pthread_t thread;
+   if (pthread_create(&thread, NULL, flusher, wb) != 0) return -1;
+   pthread_detach(thread);
+   return 0;
+}
+
+int write_behind_submit(WriteBehind *wb, const char *path, uint8_t *data, uint64_t size, int sync) {
+   PendingWrite *entry = malloc(sizeof(PendingWrite));
+   char *path_copy = strdup(path);
+   if (entry == NULL || path_copy == NULL) {
+      free(entry);
+      free(path_copy);
+      free(data);
+      errno = ENOMEM;
+      return -1;
+   }
+   entry->path = path_copy;
+   entry->data = data;
+   entry->size = size;
+   entry->flushing = 0;
+   entry->failed = 0;
+
+   PayloadBuilder head;
+   build_record(&head, path, data, size);
+
+   // Past the memory budget, writers pay for the flush themselves, and
+   // the same batch moves appends off a torn log
+   pthread_mutex_lock(&wb->lock);
+   int over_budget = wb->pending_bytes + size > wb->max_pending_bytes;
+   int torn = wb->log_torn;
+   pthread_mutex_unlock(&wb->lock);
+   if (over_budget || torn) flush_now(wb);
+
+   pthread_mutex_lock(&wb->lock);
+   int rc = append_record(wb, &head);
+   if (rc < 0) {
+      int error = errno;
+      pthread_mutex_unlock(&wb->lock);
+      payload_free(&head);
+      pending_free(entry);
+      errno = error;
+      return -1;
+   }
+   uint64_t lsn = wb->appended;
+
+   pending_insert(wb, entry);
+   wb->stats.records++;
+
+   rc = sync ? wait_committed(wb, lsn) : 0;
+   pthread_mutex_unlock(&wb->lock);
+   payload_free(&head);
+   return rc;
+}
+
+int write_behind_settle(WriteBehind *wb, const char *path, int subtree) {
+   if (__atomic_load_n(&wb->num_pending, __ATOMIC_ACQUIRE) == 0 &&
+       __atomic_load_n(&wb->retained, __ATOMIC_ACQUIRE) == 0) return 0;
+   pthread_mutex_lock(&wb->lock);
+   int pending = pending_under(wb, path, subtree);
+   pthread_mutex_unlock(&wb->lock);
+   // A batch leaves log records only of uploads still pending, so once
+   // nothing under path is, a replay cannot undo what comes next
+   if (pending || __atomic_load_n(&wb->retained, __ATOMIC_ACQUIRE) != 0) flush_now(wb);
+   pthread_mutex_lock(&wb->lock);
+   pending = pending_under(wb, path, subtree);
+   pthread_mutex_unlock(&wb->lock);
+   if (pending || __atomic_load_n(&wb->retained, __ATOMIC_ACQUIRE) != 0) {
+      errno = EAGAIN;
+      return -1;
+   }
+   return 0;
+}
+
+void write_behind_stats(WriteBehind *wb, WriteBehindStats *stats) {
+   pthread_mutex_lock(&wb->lock);
+   *stats = wb->stats;
+   pthread_mutex_unlock(&wb->lock);
+}
@@ -0,0 +1,89 @@
+#ifndef _WRITE_BEHIND_H_
+#define _WRITE_BEHIND_H_
+
+#include "headers.h"
+#include "block_cache.h"
+#include "checksum_store.h"
+#include "dedup_store.h"
+#include <stdint.h>
+
+// Optional write-behind for small uploads on the storage server.
+//
+// An upload is held whole in memory and appended to a sequential intent log,
+// and is acknowledged as soon as the log is on stable storage. Concurrent
+// uploads share that step: whichever writer finds no sync in progress
+// fdatasyncs the log on behalf of everyone who appended before it (group
+// commit). A flusher thread later renames the buffered files into place in
+// batches and makes each batch durable with one syncfs per file system. A
+// newer upload of a file still waiting simply replaces the older one, so a
+// file rewritten many times reaches the disk once per batch.
+//
+// Every batch starts a new log file, so the old one holds only records that
+// the batch is writing out and can be deleted once the batch is durable.
+// Uploads it could not write out stay pending and are logged again in the
+// new log first. On startup whatever logs a crash left behind are replayed
+// in order, and uploads that could not be applied are logged again too. A record only partly appended is cut
+// off again, or the log is rotated before anything else is appended, since
+// replay stops at the first bad record.
+//
+// Anything that touches a file directly first calls write_behind_settle so a
+// pending upload of it is never overtaken, nor replayed over it later.
+
+typedef struct PendingWrite {
+   char *path;
+   uint8_t *data;
+   uint64_t size;
+   int flushing;                // Taken by the batch in progress
+   int failed;                  // That batch could not write it out
+   struct PendingWrite *next;   // Hash chain
+} PendingWrite;
+
+typedef struct {
+   unsigned long records;       // Uploads logged
+   unsigned long log_syncs;     // fdatasyncs of the log, each covering a group
+   unsigned long coalesced;     // Uploads replaced before reaching their file
+   unsigned long files_flushed;
+   unsigned long batches;
+   unsigned long replayed;      // Records applied from logs found at startup
+} WriteBehindStats;
+
+typedef struct {
+   char dir[256];               // Holds the intent.<generation> logs
+   uint64_t generation;         // Of the log being appended to
+   uint64_t retained;           // Oldest log kept as uploads could not be logged again, or 0
+   int log_fd;
+   int log_torn;                // A failed append could not be cut off the log
+   BlockCache *cache;           // Told about files replaced by a flush
+   ChecksumStore *checksums;    // Given the checksums of files flushed, if kept
+   DedupStore *dedup;           // Chunks the files flushed, if set
+
+   pthread_mutex_t lock;        // Log appends, the pending table and counters
+   pthread_cond_t committed;    // A log sync finished
+   uint64_t appended;           // Bytes ever appended, across log files
+   uint64_t synced;             // Prefix of appended known to be durable
+   int syncing;                 // A writer or the batch is in fdatasync
+
+   PendingWrite **buckets;
+   size_t num_buckets;
+   size_t num_pending;          // Entries in the table; read unlocked as a hint
+   uint64_t pending_bytes;      // Held in memory, including the batch in progress
+   uint64_t max_pending_bytes;  // Uploads past this flush a batch first
+
+   pthread_mutex_t flush_lock;  // One batch at a time
+   int flush_interval_ms;
+   WriteBehindStats stats;
+} WriteBehind;
+
+// Replays any logs left in log_dir, then starts a fresh log and the flusher.
+// Returns -1 if the log directory cannot be used.
+int write_behind_init(WriteBehind *wb, const char *log_dir, BlockCache *cache, ChecksumStore *checksums,
+                      DedupStore *dedup, uint64_t max_pending_bytes, int flush_interval_ms);
+// Logs an upload of path, taking ownership of data. With sync it returns
+// only once the record is durable. Returns -1 with errno set on failure.
+int write_behind_submit(WriteBehind *wb, const char *path, uint8_t *data, uint64_t size, int sync);
+// Writes out a pending upload of path, or with subtree of anything beneath
+// it. Returns -1 with errno EAGAIN if one could not be written out yet.
+int write_behind_settle(WriteBehind *wb, const char *path, int subtree);
+void write_behind_stats(WriteBehind *wb, WriteBehindStats *stats);
+
+#endif